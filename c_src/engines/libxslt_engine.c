@@ -0,0 +1,950 @@
+/*
+ * libxslt_engine.c
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * An XSLT engine provider backed by libxslt and libxml2 (ABI version 2).
+ *
+ * - Documents are parsed straight from the (borrowed) request buffers.
+ * - Compiled stylesheets are cached, keyed by the stylesheet source (found by
+ *   its hash, but always compared in full) and whether it is a buffer or a
+ *   file uri, in a single cache shared by every port and worker in the process
+ *   - a cached stylesheet is never modified, and is reference counted so it can
+ *   be evicted whilst still in use. Lookups are lock free (see StylesheetCache).
+ * - The cache is bounded by memory (ERLXSL_STYLESHEET_CACHE_BYTES, 64MB by
+ *   default) as well as by entries, evicting by the clock algorithm. The memory
+ *   a compiled stylesheet uses is estimated from the size of its source, and
+ *   evicted entries count against the budget until they are freed. Those are
+ *   freed as their last user releases them, once no lookup can still be
+ *   reading them (see reclaim_stylesheets).
+ * - Stylesheets are parsed into dictionaries chained from a single, read only
+ *   dictionary of the names common to all stylesheets, and each input document
+ *   into a dictionary chained from its stylesheet's, so names are interned once.
+ * - Each worker thread has a parser context of its own (see thread_init).
+ * - Output is serialized directly into the driver's result buffer.
+ * - Batches (see transform_batch) look each stylesheet up once for a run of
+ *   commands using it, rather than once per command.
+ * - The library is loaded once per process, but every engine instance (one per
+ *   port) has its own statistics, reached through providerData and the worker
+ *   state rather than a global, so ports can run concurrently.
+ * - The 'cache_stats' engine command (run on a worker, like a transform)
+ *   reports the cache's contents, with the hits for each stylesheet.
+ *
+ * Stylesheets passed by file uri are cached by their uri, so changes to the
+ * file are not picked up until every port has unloaded the engine.
+ */
+
+#include <stdarg.h>
+#include <pthread.h>
+
+#include <libxml/parser.h>
+#include <libxml/dict.h>
+#include <libxml/xmlIO.h>
+#include <libxslt/xslt.h>
+#include <libxslt/xsltInternals.h>
+#include <libxslt/transform.h>
+#include <libxslt/variables.h>
+#include <libxslt/security.h>
+#include <libxslt/xsltutils.h>
+#include <libxslt/imports.h>
+
+#include "erlxsl.h"
+
+#ifdef    __cplusplus
+extern "C" {
+#endif
+
+/* INTERNAL DATA & DATA STRUCTURES */
+
+// must be a power of two
+#define CACHE_BUCKETS 1024
+#define CACHE_MAX_ENTRIES 256
+// the default memory budget for compiled stylesheets, shared by every port
+#define CACHE_MAX_BYTES (64 * 1024 * 1024)
+// a compiled stylesheet is charged this many times the size of its source
+#define STYLESHEET_COST_FACTOR 8
+// must be a power of two
+#define READER_STRIPES 16
+#define CACHE_LINE_SIZE 64
+#define ERROR_BUFFER_SIZE 512
+
+// stylesheets are trusted, input documents are not (and may not load external entities)
+#define STYLESHEET_PARSE_OPTIONS (XSLT_PARSE_OPTIONS | XML_PARSE_NONET)
+#define DOCUMENT_PARSE_OPTIONS (XML_PARSE_NONET | XML_PARSE_NOCDATA | XML_PARSE_DTDATTR)
+
+typedef struct cached_stylesheet {
+    UInt64 hash;
+    size_t length;
+    /* whether the source is the stylesheet itself, or the uri of a file */
+    InputType type;
+    /* the (estimated) memory charged to the cache for the stylesheet */
+    size_t bytes;
+    xsltStylesheetPtr style;
+    /* the cache holds one reference, and each transform using the stylesheet
+       another - once the count drops to zero it is never taken again */
+    volatile Int32 refs;
+    /* set on each hit, and cleared as the eviction clock passes the entry */
+    volatile Int32 referenced;
+    /* set once the entry is linked into the cache - entries which never are
+       can't have been reached by a lookup, so are freed with their last reference */
+    int cached;
+    volatile UInt64 hits;
+    struct cached_stylesheet *volatile next;
+    /* links the entries waiting to be freed (see reclaim_stylesheets) */
+    struct cached_stylesheet *retired_next;
+    /* a copy of the source, compared on a hash match - the hash isn't collision resistant */
+    char source[];
+} CachedStylesheet;
+
+/* Counts the lookups running on a stripe's workers, by the parity of the epoch
+   they started in - padded to a cache line, so workers on different stripes
+   don't contend for it. */
+typedef struct {
+    volatile long active[2];
+    char padding[CACHE_LINE_SIZE - 2 * sizeof(long)];
+} ReaderStripe;
+
+/*
+ * The compiled stylesheets, shared by every engine instance (i.e., every port)
+ * in the process. Lookups take no lock: entries are published with a barrier,
+ * and an entry unlinked from its bucket is only freed once no lookup which
+ * might have reached it is still running - see reclaim_stylesheets.
+ */
+typedef struct {
+    ReaderStripe readers[READER_STRIPES];
+    CachedStylesheet *volatile buckets[CACHE_BUCKETS];
+    /* serializes inserts, evictions and reclamation - never taken by lookups */
+    pthread_mutex_t lock;
+    size_t count;
+    size_t bytes;
+    /* the memory charged for entries which have been unlinked but not yet freed,
+       which counts against max_bytes as well */
+    size_t retired_bytes;
+    size_t max_bytes;
+    /* the bucket the eviction clock points at */
+    size_t victim;
+    /* entries no longer referenced, which lookups may still be reading */
+    CachedStylesheet *volatile retired;
+    /* entries retired before the epoch last advanced - freed once the lookups
+       which started in the previous epoch have finished */
+    CachedStylesheet *pending;
+    volatile UInt32 epoch;
+    volatile UInt32 next_stripe;
+    /* names common to all stylesheets - read only once the cache is created */
+    xmlDictPtr dict;
+    /* the number of engine instances using the cache */
+    int users;
+} StylesheetCache;
+
+/* Per-instance (i.e., per port) engine state. */
+typedef struct {
+    StylesheetCache *cache;
+    xsltSecurityPrefsPtr security;
+    volatile UInt64 hits;
+    volatile UInt64 misses;
+} LibxsltEngine;
+
+/* Per-worker engine state. */
+typedef struct {
+    LibxsltEngine *engine;
+    ReaderStripe *stripe;
+    xmlParserCtxtPtr parser;
+} WorkerState;
+
+/* Collects the messages reported during a transform. */
+typedef struct {
+    char message[ERROR_BUFFER_SIZE];
+    size_t length;
+} ErrorBuffer;
+
+// element and attribute names interned in the shared dictionary
+static const char *common_names[] = {
+    "stylesheet", "transform", "template", "apply-templates", "call-template",
+    "with-param", "param", "variable", "value-of", "copy-of", "copy", "for-each",
+    "sort", "if", "choose", "when", "otherwise", "element", "attribute", "text",
+    "output", "include", "import", "key", "match", "select", "name", "mode",
+    "test", "version", "method", "encoding", "indent", "omit-xml-declaration",
+    "xsl", "http://www.w3.org/1999/XSL/Transform"
+};
+
+/* INTERNAL FUNCTIONS */
+
+ERLXSL_EXPORT void init_engine_v2(XslEngineV2*);
+static EngineState libxslt_transform(Command*);
+static void libxslt_transform_batch(Command**, EngineState*, size_t);
+static EngineState libxslt_after_transform(Command*);
+static void libxslt_shutdown(void*);
+static EngineState libxslt_thread_init(void*, void**);
+static void libxslt_thread_shutdown(void*, void*);
+static EngineState libxslt_command(Command*);
+
+// libxml2 must be initialized once per process, however many engines are loaded
+static pthread_once_t parser_once = PTHREAD_ONCE_INIT;
+
+// created by the first engine instance and freed with the last (see acquire_cache)
+static StylesheetCache *shared_cache = NULL;
+static pthread_mutex_t shared_cache_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static UInt64
+hash_stylesheet(const char *data, size_t length) {
+    // FNV-1a
+    UInt64 hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < length; i++) {
+        hash ^= (unsigned char)data[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+};
+
+/* Evaluates to true if an entry was compiled from the given source. */
+static int
+same_stylesheet(const CachedStylesheet *entry, UInt64 hash, InputType type,
+                const char *data, size_t length) {
+    return entry->hash == hash && entry->length == length && entry->type == type &&
+           memcmp(entry->source, data, length) == 0;
+};
+
+/* Queues an entry nobody references any more, to be freed by reclaim_stylesheets. */
+static void
+retire_stylesheet(StylesheetCache *cache, CachedStylesheet *entry) {
+    CachedStylesheet *head;
+    do {
+        head = cache->retired;
+        entry->retired_next = head;
+    } while (!__sync_bool_compare_and_swap(&cache->retired, head, entry));
+};
+
+/* Frees a list of entries, returning the memory that was charged for them. */
+static size_t
+free_stylesheets(CachedStylesheet *entry) {
+    size_t bytes = 0;
+    while (entry != NULL) {
+        CachedStylesheet *next = entry->retired_next;
+        bytes += entry->bytes;
+        xsltFreeStylesheet(entry->style);
+        free(entry);
+        entry = next;
+    }
+    return bytes;
+};
+
+/* Evaluates to true once no lookup which started in the previous epoch is still running. */
+static int
+previous_epoch_drained(StylesheetCache *cache) {
+    UInt32 previous = (cache->epoch - 1) & 1;
+    size_t i;
+    for (i = 0; i < READER_STRIPES; i++) {
+        if (__sync_fetch_and_add(&cache->readers[i].active[previous], 0) != 0) return 0;
+    }
+    return 1;
+};
+
+/*
+ * Frees retired entries once no lookup which might have reached them is still
+ * running, without ever waiting for readers. Retired entries are moved to the
+ * pending list as the epoch advances - lookups starting after that can't reach
+ * them, and those which started before count themselves against the previous
+ * epoch, whose counters only ever fall from then on. The pending entries are
+ * freed as soon as those counters have drained, and only then can the epoch
+ * advance again. Called with the cache lock held.
+ */
+static void
+reclaim_stylesheets(StylesheetCache *cache) {
+    if (cache->pending != NULL) {
+        if (!previous_epoch_drained(cache)) return;
+        cache->retired_bytes -= free_stylesheets(cache->pending);
+        cache->pending = NULL;
+    }
+    if (cache->retired != NULL) {
+        cache->pending = __sync_lock_test_and_set(&cache->retired, NULL);
+        __sync_add_and_fetch(&cache->epoch, 1);
+        if (previous_epoch_drained(cache)) {
+            cache->retired_bytes -= free_stylesheets(cache->pending);
+            cache->pending = NULL;
+        }
+    }
+};
+
+static void
+release_stylesheet(StylesheetCache *cache, CachedStylesheet *entry) {
+    if (__sync_sub_and_fetch(&entry->refs, 1) != 0) return;
+    if (!entry->cached) {
+        // no lookup can have reached it
+        free_stylesheets(entry);
+        return;
+    }
+    retire_stylesheet(cache, entry);
+    // rather than leaving it to the next insert, which may be a long time coming
+    if (pthread_mutex_trylock(&cache->lock) == 0) {
+        reclaim_stylesheets(cache);
+        pthread_mutex_unlock(&cache->lock);
+    }
+};
+
+/* Finds a cached stylesheet, taking a reference to it. Returns NULL on a miss. */
+static CachedStylesheet*
+lookup_stylesheet(StylesheetCache *cache, ReaderStripe *stripe, UInt64 hash,
+                  InputType type, const char *data, size_t length) {
+    CachedStylesheet *entry;
+    UInt32 epoch;
+    Int32 refs;
+
+    // a full barrier - nothing we read from here on is freed until we leave, unless
+    // the epoch advanced before reclaim_stylesheets could see us, so we retry then
+    for (;;) {
+        epoch = cache->epoch;
+        __sync_add_and_fetch(&stripe->active[epoch & 1], 1);
+        if (__sync_fetch_and_add(&cache->epoch, 0) == epoch) break;
+        __sync_sub_and_fetch(&stripe->active[epoch & 1], 1);
+    }
+    for (entry = cache->buckets[hash & (CACHE_BUCKETS - 1)]; entry != NULL; entry = entry->next) {
+        if (!same_stylesheet(entry, hash, type, data, length)) continue;
+        // an entry whose last reference has gone is being retired, and can't be revived
+        while ((refs = entry->refs) > 0 &&
+               !__sync_bool_compare_and_swap(&entry->refs, refs, refs + 1));
+        if (refs > 0) {
+            __sync_add_and_fetch(&entry->hits, 1);
+            entry->referenced = 1;
+            break;
+        }
+    }
+    __sync_sub_and_fetch(&stripe->active[epoch & 1], 1);
+    return entry;
+};
+
+/* Unlinks an entry, dropping the cache's reference. Called with the cache lock held. */
+static void
+unlink_stylesheet(StylesheetCache *cache, CachedStylesheet *volatile *link) {
+    CachedStylesheet *entry = *link;
+    *link = entry->next;
+    cache->count--;
+    cache->bytes -= entry->bytes;
+    cache->retired_bytes += entry->bytes;
+    // the lock is already held, so it's left to the caller to reclaim
+    if (__sync_sub_and_fetch(&entry->refs, 1) == 0) {
+        retire_stylesheet(cache, entry);
+    }
+};
+
+/*
+ * Evicts an entry, by the clock algorithm: entries hit since the clock last
+ * passed them are spared once. If hits keep every entry referenced, the first
+ * entry found after two full turns is evicted. Entries transforms are still
+ * using are never evicted, since that would free nothing. Returns 0 if every
+ * entry is in use. Called with the cache lock held.
+ */
+static int
+evict_stylesheet(StylesheetCache *cache) {
+    CachedStylesheet *volatile *link;
+    size_t turns;
+
+    for (turns = 0; turns < 3 * CACHE_BUCKETS;
+         cache->victim = (cache->victim + 1) & (CACHE_BUCKETS - 1), turns++) {
+        for (link = &cache->buckets[cache->victim]; *link != NULL; link = &(*link)->next) {
+            if ((*link)->refs > 1) continue;
+            if (!(*link)->referenced || turns >= 2 * CACHE_BUCKETS) {
+                unlink_stylesheet(cache, link);
+                return 1;
+            }
+            (*link)->referenced = 0;
+        }
+    }
+    return 0;
+};
+
+/*
+ * Adds a newly compiled stylesheet to the cache, returning the entry to use
+ * (with a reference taken). If another thread cached the same stylesheet in
+ * the meantime, that entry is returned and the new one discarded. Stylesheets
+ * which don't fit - too big for the cache at all, or while the memory of
+ * evicted entries is still held by transforms using them - are returned
+ * without being cached, and freed once the caller releases them.
+ */
+static CachedStylesheet*
+insert_stylesheet(StylesheetCache *cache, CachedStylesheet *entry) {
+    CachedStylesheet *existing;
+    size_t bucket = entry->hash & (CACHE_BUCKETS - 1);
+
+    if (entry->bytes > cache->max_bytes) {
+        return entry;
+    }
+    pthread_mutex_lock(&cache->lock);
+    reclaim_stylesheets(cache);
+    for (existing = cache->buckets[bucket]; existing != NULL; existing = existing->next) {
+        if (same_stylesheet(existing, entry->hash, entry->type, entry->source, entry->length)) {
+            // linked entries always hold the cache's reference
+            __sync_add_and_fetch(&existing->refs, 1);
+            pthread_mutex_unlock(&cache->lock);
+            release_stylesheet(cache, entry);
+            return existing;
+        }
+    }
+    // only evict whilst that can make room - memory still held by transforms using
+    // evicted entries can't be freed, and neither can entries in use be evicted
+    while (cache->count >= CACHE_MAX_ENTRIES ||
+           cache->bytes + cache->retired_bytes + entry->bytes > cache->max_bytes) {
+        if (cache->retired_bytes + entry->bytes > cache->max_bytes ||
+            cache->count == 0 || !evict_stylesheet(cache)) {
+            pthread_mutex_unlock(&cache->lock);
+            return entry;
+        }
+        reclaim_stylesheets(cache);
+    }
+    entry->refs = 2;
+    entry->cached = 1;
+    entry->next = cache->buckets[bucket];
+    // the entry must be complete before lookups can see it
+    __sync_synchronize();
+    cache->buckets[bucket] = entry;
+    cache->count++;
+    cache->bytes += entry->bytes;
+    pthread_mutex_unlock(&cache->lock);
+    return entry;
+};
+
+static StylesheetCache*
+create_cache(void) {
+    StylesheetCache *cache;
+    const char *limit = getenv("ERLXSL_STYLESHEET_CACHE_BYTES");
+    size_t i;
+
+    if (posix_memalign((void**)&cache, CACHE_LINE_SIZE, sizeof(StylesheetCache)) != 0) {
+        return NULL;
+    }
+    memset(cache, 0, sizeof(StylesheetCache));
+    if (pthread_mutex_init(&cache->lock, NULL) != 0) {
+        free(cache);
+        return NULL;
+    }
+    if ((cache->dict = xmlDictCreate()) == NULL) {
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+        return NULL;
+    }
+    for (i = 0; i < (sizeof(common_names) / sizeof(common_names[0])); i++) {
+        xmlDictLookup(cache->dict, BAD_CAST common_names[i], -1);
+    }
+    cache->max_bytes = (limit != NULL && strtoull(limit, NULL, 10) > 0)
+        ? (size_t)strtoull(limit, NULL, 10) : CACHE_MAX_BYTES;
+    return cache;
+};
+
+/* Returns the process wide cache, creating it for the first engine instance. */
+static StylesheetCache*
+acquire_cache(void) {
+    StylesheetCache *cache;
+    pthread_mutex_lock(&shared_cache_lock);
+    if (shared_cache == NULL) {
+        shared_cache = create_cache();
+    }
+    if ((cache = shared_cache) != NULL) {
+        cache->users++;
+    }
+    pthread_mutex_unlock(&shared_cache_lock);
+    return cache;
+};
+
+/* Drops an engine instance's use of the cache, freeing it after the last. By
+   then no worker is left to look anything up, so nothing need be deferred. */
+static void
+release_cache(StylesheetCache *cache) {
+    size_t i;
+
+    pthread_mutex_lock(&shared_cache_lock);
+    if (--cache->users == 0) {
+        INFO("libxslt_engine: freeing %lu cached stylesheets (%lu bytes)\n",
+             (unsigned long)cache->count, (unsigned long)cache->bytes);
+        for (i = 0; i < CACHE_BUCKETS; i++) {
+            while (cache->buckets[i] != NULL) {
+                unlink_stylesheet(cache, &cache->buckets[i]);
+            }
+        }
+        free_stylesheets(cache->pending);
+        free_stylesheets(cache->retired);
+        xmlDictFree(cache->dict);
+        pthread_mutex_destroy(&cache->lock);
+        free(cache);
+        shared_cache = NULL;
+    }
+    pthread_mutex_unlock(&shared_cache_lock);
+};
+
+/* Parses a document from a (not necessarily NUL terminated) buffer or file uri,
+     interning its names in a new dictionary chained from 'dict'. */
+static xmlDocPtr
+parse_document(WorkerState *worker, InputType type, const char *data,
+               size_t length, xmlDictPtr dict, int options) {
+    xmlParserCtxtPtr parser = worker->parser;
+    xmlDictPtr sub = xmlDictCreateSub(dict);
+    xmlDocPtr doc;
+
+    if (sub == NULL) return NULL;
+    if (parser->dict != NULL) {
+        xmlDictFree(parser->dict);
+    }
+    parser->dict = sub;
+
+    if (type == File) {
+        char *uri = malloc(length + 1);
+        if (uri == NULL) return NULL;
+        memcpy(uri, data, length);
+        uri[length] = '\0';
+        doc = xmlCtxtReadFile(parser, uri, NULL, options);
+        free(uri);
+    } else {
+        doc = xmlCtxtReadMemory(parser, data, (int)length, NULL, NULL, options);
+    }
+    return doc;
+};
+
+/* Compiles the stylesheet for a task, or fetches it from the cache. */
+static CachedStylesheet*
+get_stylesheet(LibxsltEngine *engine, WorkerState *worker, XslTask *task, EngineState *state) {
+    UInt64 hash = hash_stylesheet(task->stylesheet.data, task->stylesheet.length);
+    CachedStylesheet *entry;
+    xmlDocPtr doc;
+
+    if ((entry = lookup_stylesheet(engine->cache, worker->stripe, hash, task->xslt_doc->type,
+                                   task->stylesheet.data, task->stylesheet.length)) != NULL) {
+        __sync_add_and_fetch(&engine->hits, 1);
+        return entry;
+    }
+    __sync_add_and_fetch(&engine->misses, 1);
+
+    if ((entry = malloc(sizeof(CachedStylesheet) + task->stylesheet.length)) == NULL) {
+        *state = OutOfMemoryError;
+        return NULL;
+    }
+    entry->hash = hash;
+    entry->length = task->stylesheet.length;
+    entry->type = task->xslt_doc->type;
+    memcpy(entry->source, task->stylesheet.data, task->stylesheet.length);
+    entry->bytes = sizeof(CachedStylesheet) +
+                   task->stylesheet.length * (STYLESHEET_COST_FACTOR + 1);
+    entry->refs = 1;
+    entry->referenced = 0;
+    entry->cached = 0;
+    entry->hits = 0;
+    entry->next = NULL;
+    entry->retired_next = NULL;
+
+    doc = parse_document(worker, task->xslt_doc->type, task->stylesheet.data,
+                         task->stylesheet.length, engine->cache->dict, STYLESHEET_PARSE_OPTIONS);
+    if (doc == NULL) {
+        free(entry);
+        *state = XmlParseError;
+        return NULL;
+    }
+    // the stylesheet takes ownership of the document (and its dictionary)
+    if ((entry->style = xsltParseStylesheetDoc(doc)) == NULL || entry->style->errors > 0) {
+        if (entry->style != NULL) {
+            xsltFreeStylesheet(entry->style);
+        } else {
+            xmlFreeDoc(doc);
+        }
+        free(entry);
+        *state = XslCompileError;
+        return NULL;
+    }
+    return insert_stylesheet(engine->cache, entry);
+};
+
+static void
+collect_error(void *ctx, const char *msg, ...) {
+    ErrorBuffer *errors = (ErrorBuffer*)ctx;
+    va_list args;
+    int written;
+
+    if (errors->length >= sizeof(errors->message) - 1) return;
+    va_start(args, msg);
+    written = vsnprintf(errors->message + errors->length,
+                        sizeof(errors->message) - errors->length, msg, args);
+    va_end(args);
+    if (written > 0) {
+        errors->length += (size_t)written;
+        if (errors->length > sizeof(errors->message) - 1) {
+            errors->length = sizeof(errors->message) - 1;
+        }
+    }
+};
+
+/* Discards any output written so far, replacing it with an error message. */
+static EngineState
+report_error(Command *command, EngineState state, const char *message) {
+    size_t length;
+    command->result_length = 0;
+    if (message == NULL || *message == '\0') {
+        message = (state == XmlParseError) ? "failed to parse document"
+                : (state == XslCompileError) ? "failed to compile stylesheet"
+                : "transform failed";
+    }
+    length = strlen(message);
+    // libxml2's messages end with a newline
+    while (length > 0 && (message[length - 1] == '\n' || message[length - 1] == ' ')) length--;
+    if (append_result_buffer(message, length, command) == NULL) {
+        return OutOfMemoryError;
+    }
+    return state;
+};
+
+static void
+ignore_error(void *ctx, const char *msg, ...) {
+    // errors are reported to the caller instead
+};
+
+static const char*
+parser_error(WorkerState *worker) {
+    xmlErrorPtr error = xmlCtxtGetLastError(worker->parser);
+    return (error == NULL) ? NULL : error->message;
+};
+
+/* Copies the (key, value) parameter list into the NULL terminated array libxslt expects. */
+static const char**
+make_params(ParameterListNode *node) {
+    ParameterListNode *curr;
+    const char **params;
+    size_t count = 0;
+
+    for (curr = node; curr != NULL; curr = (ParameterListNode*)curr->next) count++;
+    if ((params = malloc(sizeof(char*) * (count * 2 + 1))) == NULL) return NULL;
+
+    count = 0;
+    for (curr = node; curr != NULL; curr = (ParameterListNode*)curr->next) {
+        params[count++] = curr->key;
+        params[count++] = curr->value;
+    }
+    params[count] = NULL;
+    return params;
+};
+
+static int
+write_output(void *context, const char *buffer, int length) {
+    Command *command = (Command*)context;
+    if (length > 0 && append_result_buffer(buffer, (size_t)length, command) == NULL) {
+        return -1;
+    }
+    return length;
+};
+
+/* Serializes the result document into the command's result buffer. */
+static int
+save_result(Command *command, xmlDocPtr result, xsltStylesheetPtr style) {
+    const xmlChar *encoding;
+    xmlCharEncodingHandlerPtr encoder = NULL;
+    xmlOutputBufferPtr out;
+    int written;
+
+    XSLT_GET_IMPORT_PTR(encoding, style, encoding);
+    if (encoding != NULL) {
+        encoder = xmlFindCharEncodingHandler((const char*)encoding);
+        // libxml2 writes UTF-8 natively, and must not be handed an encoder for it
+        if (encoder != NULL && xmlStrcasecmp((const xmlChar*)encoder->name, BAD_CAST "UTF-8") == 0) {
+            encoder = NULL;
+        }
+    }
+    if ((out = xmlOutputBufferCreateIO(write_output, NULL, command, encoder)) == NULL) {
+        return -1;
+    }
+    written = xsltSaveResultTo(out, result, style);
+    if (xmlOutputBufferClose(out) < 0) {
+        return -1;
+    }
+    return written;
+};
+
+void init_engine_v2(XslEngineV2 *spec) {
+    LibxsltEngine *engine;
+
+    if (spec->abi.version < 2 || spec->abi.size < sizeof(XslEngineV2)) {
+        ERROR("libxslt_engine requires ABI version 2\n");
+        return;
+    }
+    spec->abi.version = ERLXSL_ABI_VERSION;
+    spec->abi.size = sizeof(XslEngineV2);
+
+    pthread_once(&parser_once, xmlInitParser);
+    if ((engine = calloc(1, sizeof(LibxsltEngine))) == NULL) return;
+    if ((engine->cache = acquire_cache()) == NULL ||
+        (engine->security = xsltNewSecurityPrefs()) == NULL) {
+        if (engine->cache != NULL) release_cache(engine->cache);
+        free(engine);
+        return;
+    }
+    // stylesheets may read, but not write, files or the network
+    xsltSetSecurityPrefs(engine->security, XSLT_SECPREF_WRITE_FILE, xsltSecurityForbid);
+    xsltSetSecurityPrefs(engine->security, XSLT_SECPREF_CREATE_DIRECTORY, xsltSecurityForbid);
+    xsltSetSecurityPrefs(engine->security, XSLT_SECPREF_WRITE_NETWORK, xsltSecurityForbid);
+
+    spec->capabilities = EngineReentrant | EngineZeroCopyInput |
+                         EngineBinaryOutput | EngineStylesheetCache | EngineBatch;
+    spec->transform = libxslt_transform;
+    spec->transform_batch = libxslt_transform_batch;
+    spec->after_transform = libxslt_after_transform;
+    spec->shutdown = libxslt_shutdown;
+    spec->thread_init = libxslt_thread_init;
+    spec->thread_shutdown = libxslt_thread_shutdown;
+    spec->command = libxslt_command;
+    spec->providerData = engine;
+};
+
+static EngineState
+libxslt_thread_init(void *providerData, void **context) {
+    WorkerState *worker = malloc(sizeof(WorkerState));
+    if (worker == NULL) return OutOfMemoryError;
+    worker->engine = (LibxsltEngine*)providerData;
+    // workers are spread over the reader stripes, rather than all sharing one counter
+    worker->stripe = &worker->engine->cache->readers[
+        __sync_fetch_and_add(&worker->engine->cache->next_stripe, 1) & (READER_STRIPES - 1)];
+    if ((worker->parser = xmlNewParserCtxt()) == NULL) {
+        free(worker);
+        return OutOfMemoryError;
+    }
+    // the generic error handler is thread local - parse errors are reported in the reply
+    xmlSetGenericErrorFunc(NULL, ignore_error);
+    *context = worker;
+    return Ok;
+};
+
+static void
+libxslt_thread_shutdown(void *providerData, void *context) {
+    WorkerState *worker = (WorkerState*)context;
+    xmlFreeParserCtxt(worker->parser);
+    free(worker);
+};
+
+/* Transforms a task's input document with an already compiled stylesheet. */
+static EngineState
+apply_stylesheet(LibxsltEngine *engine, WorkerState *worker, Command *command,
+                 XslTask *task, CachedStylesheet *entry) {
+    EngineState state = Ok;
+    xsltTransformContextPtr ctxt;
+    xmlDocPtr doc;
+    xmlDocPtr result;
+    const char **params = NULL;
+    ErrorBuffer errors;
+
+    doc = parse_document(worker, task->input_doc->type, task->input.data,
+                         task->input.length, entry->style->dict, DOCUMENT_PARSE_OPTIONS);
+    if (doc == NULL) {
+        return report_error(command, XmlParseError, parser_error(worker));
+    }
+    if ((ctxt = xsltNewTransformContext(entry->style, doc)) == NULL) {
+        xmlFreeDoc(doc);
+        return OutOfMemoryError;
+    }
+    errors.length = 0;
+    errors.message[0] = '\0';
+    xsltSetTransformErrorFunc(ctxt, &errors, collect_error);
+    xsltSetCtxtSecurityPrefs(engine->security, ctxt);
+
+    if (task->parameters != NULL) {
+        if ((params = make_params(task->parameters)) == NULL) {
+            state = OutOfMemoryError;
+        } else if (xsltQuoteUserParams(ctxt, params) != 0) {
+            state = XslTransformError;
+        }
+    }
+    if (state == Ok) {
+        result = xsltApplyStylesheetUser(entry->style, doc, NULL, NULL, NULL, ctxt);
+        if (result == NULL || ctxt->state != XSLT_STATE_OK) {
+            state = XslTransformError;
+        } else if (save_result(command, result, entry->style) < 0) {
+            state = OutOfMemoryError;
+        }
+        if (result != NULL) xmlFreeDoc(result);
+    }
+
+    xsltFreeTransformContext(ctxt);
+    xmlFreeDoc(doc);
+    free(params);
+
+    if (state == XslTransformError) {
+        return report_error(command, state, errors.message);
+    }
+    return state;
+};
+
+static EngineState
+libxslt_transform(Command *command) {
+    WorkerState *worker = (WorkerState*)command->worker_context;
+    XslTask *task = get_task(command);
+    EngineState state = Ok;
+    CachedStylesheet *entry;
+
+    if (task == NULL || worker == NULL) return Error;
+    if ((entry = get_stylesheet(worker->engine, worker, task, &state)) == NULL) {
+        return report_error(command, state, parser_error(worker));
+    }
+    state = apply_stylesheet(worker->engine, worker, command, task, entry);
+    release_stylesheet(worker->engine->cache, entry);
+    return state;
+};
+
+/* Evaluates to true if two tasks use the same stylesheet source. */
+#define same_stylesheet(a, b) \
+    ((a)->xslt_doc->type == (b)->xslt_doc->type && \
+     (a)->stylesheet.length == (b)->stylesheet.length && \
+     ((a)->stylesheet.data == (b)->stylesheet.data || \
+      memcmp((a)->stylesheet.data, (b)->stylesheet.data, (a)->stylesheet.length) == 0))
+
+static void
+libxslt_transform_batch(Command **commands, EngineState *states, size_t count) {
+    CachedStylesheet *entry = NULL;
+    StylesheetCache *cache = NULL;
+    XslTask *compiled = NULL;
+    size_t i;
+
+    for (i = 0; i < count; i++) {
+        // all of the commands in a batch are run on the same worker
+        WorkerState *worker = (WorkerState*)commands[i]->worker_context;
+        XslTask *task = get_task(commands[i]);
+        EngineState state = Ok;
+
+        if (task == NULL || worker == NULL) {
+            states[i] = Error;
+            continue;
+        }
+        // consecutive commands using the same stylesheet share our reference to it
+        if (entry == NULL || !same_stylesheet(compiled, task)) {
+            if (entry != NULL) {
+                release_stylesheet(cache, entry);
+            }
+            cache = worker->engine->cache;
+            if ((entry = get_stylesheet(worker->engine, worker, task, &state)) == NULL) {
+                states[i] = report_error(commands[i], state, parser_error(worker));
+                continue;
+            }
+            compiled = task;
+        }
+        states[i] = apply_stylesheet(worker->engine, worker, commands[i], task, entry);
+    }
+    if (entry != NULL) {
+        release_stylesheet(cache, entry);
+    }
+};
+
+static EngineState
+libxslt_after_transform(Command *command) {
+    // everything the transform allocated has already been freed
+    return Ok;
+};
+
+static void
+libxslt_shutdown(void *state) {
+    // the driver passes v2 engines their own providerData
+    LibxsltEngine *engine = (LibxsltEngine*)state;
+
+    if (engine == NULL) return;
+    INFO("libxslt_engine: %llu stylesheet cache hits, %llu misses\n",
+         (unsigned long long)engine->hits, (unsigned long long)engine->misses);
+    xsltFreeSecurityPrefs(engine->security);
+    release_cache(engine->cache);
+    free(engine);
+};
+
+/* Appends a formatted line to a command's result. */
+static int
+append_line(Command *command, const char *format, ...) {
+    char line[256];
+    va_list args;
+    int length;
+
+    va_start(args, format);
+    length = vsnprintf(line, sizeof(line), format, args);
+    va_end(args);
+    if (length < 0) return 0;
+    if ((size_t)length >= sizeof(line)) length = sizeof(line) - 1;
+    return append_result_buffer(line, (size_t)length, command) != NULL;
+};
+
+/* A cached stylesheet's statistics, as copied out for the 'cache_stats' command. */
+typedef struct {
+    UInt64 hash;
+    size_t length;
+    size_t bytes;
+    UInt64 hits;
+    Int32 refs;
+} StylesheetStats;
+
+/*
+ * Handles the 'cache_stats' command (run on a worker thread), reporting the
+ * shared cache's totals and then a line per cached stylesheet, giving its hash,
+ * source length, the memory charged for it, its hits and references. The lock
+ * is only held to copy the statistics out, so inserts aren't kept waiting
+ * whilst the report is formatted.
+ */
+static EngineState
+libxslt_command(Command *command) {
+    CmdData *cd = get_cmd_data(command);
+    StylesheetCache *cache = shared_cache;
+    CachedStylesheet *entry;
+    StylesheetStats *stats;
+    size_t count = 0, bytes, retired_bytes, i;
+    int users;
+
+    if (cd == NULL || cd->tag == NULL || strcmp(cd->tag, "cache_stats") != 0 || cache == NULL) {
+        return Error;
+    }
+    if ((stats = malloc(sizeof(StylesheetStats) * CACHE_MAX_ENTRIES)) == NULL) {
+        return OutOfMemoryError;
+    }
+    // the lock keeps entries from being evicted (or freed) whilst we copy them
+    pthread_mutex_lock(&cache->lock);
+    for (i = 0; i < CACHE_BUCKETS; i++) {
+        for (entry = cache->buckets[i]; entry != NULL; entry = entry->next, count++) {
+            stats[count].hash = entry->hash;
+            stats[count].length = entry->length;
+            stats[count].bytes = entry->bytes;
+            stats[count].hits = entry->hits;
+            stats[count].refs = entry->refs;
+        }
+    }
+    bytes = cache->bytes;
+    retired_bytes = cache->retired_bytes;
+    users = cache->users;
+    pthread_mutex_unlock(&cache->lock);
+
+    if (!append_line(command, "entries=%lu bytes=%lu retired_bytes=%lu max_bytes=%lu users=%d\n",
+                     (unsigned long)count, (unsigned long)bytes, (unsigned long)retired_bytes,
+                     (unsigned long)cache->max_bytes, users)) {
+        free(stats);
+        return OutOfMemoryError;
+    }
+    for (i = 0; i < count; i++) {
+        if (!append_line(command, "%016llx length=%lu bytes=%lu hits=%llu refs=%d\n",
+                         (unsigned long long)stats[i].hash, (unsigned long)stats[i].length,
+                         (unsigned long)stats[i].bytes, (unsigned long long)stats[i].hits,
+                         (int)stats[i].refs)) {
+            free(stats);
+            return OutOfMemoryError;
+        }
+    }
+    free(stats);
+    return Ok;
+};
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,300 @@
+/*
+ * synthetic_engine.c
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * A synthetic engine provider (ABI version 2) for measuring the driver's own
+ * overhead - marshalling, scheduling and threading - under engine behaviour
+ * which can be tuned, rather than that of a real XSLT processor. It performs
+ * no XSLT at all. Instead, the "stylesheet" of each request is a profile of
+ * whitespace separated key=value settings, which say how the request should
+ * be handled:
+ *
+ *   spin_us=N         burn N microseconds of CPU (hashing the input document)
+ *   allocs=N          make N scratch allocations through Command.alloc, each
+ *   alloc_bytes=N     of N bytes (default 64), touching and holding them all
+ *                     until the output has been written
+ *   output_ratio=R    produce R times as many bytes as were input (default 1.0)
+ *   output_bytes=N    produce exactly N bytes instead
+ *   chunk_bytes=N     write the output in N byte chunks, letting the result
+ *                     buffer grow as it goes - by default the result buffer is
+ *                     sized up front and written in one go
+ *
+ * e.g., "spin_us=200 allocs=1000 alloc_bytes=32 output_ratio=4 chunk_bytes=512".
+ * Since the driver protocol carries no stylesheet parameters, varying the
+ * profile means varying the stylesheet. Any parameters a request does carry
+ * (e.g., when replaying a traffic log with c_src/tools/erlxsl_bench) are
+ * applied after the profile, overriding it. The output is the input document
+ * repeated.
+ *
+ * The engine advertises EngineReentrant, EngineZeroCopyInput and
+ * EngineBinaryOutput unless the ERLXSL_SYNTHETIC_CAPABILITIES environment
+ * variable gives another mask of those (e.g., 0x01 to measure the cost of
+ * copying requests and results).
+ */
+
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
+
+#include "erlxsl.h"
+
+#ifdef    __cplusplus
+extern "C" {
+#endif
+
+/* INTERNAL DATA & DATA STRUCTURES */
+
+#define SUPPORTED_CAPABILITIES (EngineReentrant | EngineZeroCopyInput | EngineBinaryOutput)
+#define MAX_SETTING_SIZE 64
+#define ERROR_BUFFER_SIZE 128
+
+typedef struct {
+    UInt64 spin_us;
+    UInt64 allocs;
+    UInt64 alloc_bytes;
+    double output_ratio;
+    /* when non-zero, overrides output_ratio */
+    UInt64 output_bytes;
+    /* zero writes the output in one go */
+    UInt64 chunk_bytes;
+} Profile;
+
+/* INTERNAL FUNCTIONS */
+
+ERLXSL_EXPORT void init_engine_v2(XslEngineV2*);
+static EngineState synthetic_transform(Command*);
+static EngineState synthetic_after_transform(Command*);
+static void synthetic_shutdown(void*);
+
+// the result of the CPU spin, so it can't be optimised away
+static volatile UInt64 spin_sink = 0;
+
+static UInt64
+now_micros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((UInt64)ts.tv_sec * 1000000) + ((UInt64)ts.tv_nsec / 1000);
+};
+
+/* Discards any output written so far, replacing it with an error message. */
+static EngineState
+report_error(Command *command, EngineState state, const char *message) {
+    command->result_length = 0;
+    if (append_result_buffer(message, strlen(message), command) == NULL) {
+        return OutOfMemoryError;
+    }
+    return state;
+};
+
+/* Applies a single setting to the profile. Returns zero if the key is unknown. */
+static int
+apply_setting(Profile *profile, const char *key, const char *value) {
+    if (strcmp(key, "spin_us") == 0) {
+        profile->spin_us = strtoull(value, NULL, 10);
+    } else if (strcmp(key, "allocs") == 0) {
+        profile->allocs = strtoull(value, NULL, 10);
+    } else if (strcmp(key, "alloc_bytes") == 0) {
+        profile->alloc_bytes = strtoull(value, NULL, 10);
+    } else if (strcmp(key, "output_ratio") == 0) {
+        profile->output_ratio = strtod(value, NULL);
+    } else if (strcmp(key, "output_bytes") == 0) {
+        profile->output_bytes = strtoull(value, NULL, 10);
+    } else if (strcmp(key, "chunk_bytes") == 0) {
+        profile->chunk_bytes = strtoull(value, NULL, 10);
+    } else {
+        return 0;
+    }
+    return 1;
+};
+
+/* Parses a (not necessarily NUL terminated) profile into 'profile', returning
+     the offending setting if there is one it doesn't understand. */
+static const char*
+parse_profile(const char *data, size_t length, Profile *profile, char *bad) {
+    char setting[MAX_SETTING_SIZE];
+    char *value;
+    size_t pos = 0;
+    size_t len;
+
+    while (pos < length) {
+        while (pos < length && (data[pos] == ' ' || data[pos] == '\t' ||
+                                data[pos] == '\n' || data[pos] == '\r')) pos++;
+        for (len = 0; pos + len < length && data[pos + len] != ' ' && data[pos + len] != '\t' &&
+                      data[pos + len] != '\n' && data[pos + len] != '\r'; len++);
+        if (len == 0) break;
+        if (len >= MAX_SETTING_SIZE) len = MAX_SETTING_SIZE - 1;
+        memcpy(setting, &data[pos], len);
+        setting[len] = '\0';
+        pos += len;
+
+        if ((value = strchr(setting, '=')) == NULL) {
+            strcpy(bad, setting);
+            return bad;
+        }
+        *value++ = '\0';
+        if (!apply_setting(profile, setting, value)) {
+            strcpy(bad, setting);
+            return bad;
+        }
+    }
+    return NULL;
+};
+
+/* Burns CPU for the given time, hashing the input document over and over. */
+static void
+spin(const char *data, size_t length, UInt64 micros) {
+    UInt64 until = now_micros() + micros;
+    UInt64 hash = 14695981039346656037ULL;
+    size_t i = 0;
+    unsigned int n;
+
+    do {
+        for (n = 0; n < 1024; n++) {
+            hash ^= (length == 0) ? n : (UInt8)data[i++ % length];
+            hash *= 1099511628211ULL;
+        }
+    } while (now_micros() < until);
+    spin_sink += hash;
+};
+
+/* Writes 'length' bytes of output (the input repeated), in one go or in chunks. */
+static EngineState
+write_output(Command *command, const char *data, size_t data_length,
+             size_t length, size_t chunk) {
+    size_t written = 0;
+    size_t piece;
+    size_t i;
+    char *out;
+
+    if (length == 0) return Ok;
+    if (chunk == 0) {
+        // size the buffer up front, then fill it as a single chunk
+        if (resize_result_buffer(length, command) == NULL) return OutOfMemoryError;
+        chunk = length;
+    }
+    while (written < length) {
+        piece = (length - written < chunk) ? length - written : chunk;
+        // grow the buffer as append_result_buffer would, then fill the chunk in place
+        if ((size_t)command->result->size < command->result_length + piece &&
+            resize_result_buffer((command->result_length + piece > (size_t)command->result->size * 2)
+                                    ? command->result_length + piece
+                                    : (size_t)command->result->size * 2, command) == NULL) {
+            return OutOfMemoryError;
+        }
+        out = command->result->payload.buffer + command->result_length;
+        for (i = 0; i < piece; i++) {
+            out[i] = (data_length == 0) ? 'x' : data[(written + i) % data_length];
+        }
+        command->result_length += piece;
+        written += piece;
+    }
+    command->result->type = Text;
+    command->result->dirty = 1;
+    return Ok;
+};
+
+void init_engine_v2(XslEngineV2 *spec) {
+    const char *mask = getenv("ERLXSL_SYNTHETIC_CAPABILITIES");
+
+    if (spec->abi.version < 2 || spec->abi.size < sizeof(XslEngineV2)) {
+        ERROR("synthetic_engine requires ABI version 2\n");
+        return;
+    }
+    spec->abi.version = ERLXSL_ABI_VERSION;
+    spec->abi.size = sizeof(XslEngineV2);
+    spec->capabilities = (mask == NULL) ? SUPPORTED_CAPABILITIES
+                       : (strtoull(mask, NULL, 0) & SUPPORTED_CAPABILITIES);
+    spec->transform = synthetic_transform;
+    spec->after_transform = synthetic_after_transform;
+    spec->shutdown = synthetic_shutdown;
+};
+
+static EngineState
+synthetic_transform(Command *command) {
+    XslTask *task = get_task(command);
+    Profile profile = { 0, 0, 64, 1.0, 0, 0 };
+    ParameterListNode *param;
+    char bad[MAX_SETTING_SIZE];
+    char message[ERROR_BUFFER_SIZE];
+    void *scratch = NULL;
+    void *block;
+    size_t output;
+    UInt64 i;
+    EngineState state;
+
+    if (task == NULL) return Error;
+    if (parse_profile(task->stylesheet.data, task->stylesheet.length, &profile, bad) != NULL) {
+        snprintf(message, sizeof(message), "unknown profile setting '%s'", bad);
+        return report_error(command, XslCompileError, message);
+    }
+    for (param = task->parameters; param != NULL; param = (ParameterListNode*)param->next) {
+        if (!apply_setting(&profile, param->key, param->value)) {
+            snprintf(message, sizeof(message), "unknown profile setting '%s'", param->key);
+            return report_error(command, XslCompileError, message);
+        }
+    }
+
+    if (profile.spin_us > 0) {
+        spin(task->input.data, task->input.length, profile.spin_us);
+    }
+    // each block links to the one before, so they can all be released afterwards
+    if (profile.alloc_bytes < sizeof(void*)) {
+        profile.alloc_bytes = sizeof(void*);
+    }
+    for (i = 0; i < profile.allocs; i++) {
+        if ((block = command->alloc(profile.alloc_bytes)) == NULL) break;
+        memset(block, (int)i, profile.alloc_bytes);
+        *(void**)block = scratch;
+        scratch = block;
+    }
+
+    output = (profile.output_bytes > 0) ? profile.output_bytes
+           : (size_t)((double)task->input.length * profile.output_ratio);
+    state = (i < profile.allocs) ? OutOfMemoryError
+          : write_output(command, task->input.data, task->input.length,
+                         output, profile.chunk_bytes);
+
+    while (scratch != NULL) {
+        block = scratch;
+        scratch = *(void**)block;
+        command->release(block);
+    }
+    return state;
+};
+
+static EngineState
+synthetic_after_transform(Command *command) {
+    // the scratch blocks are released by transform, and the result by the driver
+    return Ok;
+};
+
+static void
+synthetic_shutdown(void *state) {
+    INFO("synthetic_engine: shutdown\n");
+};
+
+#ifdef __cplusplus
+}
+#endif
@@ -36,6 +36,15 @@
 // The erlxsl_driver header brings in the main erlxsl header and major pervasive includes
 #include "erlxsl_driver.h"
 #include "erlxsl_ei.h"
+#include "erlxsl_perf.h"
+#include "erlxsl_trace.h"
+#include "erlxsl_slowlog.h"
+#include "erlxsl_traffic.h"
+#include "erlxsl_shadow.h"
+#include "erlxsl_completion.h"
+#include "erlxsl_workers.h"
+#include "erlxsl_batch.h"
+#include "erlxsl_inline.h"
 
 /* INTERNAL DATA & DATA STRUCTURES */
 
@@ -44,20 +53,941 @@ static const char* const unknown_command = "Unknown Command!";
 static const char* const heap_space_exhausted = "Out of Memory!";
 static const char* const transform_command = "transform";
 static const char* const unsupported_response_type = "Unsupported Response Type.";
+static const char* const invalid_setting = "Invalid Setting.";
+static const char* const engine_failure = "Engine Failure.";
+static const char* const no_such_engine = "No engine is loaded at the given index.";
+static const char* const no_command_handler = "The engine does not handle commands.";
 
-#define NUM_TYPE_HEADERS 3
+#define NUM_TYPE_HEADERS 4
 #define NUM_SIZE_HEADERS 2
+#define NUM_TRACE_HEADERS 2
 #define FIRST_BINV_ENTRY 1
+// long running transforms are asked to yield after this many microseconds
+#define DEFAULT_SLICE_MICROS 10000
+// engines providing transform_batch are handed up to this many jobs at once
+#define DEFAULT_BATCH_LIMIT 16
+// a BINARY_EXT term is its tag and a 32bit length, followed by the bytes themselves
+#define BINARY_EXT_HEADER 5
+// each item in a packed engine command starts with an 8bit tag and 32bit value length
+#define CMD_ITEM_HEADER 5
+
+/* Evaluates to the size of a Text result. Engines using ABI v2 report this
+   in result_length, whereas v1 engines produce NUL terminated results. */
+#define result_size(engine, cmd) \
+    (((engine)->abi.version >= 2) \
+        ? (cmd)->result_length \
+        : ((cmd)->result->payload.buffer == NULL) ? 0 : strlen((cmd)->result->payload.buffer))
+
+/* Evaluates to the hash of a command's result, so results can be compared cheaply. */
+#define result_hash(engine, cmd) \
+    (((cmd)->result->type == Binary && (cmd)->result->payload.data != NULL) \
+        ? hash_buffer(((ErlDrvBinary*)(cmd)->result->payload.data)->orig_bytes, \
+                      ((ErlDrvBinary*)(cmd)->result->payload.data)->orig_size) \
+        : ((cmd)->result->payload.buffer == NULL) ? 0 \
+        : hash_buffer((cmd)->result->payload.buffer, result_size(engine, cmd)))
+
+/* Evaluates to the reason the last engine load (or engine command) failed. */
+#define driver_error(d) \
+    (((d)->error_message == NULL) ? engine_failure : (d)->error_message)
+
+/* Evaluates to the ErlDrvBinary whose orig_bytes begin at p. */
+#define bytes_to_binary(p) \
+    ((ErlDrvBinary*)((char*)(p) - offsetof(ErlDrvBinary, orig_bytes)))
+
+/* INTERNAL DRIVER FUNCTIONS */
+
+/* Allocators installed on the commands of engines with EngineBinaryOutput, which
+   back every allocation with a refc binary (handing out its orig_bytes). */
+static void*
+binary_alloc(size_t size) {
+    ErlDrvBinary *bin = driver_alloc_binary(size);
+    return (bin == NULL) ? NULL : bin->orig_bytes;
+};
+
+static void*
+binary_realloc(void *ptr, size_t size) {
+    ErlDrvBinary *bin;
+    if (ptr == NULL) return binary_alloc(size);
+    bin = driver_realloc_binary(bytes_to_binary(ptr), size);
+    return (bin == NULL) ? NULL : bin->orig_bytes;
+};
+
+static void
+binary_release(void *ptr) {
+    if (ptr != NULL) driver_free_binary(bytes_to_binary(ptr));
+};
+
+/* Decodes a packed engine command (see erlxsl_marshall:pack_command/1) into the command's
+   CmdData array - an 8bit count of items, each <<TagLen:8, ValueLen:32/native, Tag, 0, Value, 0>>.
+   The array is sized up front, and its tags and buffers point into 'buf' rather than being
+   copied, so 'buf' must outlive the command (see retain_cmd_buffer). */
+static DriverState
+decode_cmd_buffer(Command *command, char *buf, long len) {
+    DriverIOVec *iov = command->command_data.iov;
+    char *p = buf + 1;
+    char *end = buf + len;
+    UInt32 tag_len;
+    UInt32 value_len;
+    UInt8 count;
+    UInt8 i;
+    CmdData *items;
+
+    if (len < 1 || (count = *(UInt8*)buf) == 0) return DecodeError;
+    if ((items = ALLOC(sizeof(CmdData) * count)) == NULL) return OutOfMemory;
+    for (i = 0; i < count; i++) {
+        if (end - p < CMD_ITEM_HEADER) break;
+        tag_len = *(UInt8*)p;
+        memcpy(&value_len, p + 1, sizeof(UInt32));
+        p += CMD_ITEM_HEADER;
+        // both strings are NUL terminated in the buffer, so engines can use them as they are
+        if ((UInt64)(end - p) < (UInt64)tag_len + value_len + 2 ||
+            p[tag_len] != '\0' || p[tag_len + 1 + value_len] != '\0') break;
+        items[i].tag = p;
+        items[i].type = String;
+        items[i].payload.buffer = p + tag_len + 1;
+        items[i].size = (Int32)value_len;
+        p += tag_len + value_len + 2;
+    }
+    if (i < count || p != end) {
+        DRV_FREE(items);
+        return DecodeError;
+    }
+    iov->payload.data = items;
+    iov->size = count;
+    iov->dirty = 1;
+    return Success;
+};
+
+/* Copies the buffer a command decoded by decode_cmd_buffer points into onto the end of its
+   CmdData array (in a single allocation), so the command can outlive the request. */
+static DriverState
+retain_cmd_buffer(Command *command, const char *buf, long len) {
+    DriverIOVec *iov = command->command_data.iov;
+    CmdData *items = (CmdData*)iov->payload.data;
+    size_t items_len = sizeof(CmdData) * iov->size;
+    CmdData *copy;
+    char *bytes;
+    Int32 i;
+
+    if ((copy = ALLOC(items_len + len)) == NULL) return OutOfMemory;
+    bytes = (char*)copy + items_len;
+    memcpy(bytes, buf, len);
+    for (i = 0; i < iov->size; i++) {
+        copy[i] = items[i];
+        copy[i].tag = bytes + (items[i].tag - buf);
+        copy[i].payload.buffer = bytes + (items[i].payload.buffer - buf);
+    }
+    DRV_FREE(items);
+    iov->payload.data = copy;
+    return Success;
+};
+
+/* Releases any binaries retained for the job, then frees the AsyncState. */
+static void
+release_async_state(AsyncState *state) {
+    int i;
+    for (i = 0; i < 2; i++) {
+        if (state->retained[i] != NULL) {
+            driver_free_binary((ErlDrvBinary*)state->retained[i]);
+        }
+    }
+    if (state->reply_bin != NULL) {
+        driver_free_binary((ErlDrvBinary*)state->reply_bin);
+    }
+    free_async_state(state);
+};
+
+static const struct {
+    EngineCapability flag;
+    const char *name;
+} capability_names[] = {
+    { EngineReentrant, "reentrant" },
+    { EngineZeroCopyInput, "zero_copy_input" },
+    { EngineBinaryOutput, "binary_output" },
+    { EngineStreaming, "streaming" },
+    { EngineStylesheetCache, "stylesheet_cache" },
+    { EngineBatch, "batch" },
+    { EngineAsyncCompletion, "async_completion" }
+};
+
+#define NUM_CAPABILITIES (sizeof(capability_names) / sizeof(capability_names[0]))
+
+/* Logs the capabilities negotiated with a newly loaded engine. */
+static void
+log_capabilities(LoadedEngine *slot) {
+    size_t i;
+    DBG("Engine %s uses ABI v%u\n", slot->loader->name, slot->engine->abi.version);
+    DBG("  per-worker contexts: %s\n", (slot->workers != NULL) ? "enabled" : "disabled");
+    for (i = 0; i < NUM_CAPABILITIES; i++) {
+        DBG("  %s: %s\n", capability_names[i].name,
+             (slot->capabilities & capability_names[i].flag) ? "enabled" : "disabled");
+    }
+};
+
+/* The counters of an engine which workers update, read once for both passes of stats. */
+typedef struct {
+    UInt32 workers;
+    UInt64 failures;
+    UInt64 batches;
+    UInt64 batched;
+    UInt32 largest_batch;
+} EngineCounters;
+
+/* Encodes an engine's library, ABI version, capabilities and counters as a proplist. */
+static void
+engine_encode(LoadedEngine *slot, UInt32 position, EngineCounters *counters,
+              char *buf, int *index) {
+    size_t i;
+    int count = 0;
+
+    ei_encode_list_header(buf, index, 11);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "index");
+    ei_encode_ulong(buf, index, position);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "library");
+    ei_encode_string(buf, index, slot->loader->name);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "abi");
+    ei_encode_ulong(buf, index, slot->engine->abi.version);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "capabilities");
+    for (i = 0; i < NUM_CAPABILITIES; i++) {
+        if (slot->capabilities & capability_names[i].flag) count++;
+    }
+    if (count > 0) {
+        ei_encode_list_header(buf, index, count);
+        for (i = 0; i < NUM_CAPABILITIES; i++) {
+            if (slot->capabilities & capability_names[i].flag) {
+                ei_encode_atom(buf, index, capability_names[i].name);
+            }
+        }
+    }
+    ei_encode_empty_list(buf, index);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "requests");
+    ei_encode_ulonglong(buf, index, slot->requests);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "inflight");
+    ei_encode_ulong(buf, index, slot->inflight);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "workers");
+    ei_encode_ulong(buf, index, counters->workers);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "worker_init_failures");
+    ei_encode_ulonglong(buf, index, counters->failures);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "batches");
+    ei_encode_ulonglong(buf, index, counters->batches);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "batched_requests");
+    ei_encode_ulonglong(buf, index, counters->batched);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "largest_batch");
+    ei_encode_ulong(buf, index, counters->largest_batch);
+    ei_encode_empty_list(buf, index);
+};
+
+/* Shuts an engine down, unloads its library and frees its slot. */
+static void
+unload_engine(DriverHandle *d, LoadedEngine *slot) {
+    ErlDrvPort port = (ErlDrvPort)d->port;
+    // v2 engines get their own instance data back, as several ports may share the library
+    void *state = shutdown_state(slot->engine, &port);
+
+    DBG("provider handoff: thread_shutdown\n");
+    worker_pool_destroy(slot->workers, slot->engine);
+    batch_queue_destroy(slot->batches);
+    DBG("provider handoff: shutdown\n");
+    slot->engine->shutdown(state);
+
+    // unload engine/so_library
+    DBG("unloading library %s\n", slot->loader->name);
+    release_loader(slot->loader);
+    driver_free(slot->engine);
+    driver_free(slot);
+};
+
+/* Unloads the replaced engines which have no transforms left in flight. */
+static void
+drain_retired(DriverHandle *d) {
+    LoadedEngine **link = &d->retired;
+    LoadedEngine *slot;
+    while ((slot = *link) != NULL) {
+        if (slot->inflight == 0) {
+            *link = slot->next;
+            unload_engine(d, slot);
+        } else {
+            link = &slot->next;
+        }
+    }
+};
+
+/* Takes an engine out of its slot, unloading it once its in-flight transforms have drained. */
+static void
+retire_engine(DriverHandle *d, UInt32 index) {
+    LoadedEngine *slot = d->engines[index];
+    d->engines[index] = NULL;
+    slot->next = d->retired;
+    d->retired = slot;
+    drain_retired(d);
+};
+
+/* Sets up the completion queue, if it isn't already, and starts watching its
+   event. Returns 0 if it can't be created. */
+static int
+watch_completions(DriverHandle *d) {
+    if (d->completions == NULL) {
+        if ((d->completions = completion_queue_create()) == NULL) {
+            return 0;
+        }
+        driver_select((ErlDrvPort)d->port, completion_event(d->completions),
+                      ERL_DRV_READ | ERL_DRV_USE, 1);
+    }
+    return 1;
+};
+
+/* Loads an engine into the next free slot, preparing its worker pool. */
+static DriverState
+load_engine(DriverHandle *d, char *path, LoadedEngine **loaded, UInt32 *index) {
+    DriverState state = stage_provider(d, path, index);
+    if (state != InitOk) {
+        return state;
+    }
+    *loaded = d->engines[*index];
+    if ((*loaded)->engine->thread_init != NULL &&
+        ((*loaded)->workers = worker_pool_create()) == NULL) {
+        retire_engine(d, *index);
+        return OutOfMemory;
+    }
+    if (((*loaded)->capabilities & EngineBatch) &&
+        ((*loaded)->batches = batch_queue_create()) == NULL) {
+        retire_engine(d, *index);
+        return OutOfMemory;
+    }
+    // the completion queue is only set up once something can make use of it - batched
+    // jobs are completed through it by the worker which ran them
+    if (((*loaded)->capabilities & (EngineAsyncCompletion | EngineBatch)) &&
+        !watch_completions(d)) {
+        retire_engine(d, *index);
+        return OutOfMemory;
+    }
+    return InitOk;
+};
+
+/* Evaluates to the driver_async key for an engine's jobs. Jobs for non-reentrant engines
+   share a key, and therefore a single async thread - unless the engine keeps per-worker
+   state, in which case workers never share it. */
+#define async_key(slot) \
+    ((((slot)->capabilities & EngineReentrant) || (slot)->workers != NULL) \
+        ? NULL : &(slot)->async_key)
+
+/* Evaluates to the engine loaded at index i, or NULL if there isn't one. */
+#define engine_at(d, i) \
+    (((i) < 0 || (i) >= (long)(d)->engine_count) ? NULL : (d)->engines[(i)])
+
+/* Handles RELOAD_COMMAND. Reloading an engine is a three step process, driven
+     by the caller: {stage, Path} loads the replacement into a free slot and
+     replies {ok, Staged}, after which the caller can warm it up by routing
+     requests to Staged; {switch, Index, Staged} swaps the replacement into slot
+     Index; {discard, Staged} abandons it instead. The replaced engine stays
+     loaded until its in-flight transforms have completed. */
+static int
+reload(DriverHandle *d, char *buf, int *index, char **rbuf) {
+    ReloadRequest request;
+    LoadedEngine *slot = NULL;
+    UInt32 staged = 0;
+    int rindex = 0;
+    const char *err = no_such_engine;
+    DriverState state = decode_ei_reload(buf, index, &request);
+
+    if (state == Success) {
+        if (strcmp(request.op, "stage") == 0) {
+            d->error_message = NULL;
+            if ((state = load_engine(d, request.path, &slot, &staged)) == InitOk) {
+                DBG("Provider staged with library %s\n", slot->loader->name);
+                log_capabilities(slot);
+            } else {
+                err = (state == OutOfMemory) ? heap_space_exhausted : driver_error(d);
+            }
+        } else if (strcmp(request.op, "switch") == 0) {
+            if (engine_at(d, request.index) == NULL || engine_at(d, request.staged) == NULL ||
+                request.index == request.staged) {
+                state = BadArgumentError;
+            } else {
+                DBG("switching engine %li to staged engine %li\n", request.index, request.staged);
+                slot = d->engines[request.staged];
+                d->engines[request.staged] = NULL;
+                retire_engine(d, (UInt32)request.index);
+                d->engines[request.index] = slot;
+            }
+        } else if (engine_at(d, request.staged) == NULL || request.staged == 0) {
+            // the default engine can only be replaced, never discarded
+            state = BadArgumentError;
+        } else {
+            DBG("discarding staged engine %li\n", request.staged);
+            retire_engine(d, (UInt32)request.staged);
+        }
+    } else if (state != OutOfMemory) {
+        err = unknown_command;
+    } else {
+        err = heap_space_exhausted;
+    }
+    DRV_FREE(request.path);
+
+    ei_encode_version(*rbuf, &rindex);
+    if (state == InitOk) {
+        ei_encode_tuple_header(*rbuf, &rindex, 2);
+        ei_encode_atom(*rbuf, &rindex, "ok");
+        ei_encode_ulong(*rbuf, &rindex, staged);
+    } else if (state == Success) {
+        ei_encode_atom(*rbuf, &rindex, "ok");
+    } else {
+        ei_encode_tuple_header(*rbuf, &rindex, 2);
+        ei_encode_atom(*rbuf, &rindex, "error");
+        ei_encode_string_len(*rbuf, &rindex, err, strlen(err));
+    }
+    return rindex;
+};
+
+/* Evaluates to the microseconds between two wall clock timestamps, or zero if
+   the clock went backwards in between. */
+#define micros_between(from, to) (((to) > (from)) ? (to) - (from) : 0)
+
+/*
+ * Builds the reply to a transform - {result|error, Port, Result}, with a fourth
+ * element of {TraceId, QueueMicros, EngineMicros} for traced requests - so that
+ * deliver_result has only to send it. Batched replies carry the caller's reply
+ * id in place of the port, and are sent in a list (see send_grouped_replies).
+ * A Text result the engine didn't put in a binary is copied into one here,
+ * which keeps that copy off the emulator thread.
+ */
+static void
+prepare_reply(AsyncState *data, EngineState state) {
+    Command *command = data->command;
+    LoadedEngine *slot = data->engine;
+    DriverIOVec *outv = command->result;
+    RequestTrace *trace = data->trace;
+    ErlDrvTermData *spec = (ErlDrvTermData*)data->reply;
+    ErlDrvBinary *bin = NULL;
+    const char *text = unsupported_response_type;
+    size_t size = 0;
+    int n = 0;
+
+    data->reply_len = 0;
+    if (data->shadow == ShadowRun || state == OutOfMemoryError) {
+        // nobody is waiting on a shadow run, and running out of memory fails the port
+        return;
+    }
+
+    switch (outv->type) {
+    case Text:
+        size = result_size(slot->engine, command);
+        if ((slot->capabilities & EngineBinaryOutput) && outv->payload.buffer != NULL) {
+            // the result already lives in a binary, which we can pass on without copying
+            bin = bytes_to_binary(outv->payload.buffer);
+        } else if ((data->reply_bin = bin = driver_alloc_binary(size)) == NULL) {
+            return;
+        } else if (size > 0) {
+            memcpy(bin->orig_bytes, outv->payload.buffer, size);
+        }
+        break;
+    case Binary:
+        if ((bin = (ErlDrvBinary*)outv->payload.data) != NULL) {
+            size = bin->orig_size;
+        } else {
+            text = "";
+        }
+        break;
+    default:
+        break;
+    }
+
+    spec[n++] = ERL_DRV_ATOM;
+    spec[n++] = (state == Ok) ? atom_result : atom_error;
+    if (data->batch_reply) {
+        spec[n++] = ERL_DRV_UINT;
+        spec[n++] = (ErlDrvTermData)data->reply_id;
+    } else {
+        spec[n++] = ERL_DRV_PORT;
+        spec[n++] = data->driver->port_term;
+    }
+    if (bin != NULL) {
+        // the binary, the number of bytes to take from it and the offset to take them from
+        spec[n++] = ERL_DRV_BINARY;
+        spec[n++] = (ErlDrvTermData)bin;
+        spec[n++] = (ErlDrvTermData)size;
+        spec[n++] = 0;
+    } else {
+        spec[n++] = ERL_DRV_BUF2BINARY;
+        spec[n++] = (ErlDrvTermData)text;
+        spec[n++] = (ErlDrvTermData)strlen(text);
+    }
+    if (trace != NULL) {
+        spec[n++] = ERL_DRV_UINT;
+        spec[n++] = (ErlDrvTermData)trace->trace_id;
+        spec[n++] = ERL_DRV_UINT;
+        spec[n++] = (ErlDrvTermData)micros_between(trace->queued, trace->started);
+        spec[n++] = ERL_DRV_UINT;
+        spec[n++] = (ErlDrvTermData)micros_between(trace->started, trace->finished);
+        spec[n++] = ERL_DRV_TUPLE;
+        spec[n++] = 3;
+    }
+    spec[n++] = ERL_DRV_TUPLE;
+    spec[n++] = (trace != NULL) ? 4 : 3;
+    ASSERT(n <= REPLY_SPEC_SIZE);
+    data->reply_len = n;
+};
+
+/* Records the outcome of a transform - called on whichever thread completed it. */
+static void
+finish_transform(AsyncState *data, EngineState state) {
+    DriverHandle* driver = data->driver;
+    Command* command = data->command;
+
+    if (data->trace != NULL) {
+        data->trace->finished = wall_clock_micros();
+    }
+    if (data->shadow != NotShadowed) {
+        // hashing here keeps the comparison's cost off the emulator thread
+        data->elapsed = monotonic_micros() - data->started;
+        data->result_hash = result_hash(data->engine->engine, command);
+    }
+    if (data->inline_key != 0) {
+        data->engine_us = monotonic_micros() - data->started;
+    }
+    if (data->enqueued > 0) {
+        UInt64 finished = monotonic_micros();
+        slow_log_capture(driver->slowlog, command->command_data.xsl_task, state,
+                         data->started - data->enqueued, finished - data->started);
+        traffic_log_record(driver->traffic, command->command_data.xsl_task, state,
+                           data->enqueued, data->started, finished);
+    }
+    prepare_reply(data, state);
+};
+
+/* Completion callback (see Command.complete) for commands left pending by their engine. */
+static void
+complete_transform(Command *command, EngineState state) {
+    AsyncState *data = (AsyncState*)command->driver_private;
+    finish_transform(data, state);
+    data->completion = state;
+    completion_queue_push(data->driver->completions, data);
+};
+
+/* Hands a job whose caller asked for batched replies to the completion queue, so that
+   ready_input can send its reply along with any others for the same caller. The job
+   is Pending (to ready_async) from here on, and can no longer be touched by the worker. */
+static void
+queue_reply(AsyncState *data) {
+    data->completion = data->state;
+    data->state = Pending;
+    completion_queue_push(data->driver->completions, data);
+};
+
+/* Yield check (see Command.yield_check) for transforms run on the driver's workers. */
+static int
+transform_yield_check(Command *command) {
+    AsyncState *data = (AsyncState*)command->driver_private;
+    UInt64 slice = data->driver->slicing.slice;
+    return slice > 0 && (monotonic_micros() - data->slice_started) >= slice;
+};
+
+/* Marks the start of a job's time slice, and of the job itself if it is the first. */
+static void
+begin_transform(AsyncState *data) {
+    data->slice_started = monotonic_micros();
+    // resumed jobs are timed from the start of their first slice
+    if (data->yields == 0) {
+        data->started = (data->enqueued > 0 || data->shadow != NotShadowed || data->inline_key != 0)
+            ? data->slice_started : 0;
+        if (data->trace != NULL) {
+            data->trace->worker_tid = current_thread_id();
+            data->trace->started = wall_clock_micros();
+        }
+    }
+};
+
+/* Logs a completed job's output. */
+static void
+log_output(LoadedEngine *slot, Command *command) {
+    if (command->result->type == Text) {
+        // v2 results are not NUL terminated
+        DBG("output buffer: %.*s\n", (int)result_size(slot->engine, command),
+             (char*)command->result->payload.buffer);
+    }
+};
+
+/*
+Runs a job in a batch with the other jobs waiting in its engine's batch queue. The jobs
+are claimed by whichever of their workers gets to them first - the others find their job
+gone, and leave it Pending for ready_async. The claiming worker completes those jobs
+through the completion queue, just as an EngineAsyncCompletion engine would.
+*/
+static void
+apply_batch(AsyncState *data) {
+    AsyncState *jobs[MAX_BATCH_SIZE];
+    Command *commands[MAX_BATCH_SIZE];
+    EngineState states[MAX_BATCH_SIZE];
+    DriverHandle *driver = data->driver;
+    LoadedEngine *slot = data->engine;
+    void *context;
+    EngineState state;
+    UInt32 count;
+    UInt32 i;
+
+    if ((count = batch_queue_claim(slot->batches, data, jobs, driver->batch_limit)) == 0) {
+        data->state = Pending;
+        return;
+    }
+
+    state = worker_pool_context(slot->workers, slot->engine, &context);
+    for (i = 0; i < count; i++) {
+        begin_transform(jobs[i]);
+        commands[i] = jobs[i]->command;
+        commands[i]->worker_context = context;
+        // batched commands must be completed by the time transform_batch returns
+        commands[i]->complete = NULL;
+        commands[i]->yield_check = NULL;
+        states[i] = state;
+    }
+    if (state == Ok) {
+        run_transform_batch(slot->engine, commands, states, count);
+    }
+
+    for (i = 0; i < count; i++) {
+        if (states[i] == Pending || states[i] == Yielded) {
+            ERROR("engine returned %s from a batch\n", (states[i] == Pending) ? "Pending" : "Yielded");
+            states[i] = Error;
+        }
+        log_output(slot, commands[i]);
+        if (jobs[i] == data) {
+            data->state = states[i];
+            finish_transform(data, states[i]);
+        } else {
+            complete_transform(commands[i], states[i]);
+        }
+    }
+    trace_log_maybe_flush(driver->trace);
+    if (data->batch_reply) {
+        queue_reply(data);
+    }
+};
+
+/* Async callback wrapper that takes an AsyncState struct, applies the engine function and stores the result */
+static void
+apply_transform(void *asd) {
+    AsyncState* data = (AsyncState*)asd;
+    DriverHandle* driver = data->driver;
+    LoadedEngine* slot = data->engine;
+    XslEngineV2* engine = slot->engine;
+    Command* command = data->command;
+    PerfSample start;
+    int sampled;
+
+    if (slot->batches != NULL) {
+        // batches are left out of the perf figures, which are gathered per stylesheet
+        apply_batch(data);
+        return;
+    }
+    // shadow runs are left out of the perf figures, which describe the live engines
+    sampled = (data->shadow != ShadowRun) && perf_sample_begin(driver->perf, &start);
+
+    begin_transform(data);
+    data->state = worker_pool_context(slot->workers, engine, &command->worker_context);
+    if (data->state == Ok) {
+        data->state = engine->transform(command);
+    }
+    if (data->state == Pending) {
+        if (command->complete != NULL) {
+            // the engine will call complete_transform, possibly on another thread, once
+            // it is done - the command can no longer be touched here
+            return;
+        }
+        ERROR("engine returned Pending without a completion callback\n");
+        data->state = Error;
+    } else if (data->state == Yielded) {
+        if (command->yield_check != NULL) {
+            // the engine has parked the command, ready_async puts it back in the queue
+            return;
+        }
+        ERROR("engine returned Yielded without a yield check\n");
+        data->state = Error;
+    }
+
+    finish_transform(data, data->state);
+    if (sampled) {
+        InputDocument *xsl = command->command_data.xsl_task->xslt_doc;
+        perf_sample_end(driver->perf,
+            hash_buffer(get_doc_buffer(xsl), get_doc_size(xsl)), &start);
+    }
+    // workers take care of writing out the trace log, keeping file I/O off the schedulers
+    trace_log_maybe_flush(driver->trace);
+    log_output(slot, command);
+    if (data->batch_reply) {
+        queue_reply(data);
+    }
+};
+
+/* Async callback which runs an engine command (see engine_command) on a worker. */
+static void
+apply_command(void *asd) {
+    AsyncState *data = (AsyncState*)asd;
+    LoadedEngine *slot = data->engine;
+    Command *command = data->command;
+
+    data->state = worker_pool_context(slot->workers, slot->engine, &command->worker_context);
+    if (data->state == Ok) {
+        data->state = slot->engine->command(command);
+    }
+};
+
+/* Applies a single {Key, Value} setting to the driver. */
+static DriverState
+configure_driver(DriverHandle *d, DriverSetting *setting) {
+    const char *key = setting->key;
+    if (strcmp(key, "perf_sample_rate") == 0) {
+        return perf_set_sample_rate(d->perf, setting->number);
+    } else if (strcmp(key, "trace_file") == 0) {
+        return (setting->string == NULL) ? BadArgumentError
+            : trace_log_open(d->trace, setting->string);
+    } else if (strcmp(key, "trace_threshold_us") == 0) {
+        if (setting->number < 0) return BadArgumentError;
+        d->trace->threshold = (UInt64)setting->number;
+        return Success;
+    } else if (strcmp(key, "trace_flush_interval_ms") == 0) {
+        if (setting->number <= 0) return BadArgumentError;
+        d->trace->flush_interval = (UInt64)(setting->number * 1000);
+        return Success;
+    } else if (strcmp(key, "capture_dir") == 0) {
+        if (setting->string == NULL) return BadArgumentError;
+        // an empty path switches the slow log off
+        slow_log_set_dir(d->slowlog, (*setting->string == '\0') ? NULL : setting->string);
+        if (d->slowlog->dir != NULL) setting->string = NULL;  // now owned by the slow log
+        return Success;
+    } else if (strcmp(key, "capture_threshold_ms") == 0) {
+        if (setting->number < 0) return BadArgumentError;
+        d->slowlog->threshold = (UInt64)(setting->number * 1000);
+        return Success;
+    } else if (strcmp(key, "capture_rate_per_min") == 0) {
+        if (setting->number < 0) return BadArgumentError;
+        d->slowlog->rate_limit = (UInt32)setting->number;
+        return Success;
+    } else if (strcmp(key, "capture_max_bytes") == 0) {
+        if (setting->number < 0) return BadArgumentError;
+        d->slowlog->max_bytes = (UInt64)setting->number;
+        return Success;
+    } else if (strcmp(key, "capture_max_total_bytes") == 0) {
+        if (setting->number < 0) return BadArgumentError;
+        d->slowlog->max_total = (UInt64)setting->number;
+        return Success;
+    } else if (strcmp(key, "traffic_file") == 0) {
+        return (setting->string == NULL) ? BadArgumentError
+            : traffic_log_open(d->traffic, setting->string);
+    } else if (strcmp(key, "traffic_body_rate") == 0) {
+        return traffic_log_set_body_rate(d->traffic, setting->number);
+    } else if (strcmp(key, "traffic_max_total_bytes") == 0) {
+        if (setting->number < 0) return BadArgumentError;
+        d->traffic->max_total = (UInt64)setting->number;
+        return Success;
+    } else if (strcmp(key, "transform_batch_max") == 0) {
+        if (setting->number < 1 || setting->number > MAX_BATCH_SIZE) return BadArgumentError;
+        d->batch_limit = (UInt32)setting->number;
+        return Success;
+    } else if (strcmp(key, "transform_slice_us") == 0) {
+        if (setting->number < 0) return BadArgumentError;
+        d->slicing.slice = (UInt64)setting->number;
+        return Success;
+    } else if (strcmp(key, "inline_max_us") == 0) {
+        if (setting->number < 0) return BadArgumentError;
+        d->inlining->max_us = (UInt64)setting->number;
+        return Success;
+    } else if (strcmp(key, "inline_max_input") == 0) {
+        if (setting->number < 0) return BadArgumentError;
+        d->inlining->max_input = (UInt64)setting->number;
+        return Success;
+    } else if (strcmp(key, "shadow_engine") == 0) {
+        // the engine need not be loaded yet, so only the range is checked
+        if (setting->string != NULL || setting->number < SHADOW_NONE ||
+            setting->number >= MAX_ENGINES) return BadArgumentError;
+        d->shadow->engine = (long)setting->number;
+        return Success;
+    } else if (strcmp(key, "shadow_sample_rate") == 0) {
+        return shadow_set_sample_rate(d->shadow, setting->number);
+    } else if (strcmp(key, "shadow_max_pending") == 0) {
+        if (setting->number < 0) return BadArgumentError;
+        d->shadow->max_pending = (UInt32)setting->number;
+        return Success;
+    }
+    return UnknownCommand;
+};
+
+/* Handles CONFIGURE_COMMAND, replying with 'ok' or {error, Reason}. */
+static int
+configure(DriverHandle *d, char *buf, int *index, char **rbuf) {
+    DriverSetting setting;
+    int rindex = 0;
+    DriverState state = decode_ei_setting(buf, index, &setting);
+    if (state == Success) {
+        state = configure_driver(d, &setting);
+    }
+    DRV_FREE(setting.string);
+
+    ei_encode_version(*rbuf, &rindex);
+    if (state == Success) {
+        DBG("Driver setting %s changed\n", setting.key);
+        ei_encode_atom(*rbuf, &rindex, "ok");
+    } else {
+        ei_encode_tuple_header(*rbuf, &rindex, 2);
+        ei_encode_atom(*rbuf, &rindex, "error");
+        ei_encode_string(*rbuf, &rindex,
+            (state == UnknownCommand) ? unknown_command : invalid_setting);
+    }
+    return rindex;
+};
+
+/* Encodes the time slicing counters as a proplist of the form
+
+   [{slice_us, N}, {yields, N}, {yielded_jobs, N}, {max_yields, N}]
+
+   If buf is NULL, only the index is advanced (i.e., the size is computed). */
+static void
+slicing_encode(TimeSlicing *slicing, char *buf, int *index) {
+    ei_encode_list_header(buf, index, 4);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "slice_us");
+    ei_encode_ulonglong(buf, index, slicing->slice);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "yields");
+    ei_encode_ulonglong(buf, index, slicing->yields);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "yielded_jobs");
+    ei_encode_ulonglong(buf, index, slicing->yielded_jobs);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "max_yields");
+    ei_encode_ulong(buf, index, slicing->max_yields);
+    ei_encode_empty_list(buf, index);
+};
+
+/* Handles STATS_COMMAND, replying with a proplist of statistics sections. */
+static int
+stats(DriverHandle *d, char **rbuf, int rlen) {
+    int size = 0;
+    int rindex = 0;
+    int pass;
+    UInt32 i;
+    EngineCounters counters[MAX_ENGINES];
+    char *buf = NULL;
+    int *index = &size;
+    PerfStats *perf = d->perf;
+    TraceLog *trace = d->trace;
+    SlowLog *slowlog = d->slowlog;
+    TrafficLog *traffic = d->traffic;
+
+    UInt32 loaded = 0;
+    UInt32 draining = 0;
+    LoadedEngine *retired;
+
+    // worker and batch counts can change at any time, so are read once for both passes
+    for (i = 0; i < d->engine_count; i++) {
+        if (d->engines[i] != NULL) {
+            worker_pool_snapshot(d->engines[i]->workers, &counters[i].workers, &counters[i].failures);
+            batch_queue_snapshot(d->engines[i]->batches, &counters[i].batches,
+                                 &counters[i].batched, &counters[i].largest_batch);
+            loaded++;
+        }
+    }
+    for (retired = d->retired; retired != NULL; retired = retired->next) {
+        draining++;
+    }
+    // every section stays locked across both passes, so the size can't change
+    erl_drv_mutex_lock(perf->lock);
+    erl_drv_mutex_lock(trace->lock);
+    erl_drv_mutex_lock(slowlog->lock);
+    erl_drv_mutex_lock(traffic->lock);
+    // the first pass computes the size of the encoded term, the second writes it
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            if (size > rlen && (*rbuf = ALLOC(size)) == NULL) {
+                size = -1;
+                break;
+            }
+            buf = *rbuf;
+            index = &rindex;
+        }
+        ei_encode_version(buf, index);
+        ei_encode_list_header(buf, index, 9);
+        ei_encode_tuple_header(buf, index, 2);
+        ei_encode_atom(buf, index, "perf");
+        perf_stats_encode(perf, buf, index);
+        ei_encode_tuple_header(buf, index, 2);
+        ei_encode_atom(buf, index, "trace");
+        trace_log_encode(trace, buf, index);
+        ei_encode_tuple_header(buf, index, 2);
+        ei_encode_atom(buf, index, "capture");
+        slow_log_encode(slowlog, buf, index);
+        ei_encode_tuple_header(buf, index, 2);
+        ei_encode_atom(buf, index, "traffic");
+        traffic_log_encode(traffic, buf, index);
+        ei_encode_tuple_header(buf, index, 2);
+        ei_encode_atom(buf, index, "engines");
+        if (loaded > 0) {
+            ei_encode_list_header(buf, index, loaded);
+            for (i = 0; i < d->engine_count; i++) {
+                if (d->engines[i] != NULL) {
+                    engine_encode(d->engines[i], i, &counters[i], buf, index);
+                }
+            }
+        }
+        ei_encode_empty_list(buf, index);
+        ei_encode_tuple_header(buf, index, 2);
+        ei_encode_atom(buf, index, "draining_engines");
+        ei_encode_ulong(buf, index, draining);
+        ei_encode_tuple_header(buf, index, 2);
+        ei_encode_atom(buf, index, "shadow");
+        shadow_stats_encode(d->shadow, buf, index);
+        ei_encode_tuple_header(buf, index, 2);
+        ei_encode_atom(buf, index, "slicing");
+        slicing_encode(&d->slicing, buf, index);
+        ei_encode_tuple_header(buf, index, 2);
+        ei_encode_atom(buf, index, "inline");
+        inline_stats_encode(d->inlining, buf, index);
+        ei_encode_empty_list(buf, index);
+    }
+    erl_drv_mutex_unlock(traffic->lock);
+    erl_drv_mutex_unlock(slowlog->lock);
+    erl_drv_mutex_unlock(trace->lock);
+    erl_drv_mutex_unlock(perf->lock);
+    return (size < 0) ? -1 : rindex;
+};
 
 /* DRIVER CALLBACK FUNCTIONS */
 
-// Called by the emulator when the driver is starting.
-static ErlDrvData
-start_driver(ErlDrvPort port, char *buff) {
+// Called by the emulator when the driver is loaded.
+static int
+init_driver(void) {
+    // atoms are global to the emulator, so are created once rather than per port
     atom_result = driver_mk_atom("result");
     atom_error    = driver_mk_atom("error");
     atom_log        = driver_mk_atom("log");
+    atom_command    = driver_mk_atom("command");
+    atom_results    = driver_mk_atom("results");
+    if (worker_init() != 0) {
+        return -1;
+    }
+    return perf_init();
+};
 
+// Called by the emulator when the driver is unloaded.
+static void
+finish_driver(void) {
+    worker_finish();
+    perf_finish();
+};
+
+// Called by the emulator when the driver is starting.
+static ErlDrvData
+start_driver(ErlDrvPort port, char *buff) {
     // avoid total madness! nice tip that one...
     if (port == NULL) {
             return ERL_DRV_ERROR_GENERAL;
@@ -68,31 +998,225 @@ start_driver(ErlDrvPort port, char *buff) {
         return ERL_DRV_ERROR_GENERAL; // TODO: use ERL_DRV_ERROR_ERRNO and provide out-of-memory info
     }
     d->port = (void*)port;
+    d->port_term = driver_mk_port(port);
     d->logging_port = NULL;
+    memset(d->engines, 0, sizeof(d->engines));
+    d->engine_count = 0;
+    d->retired = NULL;
+    d->error_message = NULL;
+    d->perf = perf_stats_create();
+    d->trace = trace_log_create();
+    d->slowlog = slow_log_create();
+    d->traffic = traffic_log_create();
+    d->shadow = shadow_stats_create();
+    d->inlining = inline_stats_create();
+    d->completions = NULL;
+    memset(&d->slicing, 0, sizeof(TimeSlicing));
+    d->slicing.slice = DEFAULT_SLICE_MICROS;
+    d->batch_limit = DEFAULT_BATCH_LIMIT;
+    d->last_command_id = 0;
+    if (d->perf == NULL || d->trace == NULL || d->slowlog == NULL ||
+        d->traffic == NULL || d->shadow == NULL || d->inlining == NULL) {
+        perf_stats_destroy(d->perf);
+        trace_log_destroy(d->trace);
+        slow_log_destroy(d->slowlog);
+        traffic_log_destroy(d->traffic);
+        shadow_stats_destroy(d->shadow);
+        inline_stats_destroy(d->inlining);
+        DRV_FREE(d);
+        return ERL_DRV_ERROR_GENERAL;
+    }
     return (ErlDrvData)d;
 };
 
+/* Releases the completed jobs left in the queue when the port closes, without
+   delivering their results. Jobs for which ready_async never ran may still be in
+   use by a worker, so are left alone. */
+static void
+discard_completions(DriverHandle *d, int engines_loaded) {
+    AsyncState *job = completion_queue_take(d->completions);
+    AsyncState *next;
+
+    for (; job != NULL; job = next) {
+        next = job->next;
+        if (job->parked) {
+            if (engines_loaded) {
+                job->engine->engine->after_transform(job->command);
+            }
+            release_async_state(job);
+        }
+    }
+};
+
 // Called by the emulator when the driver is stopping.
 static void
 stop_driver(ErlDrvData drv_data) {
-    // give the provider a chance to clean up
     DriverHandle *d = (DriverHandle*)drv_data;
-    ErlDrvPort port = (ErlDrvPort)d->port;
-    XslEngine *engine = d->engine;
-    void *state = &port;
-    INFO("provider handoff: shutdown\n");
-    engine->shutdown(state);
+    LoadedEngine *slot;
+    UInt32 i;
 
-    // unload engine/so_library
-    INFO("unloading library %s\n", d->loader->name);
-    dlclose((void*)d->loader->library);
+    if (d->completions != NULL) {
+        discard_completions(d, 1);
+    }
+    // give each provider a chance to clean up
+    for (i = 0; i < d->engine_count; i++) {
+        if (d->engines[i] != NULL) {
+            unload_engine(d, d->engines[i]);
+        }
+    }
+    while ((slot = d->retired) != NULL) {
+        d->retired = slot->next;
+        unload_engine(d, slot);
+    }
+    if (d->completions != NULL) {
+        // engines complete any commands still pending as they shut down
+        discard_completions(d, 0);
+        driver_select((ErlDrvPort)d->port, completion_event(d->completions), ERL_DRV_USE, 0);
+        completion_queue_destroy(d->completions);
+    }
 
     // driver cleanup
-    driver_free(engine);
-    driver_free(d->loader);
+    trace_log_cancel_timer(d->trace, (ErlDrvPort)d->port);
+    perf_stats_destroy(d->perf);
+    trace_log_destroy(d->trace);
+    slow_log_destroy(d->slowlog);
+    traffic_log_destroy(d->traffic);
+    shadow_stats_destroy(d->shadow);
+    inline_stats_destroy(d->inlining);
     driver_free(drv_data);
 };
 
+/* Returns non-zero if the engine declares command cheap enough to run on the emulator thread. */
+static int
+is_trivial_command(XslEngineV2 *engine, const char *command) {
+    const char **trivial;
+    if (command == NULL || !abi_has_field(engine, trivial_commands) ||
+        engine->trivial_commands == NULL) {
+        return 0;
+    }
+    for (trivial = engine->trivial_commands; *trivial != NULL; trivial++) {
+        if (strcmp(*trivial, command) == 0) return 1;
+    }
+    return 0;
+};
+
+/* Decodes the argument of an ENGINE_COMMAND - a binary packed by erlxsl_marshall:pack_command/1,
+   or a {Tag, Value} tuple. Sets *packed to the bytes the decoded command points into, or to
+   NULL if the command owns its data. */
+static DriverState
+decode_engine_command(Command *cmd, char *buf, int *index, char **packed, long *packed_len) {
+    int type;
+    int size;
+
+    *packed = NULL;
+    if (!DECODE_OK(ei_get_type(buf, index, &type, &size))) return DecodeError;
+    if (type != ERL_BINARY_EXT) return decode_ei_cmd(cmd, buf, index);
+    *packed = buf + *index + BINARY_EXT_HEADER;
+    *packed_len = size;
+    return decode_cmd_buffer(cmd, *packed, size);
+};
+
+/* Handles ENGINE_COMMAND. Trivial commands (see XslEngineV2.trivial_commands) are run here
+   and reply {ok, Binary} or {error, Reason}. Everything else is handed to a worker, replying
+   {pending, Id} straight away - the result follows as {command, Port, Id, result|error, Binary}
+   (see deliver_command). */
+static int
+engine_command(DriverHandle *d, char *buf, int *index, char **rbuf, int rlen) {
+    int size = 0;
+    int rindex = 0;
+    int pass;
+    int *at = &size;
+    char *out = NULL;
+    const char *err = NULL;
+    const char *payload = NULL;
+    long payload_len = 0;
+    EngineState enstate = Ok;
+    ErlDrvPort port = (ErlDrvPort)d->port;
+    LoadedEngine *slot = d->engines[0];
+    DriverContext *ctx = NULL;
+    Command *cmd = NULL;
+    char *packed = NULL;
+    long packed_len = 0;
+    AsyncState *asd;
+    DriverState state;
+
+    // engine commands are handled by the default engine
+    if (slot == NULL) {
+        err = no_such_engine;
+    } else if (slot->engine->command == NULL) {
+        err = no_command_handler;
+    } else if ((ctx = ALLOC(sizeof(DriverContext))) == NULL ||
+               (cmd = init_command(NULL, ctx, NULL, init_iov(Text, 0, NULL))) == NULL ||
+               cmd->command_data.iov == NULL) {
+        err = heap_space_exhausted;
+    } else if ((state = decode_engine_command(cmd, buf, index, &packed, &packed_len)) != Success ||
+               cmd->command_data.iov->size == 0) {
+        err = (state == OutOfMemory) ? heap_space_exhausted : unknown_command;
+    } else {
+        ctx->port = port;
+        ctx->caller_pid = driver_caller(port);
+        cmd->command_string = ((CmdData*)cmd->command_data.iov->payload.data)->tag;
+        if (!is_trivial_command(slot->engine, cmd->command_string)) {
+            // the request buffer is gone by the time a worker runs the command
+            if ((packed != NULL && retain_cmd_buffer(cmd, packed, packed_len) != Success) ||
+                (asd = ALLOC(sizeof(AsyncState))) == NULL) {
+                err = heap_space_exhausted;
+            } else {
+                cmd->command_string = ((CmdData*)cmd->command_data.iov->payload.data)->tag;
+                memset(asd, 0, sizeof(AsyncState));
+                asd->driver = d;
+                asd->engine = slot;
+                asd->command = cmd;
+                asd->request_id = ++d->last_command_id;
+                cmd->driver_private = asd;
+                DBG("queueing engine command %s as request %lu\n",
+                    cmd->command_string, (unsigned long)asd->request_id);
+                // the engine can't be unloaded (by a reload) until deliver_command has run
+                slot->inflight++;
+                driver_async(port, async_key(slot), apply_command, asd, NULL);
+
+                ei_encode_version(*rbuf, &rindex);
+                ei_encode_tuple_header(*rbuf, &rindex, 2);
+                ei_encode_atom(*rbuf, &rindex, "pending");
+                ei_encode_ulonglong(*rbuf, &rindex, asd->request_id);
+                return rindex;
+            }
+        } else if ((enstate = slot->engine->command(cmd)) != Ok) {
+            err = (enstate == OutOfMemoryError) ? heap_space_exhausted : engine_failure;
+        } else if (cmd->result->type == Binary && cmd->result->payload.data != NULL) {
+            payload = ((ErlDrvBinary*)cmd->result->payload.data)->orig_bytes;
+            payload_len = ((ErlDrvBinary*)cmd->result->payload.data)->orig_size;
+        } else {
+            payload = cmd->result->payload.buffer;
+            payload_len = (payload == NULL) ? 0 : result_size(slot->engine, cmd);
+        }
+    }
+
+    // the first pass computes the size of the reply, the second writes it
+    for (pass = 0; pass < 2; pass++) {
+        if (pass == 1) {
+            if (size > rlen && (*rbuf = ALLOC(size)) == NULL) {
+                size = -1;
+                break;
+            }
+            out = *rbuf;
+            at = &rindex;
+        }
+        ei_encode_version(out, at);
+        ei_encode_tuple_header(out, at, 2);
+        if (err == NULL) {
+            ei_encode_atom(out, at, "ok");
+            ei_encode_binary(out, at, payload, payload_len);
+        } else {
+            ei_encode_atom(out, at, "error");
+            ei_encode_string(out, at, err);
+        }
+    }
+    free_command(cmd);
+    DRV_FREE(ctx);
+    return (size < 0) ? -1 : rindex;
+};
+
 /*
 This function is called from erlang:port_call/3. It works a lot like the control call-back,
 but uses the external term format for input and output.
@@ -109,10 +1233,17 @@ The return value (of this callback function) is the number of bytes returned in
 THIS IMPLEMENTATION of the callback handles two kinds of commands, INIT_COMMAND and ENGINE_COMMAND. An INIT_COMMAND should
 only be issued once during the lifecycle of the driver, *before* any data is sent to the port using port_command/port_control.
 The INIT_COMMAND causes the driver to load the specified shared library and call a predefined entry point (see the
-erlxsl_driver header file for details) to initialize an XslEngine structure.
+erlxsl header file for details) to initialize an XslEngineV2 structure. Libraries exporting only the ABI v1 entry point
+(init_engine) initialize an XslEngine structure, which is adapted.
+
+A CONFIGURE_COMMAND takes a {Key, Value} tuple and adjusts a driver setting (e.g., {perf_sample_rate, 0.01}), whilst a
+STATS_COMMAND returns a proplist of the statistics the driver has gathered (e.g., sampled hardware counters).
+
+An ENGINE_COMMAND takes a command packed by erlxsl_marshall:pack_command/1 (or a {Tag, Value} tuple) and passes it
+to the default engine's command function. Commands the
+engine declares trivial are run straight away, everything else is run on a worker - the caller gets {pending, Id}
+and the result is sent to it once the command completes (see engine_command).
 
-TODO: document ENGINE_COMMAND.
-TODO: locking during ENGINE_COMMAND calls
 TODO: support the transform command here as well - small binaries (which we can't/won't share/refcount) can be passed and copied...
 */
 static int
@@ -127,62 +1258,42 @@ call(ErlDrvData drv_data, unsigned int command, char *buf,
     /*int arity;
      *
     char cmd[MAXATOMLEN];*/
-    char *data;
+    char *data = NULL;
     DriverState state;
     DriverHandle *d = (DriverHandle*)drv_data;
+    LoadedEngine *slot = NULL;
+    UInt32 loaded;
 
     ei_decode_version(buf, &index, &i);
-    if (command == INIT_COMMAND) {
+    if (command == CONFIGURE_COMMAND) {
+        return configure(d, buf, &index, rbuf);
+    } else if (command == STATS_COMMAND) {
+        return stats(d, rbuf, rlen);
+    } else if (command == RELOAD_COMMAND) {
+        return reload(d, buf, &index, rbuf);
+    } else if (command == ENGINE_COMMAND) {
+        return engine_command(d, buf, &index, rbuf, rlen);
+    } else if (command == INIT_COMMAND) {
         ei_get_type(buf, &index, &type, &size);
-        INFO("ei_get_type %s of size = %i\n", ((char*)&type), size);
+        DBG("ei_get_type %s of size = %i\n", ((char*)&type), size);
         // TODO: pull options tuple instead
         data = ALLOC(size + 1);
         ei_decode_string(buf, &index, data);
-        INFO("Driver received data %s\n", data);
-        state = init_provider(d, data);
-    } else if (command == ENGINE_COMMAND) {
-        DriverContext *ctx = ALLOC(sizeof(DriverContext));
-        // ErlDrvPort port = (ErlDrvPort)d->port;
-        // XslEngine *engine = (XslEngine*)d->engine;
-        // ErlDrvTermData callee_pid = driver_caller(port);
-        Command *cmd = init_command(NULL, ctx, NULL, init_iov(Text, 0, NULL));
-
-        state = decode_ei_cmd(cmd, buf, &index);
-        if (state == Success) {
-            XslEngine *engine = (XslEngine*)d->engine;
-            if (engine->command != NULL) {
-                EngineState enstate = engine->command(cmd);
-                if (enstate == Ok) {
-                    state = Success;
-                }
-            }
-        }
-        /*ei_get_type(buf, &index, &type, &size);
-        INFO("ei_get_type %s of size = %i\n", ((char*)&type), size);
-        data = ALLOC(size + 1);
-        ei_decode_string(buf, &index, data);*/
+        DBG("Driver received data %s\n", data);
+        // each INIT_COMMAND loads another engine, the first becoming the default
+        state = load_engine(d, data, &slot, &loaded);
     } else {
         state = UnknownCommand;
     }
 
     ei_encode_version(*rbuf, &rindex);
     if (state == InitOk) {
-        INFO("Provider configured with library %s\n", d->loader->name);
+        DBG("Provider configured with library %s\n", slot->loader->name);
+        log_capabilities(slot);
 #ifdef _DRV_SASL_LOGGING
         // TODO: pull the logging_port and install it....
 #endif
         ei_encode_atom(*rbuf, &rindex, "configured");
-    } else if (state == Success) {
-        ei_encode_tuple_header(*rbuf, &rindex, 2);
-        ei_encode_atom(*rbuf, &rindex, "ok");
-        if (state == OutOfMemory) {
-            ei_encode_string(*rbuf, &rindex, heap_space_exhausted);
-        } else if (state == UnknownCommand) {
-            ei_encode_string(*rbuf, &rindex, unknown_command);
-        } else {
-            const char *err = (d->loader)->error_message;
-            ei_encode_string_len(*rbuf, &rindex, err, strlen(err));
-        }
     } else {
         ei_encode_tuple_header(*rbuf, &rindex, 2);
         ei_encode_atom(*rbuf, &rindex, "error");
@@ -191,7 +1302,7 @@ call(ErlDrvData drv_data, unsigned int command, char *buf,
         } else if (state == UnknownCommand) {
             ei_encode_string(*rbuf, &rindex, unknown_command);
         } else {
-            const char *err = (d->loader)->error_message;
+            const char *err = driver_error(d);
             ei_encode_string_len(*rbuf, &rindex, err, strlen(err));
         }
     }
@@ -199,6 +1310,168 @@ call(ErlDrvData drv_data, unsigned int command, char *buf,
     return(rindex);
 };
 
+/* Puts a job in the async queue. */
+static void
+queue_job(ErlDrvPort port, LoadedEngine *slot, AsyncState *asd) {
+    driver_async(port, async_key(slot), apply_transform, asd, NULL); //cleanup_task);
+};
+
+/* Hands a job to an async thread. */
+static void
+submit_job(ErlDrvPort port, LoadedEngine *slot, AsyncState *asd) {
+    // the engine can't be unloaded (by a reload) until ready_async has run
+    slot->inflight++;
+    if (slot->batches != NULL) {
+        batch_queue_push(slot->batches, asd);
+    }
+    queue_job(port, slot, asd);
+};
+
+/* Evaluates to non-zero if a job may be run on the scheduler thread - the engine must
+   tolerate running there alongside its workers, and must complete the job before returning.
+   Nor may the slow or traffic logs be on, since finishing the job would write to them. */
+#define can_run_inline(slot, asd) \
+    ((((slot)->capabilities & EngineReentrant) || (slot)->workers != NULL) && \
+     ((slot)->capabilities & EngineStylesheetCache) && \
+     !((slot)->capabilities & EngineAsyncCompletion) && (asd)->shadow == NotShadowed && \
+     !slow_log_enabled((asd)->driver->slowlog) && !traffic_log_enabled((asd)->driver->traffic))
+
+static void deliver_result(DriverHandle*, AsyncState*);
+
+/* Runs a small job on the scheduler thread which received it (see erlxsl_inline.h), and
+   charges the scheduler for the time it took. */
+static void
+run_inline(DriverHandle *d, LoadedEngine *slot, AsyncState *asd) {
+    Command *command = asd->command;
+    UInt64 started = monotonic_micros();
+
+    slot->inflight++;
+    // there's nothing to yield to, and no worker to complete the job on
+    command->yield_check = NULL;
+    begin_transform(asd);
+    asd->state = worker_pool_context(slot->workers, slot->engine, &command->worker_context);
+    if (asd->state == Ok) {
+        asd->state = slot->engine->transform(command);
+    }
+    if (asd->state == Pending || asd->state == Yielded) {
+        ERROR("engine returned %s from an inline transform\n", (asd->state == Pending) ? "Pending" : "Yielded");
+        asd->state = Error;
+    }
+    finish_transform(asd, asd->state);
+    log_output(slot, command);
+    inline_charge(d->inlining, (ErlDrvPort)d->port, monotonic_micros() - started);
+    deliver_result(d, asd);
+};
+
+/* Queues a job which yielded behind those already waiting, so it resumes once
+   they have had their turn. */
+static void
+resume_job(DriverHandle *d, AsyncState *asd) {
+    TimeSlicing *slicing = &d->slicing;
+
+    if (asd->yields++ == 0) {
+        slicing->yielded_jobs++;
+    }
+    slicing->yields++;
+    if (asd->yields > slicing->max_yields) {
+        slicing->max_yields = asd->yields;
+    }
+    queue_job((ErlDrvPort)d->port, asd->engine, asd);
+};
+
+/* Copies a borrowed document into a NUL terminated buffer of its own, which
+   free_task will release. Returns 0 if we're out of memory. */
+static int
+own_document(InputDocument *doc, BufferView *view) {
+    char *copy;
+    if ((copy = ALLOC(doc->iov->size + 1)) == NULL) {
+        return 0;
+    }
+    memcpy(copy, doc->iov->payload.buffer, doc->iov->size);
+    copy[doc->iov->size] = '\0';
+    doc->iov->payload.buffer = copy;
+    doc->iov->dirty = 1;
+    view->data = copy;
+    return 1;
+};
+
+/* Runs a shadowed job again on the shadow engine, once its result has been
+   sent and released. Returns 0 (leaving the job to be released) if the shadow
+   engine is busy or no longer loaded. */
+static int
+shadow_dispatch(DriverHandle *d, AsyncState *asd) {
+    ShadowStats *shadow = d->shadow;
+    LoadedEngine *slot;
+    Command *command = asd->command;
+    XslTask *task = command->command_data.xsl_task;
+    DriverIOVec *result = command->result;
+
+    if (shadow->engine == SHADOW_NONE || shadow->engine >= (long)d->engine_count ||
+        (slot = d->engines[shadow->engine]) == NULL || slot == asd->engine ||
+        shadow->pending >= shadow->max_pending) {
+        shadow->skipped++;
+        return 0;
+    }
+    // the documents may point straight into the request binaries, which are not NUL
+    // terminated - only engines which honour the buffer lengths can be given those
+    if (asd->retained[0] != NULL && !(slot->capabilities & EngineZeroCopyInput) &&
+        (!own_document(task->input_doc, &task->input) ||
+         !own_document(task->xslt_doc, &task->stylesheet))) {
+        shadow->skipped++;
+        return 0;
+    }
+
+    asd->primary_state = asd->state;
+    asd->primary_elapsed = asd->elapsed;
+    asd->primary_hash = asd->result_hash;
+    asd->shadow = ShadowRun;
+    asd->batch_reply = 0;
+    asd->engine = slot;
+    asd->enqueued = 0;
+    asd->yields = 0;
+    asd->parked = asd->completed = asd->replied = 0;
+    DRV_FREE(asd->trace);
+    asd->trace = NULL;
+
+    // start the shadow engine off with a clean result, allocated its way
+    if (result->dirty == 1 && command->release != NULL) {
+        command->release(result->payload.data);
+    }
+    result->type = Text;
+    result->payload.buffer = NULL;
+    result->size = 0;
+    result->dirty = 0;
+    command->result_length = 0;
+    command->worker_context = NULL;
+    command->async_state = NULL;
+    command->alloc = (slot->capabilities & EngineBinaryOutput) ? binary_alloc : internal_alloc;
+    command->resize = (slot->capabilities & EngineBinaryOutput) ? binary_realloc : internal_realloc;
+    command->release = (slot->capabilities & EngineBinaryOutput) ? binary_release : internal_free;
+    command->complete = (slot->capabilities & EngineAsyncCompletion) ? complete_transform : NULL;
+    command->driver_private = asd;
+
+    shadow->pending++;
+    submit_job((ErlDrvPort)d->port, slot, asd);
+    return 1;
+};
+
+/* Compares a completed shadow run with the original and discards its result. */
+static void
+shadow_complete(DriverHandle *d, AsyncState *asd) {
+    LoadedEngine *slot = asd->engine;
+
+    d->shadow->pending--;
+    shadow_record(d->shadow, asd->primary_state, asd->primary_hash, asd->primary_elapsed,
+                  asd->state, asd->result_hash, asd->elapsed);
+    if (asd->state != OutOfMemoryError) {
+        slot->engine->after_transform(asd->command);
+    }
+    release_async_state(asd);
+    if (--slot->inflight == 0 && d->retired != NULL) {
+        drain_retired(d);
+    }
+};
+
 /*
 This function is called whenever the port is written to. The port should be in binary mode, see open_port/2.
 The ErlIOVec contains both a SysIOVec, suitable for writev, and one or more binaries. If these binaries should be retained,
@@ -217,6 +1490,11 @@ outputv(ErlDrvData drv_data, ErlIOVec *ev) {
     char *xml;
     char *xsl;
     char *data;
+    char *xsl_data;
+    char *xml_owned;
+    char *xsl_owned;
+    ErlDrvBinary *xml_bin;
+    ErlDrvBinary *xsl_bin;
 
     DriverHandle *d = (DriverHandle*)drv_data;
     ErlDrvPort port = (ErlDrvPort)d->port;
@@ -230,6 +1508,12 @@ outputv(ErlDrvData drv_data, ErlIOVec *ev) {
     ErlDrvTermData callee_pid = driver_caller(port);
     UInt8 *type1;
     UInt64 *size;
+    UInt64 trace_id = 0;
+    UInt64 submitted = 0;
+    UInt64 engine_index = 0;
+    UInt64 reply_id = 0;
+    LoadedEngine *slot;
+    UInt64 received = trace_enabled(d->trace) ? wall_clock_micros() : 0;
 
     if ((hspec = ALLOC(sizeof(InputSpec))) == NULL) {
         FAIL(port, "system_limit");
@@ -252,6 +1536,10 @@ outputv(ErlDrvData drv_data, ErlIOVec *ev) {
     type1++;
     hspec->xsl_kind = *type1;
 
+    // the next 8bit chunk flags which optional (64bit) headers are present
+    type1++;
+    hspec->flags = *type1;
+
     // next two 64bit chunks hold the type specs
     type1++;
     size = ((UInt64*)type1);
@@ -260,6 +1548,37 @@ outputv(ErlDrvData drv_data, ErlIOVec *ev) {
     size++;
     hsize->xsl_size = *size;
 
+    // traced requests carry their trace id and (erlang side) submission time
+    if (hspec->flags & REQUEST_TRACED) {
+        size++;
+        trace_id = *size;
+        size++;
+        submitted = *size;
+    }
+    // requests may select the engine to run on, by its index in load order
+    if (hspec->flags & REQUEST_ENGINE) {
+        size++;
+        engine_index = *size;
+    }
+    // and may ask for their reply to be batched with others, under an id of their choosing
+    if (hspec->flags & REQUEST_BATCH_REPLY) {
+        size++;
+        reply_id = *size;
+        // batched replies are sent from the completion queue
+        if (!watch_completions(d)) {
+            DRV_FREE(hsize);
+            DRV_FREE(hspec);
+            FAIL(port, "system_limit");
+            return;
+        }
+    }
+    if (engine_index >= d->engine_count || d->engines[engine_index] == NULL) {
+        DBG("no engine at index %llu, using the default\n", (unsigned long long)engine_index);
+        engine_index = 0;
+    }
+    slot = d->engines[engine_index];
+    slot->requests++;
+
     // next comes the xml and xslt binaries, which may be in one of three places:
     // 1. if the XML binary is heap allocated, it'll be in the binv entry
     // 2. if the XML binary is not heap allocated, it'll be in the next binv entry
@@ -270,7 +1589,16 @@ outputv(ErlDrvData drv_data, ErlIOVec *ev) {
     // we pull it from there. Otherwise, it'll be collapsed into the first binary.
     size_t pos = ((sizeof(UInt8) * NUM_TYPE_HEADERS) +
                                 (sizeof(UInt64) * NUM_SIZE_HEADERS));
-    // INFO("pos = %lu \n", pos);
+    if (hspec->flags & REQUEST_TRACED) {
+        pos += (sizeof(UInt64) * NUM_TRACE_HEADERS);
+    }
+    if (hspec->flags & REQUEST_ENGINE) {
+        pos += sizeof(UInt64);
+    }
+    if (hspec->flags & REQUEST_BATCH_REPLY) {
+        pos += sizeof(UInt64);
+    }
+    // DBG("pos = %lu \n", pos);
     UInt8 bin_idx = FIRST_BINV_ENTRY;    // first entry is reserved
 
     if ((pos + hsize->input_size) <= ev->binv[bin_idx]->orig_size) {
@@ -278,43 +1606,97 @@ outputv(ErlDrvData drv_data, ErlIOVec *ev) {
     } else {
         data = ev->binv[++bin_idx]->orig_bytes;
     }
-    // FIXME: find a way around NULL terminated strings and we can share the binary!
-    xml = ALLOC(hsize->input_size + 1);
-    xml[hsize->input_size] = '\0';
-    strncpy(xml, data, hsize->input_size);
+    xml_bin = ev->binv[bin_idx];
 
     if (hsize->xsl_size < 64) {
-        data = &ev->iov[++bin_idx].iov_base[0];
+        // small binaries are copied into the io vector, so there may be no binary to share
+        xsl_data = &ev->iov[++bin_idx].iov_base[0];
     } else {
-        data = ev->binv[++bin_idx]->orig_bytes;
+        xsl_data = ev->binv[++bin_idx]->orig_bytes;
+    }
+    xsl_bin = ev->binv[bin_idx];
+
+    // engines which honour the buffer lengths can read straight from the binaries
+    hspec->borrowed = ((slot->capabilities & EngineZeroCopyInput) &&
+                       xml_bin != NULL && xsl_bin != NULL);
+    if (hspec->borrowed) {
+        xml = data;
+        xsl = xsl_data;
+    } else {
+        xml = ALLOC(hsize->input_size + 1);
+        xml[hsize->input_size] = '\0';
+        memcpy(xml, data, hsize->input_size);
+
+        xsl = ALLOC(hsize->xsl_size + 1);
+        xsl[hsize->xsl_size] = '\0';
+        memcpy(xsl, xsl_data, hsize->xsl_size);
     }
-    xsl = ALLOC(hsize->xsl_size + 1);
-    xsl[hsize->xsl_size] = '\0';
-    strncpy(xsl, data, hsize->xsl_size);
+    // borrowed buffers must never be freed should we run out of memory
+    xml_owned = hspec->borrowed ? NULL : xml;
+    xsl_owned = hspec->borrowed ? NULL : xsl;
 
     if ((job = (XslTask*)try_driver_alloc(port,
-        sizeof(XslTask), xml, xsl, hsize, hspec)) == NULL) return;
+        sizeof(XslTask), xml_owned, xsl_owned, hsize, hspec)) == NULL) return;
     if ((ctx = (DriverContext*)try_driver_alloc(port,
-        sizeof(DriverContext), xml, xsl, hsize, hspec, job)) == NULL) return;
+        sizeof(DriverContext), xml_owned, xsl_owned, hsize, hspec, job)) == NULL) return;
     if ((asd = (AsyncState*)try_driver_alloc(port,
-        sizeof(AsyncState), xml, xsl, hsize, hspec, job, ctx)) == NULL) return;
+        sizeof(AsyncState), xml_owned, xsl_owned, hsize, hspec, job, ctx)) == NULL) return;
 
     ctx->port = port;
     ctx->caller_pid = callee_pid;
     asd->driver = d;
+    asd->engine = slot;
+    asd->trace = NULL;
+    asd->enqueued = 0;
+    asd->retained[0] = asd->retained[1] = NULL;
+    asd->shadow = shadow_sample(d->shadow, (UInt32)engine_index) ? Shadowed : NotShadowed;
+    asd->parked = asd->completed = 0;
+    asd->next = NULL;
+    asd->yields = 0;
+    asd->request_id = 0;
+    asd->inline_key = asd->queued_at = asd->engine_us = 0;
+    asd->reply_len = 0;
+    asd->reply_bin = NULL;
+    asd->replied = 0;
+    asd->batch_reply = (hspec->flags & REQUEST_BATCH_REPLY) ? 1 : 0;
+    asd->reply_id = reply_id;
+    if (hspec->borrowed) {
+        driver_binary_inc_refc(xml_bin);
+        driver_binary_inc_refc(xsl_bin);
+        asd->retained[0] = xml_bin;
+        asd->retained[1] = xsl_bin;
+    }
+    if (trace_id != 0 && received != 0 &&
+        (asd->trace = ALLOC(sizeof(RequestTrace))) != NULL) {
+        memset(asd->trace, 0, sizeof(RequestTrace));
+        asd->trace->trace_id = trace_id;
+        asd->trace->submitted = submitted;
+        asd->trace->received = received;
+        asd->trace->scheduler_tid = current_thread_id();
+    }
     if ((asd->command = init_command(transform_command, ctx, job, NULL)) == NULL) {
-        free_async_state(asd);
+        release_async_state(asd);
         FAIL(port, "system_limit");
         return;
     }
+    if (slot->capabilities & EngineBinaryOutput) {
+        asd->command->alloc = binary_alloc;
+        asd->command->resize = binary_realloc;
+        asd->command->release = binary_release;
+    }
+    if (slot->capabilities & EngineAsyncCompletion) {
+        asd->command->complete = complete_transform;
+    }
+    asd->command->yield_check = transform_yield_check;
+    asd->command->driver_private = asd;
 
-    fprintf(stderr, "xml[spec: %lu, len:%lu]\n", (long unsigned int)hsize->input_size, strlen(xml));
-    fprintf(stderr, "xsl[spec: %lu, len:%lu]\n", (long unsigned int)hsize->xsl_size, strlen(xsl));
+    DBG("xml[spec: %lu]\n", (long unsigned int)hsize->input_size);
+    DBG("xsl[spec: %lu]\n", (long unsigned int)hsize->xsl_size);
 
     state = init_task(job, hsize, hspec, xml, xsl);
     switch (state) {
     case OutOfMemoryError:
-        free_async_state(asd);
+        release_async_state(asd);
         FAIL(port, "system_limit");
         return;
     case Success:
@@ -329,8 +1711,23 @@ outputv(ErlDrvData drv_data, ErlIOVec *ev) {
                 (*a->async_free)(a->async_data);
         }
         */
-        INFO("provider handoff: transform\n");
-        driver_async(port, NULL, apply_transform, asd, NULL); //cleanup_task);
+        DBG("provider handoff: transform\n");
+        if (asd->trace != NULL) {
+            asd->trace->queued = wall_clock_micros();
+        }
+        if (slow_log_enabled(d->slowlog) || traffic_log_enabled(d->traffic)) {
+            asd->enqueued = monotonic_micros();
+        }
+        if (inline_candidate(d->inlining, hsize->input_size)) {
+            // small jobs are timed, so they can be run inline once their stylesheet is known
+            asd->inline_key = inline_key(xsl, hsize->xsl_size, (UInt32)engine_index);
+            if (can_run_inline(slot, asd) && inline_predict(d->inlining, asd->inline_key)) {
+                run_inline(d, slot, asd);
+                break;
+            }
+            asd->queued_at = monotonic_micros();
+        }
+        submit_job(port, slot, asd);
         break;
     default:    // TODO: it would be better if we didn't do "everthing else is an error" here
         // TODO: error!?
@@ -338,6 +1735,182 @@ outputv(ErlDrvData drv_data, ErlIOVec *ev) {
     }
 };
 
+/* Records what's known of a job as its reply goes out - on the emulator thread. */
+static void
+reply_sending(DriverHandle *d, AsyncState *job, EngineState state) {
+    if (job->trace != NULL) {
+        job->trace->delivering = wall_clock_micros();
+    }
+    if (job->inline_key != 0 && state == Ok) {
+        inline_record(d->inlining, job->inline_key, job->engine_us);
+        if (job->queued_at > 0 && job->yields == 0) {
+            UInt64 round_trip = monotonic_micros() - job->queued_at;
+            if (round_trip > job->engine_us) {
+                inline_record_round_trip(d->inlining, round_trip - job->engine_us);
+            }
+        }
+    }
+};
+
+/* Tidies up once a job's reply has been sent. */
+static void
+reply_sent(DriverHandle *d, AsyncState *job) {
+    job->replied = 1;
+    if (job->reply_bin != NULL) {
+        // the reply holds its own reference now
+        driver_free_binary((ErlDrvBinary*)job->reply_bin);
+        job->reply_bin = NULL;
+    }
+    if (job->trace != NULL) {
+        trace_record(d->trace, job->trace, wall_clock_micros());
+        trace_log_set_timer(d->trace, (ErlDrvPort)d->port);
+    }
+};
+
+/*
+ * Sends the replies to jobs whose caller asked for batched replies, as a single
+ * {results, Port, [Reply, ...]} message - the jobs must share a caller, and there
+ * may be at most MAX_GROUPED_REPLIES of them.
+ */
+static void
+send_grouped_replies(DriverHandle *d, AsyncState **jobs, int count) {
+    ErlDrvTermData spec[GROUPED_SPEC_SIZE];
+    ErlDrvTermData callee_pid = (ErlDrvTermData)jobs[0]->command->context->caller_pid;
+    int n = 0;
+    int i;
+
+    spec[n++] = ERL_DRV_ATOM;
+    spec[n++] = atom_results;
+    spec[n++] = ERL_DRV_PORT;
+    spec[n++] = d->port_term;
+    for (i = 0; i < count; i++) {
+        reply_sending(d, jobs[i], jobs[i]->completion);
+        memcpy(&spec[n], jobs[i]->reply, jobs[i]->reply_len * sizeof(ErlDrvTermData));
+        n += jobs[i]->reply_len;
+    }
+    spec[n++] = ERL_DRV_NIL;
+    spec[n++] = ERL_DRV_LIST;
+    spec[n++] = count + 1;
+    spec[n++] = ERL_DRV_TUPLE;
+    spec[n++] = 3;
+
+    DBG("Sending back %i batched responses\n", count);
+    driver_send_term((ErlDrvPort)d->port, callee_pid, spec, n);
+    for (i = 0; i < count; i++) {
+        reply_sent(d, jobs[i]);
+    }
+};
+
+/* Sends a completed job's reply to the caller. Returns 0, having failed the port,
+   if the reply couldn't be built. */
+static int
+send_reply(DriverHandle *d, AsyncState *job, EngineState state) {
+    ErlDrvPort port = (ErlDrvPort)d->port;
+    ErlDrvTermData callee_pid = (ErlDrvTermData)job->command->context->caller_pid;
+
+    if (state == OutOfMemoryError || job->reply_len == 0) {
+        ERROR("Driver Out Of Memory!\n");
+        // counts as the reply, so ready_input and deliver_result don't fail the port again
+        job->replied = 1;
+        FAIL(port, "system_limit");
+        // this statement [above] will cause the driver to unload, so we may as well fail fast....
+        return 0;
+    }
+    if (job->batch_reply) {
+        send_grouped_replies(d, &job, 1);
+        return 1;
+    }
+
+    reply_sending(d, job, state);
+    DBG("Sending back response! \n");
+    // TODO: use driver_output_term instead, passing the origin-PID in the term and use gen_server:reply to forward
+    driver_send_term(port, callee_pid, (ErlDrvTermData*)job->reply, job->reply_len);
+    reply_sent(d, job);
+    return 1;
+};
+
+/* Sends a completed job's result to the caller (unless it has been sent already)
+   and cleans up after it. */
+static void
+deliver_result(DriverHandle *driver_handle, AsyncState *async_state) {
+    LoadedEngine *slot = async_state->engine;
+    XslEngineV2 *provider = slot->engine;
+    Command *command = async_state->command;
+
+    if (async_state->shadow == ShadowRun) {
+        // the caller already has its result, this one is only compared
+        shadow_complete(driver_handle, async_state);
+        return;
+    }
+    if (!async_state->replied && !send_reply(driver_handle, async_state, async_state->state)) {
+        release_async_state(async_state);
+        return;
+    }
+
+    // now the engine needs the opportunity to free up any intermediate structures
+    DBG("provider handoff: after_transform\n");
+    provider->after_transform(command);
+
+    // internal cleanup time, unless the job is run again on the shadow engine
+    if (async_state->shadow != Shadowed || !shadow_dispatch(driver_handle, async_state)) {
+        release_async_state(async_state);
+    }
+    if (--slot->inflight == 0 && driver_handle->retired != NULL) {
+        drain_retired(driver_handle);
+    }
+};
+
+/* Sends the result of an engine command run on a worker (see engine_command) to its caller,
+   as {command, Port, Id, result|error, Binary}, and cleans up after it. */
+static void
+deliver_command(DriverHandle *driver_handle, AsyncState *async_state) {
+    ErlDrvTermData spec[13];
+    ErlDrvPort port = (ErlDrvPort)driver_handle->port;
+    LoadedEngine *slot = async_state->engine;
+    Command *command = async_state->command;
+    DriverContext *context = command->context;
+    DriverIOVec *outv = command->result;
+    char *payload = NULL;
+    long payload_len = 0;
+
+    if (async_state->state == Ok) {
+        if (outv->type == Binary && outv->payload.data != NULL) {
+            payload = ((ErlDrvBinary*)outv->payload.data)->orig_bytes;
+            payload_len = ((ErlDrvBinary*)outv->payload.data)->orig_size;
+        } else if (outv->payload.buffer != NULL) {
+            payload = outv->payload.buffer;
+            payload_len = result_size(slot->engine, command);
+        }
+    } else {
+        // commands aren't resumed, so an engine which yields or leaves one pending has failed it
+        payload = (char*)((async_state->state == OutOfMemoryError) ? heap_space_exhausted : engine_failure);
+        payload_len = strlen(payload);
+    }
+
+    spec[0] = ERL_DRV_ATOM;
+    spec[1] = atom_command;
+    spec[2] = ERL_DRV_PORT;
+    spec[3] = driver_handle->port_term;
+    spec[4] = ERL_DRV_UINT;
+    spec[5] = (ErlDrvTermData)async_state->request_id;
+    spec[6] = ERL_DRV_ATOM;
+    spec[7] = (async_state->state == Ok) ? atom_result : atom_error;
+    spec[8] = ERL_DRV_BUF2BINARY;
+    spec[9] = (ErlDrvTermData)payload;
+    spec[10] = (ErlDrvTermData)payload_len;
+    spec[11] = ERL_DRV_TUPLE;
+    spec[12] = 5;
+
+    DBG("Sending back the result of engine command %lu\n", (unsigned long)async_state->request_id);
+    driver_send_term(port, (ErlDrvTermData)context->caller_pid, spec, 13);
+
+    release_async_state(async_state);
+    DRV_FREE(context);
+    if (--slot->inflight == 0 && driver_handle->retired != NULL) {
+        drain_retired(driver_handle);
+    }
+};
+
 /*
 This function is called after an asynchronous call has completed. The asynchronous
 call is started with driver_async. This function is called from the erlang emulator thread,
@@ -348,85 +1921,115 @@ to the appropriate erlang process (e.g. the specified receiver).
 */
 static void
 ready_async(ErlDrvData drv_data, ErlDrvThreadData data) {
-    long response_len;
-    ErlDrvTermData *term;
-
-    DriverHandle *driver_handle = (DriverHandle*)drv_data;
-    ErlDrvPort port = (ErlDrvPort)driver_handle->port;
-    XslEngine *provider = (XslEngine*)driver_handle->engine;
     AsyncState *async_state = (AsyncState*)data;
-    EngineState state = async_state->state;
-    Command *command = async_state->command;
-    ErlDrvTermData callee_pid = (ErlDrvTermData)(command->context)->caller_pid;
-    ErlDrvTermData tag = (state == Ok) ? atom_result : atom_error;
-    DriverIOVec* outv = command->result;
 
-    if (state == OutOfMemoryError) {
-        ERROR("Driver Out Of Memory!\n");
-        free_async_state(async_state);
-        FAIL(port, "system_limit");
-        // this statement [above] will cause the driver to unload, so we may as well fail fast....
+    if ((void*)data == (void*)((DriverHandle*)drv_data)->trace) {
+        // a trace flush (see trace_log_flush_async), which needs nothing more from us
         return;
     }
-
-    switch (outv->type) {
-    case Text:
-        term = make_driver_term(&port, outv->payload.buffer, &tag, &response_len);
-        break;
-    case Binary:
-        term = make_driver_term_bin(&port, ((ErlDrvBinary*)outv->payload.data), &tag, &response_len);
-        break;
-    default:
-        term = make_driver_term(&port, (char*)unsupported_response_type, &tag, &response_len);
-        break;
+    if (async_state->command->op == OpCommand) {
+        deliver_command((DriverHandle*)drv_data, async_state);
+        return;
     }
-
-    if (term == NULL) {
-        ERROR("Driver Out Of Memory!\n");
-        // do a quick internal cleanup ?
-        // free_async_state(asd);
-        // give the XslEngine a chance to try and clean up!?
-        // state = provider->after_transform(command);
-
-        FAIL(port, "system_limit");
-        // this statement [above] will cause the driver to unload, so we may as well fail fast....
+    if (async_state->state == Yielded) {
+        resume_job((DriverHandle*)drv_data, async_state);
         return;
     }
+    if (async_state->state == Pending) {
+        // the engine still owns the command, see ready_input
+        async_state->parked = 1;
+        if (!async_state->completed) return;
+        async_state->state = async_state->completion;
+    }
+    deliver_result((DriverHandle*)drv_data, async_state);
+};
 
-    INFO("Sending back response! \n");
+/*
+This function is called when the completion queue's event is signalled, i.e., once
+an engine has completed one or more commands which its transform left Pending, or
+workers have finished jobs whose caller asked for batched replies. Every reply is
+sent here - batched replies to the same caller in as few messages as possible - but
+a job is only cleaned up once ready_async has run for it, which may be later on.
+*/
+static void
+ready_input(ErlDrvData drv_data, ErlDrvEvent event) {
+    DriverHandle *d = (DriverHandle*)drv_data;
+    AsyncState *jobs = completion_queue_take(d->completions);
+    AsyncState *group[MAX_GROUPED_REPLIES];
+    AsyncState *job;
+    AsyncState *other;
+    AsyncState *next;
+    int count;
 
-    // TODO: use driver_output_term instead, passing the origin-PID in the term and use gen_server:reply to forward
-    driver_send_term(port, callee_pid, term, response_len);
+    for (job = jobs; job != NULL; job = job->next) {
+        job->completed = 1;
+        if (job->replied || job->shadow == ShadowRun) continue;
+        if (!job->batch_reply || job->reply_len == 0) {
+            send_reply(d, job, job->completion);
+            continue;
+        }
+        // replies to the same caller are gathered from the rest of the batch
+        group[0] = job;
+        count = 1;
+        for (other = job->next; other != NULL && count < MAX_GROUPED_REPLIES; other = other->next) {
+            if (other->batch_reply && !other->replied && other->reply_len > 0 &&
+                other->command->context->caller_pid == job->command->context->caller_pid) {
+                group[count++] = other;
+            }
+        }
+        send_grouped_replies(d, group, count);
+    }
+    for (job = jobs; job != NULL; job = next) {
+        next = job->next;
+        if (job->parked) {
+            job->state = job->completion;
+            deliver_result(d, job);
+        }
+    }
+};
 
-    // now the engine needs the opportunity to free up any intermediate structures
-    INFO("provider handoff: after_transform\n");
-    state = provider->after_transform(command);
+/* Called when the port's trace flush timer fires - has a worker write out any
+   spans which arrived after the last worker flush. */
+static void
+timeout(ErlDrvData drv_data) {
+    DriverHandle *d = (DriverHandle*)drv_data;
+    trace_log_flush_async(d->trace, (ErlDrvPort)d->port);
+};
 
-    // internal cleanup time...
-    free_async_state(async_state);
+/* Called once the driver has deselected the completion queue's event. */
+static void
+stop_select(ErlDrvEvent event, void *reserved) {
+    close((int)(long)event);
 };
 
 /* DRIVER API EXPORTS */
 
 static ErlDrvEntry driver_entry = {
-    NULL,               /* init */
+    init_driver,        /* init, called when the driver is loaded */
     start_driver,       /* start, called when port is opened */
     stop_driver,        /* stop, called when port is closed */
     NULL,               /* output, called when port receives messages */
-    NULL,               /* ready_input, called when input descriptor ready to read*/
+    ready_input,        /* ready_input, called when input descriptor ready to read*/
     NULL,               /* ready_output, called when output descriptor ready to write */
     "erlxsl",           /* the name of the driver */
-    NULL,               /* finish, called when unloaded */ //TODO: should we do resource disposal here!?
+    finish_driver,      /* finish, called when unloaded */
     NULL,               /* handle,    */
     NULL,               /* control */
-    NULL,               /* timeout */
+    timeout,            /* timeout, called when the port's timer fires */
     outputv,            /* outputv */
     ready_async,        /* ready_async, called (from the emulator thread) after an asynchronous call has completed. */
     NULL,               /* flush */
     call,               /* call */
-    NULL                /* event */
+    NULL,               /* event */
+    ERL_DRV_EXTENDED_MARKER,
+    ERL_DRV_EXTENDED_MAJOR_VERSION,
+    ERL_DRV_EXTENDED_MINOR_VERSION,
+    ERL_DRV_FLAG_USE_PORT_LOCKING, /* driver_flags - ports run concurrently */
+    NULL,               /* handle2 */
+    NULL,               /* process_exit */
+    stop_select         /* stop_select, called once the completion event is deselected */
 };
 
-DRIVER_INIT(erlxsl_drv) {
+ERLXSL_EXPORT DRIVER_INIT(erlxsl_drv) {
     return &driver_entry;
 }
@@ -37,6 +37,7 @@
 #include <stdlib.h>
 #include <stdint.h>
 #include <stdbool.h>
+#include <stddef.h>
 
 #ifndef DEBUG
 #define NDEBUG        // prevent assert from happening!
@@ -54,6 +55,11 @@ extern "C" {
 
 /* macro definitions and other hash-defines */
 
+// debug builds (see PROFILE in the Makefile) log as each request is handled
+#if defined(DEBUG) && !defined(LOG_DEBUG)
+#define LOG_DEBUG
+#endif
+
 #ifdef LOG_DEBUG
 // writes to stdout if DEBUG is defined
 #define DBG(str, ...) INFO(str, ##__VA_ARGS__);
@@ -73,13 +79,21 @@ extern "C" {
 #define LOG(stream, str, ...)    \
         fprintf(stream, str, ##__VA_ARGS__);
 
-/* If the Command is not a null pointer and its command_string is equal to
-     the value "transform", evaluates to the XslTask associated with
-     its command_data, otherwise to NULL. */
+/* Marks the entry points looked up at load time (the driver's DRIVER_INIT and
+   an engine's init_engine or init_engine_v2) as exported, so engines and the
+   driver can be built with -fvisibility=hidden. */
+#if defined(__GNUC__) && __GNUC__ >= 4
+#define ERLXSL_EXPORT __attribute__((visibility("default")))
+#else
+#define ERLXSL_EXPORT
+#endif
+
+/* If the Command is not a null pointer and its op is OpTransform, evaluates
+     to the XslTask associated with its command_data, otherwise to NULL. */
 #define get_task(cmd) \
         ((cmd == NULL)  \
             ? NULL      \
-            : (strcmp("transform", cmd->command_string) == 0)  \
+            : (cmd->op == OpTransform)  \
                 ? cmd->command_data.xsl_task    \
                 : NULL)
 
@@ -206,6 +220,25 @@ extern "C" {
             : strcat(cmd->result->payload.buffer, buff)    \
         : NULL)
 
+/* Appends 'len' bytes of 'data' to the result buffer of 'cmd', growing the
+     buffer (at least geometrically) when necessary and updating result_length.
+     Neither the data nor the result need be NUL terminated. Evaluates to the
+     result buffer, or NULL if cmd or cmd->result is a null pointer or the
+     buffer could not be grown. Note that 'len' is evaluated more than once. */
+#define append_result_buffer(data, len, cmd) \
+    ((cmd == NULL || cmd->result == NULL) \
+        ? NULL \
+        : ((size_t)cmd->result->size < (cmd->result_length + (len)) && \
+           resize_result_buffer(((cmd->result_length + (len)) > (size_t)cmd->result->size * 2) \
+                                    ? (cmd->result_length + (len)) \
+                                    : (size_t)cmd->result->size * 2, cmd) == NULL) \
+            ? NULL \
+            : (cmd->result->dirty = 1, \
+               cmd->result->type = Text, \
+               memcpy(cmd->result->payload.buffer + cmd->result_length, data, len), \
+               cmd->result_length += (len), \
+               cmd->result->payload.buffer))
+
 #define make_pid_data(Ser, Num) \
         ((Uint) ((Ser) << _PID_NUM_SIZE | (Num)))
 
@@ -223,6 +256,11 @@ typedef int16_t     Int16;
 typedef int32_t     Int32;
 typedef int64_t     Int64;
 
+/* The engine ABI version implemented by this header. Engines built against it
+     should export init_engine_v2 (declared with ERLXSL_EXPORT); engines exporting
+     only init_engine are treated as version 1, and are driven through an adapter. */
+#define ERLXSL_ABI_VERSION 2
+
 // supported item types.
 typedef enum { String, Pid, Item } ItemType;
 
@@ -237,6 +275,8 @@ typedef struct {
         char *buffer;
         void *data;
     } payload;
+    /* length of payload.buffer, excluding its NUL terminator */
+    Int32 size;
 } CmdData;
 
 /* Indicates the transient state of a driver. */
@@ -261,9 +301,23 @@ typedef enum {
     XmlParseError,
     XslCompileError,
     XslTransformError,
-    OutOfMemoryError
+    OutOfMemoryError,
+    /* returned by transform when the engine will complete the command later
+       (see Command.complete) - never passed to the completion callback */
+    Pending,
+    /* returned by transform when the engine has parked the command, having
+       been told its time slice is used up (see Command.yield_check) */
+    Yielded
 } EngineState;
 
+/* Identifies the operation a Command requests. */
+typedef enum {
+    /* A generic engine command, whose data is held in command_data.iov. */
+    OpCommand = 1,
+    /* An XSLT transformation, whose data is held in command_data.xsl_task. */
+    OpTransform = 2
+} OpCode;
+
 /* Used to identify the semantic meaning of the data in an InputDocument,
      as being a file uri (File), char buffer (Buffer) or input stream (Stream). */
 typedef enum {
@@ -341,6 +395,12 @@ typedef struct {
     void* next;
 } ParameterListNode;
 
+/* A length delimited view of a buffer, which is not necessarily NUL terminated. */
+typedef struct {
+    const char* data;
+    size_t length;
+} BufferView;
+
 /* A specialised command pertaining to an XSLT transformation that has been tasked. */
 typedef struct {
     /* The input (XML) document. */
@@ -349,6 +409,9 @@ typedef struct {
     InputDocument* xslt_doc;
     /* The head of a linked list of parameters, or NULL if none are passed. */
     ParameterListNode* parameters;
+    /* ABI v2: views of the input document and stylesheet contents. */
+    BufferView input;
+    BufferView stylesheet;
 } XslTask;
 
 /* Allocation function type. */
@@ -360,11 +423,32 @@ typedef void * realloc_f(void *ptr, size_t size);
 /* Release/Free function type. */
 typedef void release_f(void* p);
 
+struct command;
+
+/*
+ * Completes a command for which transform returned Pending, passing the state
+ * transform would otherwise have returned. This may be called from any thread,
+ * exactly once per pending command; the engine must not touch the command
+ * again until it is passed to after_transform.
+ */
+typedef void complete_function(struct command* cmd, EngineState state);
+
+/*
+ * Returns non-zero once a command has used up its time slice. Engines running
+ * long transforms can call this periodically (it is cheap) and, when it returns
+ * non-zero, save their progress in Command.async_state and return Yielded. The
+ * driver then runs other queued commands before calling transform again with
+ * the same command, which may happen on another worker (with another
+ * worker_context). Engines must not return Yielded otherwise.
+ */
+typedef int yield_check_function(struct command* cmd);
+
 /* A generic command. */
-typedef struct {
+typedef struct command {
+    /* The name of the command - retained for ABI v1 engines, use 'op' instead. */
     const char *command_string;
     /* Stores either an IO vector containing the command data or an XslTask.
-         When command_string == "transform" then command_data contains the XslTask. */
+         When op == OpTransform then command_data contains the XslTask. */
     union {
         // Data is held in a DriverIOVec
         DriverIOVec* iov;
@@ -383,6 +467,30 @@ typedef struct {
     release_f* release;
     /* A general purpose storage area - providers can use this as they please */
     void *async_state;
+    /* ABI v2: the operation requested. */
+    OpCode op;
+    /* ABI v2: the number of bytes of the result buffer in use. Engines using
+         ABI v2 must set this (append_result_buffer does so) - their results
+         are not assumed to be NUL terminated. */
+    size_t result_length;
+    /* The calling worker's engine context (see XslEngineV2.thread_init), or NULL
+         if the engine keeps no per-worker state or the command is not run on a
+         worker thread. */
+    void* worker_context;
+    /* Set by the driver for engines with the EngineAsyncCompletion capability.
+         When it is not NULL, transform may return Pending and complete the
+         command later (e.g., once the resources it waits on have been fetched),
+         leaving the worker thread free to run other commands meanwhile. When
+         it is NULL, transform must complete the command before returning. */
+    complete_function* complete;
+    /* Private to the driver - engines must not touch it. */
+    void* driver_private;
+    /* Set by the driver for transforms run on its workers, or NULL if the
+         caller can't resume a parked command (in which case transform must
+         never return Yielded). */
+    yield_check_function* yield_check;
+    /* Reserved for future use - always zeroed by the driver. */
+    void* reserved[4];
 } Command;
 
 /*
@@ -407,7 +515,13 @@ typedef EngineState transform_function(Command* cmd);
  */
 typedef EngineState after_transform_function(Command* cmd);
 
-/* Generic command processing function. */
+/*
+ * Generic command processing function. Commands (ENGINE_COMMAND) are run on a
+ * worker thread, like transforms, unless the engine lists them in
+ * XslEngineV2.trivial_commands, in which case they run on the emulator thread
+ * (without a worker_context) and must return promptly. Any result is written to
+ * Command.result, as it would be by a transform.
+ */
 typedef EngineState command_function(Command* cmd);
 
 /*
@@ -418,10 +532,44 @@ typedef EngineState command_function(Command* cmd);
  * After this function returns, the memory allocated for the xsl_engine will be
  * freed, which means that the engine must fully release all references/pointers
  * held before returning.
+ *
+ * Engines using ABI version 2 are passed their own providerData as 'state'. The
+ * driver uses port level locking, so each port loads its own engine instance
+ * and several instances (sharing the library's static data) may be running at
+ * once; per-instance state belongs in providerData rather than in globals.
  */
 typedef void shutdown_function(void* state);
 
-/* Represents an XSLT engine. */
+/*
+ * Called on each worker thread, before the first command it runs, to create
+ * the engine state private to that thread (e.g., a parser dictionary or an
+ * XPath cache). The context is passed in Command.worker_context for every
+ * command the worker subsequently runs, so it can be used without locking.
+ *
+ * Returns Ok and sets *context on success - any other value causes the
+ * command to fail, and the hook to be called again for the next command.
+ */
+typedef EngineState thread_init_function(void* providerData, void** context);
+
+/*
+ * Releases a context created by thread_init. This is called once for each
+ * context when the engine is shut down (before shutdown_function), and not
+ * necessarily on the thread which created it.
+ */
+typedef void thread_shutdown_function(void* providerData, void* context);
+
+/*
+ * Runs a batch of transforms in a single call, letting the engine share its
+ * per-call setup (such as a transform context, or a compiled stylesheet) among
+ * them. The commands are unrelated requests, which may use different stylesheets,
+ * and are all run on the calling thread. The engine stores the outcome of each
+ * command in the corresponding entry of 'states'. Every command must be completed
+ * before transform_batch returns, so Pending and Yielded are not allowed. The
+ * driver calls after_transform for each command, as it does for transform.
+ */
+typedef void transform_batch_function(Command** cmds, EngineState* states, size_t count);
+
+/* Represents an XSLT engine (ABI version 1, initialized by 'init_engine'). */
 typedef struct {
     /* The following function pointers will need be set by the provider on startup */
     command_function*           command;
@@ -432,6 +580,92 @@ typedef struct {
     void*                       providerData;
 } XslEngine;
 
+/*
+ * Leads every versioned ABI structure. Before calling an engine's entry point,
+ * the driver sets 'version' and 'size' to the ABI version (and structure size)
+ * it implements; the engine overwrites them with the version it was built
+ * against and sizeof the structure it knows about. This tells the driver which
+ * (later) fields it may use, and lets new fields be carved from 'reserved'.
+ * Engines must not write to fields lying beyond the size the driver passed in.
+ */
+typedef struct {
+    UInt32 version;
+    UInt32 size;
+} AbiHeader;
+
+/*
+ * Optional features an engine advertises in XslEngineV2.capabilities, which
+ * allow the driver to choose cheaper ways of handling requests. Engines using
+ * ABI v1 are assumed to be reentrant (as the driver has always assumed) and
+ * to support nothing else.
+ */
+typedef enum {
+    /* transform may be called concurrently from several threads - otherwise
+       the driver runs all of the engine's transforms on a single thread,
+       unless it keeps per-worker state (see XslEngineV2.thread_init) */
+    EngineReentrant = 0x01,
+    /* the engine reads its inputs via the XslTask BufferViews, honouring their
+       lengths - the driver then passes the request's binaries through without
+       copying them, and they are *not* NUL terminated */
+    EngineZeroCopyInput = 0x02,
+    /* the engine allocates its result buffer only via cmd->alloc/cmd->resize
+       (as the result buffer macros do) - the driver then backs the result with
+       a refc binary, handing it to the emulator without copying it */
+    EngineBinaryOutput = 0x04,
+    /* the engine can produce its output incrementally */
+    EngineStreaming = 0x08,
+    /* the engine caches compiled stylesheets between transforms */
+    EngineStylesheetCache = 0x10,
+    /* the engine can process a batch of transforms in a single call - this
+       is ignored unless the engine sets XslEngineV2.transform_batch */
+    EngineBatch = 0x20,
+    /* transform may return Pending, completing the command later via
+       Command.complete - engines must complete (or fail) every pending
+       command before their shutdown function returns */
+    EngineAsyncCompletion = 0x40
+} EngineCapability;
+
+/* All of the capabilities known to this version of the ABI. */
+#define ENGINE_CAPABILITIES 0x7F
+
+/*
+ * Represents an XSLT engine (ABI version 2, initialized by 'init_engine_v2').
+ *
+ * The driver zeroes the structure before calling init_engine_v2, so engines need
+ * only set the fields they use. 'transform', 'after_transform' and 'shutdown' are
+ * required. Engines using this ABI must honour the lengths given in BufferView
+ * and DriverIOVec fields and report their output size in Command.result_length.
+ */
+typedef struct {
+    AbiHeader                   abi;
+    /* Bitmask of the optional features (see EngineCapability) the engine supports. */
+    UInt64                      capabilities;
+    command_function*           command;
+    transform_function*         transform;
+    after_transform_function*   after_transform;
+    shutdown_function*          shutdown;
+    /* Generic storage location, so providers can stash whatever they need. */
+    void*                       providerData;
+    /* Optional per-worker state hooks. Engines which set thread_init get their
+       own context on every worker, and may be run on several workers at once
+       even if they are not EngineReentrant. */
+    thread_init_function*       thread_init;
+    thread_shutdown_function*   thread_shutdown;
+    /* Optional, see EngineBatch. The driver runs batches one transform at a time
+       for engines which don't provide it. */
+    transform_batch_function*   transform_batch;
+    /* Optional NULL terminated list of the commands cheap enough to run on the
+       emulator thread (see command_function). */
+    const char**                trivial_commands;
+    /* Reserved for future use - must be left zeroed. */
+    void*                       reserved[12];
+} XslEngineV2;
+
+/* Evaluates to true if the abi.size of the supplied XslEngineV2 covers 'field',
+     i.e., the engine was built knowing about that field. */
+#define abi_has_field(engine, field) \
+    ((engine)->abi.size >= (offsetof(XslEngineV2, field) + sizeof((engine)->field)))
+
 #ifdef    __cplusplus
 }
 #endif
@@ -0,0 +1,160 @@
+/*
+ * erlxsl_batch.h
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * This header contains the batch queues used by the linked-in driver for
+ * engines which provide transform_batch. Every job routed to such an engine
+ * is pushed onto its queue before being handed to driver_async. The worker
+ * which picks a job up claims it along with the jobs queued behind it, and
+ * runs them all in a single call to transform_batch. When a worker gets to a
+ * job which another worker has already claimed, it leaves the job Pending,
+ * and the claiming worker completes it (see complete_transform) once the
+ * batch has run.
+ *
+ * This header is specific to the linked-in driver and *must* be included after
+ * the erlxsl_driver and erlxsl_ei headers.
+ *
+ */
+
+#ifndef _ERLXSL_BATCH_H
+#define _ERLXSL_BATCH_H
+
+// the most jobs passed to transform_batch in one call
+#define MAX_BATCH_SIZE 64
+
+/* INTERNAL DATA & DATA STRUCTURES */
+
+struct batch_queue {
+    ErlDrvMutex *lock;
+    /* unclaimed jobs, oldest first */
+    AsyncState *head;
+    AsyncState *tail;
+    /* the number of calls to transform_batch, and the jobs they ran */
+    UInt64 batches;
+    UInt64 batched;
+    /* the largest batch run so far */
+    UInt32 largest;
+};
+
+typedef struct batch_queue BatchQueue;
+
+/* INTERNAL FUNCTIONS */
+
+static BatchQueue*
+batch_queue_create(void) {
+    BatchQueue *queue = ALLOC(sizeof(BatchQueue));
+    if (queue == NULL) return NULL;
+
+    memset(queue, 0, sizeof(BatchQueue));
+    if ((queue->lock = erl_drv_mutex_create("erlxsl_batch_queue")) == NULL) {
+        DRV_FREE(queue);
+        return NULL;
+    }
+    return queue;
+};
+
+/* Frees the queue - the jobs still on it belong to their own async jobs. */
+static void
+batch_queue_destroy(BatchQueue *queue) {
+    if (queue == NULL) return;
+    erl_drv_mutex_destroy(queue->lock);
+    DRV_FREE(queue);
+};
+
+static void
+batch_queue_push(BatchQueue *queue, AsyncState *job) {
+    job->batch_next = NULL;
+    erl_drv_mutex_lock(queue->lock);
+    job->batch_queued = 1;
+    if (queue->tail == NULL) {
+        queue->head = job;
+    } else {
+        queue->tail->batch_next = job;
+    }
+    queue->tail = job;
+    erl_drv_mutex_unlock(queue->lock);
+};
+
+/*
+ * Claims 'job' along with up to limit - 1 of the oldest jobs queued with it,
+ * storing them in 'jobs' (job first). Returns the number of jobs claimed,
+ * which is zero if another worker has already claimed 'job'.
+ */
+static UInt32
+batch_queue_claim(BatchQueue *queue, AsyncState *job, AsyncState **jobs, UInt32 limit) {
+    AsyncState **link;
+    AsyncState *prev = NULL;
+    AsyncState *next;
+    UInt32 count = 0;
+
+    erl_drv_mutex_lock(queue->lock);
+    if (!job->batch_queued) {
+        erl_drv_mutex_unlock(queue->lock);
+        return 0;
+    }
+    // jobs are claimed in roughly the order they were queued, so this is usually the head
+    for (link = &queue->head; *link != job; link = &(*link)->batch_next) {
+        prev = *link;
+    }
+    *link = job->batch_next;
+    if (queue->tail == job) {
+        queue->tail = prev;
+    }
+    job->batch_queued = 0;
+    jobs[count++] = job;
+
+    while (count < limit && (next = queue->head) != NULL) {
+        queue->head = next->batch_next;
+        next->batch_queued = 0;
+        jobs[count++] = next;
+    }
+    if (queue->head == NULL) {
+        queue->tail = NULL;
+    }
+    queue->batches++;
+    queue->batched += count;
+    if (count > queue->largest) {
+        queue->largest = count;
+    }
+    erl_drv_mutex_unlock(queue->lock);
+    return count;
+};
+
+/* Reads the number of batches run, the jobs they ran, and the largest of them. */
+static void
+batch_queue_snapshot(BatchQueue *queue, UInt64 *batches, UInt64 *batched, UInt32 *largest) {
+    *batches = 0;
+    *batched = 0;
+    *largest = 0;
+    if (queue != NULL) {
+        erl_drv_mutex_lock(queue->lock);
+        *batches = queue->batches;
+        *batched = queue->batched;
+        *largest = queue->largest;
+        erl_drv_mutex_unlock(queue->lock);
+    }
+};
+
+#endif /* _ERLXSL_BATCH_H */
@@ -0,0 +1,464 @@
+/*
+ * erlxsl_capture.h
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * This header defines the on-disk formats used to capture requests (see the
+ * slow request log in erlxsl_slowlog.h and the traffic log in
+ * erlxsl_traffic.h) so they can be replayed offline, along with functions for
+ * reading and writing them. It has no dependency on erl_driver, so that
+ * standalone tools (see c_src/tools) can use it too.
+ *
+ * A capture file contains a fixed size CaptureHeader, followed by the
+ * parameters (each a UInt32 length prefixed key and value), the input document
+ * and the stylesheet. All integers are written in native byte order.
+ *
+ * A traffic log contains a TrafficHeader followed by a stream of records.
+ * TrafficRequest records describe each request by the hashes and sizes of its
+ * documents and parameters, along with its arrival time and timings. The
+ * documents themselves are written (at most once per hash) as TrafficBody
+ * records, so a replay can resolve a request's hashes to whichever bodies
+ * made it into the log. Parameters are stored as a single body holding the
+ * same length prefixed key/value pairs used in capture files.
+ *
+ * This header *must* be included after the erlxsl_internal header.
+ *
+ */
+
+#ifndef _ERLXSL_CAPTURE_H
+#define _ERLXSL_CAPTURE_H
+
+#define CAPTURE_MAGIC "XCAP"
+#define CAPTURE_VERSION 1
+#define CAPTURE_EXTENSION ".xcap"
+
+/* Fixed size (64 byte) header at the start of every capture file. */
+typedef struct {
+    char magic[4];
+    UInt32 version;
+    /* wall clock time (microseconds) at which the request was captured */
+    UInt64 captured_at;
+    /* time (microseconds) the request spent queued before a worker picked it up */
+    UInt64 queue_time;
+    /* time (microseconds) the engine took to transform the request */
+    UInt64 transform_time;
+    UInt64 input_size;
+    UInt64 xsl_size;
+    UInt32 param_count;
+    /* the EngineState returned by the transform */
+    UInt32 engine_state;
+    UInt8 input_kind;
+    UInt8 xsl_kind;
+    UInt8 reserved[6];
+} CaptureHeader;
+
+/* A capture read back from disk. The buffers are NUL terminated. */
+typedef struct {
+    CaptureHeader header;
+    char *input;
+    char *stylesheet;
+    ParameterListNode *parameters;
+} CaptureRecord;
+
+#define TRAFFIC_MAGIC "XTRF"
+#define TRAFFIC_VERSION 1
+#define TRAFFIC_EXTENSION ".xtrf"
+
+/* Fixed size (16 byte) header at the start of every traffic log. */
+typedef struct {
+    char magic[4];
+    UInt32 version;
+    /* wall clock time (microseconds) at which the log was started */
+    UInt64 started_at;
+} TrafficHeader;
+
+typedef enum {
+    TrafficBodyRecord = 1,
+    TrafficRequestRecord = 2
+} TrafficRecordType;
+
+typedef enum {
+    TrafficInput = 1,
+    TrafficStylesheet = 2,
+    TrafficParameters = 3
+} TrafficBodyKind;
+
+/* Precedes the bytes of a document (or parameter set) in a traffic log. */
+typedef struct {
+    UInt8 type;
+    UInt8 kind;
+    UInt16 reserved;
+    UInt32 size;
+    UInt64 hash;
+} TrafficBody;
+
+/* A single request in a traffic log. Hashes are those given by hash_buffer. */
+typedef struct {
+    UInt8 type;
+    UInt8 input_kind;
+    UInt8 xsl_kind;
+    UInt8 param_count;
+    /* the EngineState returned by the transform */
+    UInt32 engine_state;
+    /* arrival time, in microseconds since the log was started */
+    UInt64 offset;
+    UInt64 input_hash;
+    UInt64 xsl_hash;
+    /* zero when the request had no parameters */
+    UInt64 params_hash;
+    UInt32 input_size;
+    UInt32 xsl_size;
+    UInt32 params_size;
+    UInt32 queue_time;
+    UInt32 transform_time;
+    UInt32 reserved;
+} TrafficRequest;
+
+/* Either kind of traffic log record, distinguished by the (leading) type field. */
+typedef union {
+    UInt8 type;
+    TrafficBody body;
+    TrafficRequest request;
+} TrafficRecord;
+
+/* FORWARD DEFS */
+
+/* Writes a capture of the supplied buffers and parameters. Returns the number of bytes written or -1. */
+static Int64 capture_write(FILE*, CaptureHeader*, const char*, const char*, const ParameterListNode*);
+#ifdef _ERLXSL_PRT_H
+/* Reads a capture, allocating its buffers and parameters. */
+static DriverState capture_read(FILE*, CaptureRecord*);
+/* Frees the buffers and parameters held by a CaptureRecord (but not the record itself). */
+static void capture_free(CaptureRecord*);
+#endif
+/* Serializes a parameter list into a newly allocated buffer, storing its size. Returns NULL for no parameters. */
+static char* traffic_encode_params(const ParameterListNode*, UInt32*);
+/* Fills in the document and parameter fields of a request record, returning the encoded parameters (or NULL). */
+static char* traffic_describe_task(TrafficRequest*, const XslTask*);
+#ifdef _ERLXSL_PRT_H
+/* Rebuilds a parameter list from a buffer written by traffic_encode_params. */
+static ParameterListNode* traffic_decode_params(const char*, UInt32);
+#endif
+/* Writes a traffic log header, returning the number of bytes written or -1. */
+static Int64 traffic_write_header(FILE*, UInt64);
+/* Writes a body record and the supplied bytes, returning the number of bytes written or -1. */
+static Int64 traffic_write_body(FILE*, TrafficBodyKind, UInt64, const char*, UInt32);
+/* Writes a request record, returning the number of bytes written or -1. */
+static Int64 traffic_write_request(FILE*, TrafficRequest*);
+#ifdef _ERLXSL_PRT_H
+/* Reads and validates a traffic log header. */
+static DriverState traffic_read_header(FILE*, TrafficHeader*);
+/* Reads the next record, allocating a (NUL terminated) buffer for any body. Returns 1, 0 at EOF or -1. */
+static int traffic_read_record(FILE*, TrafficRecord*, char**);
+#endif
+
+/* INTERNAL FUNCTIONS */
+
+static int
+capture_write_string(FILE *out, const char *str) {
+    UInt32 len = (str == NULL) ? 0 : (UInt32)strlen(str);
+    if (fwrite(&len, sizeof(len), 1, out) != 1) return -1;
+    if (len > 0 && fwrite(str, 1, len, out) != len) return -1;
+    return (int)(sizeof(len) + len);
+};
+
+/* The readers are only needed by the offline tools (see erlxsl_port.h), not the driver. */
+#ifdef _ERLXSL_PRT_H
+static char*
+capture_read_string(FILE *in) {
+    UInt32 len;
+    char *str;
+    if (fread(&len, sizeof(len), 1, in) != 1) return NULL;
+    if ((str = ALLOC(len + 1)) == NULL) return NULL;
+    if (len > 0 && fread(str, 1, len, in) != len) {
+        DRV_FREE(str);
+        return NULL;
+    }
+    str[len] = '\0';
+    return str;
+};
+
+static char*
+capture_read_buffer(FILE *in, UInt64 size) {
+    char *buffer;
+    if ((buffer = ALLOC(size + 1)) == NULL) return NULL;
+    if (size > 0 && fread(buffer, 1, size, in) != size) {
+        DRV_FREE(buffer);
+        return NULL;
+    }
+    buffer[size] = '\0';
+    return buffer;
+};
+
+#endif /* _ERLXSL_PRT_H */
+
+static Int64
+capture_write(FILE *out, CaptureHeader *header, const char *input,
+              const char *stylesheet, const ParameterListNode *params) {
+    const ParameterListNode *param;
+    Int64 written = sizeof(CaptureHeader);
+    int len;
+
+    memcpy(header->magic, CAPTURE_MAGIC, sizeof(header->magic));
+    header->version = CAPTURE_VERSION;
+    header->param_count = 0;
+    for (param = params; param != NULL; param = (ParameterListNode*)param->next) {
+        header->param_count++;
+    }
+
+    if (fwrite(header, sizeof(CaptureHeader), 1, out) != 1) return -1;
+    for (param = params; param != NULL; param = (ParameterListNode*)param->next) {
+        if ((len = capture_write_string(out, param->key)) < 0) return -1;
+        written += len;
+        if ((len = capture_write_string(out, param->value)) < 0) return -1;
+        written += len;
+    }
+    if (fwrite(input, 1, header->input_size, out) != header->input_size) return -1;
+    if (fwrite(stylesheet, 1, header->xsl_size, out) != header->xsl_size) return -1;
+    return written + header->input_size + header->xsl_size;
+};
+
+#ifdef _ERLXSL_PRT_H
+static DriverState
+capture_read(FILE *in, CaptureRecord *record) {
+    ParameterListNode *tail = NULL;
+    ParameterListNode *param;
+    UInt32 i;
+
+    record->input = record->stylesheet = NULL;
+    record->parameters = NULL;
+
+    if (fread(&record->header, sizeof(CaptureHeader), 1, in) != 1) {
+        return DecodeError;
+    }
+    if (memcmp(record->header.magic, CAPTURE_MAGIC, sizeof(record->header.magic)) != 0 ||
+        record->header.version != CAPTURE_VERSION) {
+        return DecodeError;
+    }
+
+    for (i = 0; i < record->header.param_count; i++) {
+        if ((param = ALLOC(sizeof(ParameterListNode))) == NULL) {
+            capture_free(record);
+            return OutOfMemory;
+        }
+        param->next = NULL;
+        param->key = capture_read_string(in);
+        param->value = capture_read_string(in);
+        if (tail == NULL) {
+            record->parameters = param;
+        } else {
+            tail->next = param;
+        }
+        tail = param;
+        if (param->key == NULL || param->value == NULL) {
+            capture_free(record);
+            return DecodeError;
+        }
+    }
+
+    record->input = capture_read_buffer(in, record->header.input_size);
+    record->stylesheet = capture_read_buffer(in, record->header.xsl_size);
+    if (record->input == NULL || record->stylesheet == NULL) {
+        capture_free(record);
+        return DecodeError;
+    }
+    return Success;
+};
+
+static void
+capture_free(CaptureRecord *record) {
+    if (record != NULL) {
+        free_parameters(record->parameters);
+        DRV_FREE(record->input);
+        DRV_FREE(record->stylesheet);
+        record->parameters = NULL;
+        record->input = record->stylesheet = NULL;
+    }
+};
+
+#endif /* _ERLXSL_PRT_H */
+
+static char*
+traffic_encode_params(const ParameterListNode *params, UInt32 *size) {
+    const ParameterListNode *param;
+    UInt32 len;
+    char *buffer;
+    char *pos;
+
+    *size = 0;
+    for (param = params; param != NULL; param = (ParameterListNode*)param->next) {
+        *size += (UInt32)(2 * sizeof(UInt32) + strlen(param->key) + strlen(param->value));
+    }
+    if (*size == 0 || (buffer = ALLOC(*size)) == NULL) {
+        *size = 0;
+        return NULL;
+    }
+
+    pos = buffer;
+    for (param = params; param != NULL; param = (ParameterListNode*)param->next) {
+        len = (UInt32)strlen(param->key);
+        memcpy(pos, &len, sizeof(len));
+        memcpy(pos + sizeof(len), param->key, len);
+        pos += sizeof(len) + len;
+        len = (UInt32)strlen(param->value);
+        memcpy(pos, &len, sizeof(len));
+        memcpy(pos + sizeof(len), param->value, len);
+        pos += sizeof(len) + len;
+    }
+    return buffer;
+};
+
+static char*
+traffic_describe_task(TrafficRequest *request, const XslTask *task) {
+    const ParameterListNode *param;
+    char *params = traffic_encode_params(task->parameters, &request->params_size);
+
+    request->input_kind = (UInt8)task->input_doc->type;
+    request->xsl_kind = (UInt8)task->xslt_doc->type;
+    request->input_size = (UInt32)get_doc_size(task->input_doc);
+    request->xsl_size = (UInt32)get_doc_size(task->xslt_doc);
+    request->input_hash = hash_buffer(get_doc_buffer(task->input_doc), request->input_size);
+    request->xsl_hash = hash_buffer(get_doc_buffer(task->xslt_doc), request->xsl_size);
+    request->param_count = 0;
+    for (param = task->parameters; param != NULL; param = (ParameterListNode*)param->next) {
+        request->param_count++;
+    }
+    if (params != NULL) {
+        request->params_hash = hash_buffer(params, request->params_size);
+    }
+    return params;
+};
+
+#ifdef _ERLXSL_PRT_H
+static char*
+traffic_decode_string(const char **pos, const char *end) {
+    UInt32 len;
+    char *str;
+    if ((size_t)(end - *pos) < sizeof(len)) return NULL;
+    memcpy(&len, *pos, sizeof(len));
+    *pos += sizeof(len);
+    if ((UInt32)(end - *pos) < len || (str = ALLOC(len + 1)) == NULL) return NULL;
+    memcpy(str, *pos, len);
+    str[len] = '\0';
+    *pos += len;
+    return str;
+};
+
+static ParameterListNode*
+traffic_decode_params(const char *buffer, UInt32 size) {
+    ParameterListNode *head = NULL;
+    ParameterListNode *tail = NULL;
+    ParameterListNode *param;
+    const char *pos = buffer;
+    const char *end = buffer + size;
+
+    while (pos < end) {
+        if ((param = ALLOC(sizeof(ParameterListNode))) == NULL) break;
+        param->next = NULL;
+        param->key = traffic_decode_string(&pos, end);
+        param->value = traffic_decode_string(&pos, end);
+        if (tail == NULL) {
+            head = param;
+        } else {
+            tail->next = param;
+        }
+        tail = param;
+        if (param->key == NULL || param->value == NULL) {
+            free_parameters(head);
+            return NULL;
+        }
+    }
+    return head;
+};
+
+#endif /* _ERLXSL_PRT_H */
+
+static Int64
+traffic_write_header(FILE *out, UInt64 started_at) {
+    TrafficHeader header;
+    memset(&header, 0, sizeof(TrafficHeader));
+    memcpy(header.magic, TRAFFIC_MAGIC, sizeof(header.magic));
+    header.version = TRAFFIC_VERSION;
+    header.started_at = started_at;
+    return (fwrite(&header, sizeof(TrafficHeader), 1, out) == 1) ? (Int64)sizeof(TrafficHeader) : -1;
+};
+
+static Int64
+traffic_write_body(FILE *out, TrafficBodyKind kind, UInt64 hash,
+                   const char *buffer, UInt32 size) {
+    TrafficBody body;
+    memset(&body, 0, sizeof(TrafficBody));
+    body.type = TrafficBodyRecord;
+    body.kind = (UInt8)kind;
+    body.size = size;
+    body.hash = hash;
+    if (fwrite(&body, sizeof(TrafficBody), 1, out) != 1) return -1;
+    if (size > 0 && fwrite(buffer, 1, size, out) != size) return -1;
+    return (Int64)(sizeof(TrafficBody) + size);
+};
+
+static Int64
+traffic_write_request(FILE *out, TrafficRequest *request) {
+    request->type = TrafficRequestRecord;
+    return (fwrite(request, sizeof(TrafficRequest), 1, out) == 1) ? (Int64)sizeof(TrafficRequest) : -1;
+};
+
+#ifdef _ERLXSL_PRT_H
+static DriverState
+traffic_read_header(FILE *in, TrafficHeader *header) {
+    if (fread(header, sizeof(TrafficHeader), 1, in) != 1 ||
+        memcmp(header->magic, TRAFFIC_MAGIC, sizeof(header->magic)) != 0 ||
+        header->version != TRAFFIC_VERSION) {
+        return DecodeError;
+    }
+    return Success;
+};
+
+static int
+traffic_read_record(FILE *in, TrafficRecord *record, char **body) {
+    size_t size;
+
+    *body = NULL;
+    if (fread(&record->type, 1, 1, in) != 1) return feof(in) ? 0 : -1;
+    switch (record->type) {
+    case TrafficBodyRecord:
+        size = sizeof(TrafficBody);
+        break;
+    case TrafficRequestRecord:
+        size = sizeof(TrafficRequest);
+        break;
+    default:
+        return -1;
+    }
+    if (fread(((char*)record) + 1, size - 1, 1, in) != 1) return -1;
+
+    if (record->type == TrafficBodyRecord) {
+        if ((*body = capture_read_buffer(in, record->body.size)) == NULL) return -1;
+    }
+    return 1;
+};
+
+#endif /* _ERLXSL_PRT_H */
+
+#endif /* _ERLXSL_CAPTURE_H */
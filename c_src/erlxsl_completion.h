@@ -0,0 +1,161 @@
+/*
+ * erlxsl_completion.h
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * This header contains the completion queue used by the linked-in driver for
+ * engines with the EngineAsyncCompletion capability. Such engines may return
+ * Pending from transform, freeing the worker thread, and complete the command
+ * later from a thread of their own. Completed jobs are pushed onto the queue
+ * and an event descriptor (an eventfd, or a pipe where that isn't available)
+ * is signalled, which the driver watches with driver_select; ready_input then
+ * takes the completed jobs and delivers their results on the emulator thread.
+ * Jobs whose caller asked for batched replies are completed the same way, so
+ * that replies to the same caller can be sent together.
+ *
+ * The queue is lock free, with any number of producers and the emulator thread
+ * as its only consumer: jobs are pushed onto a stack with a compare and swap,
+ * and ready_input takes the whole stack at once. Only the first job pushed
+ * after each take signals the event, so one wakeup covers a whole batch.
+ *
+ * This header is specific to the linked-in driver and *must* be included after
+ * the erlxsl_driver and erlxsl_ei headers.
+ *
+ */
+
+#ifndef _ERLXSL_COMPLETION_H
+#define _ERLXSL_COMPLETION_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+
+#ifdef __linux__
+#include <sys/eventfd.h>
+#define HAVE_EVENTFD 1
+#endif
+
+/* INTERNAL DATA & DATA STRUCTURES */
+
+struct completion_queue {
+    /* completed jobs, newest first */
+    AsyncState *volatile head;
+    /* fds[0] is watched by the driver, fds[1] is written to - with an eventfd,
+       both are the same descriptor */
+    int fds[2];
+    /* whether a wakeup has been signalled since the queue was last taken */
+    volatile int signalled;
+};
+
+typedef struct completion_queue CompletionQueue;
+
+/* Evaluates to the event the driver selects on to be told of completions. */
+#define completion_event(queue) ((ErlDrvEvent)(long)(queue)->fds[0])
+
+/* INTERNAL FUNCTIONS */
+
+static CompletionQueue*
+completion_queue_create(void) {
+    CompletionQueue *queue = ALLOC(sizeof(CompletionQueue));
+    if (queue == NULL) return NULL;
+
+    memset(queue, 0, sizeof(CompletionQueue));
+#ifdef HAVE_EVENTFD
+    queue->fds[0] = queue->fds[1] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (queue->fds[0] < 0) {
+#else
+    if (pipe(queue->fds) != 0 ||
+        fcntl(queue->fds[0], F_SETFL, O_NONBLOCK) != 0 ||
+        fcntl(queue->fds[1], F_SETFL, O_NONBLOCK) != 0) {
+#endif
+        DRV_FREE(queue);
+        return NULL;
+    }
+    return queue;
+};
+
+/* Frees the queue. The descriptor watched by the driver is closed by stop_select,
+   once the driver has deselected it. */
+static void
+completion_queue_destroy(CompletionQueue *queue) {
+    if (queue != NULL) {
+        if (queue->fds[1] != queue->fds[0]) {
+            close(queue->fds[1]);
+        }
+        DRV_FREE(queue);
+    }
+};
+
+/* Queues a completed job, waking the driver. Called from any thread. */
+static void
+completion_queue_push(CompletionQueue *queue, AsyncState *job) {
+    AsyncState *head;
+#ifdef HAVE_EVENTFD
+    UInt64 one = 1;
+#else
+    char one = 1;
+#endif
+
+    do {
+        head = queue->head;
+        job->next = head;
+    } while (!__sync_bool_compare_and_swap(&queue->head, head, job));
+
+    // one wakeup is enough for everything queued before ready_input runs
+    if (__sync_lock_test_and_set(&queue->signalled, 1) == 0) {
+        while (write(queue->fds[1], &one, sizeof(one)) < 0 && errno == EINTR);
+    }
+};
+
+/* Takes every queued job (oldest first), resetting the event. Called by ready_input. */
+static AsyncState*
+completion_queue_take(CompletionQueue *queue) {
+    AsyncState *jobs;
+    AsyncState *oldest = NULL;
+    AsyncState *next;
+    char drain[64];
+
+    // the event is reset before the queue is emptied, so no wakeup can be missed
+    for (;;) {
+        ssize_t n = read(queue->fds[0], drain, sizeof(drain));
+        if (n > 0 || (n < 0 && errno == EINTR)) continue;
+        break;
+    }
+    // ...and the flag cleared before it is, so any job pushed after the take signals again
+    queue->signalled = 0;
+    __sync_synchronize();
+    do {
+        jobs = queue->head;
+    } while (!__sync_bool_compare_and_swap(&queue->head, jobs, NULL));
+
+    // the stack holds the newest job first
+    for (; jobs != NULL; jobs = next) {
+        next = jobs->next;
+        jobs->next = oldest;
+        oldest = jobs;
+    }
+    return oldest;
+};
+
+#endif /* _ERLXSL_COMPLETION_H */
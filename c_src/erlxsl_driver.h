@@ -34,12 +34,15 @@
 #define    _ERLXSL_DRV_H
 
 #include <erl_driver.h>
+#include <time.h>
 
 /* INTERNAL DATA & DATA STRUCTURES */
 
 static ErlDrvTermData atom_result;
 static ErlDrvTermData atom_error;
 static ErlDrvTermData atom_log;
+static ErlDrvTermData atom_command;
+static ErlDrvTermData atom_results;
 
 /* LINKED-IN DRIVER SPECIFIC MACROS - MUST BE SPECIFIED BEFORE INCLUDING INTERNAL FUNCTIONS/TYPES */
 
@@ -52,6 +55,14 @@ static ErlDrvTermData atom_log;
 #define INIT_COMMAND (UInt32)9
 #define ENGINE_COMMAND (UInt32)7
 #define TRANSFORM_COMMAND (UInt32)5
+#define CONFIGURE_COMMAND (UInt32)11
+#define STATS_COMMAND (UInt32)13
+#define RELOAD_COMMAND (UInt32)15
+
+// flags for the optional request header fields
+#define REQUEST_TRACED 0x01
+#define REQUEST_ENGINE 0x02
+#define REQUEST_BATCH_REPLY 0x04
 
 // NULL safe driver_free wrapper
 #define DRV_FREE(x) if (x != NULL) driver_free(x)
@@ -59,14 +70,6 @@ static ErlDrvTermData atom_log;
 // Cause the driver to fail (e.g., exit/unload)
 #define FAIL(p, msg) driver_failure_atom(p, msg)
 
-/* FORWARD DEFINES */
-
-/* makes a tagged tuple (using the driver term format) for the supplied binary payload. */
-static ErlDrvTermData* make_driver_term_bin(ErlDrvPort*, ErlDrvBinary*, ErlDrvTermData*, long*);
-
-/* makes a tagged tuple (using the driver term format) for the supplied buffer payload. */
-static ErlDrvTermData* make_driver_term(ErlDrvPort*, char*, ErlDrvTermData*, long*);
-
 /* grab the API functions... */
 #include "erlxsl.h"
 
@@ -75,6 +78,14 @@ static ErlDrvTermData* make_driver_term(ErlDrvPort*, char*, ErlDrvTermData*, lon
 
 /* INTERNAL UTILITY FUNCTIONS */
 
+/* Returns a monotonic timestamp in microseconds, for measuring intervals. */
+static UInt64
+monotonic_micros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((UInt64)ts.tv_sec * 1000000) + ((UInt64)ts.tv_nsec / 1000);
+};
+
 /*
 static void
 driver_log(DriverHandle *drv, ErlDrvTermData *level, const char *const message) {
@@ -129,57 +140,5 @@ make_two_tag_tuple(ErlDrvPort *port, DrvTaggedData *payload, ErlDrvTermData *tag
 };
 */
 
-static ErlDrvTermData*
-make_driver_term_bin(ErlDrvPort *port, ErlDrvBinary *payload, ErlDrvTermData *tag, long *length) {
-    ErlDrvTermData *term;
-    ErlDrvTermData    spec[10];
-    term = ALLOC(sizeof(spec));
-    if (term == NULL) return NULL;
-
-    spec[0] = ERL_DRV_ATOM;
-    spec[1] = *tag;
-    spec[2] = ERL_DRV_PORT;
-    spec[3] = driver_mk_port(*port);
-    spec[4] = ERL_DRV_BINARY;
-    spec[5] = (ErlDrvTermData)payload;
-    spec[6] = ERL_DRV_UINT;
-    spec[7] = payload->orig_size;
-    spec[8] = ERL_DRV_TUPLE;
-    spec[9] = 3;
-
-    memcpy(term, &spec, sizeof(spec));
-    *length = sizeof(spec) / sizeof(spec[0]);
-    return term;
-};
-
-static ErlDrvTermData*
-make_driver_term(ErlDrvPort *port, char *payload, ErlDrvTermData *tag, long *length) {
-    ErlDrvTermData *term;
-    ErlDrvTermData    spec[9];
-    term = ALLOC(sizeof(spec));
-    if (term == NULL) return NULL;
-
-    spec[0] = ERL_DRV_ATOM;
-    spec[1] = *tag;
-    spec[2] = ERL_DRV_PORT;
-    spec[3] = driver_mk_port(*port);
-    /*if (result->format == Binary) {
-        spec[4] = ERL_DRV_BINARY;
-        spec[5] = (ErlDrvBinary*)payload;
-        spec[6] = ERL_DRV_UINT;
-        spec[7] = result->size;
-    } else {*/
-    spec[4] = ERL_DRV_BUF2BINARY;
-    spec[5] = (ErlDrvTermData)payload;
-    spec[6] = strlen(payload);
-    /*}*/
-    spec[7] = ERL_DRV_TUPLE;
-    spec[8] = 3;
-
-    memcpy(term, &spec, sizeof(spec));
-    *length = sizeof(spec) / sizeof(spec[0]);
-    return term;
-};
-
 #endif /* _ERLXSL_DRV_H */
 
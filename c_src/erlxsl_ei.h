@@ -61,7 +61,27 @@ typedef unsigned int Uint;
 
 /* ERLANG INTERFACE FUNCTIONS */
 
+/* A single {Key, Value} driver setting. */
+typedef struct {
+    char key[MAXATOMLEN];
+    double number;
+    /* only set when the value is a string */
+    char *string;
+} DriverSetting;
+
 static DriverState decode_ei_cmd(Command*, char*, int*);
+static DriverState decode_ei_setting(char*, int*, DriverSetting*);
+
+/* An engine reload step - {stage, Path}, {switch, Index, Staged} or {discard, Staged}. */
+typedef struct {
+    char op[MAXATOMLEN];
+    /* the library to stage (only set for stage) */
+    char *path;
+    long index;
+    long staged;
+} ReloadRequest;
+
+static DriverState decode_ei_reload(char*, int*, ReloadRequest*);
 
 /* Allocates all neccessary heap space for the next serialised term
      in the supplied buffer. If a mapping to an internal structure is known
@@ -76,7 +96,7 @@ static DriverState decode_ei_cmd(Command *command, char *buf, int *index) {
     int type;
     int size = 0;
     int arity;
-    DriverState state;
+    DriverState state = DecodeError;
     if (!DECODE_OK(ei_get_type(buf, index, &type, &size))) {
         return DecodeError;
     }
@@ -109,23 +129,25 @@ static DriverState decode_ei_cmd(Command *command, char *buf, int *index) {
             }
             break;
         case ERL_ATOM_EXT:
-            INFO("processing atom at index %i\n", (*index));
-            // TODO: drop the intermediate data and copy operations.
-            char *pcmd = ALLOC(sizeof(char) * MAXATOMLEN);
+            DBG("processing atom at index %i\n", (*index));
+            // packed commands (see decode_cmd_buffer in erlxsl.c) avoid these copies altogether
+            char pcmd[MAXATOMLEN];
             if (DECODE_OK(ei_decode_atom(buf, index, pcmd))) {
                 // atoms are always command strings
                 item = (CmdData*)command->command_data.iov->payload.data;
-                item->tag = ALLOC(strlen(pcmd));
-                // char *cmd = (char *)item->tag;
+                if ((item->tag = ALLOC(strlen(pcmd) + 1)) == NULL) {
+                    state = OutOfMemory;
+                    break;
+                }
                 strcpy((char *)item->tag, pcmd);
-                INFO("assigned unpacked atom buffer %s\n", item->tag);
+                DBG("assigned unpacked atom buffer %s\n", item->tag);
                 state = Success;
             } else {
                 state = DecodeError;
             }
             break;
         case ERL_STRING_EXT:
-            INFO("processing string at index %i\n", (*index));
+            DBG("processing string at index %i\n", (*index));
             char *data;
             if ((data = ALLOC(size + 1)) == NULL) {
                 state = OutOfMemory;
@@ -133,20 +155,19 @@ static DriverState decode_ei_cmd(Command *command, char *buf, int *index) {
                 if (DECODE_OK(ei_decode_string(buf, index, data))) {
                     item = (CmdData*)command->command_data.iov->payload.data;
                     item->type = String;
-                    // FIXME: WTF is this doing? surely you want to allocate and/or copy!?
-                    if ((strncpy(item->payload.buffer, data, strlen(data)) == NULL)) {
-                        DRV_FREE(data); // we don't get another chance to free this buffer
-                        state = OutOfMemory;
-                    } else {
-                        INFO("assigning unpacked buffer %s\n", data);
-                        item->payload.buffer = strcpy(item->payload.buffer, data);
-                        state = Success;
-                    }
+                    // the item takes ownership of the decoded buffer
+                    DBG("assigning unpacked buffer %s\n", data);
+                    item->payload.buffer = data;
+                    item->size = size;
+                    state = Success;
+                } else {
+                    DRV_FREE(data);
+                    state = DecodeError;
                 }
             }
             break;
         /*case ERL_PID_EXT:
-            INFO("processing pid at index %i\n", (*index));
+            DBG("processing pid at index %i\n", (*index));
             erlang_pid *pid;
             if ((pid = ALLOC(sizeof(erlang_pid))) == NULL) {
                 state = OutOfMemory;
@@ -156,7 +177,7 @@ static DriverState decode_ei_cmd(Command *command, char *buf, int *index) {
                         DRV_FREE(pid);
                         state = OutOfMemory;
                     } else {
-                        INFO("transforming pid number %i\n", (Int32)pid->num);
+                        DBG("transforming pid number %i\n", (Int32)pid->num);
                         ErlDrvTermData *data = ALLOC(sizeof(ErlDrvTermData));
                         *data = make_pid_data(pid->serial, pid->num);
                         command->command_data.iov->dirty = 1;
@@ -176,4 +197,90 @@ static DriverState decode_ei_cmd(Command *command, char *buf, int *index) {
     return state;
 };
 
+/* Decodes a driver setting, which is passed as a {Key, Value} tuple where
+     Key is an atom and Value is either an integer, a float or a string. String
+     values are allocated on the heap and must be freed by the caller. */
+static DriverState decode_ei_setting(char *buf, int *index, DriverSetting *setting) {
+    int type;
+    int size;
+    int arity;
+    long lval;
+
+    setting->number = 0.0;
+    setting->string = NULL;
+    if (!DECODE_OK(ei_decode_tuple_header(buf, index, &arity)) || arity != 2) {
+        return BadArgumentError;
+    }
+    if (!DECODE_OK(ei_decode_atom(buf, index, setting->key))) {
+        return DecodeError;
+    }
+    if (!DECODE_OK(ei_get_type(buf, index, &type, &size))) {
+        return DecodeError;
+    }
+
+    switch (type) {
+        case ERL_FLOAT_EXT:
+        case NEW_FLOAT_EXT:
+            return DECODE_OK(ei_decode_double(buf, index, &setting->number)) ? Success : DecodeError;
+        case ERL_SMALL_INTEGER_EXT:
+        case ERL_INTEGER_EXT:
+            if (!DECODE_OK(ei_decode_long(buf, index, &lval))) {
+                return DecodeError;
+            }
+            setting->number = (double)lval;
+            return Success;
+        case ERL_STRING_EXT:
+            if ((setting->string = ALLOC(size + 1)) == NULL) {
+                return OutOfMemory;
+            }
+            if (!DECODE_OK(ei_decode_string(buf, index, setting->string))) {
+                DRV_FREE(setting->string);
+                setting->string = NULL;
+                return DecodeError;
+            }
+            return Success;
+        default:
+            return BadArgumentError;
+    }
+};
+
+/* Decodes an engine reload step. The path of a staged library is allocated on
+     the heap and must be freed by the caller. */
+static DriverState decode_ei_reload(char *buf, int *index, ReloadRequest *request) {
+    int type;
+    int size;
+    int arity;
+
+    request->path = NULL;
+    request->index = request->staged = -1;
+    if (!DECODE_OK(ei_decode_tuple_header(buf, index, &arity)) || arity < 2 || arity > 3) {
+        return BadArgumentError;
+    }
+    if (!DECODE_OK(ei_decode_atom(buf, index, request->op))) {
+        return DecodeError;
+    }
+    if (strcmp(request->op, "stage") == 0 && arity == 2) {
+        if (!DECODE_OK(ei_get_type(buf, index, &type, &size)) || type != ERL_STRING_EXT) {
+            return BadArgumentError;
+        }
+        if ((request->path = ALLOC(size + 1)) == NULL) {
+            return OutOfMemory;
+        }
+        if (!DECODE_OK(ei_decode_string(buf, index, request->path))) {
+            DRV_FREE(request->path);
+            request->path = NULL;
+            return DecodeError;
+        }
+        return Success;
+    }
+    if (strcmp(request->op, "switch") == 0 && arity == 3) {
+        return (DECODE_OK(ei_decode_long(buf, index, &request->index)) &&
+                DECODE_OK(ei_decode_long(buf, index, &request->staged))) ? Success : DecodeError;
+    }
+    if (strcmp(request->op, "discard") == 0 && arity == 2) {
+        return DECODE_OK(ei_decode_long(buf, index, &request->staged)) ? Success : DecodeError;
+    }
+    return UnknownCommand;
+};
+
 #endif /* _ERLXSL_EI_H */
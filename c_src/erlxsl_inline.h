@@ -0,0 +1,230 @@
+/*
+ * erlxsl_inline.h
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * This header contains the statistics the linked-in driver uses to decide
+ * whether to run a small transform inline, on the scheduler thread which
+ * received it, rather than queueing it for an async thread. For tiny
+ * documents the driver_async round trip (queueing, waking a thread, and
+ * ready_async on a later scheduler pass) can cost more than the transform.
+ *
+ * Jobs are only run inline once their stylesheet has been run (and so,
+ * for engines with EngineStylesheetCache, compiled and cached) before, and
+ * only if the engine's average time for it is below the threshold - the
+ * lesser of the inline_max_us setting and the average round trip overhead
+ * observed for queued jobs. Both averages are learned from the jobs the
+ * driver runs, so a stylesheet which gets slower stops being run inline.
+ *
+ * Everything here is updated on the emulator thread (in outputv and
+ * ready_async) whilst holding the port lock, so no mutex is needed.
+ *
+ * This header is specific to the linked-in driver and *must* be included after
+ * the erlxsl_driver and erlxsl_ei headers.
+ *
+ */
+
+#ifndef _ERLXSL_INLINE_H
+#define _ERLXSL_INLINE_H
+
+/* INTERNAL DATA & DATA STRUCTURES */
+
+// the number of stylesheets (per engine) whose timings are remembered
+#define INLINE_SLOTS 64
+// documents larger than this (in bytes) are always queued
+#define INLINE_DEFAULT_MAX_INPUT 1024
+// jobs predicted to take longer than this (microseconds) are always queued
+#define INLINE_DEFAULT_MAX_US 100
+// a stylesheet is run this many times on an async thread before its jobs are run inline
+#define INLINE_MIN_RUNS 2
+// stylesheets are told apart by their size and this many bytes from either end
+#define INLINE_FINGERPRINT_BYTES 64
+// the nominal length (microseconds) of a scheduler time slice
+#define INLINE_TIMESLICE_US 1000
+// the weight given to each new observation in the moving averages
+#define INLINE_EWMA_WEIGHT 0.125
+
+/* erl_drv_consume_timeslice is only available to drivers built against ERTS 5.10 (R16B) or later */
+#if ERL_DRV_EXTENDED_MAJOR_VERSION > 2 || \
+    (ERL_DRV_EXTENDED_MAJOR_VERSION == 2 && ERL_DRV_EXTENDED_MINOR_VERSION >= 1)
+#define consume_timeslice(port, percent) erl_drv_consume_timeslice((port), (percent))
+#else
+#define consume_timeslice(port, percent) ((void)(port), (void)(percent))
+#endif
+
+typedef struct {
+    /* the stylesheet's fingerprint, mixed with the index of the engine it ran on */
+    UInt64 key;
+    /* moving average of the engine's time (microseconds) for the stylesheet */
+    double engine_us;
+    UInt32 runs;
+} InlineEntry;
+
+struct inline_stats {
+    /* jobs predicted to take longer than this are queued - zero never runs jobs inline */
+    UInt64 max_us;
+    /* documents larger than this are queued */
+    UInt64 max_input;
+    /* moving average of the time (microseconds) queued jobs spent outside the engine */
+    double overhead_us;
+    /* queued jobs whose round trips have been timed */
+    UInt64 round_trips;
+    /* jobs run inline, and the total time (microseconds) they took */
+    UInt64 inlined;
+    UInt64 inline_us;
+    /* small jobs queued because their stylesheet's average was over the threshold */
+    UInt64 too_slow;
+    InlineEntry entries[INLINE_SLOTS];
+};
+
+typedef struct inline_stats InlineStats;
+
+/* INTERNAL FUNCTIONS */
+
+static InlineStats*
+inline_stats_create(void) {
+    InlineStats *stats = ALLOC(sizeof(InlineStats));
+    if (stats == NULL) return NULL;
+
+    memset(stats, 0, sizeof(InlineStats));
+    stats->max_us = INLINE_DEFAULT_MAX_US;
+    stats->max_input = INLINE_DEFAULT_MAX_INPUT;
+    return stats;
+};
+
+static void
+inline_stats_destroy(InlineStats *stats) {
+    DRV_FREE(stats);
+};
+
+/* Evaluates to non-zero if a document of 'size' bytes is small enough to be run inline. */
+#define inline_candidate(stats, size) \
+    ((stats)->max_us > 0 && (UInt64)(size) <= (stats)->max_input)
+
+/* Returns the key a stylesheet's timings are kept under, for the engine at 'index'. Only
+   the ends of the stylesheet are hashed, so it costs the same whatever its size - a
+   collision merely costs a poor prediction, as the engine does its own caching. */
+static UInt64
+inline_key(const char *xsl, size_t size, UInt32 index) {
+    UInt64 hash;
+    if (size <= 2 * INLINE_FINGERPRINT_BYTES) {
+        hash = hash_buffer(xsl, size);
+    } else {
+        hash = hash_buffer(xsl, INLINE_FINGERPRINT_BYTES) ^
+               (hash_buffer(xsl + size - INLINE_FINGERPRINT_BYTES, INLINE_FINGERPRINT_BYTES) * 31);
+    }
+    return (hash ^ ((UInt64)size << 8)) + index;
+};
+
+/* Returns the longest (microseconds) a job may be predicted to take and still be run inline. */
+static double
+inline_threshold(InlineStats *stats) {
+    // until a round trip has been timed, there's nothing to compare against
+    if (stats->round_trips == 0) return 0;
+    return (stats->overhead_us < (double)stats->max_us) ? stats->overhead_us : (double)stats->max_us;
+};
+
+/* Decides whether the job whose stylesheet has the given key should be run inline. */
+static int
+inline_predict(InlineStats *stats, UInt64 key) {
+    InlineEntry *entry = &stats->entries[key % INLINE_SLOTS];
+
+    if (entry->key != key || entry->runs < INLINE_MIN_RUNS) return 0;
+    if (entry->engine_us >= inline_threshold(stats)) {
+        stats->too_slow++;
+        return 0;
+    }
+    return 1;
+};
+
+/* Records the engine's time for a small job, whether it was run inline or queued. */
+static void
+inline_record(InlineStats *stats, UInt64 key, UInt64 engine_us) {
+    InlineEntry *entry = &stats->entries[key % INLINE_SLOTS];
+
+    if (entry->key != key || entry->runs == 0) {
+        // the slot goes to the most recently seen stylesheet
+        entry->key = key;
+        entry->engine_us = (double)engine_us;
+        entry->runs = 1;
+        return;
+    }
+    entry->engine_us += INLINE_EWMA_WEIGHT * ((double)engine_us - entry->engine_us);
+    entry->runs++;
+};
+
+/* Records the time (microseconds) a queued job spent outside the engine, between being
+   queued and its result reaching ready_async. */
+static void
+inline_record_round_trip(InlineStats *stats, UInt64 overhead_us) {
+    if (stats->round_trips++ == 0) {
+        stats->overhead_us = (double)overhead_us;
+    } else {
+        stats->overhead_us += INLINE_EWMA_WEIGHT * ((double)overhead_us - stats->overhead_us);
+    }
+};
+
+/* Charges the scheduler for a job run inline, which took 'elapsed_us' microseconds. */
+static void
+inline_charge(InlineStats *stats, ErlDrvPort port, UInt64 elapsed_us) {
+    UInt64 percent = (elapsed_us * 100) / INLINE_TIMESLICE_US;
+    stats->inlined++;
+    stats->inline_us += elapsed_us;
+    consume_timeslice(port, (int)((percent < 1) ? 1 : (percent > 100) ? 100 : percent));
+};
+
+/* Encodes the statistics as a proplist of the form
+
+   [{max_us, N}, {max_input, N}, {threshold_us, Float}, {overhead_us, Float},
+    {round_trips, N}, {inlined, N}, {inline_us, N}, {too_slow, N}]
+
+   If buf is NULL, only the index is advanced (i.e., the size is computed). */
+static void
+inline_stats_encode(InlineStats *stats, char *buf, int *index) {
+    const char *names[] = { "round_trips", "inlined", "inline_us", "too_slow" };
+    UInt64 values[] = { stats->round_trips, stats->inlined, stats->inline_us, stats->too_slow };
+    int i;
+
+    ei_encode_list_header(buf, index, 8);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "max_us");
+    ei_encode_ulonglong(buf, index, stats->max_us);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "max_input");
+    ei_encode_ulonglong(buf, index, stats->max_input);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "threshold_us");
+    ei_encode_double(buf, index, inline_threshold(stats));
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "overhead_us");
+    ei_encode_double(buf, index, stats->overhead_us);
+    for (i = 0; i < 4; i++) {
+        ei_encode_tuple_header(buf, index, 2);
+        ei_encode_atom(buf, index, names[i]);
+        ei_encode_ulonglong(buf, index, values[i]);
+    }
+    ei_encode_empty_list(buf, index);
+};
+
+#endif /* _ERLXSL_INLINE_H */
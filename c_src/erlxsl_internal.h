@@ -35,6 +35,7 @@
 #define _ERLXSL_INT_H
 
 #include <stdarg.h>
+#include <sys/time.h>
 
 #ifdef WIN32
     #include <Windows.h>
@@ -46,19 +47,92 @@
 
 // typedef void InitEngineFunc(xsl_engine* engine);
 typedef void (*init_func)(XslEngine*);
+typedef void (*init_v2_func)(XslEngineV2*);
 
 typedef struct {
     char* name;
     char* error_message;
     void* library;
+    /* the v1 entry point, which is only looked up if there is no v2 entry point */
     init_func init_f;
+    init_v2_func init_v2_f;
+    /* the structure a v1 engine was initialized with, which it may still reference */
+    XslEngine* legacy;
 } LoaderSpec;
 
+// the number of engine providers a driver instance can load at once
+#define MAX_ENGINES 8
+
+/* An engine provider loaded by the driver. */
+typedef struct loaded_engine {
+    /* the loaded engine - v1 engines are adapted to the v2 structure */
+    XslEngineV2* engine;
+    /* the engine's capabilities (see EngineCapability), as negotiated on loading */
+    UInt64 capabilities;
+    LoaderSpec* loader;
+    /* per-worker engine contexts (linked-in driver only, see erlxsl_workers.h) */
+    struct worker_pool* workers;
+    /* the driver_async key serializing the engine's transforms, if it is not reentrant -
+       derived from the library, so it is the same for every instance of it */
+    unsigned int async_key;
+    /* the number of transforms routed to the engine */
+    UInt64 requests;
+    /* the number of transforms queued or running on the engine */
+    UInt32 inflight;
+    /* jobs waiting to be batched, or NULL unless the engine provides transform_batch
+       (linked-in driver only, see erlxsl_batch.h) */
+    struct batch_queue* batches;
+    /* links engines which have been replaced, and are draining */
+    struct loaded_engine* next;
+} LoadedEngine;
+
+/* Time slicing of long running transforms (see Command.yield_check). */
+typedef struct {
+    /* the length of a time slice in microseconds, or zero if jobs never yield */
+    UInt64 slice;
+    /* the number of times jobs have yielded */
+    UInt64 yields;
+    /* the number of jobs which yielded at least once */
+    UInt64 yielded_jobs;
+    /* the most times a single job has yielded */
+    UInt32 max_yields;
+} TimeSlicing;
+
 typedef struct {
     void* port;
+    /* the port as a driver term (an ErlDrvTermData) - made once, so workers can build replies with it */
+    unsigned long port_term;
     void* logging_port;
-    XslEngine* engine;
-    LoaderSpec* loader;
+    /* the loaded engines, indexed in the order they were loaded - the first is
+       the default. Slots freed by a reload are NULL until reused. */
+    LoadedEngine* engines[MAX_ENGINES];
+    UInt32 engine_count;
+    /* replaced engines, unloaded once their in-flight transforms complete */
+    LoadedEngine* retired;
+    /* describes why the most recent attempt to load an engine failed */
+    char* error_message;
+    /* hardware counter statistics (linked-in driver only, see erlxsl_perf.h) */
+    struct perf_stats* perf;
+    /* request trace log (linked-in driver only, see erlxsl_trace.h) */
+    struct trace_log* trace;
+    /* slow request capture log (linked-in driver only, see erlxsl_slowlog.h) */
+    struct slow_log* slowlog;
+    /* traffic capture log (linked-in driver only, see erlxsl_traffic.h) */
+    struct traffic_log* traffic;
+    /* shadow engine statistics (linked-in driver only, see erlxsl_shadow.h) */
+    struct shadow_stats* shadow;
+    /* timings of small jobs, which may be run inline (linked-in driver only, see erlxsl_inline.h) */
+    struct inline_stats* inlining;
+    /* commands completed asynchronously by their engines, and jobs whose caller
+       asked for batched replies (see erlxsl_completion.h) */
+    struct completion_queue* completions;
+    /* time slicing settings and counters - only touched on the emulator thread,
+       bar the slice length, which workers read */
+    TimeSlicing slicing;
+    /* the most jobs run in one call to an engine's transform_batch - read by workers */
+    UInt32 batch_limit;
+    /* the id given to the last engine command run on a worker */
+    UInt64 last_command_id;
 } DriverHandle;
 
 /*
@@ -69,6 +143,11 @@ typedef struct {
     UInt8 input_kind;
     UInt8 xsl_kind;
     UInt8 param_grp_arity;
+    /* bitmask of the optional header fields present in the request */
+    UInt8 flags;
+    /* when set, the document buffers are borrowed - they are neither owned
+       nor NUL terminated, and must not be freed by the task */
+    UInt8 borrowed;
 } InputSpec;
 
 /*
@@ -90,18 +169,131 @@ typedef struct request_buffer_argument_outline {
     UInt16    value_size;
 } ParameterSpecHeaders;
 
-/* Used as a handle during async processing */
+/* The most driver term slots a transform's reply takes - {Tag, Port, Result}, plus
+   {TraceId, QueueMicros, EngineMicros} for traced requests. Batched replies take
+   the same, with the caller's reply id in place of the port. */
+#define REPLY_SPEC_SIZE 18
+
+/* The most batched replies sent to a caller in one message, and the driver term
+   slots that message takes - {results, Port, [Reply, ...]}. */
+#define MAX_GROUPED_REPLIES 32
+#define GROUPED_SPEC_SIZE (8 + (MAX_GROUPED_REPLIES * REPLY_SPEC_SIZE))
+
+/* Timestamps (wall clock microseconds) recorded for a traced request. */
 typedef struct {
+    UInt64 trace_id;
+    /* set by the erlang client (taken from the request header) */
+    UInt64 submitted;
+    /* outputv was entered */
+    UInt64 received;
+    /* the job was handed to driver_async */
+    UInt64 queued;
+    /* a worker thread picked the job up */
+    UInt64 started;
+    /* the engine returned */
+    UInt64 finished;
+    /* ready_async was entered */
+    UInt64 delivering;
+    UInt64 scheduler_tid;
+    UInt64 worker_tid;
+} RequestTrace;
+
+typedef enum {
+    NotShadowed = 0,
+    /* the job's result will be compared with a run on the shadow engine */
+    Shadowed = 1,
+    /* the job is running on the shadow engine, and its result is never sent */
+    ShadowRun = 2
+} ShadowMode;
+
+/* Used as a handle during async processing */
+typedef struct async_state {
     /* Holds the state of the XslEngine post processing. */
     EngineState state;
     /* Holds the DriverHandle. */
     DriverHandle* driver;
+    /* The engine the request was routed to. */
+    LoadedEngine* engine;
     /* Holds the command being processed. */
     Command* command;
+    /* Lifecycle timestamps, or NULL if the request is not being traced. */
+    RequestTrace* trace;
+    /* Monotonic time (microseconds) at which the job was queued, if the slow log is on. */
+    UInt64 enqueued;
+    /* Binaries the (borrowed) documents point into, held until the job completes. */
+    void* retained[2];
+    /* Whether the job is being shadowed (see erlxsl_shadow.h), or is itself a shadow run. */
+    ShadowMode shadow;
+    /* For shadowed jobs - the engine's time (microseconds), state and result hash. */
+    UInt64 elapsed;
+    UInt64 result_hash;
+    /* For shadow runs - the figures recorded for the original run. */
+    EngineState primary_state;
+    UInt64 primary_elapsed;
+    UInt64 primary_hash;
+    /* Monotonic time (microseconds) at which the engine was called, when it is timed. */
+    UInt64 started;
+    /* Monotonic time (microseconds) at which the current time slice began. */
+    UInt64 slice_started;
+    /* The number of times the engine has parked the command (see Command.yield_check). */
+    UInt32 yields;
+    /* For pending jobs - the state the engine completed the command with. */
+    EngineState completion;
+    /* For pending jobs - set once ready_async has run, and once the engine has
+       completed the command. The result is delivered when both are set. */
+    int parked;
+    int completed;
+    /* Links jobs in the completion queue (see erlxsl_completion.h). */
+    struct async_state* next;
+    /* Set whilst the job waits in its engine's batch queue (see erlxsl_batch.h). */
+    int batch_queued;
+    struct async_state* batch_next;
+    /* For engine commands - the id the caller was given in place of the result. */
+    UInt64 request_id;
+    /* For small jobs (see erlxsl_inline.h) - the key their stylesheet's timings are kept
+       under, or zero if the job isn't timed, the monotonic time (microseconds) at which
+       a queued job was queued and the engine's time. */
+    UInt64 inline_key;
+    UInt64 queued_at;
+    UInt64 engine_us;
+    /* The reply to the caller, built by whichever thread finished the job (see
+       prepare_reply) so delivering it is a single send, and its length - zero if
+       it couldn't be built. The reply is an ErlDrvTermData spec; a Text result is
+       copied into the reply_bin (ErlDrvBinary) along the way. */
+    unsigned long reply[REPLY_SPEC_SIZE];
+    long reply_len;
+    void* reply_bin;
+    /* Set once the reply has been sent, which for jobs taken from the completion
+       queue may be before ready_async has run. */
+    int replied;
+    /* For requests asking for batched replies (see REQUEST_BATCH_REPLY) - set, along
+       with the id the caller gave the request. */
+    int batch_reply;
+    UInt64 reply_id;
 } AsyncState;
 
-// entry point in the provider engine shared object library
-static const char const *init_entry_point = "init_engine";
+// entry points in the provider engine shared object library, in order of preference
+static const char *const init_v2_entry_point = "init_engine_v2";
+static const char *const init_entry_point = "init_engine";
+
+#ifdef ERLXSL_STATIC_ENGINE
+/*
+ * A (v2) engine linked straight into the driver - see the 'static' make target.
+ * It is used in place of any library whose file name, less its extension, is
+ * ERLXSL_STATIC_ENGINE; other engines are still loaded with dlopen.
+ */
+void init_engine_v2(XslEngineV2*);
+/* stands in for the library handle of the linked in engine */
+static char static_library;
+#define linked_in(lib) ((lib)->library == &static_library)
+#else
+#define linked_in(lib) 0
+#endif
+
+/* Evaluates to the state to pass an engine's shutdown function: v2 engines get
+   their own providerData back (see shutdown_function), v1 engines 'legacy'. */
+#define shutdown_state(engine, legacy) \
+    (((engine)->abi.version >= 2) ? (engine)->providerData : (void*)(legacy))
 
 /* FORWARD DEFS */
 
@@ -120,10 +312,14 @@ static void *_dlopen(const char*);
 
 /* Attempt to load the shared object library specified by the supplied LoaderSpec */
 static void load_library(LoaderSpec*);
-/* Attempts to initialize the XSLT engine provider */
+#ifdef _ERLXSL_PRT_H
+/* Attempts to load and initialize an additional XSLT engine provider */
 static DriverState init_provider(DriverHandle*, char*);
-/* Async callback wrapper that takes an AsyncState struct, applies the engine function and stores the result */
-static void apply_transform(void*);
+#endif
+/* Computes a (non cryptographic) 64bit FNV-1a hash of the supplied buffer. */
+static UInt64 hash_buffer(const char*, size_t);
+/* Returns the current wall clock time in microseconds since the epoch. */
+static UInt64 wall_clock_micros(void);
 /* Free all memory associated with the supplied DriverIOVec (including all referenced data). */
 static void free_iov(DriverIOVec*);
 /* Free all memory associated with the supplied ParameterListNode (including all referenced data). */
@@ -153,7 +349,9 @@ init_task(XslTask*,
      (presets all fields appropriately). Returns NULL on failure. */
 static Command* init_command(const char*, DriverContext*, XslTask*, DriverIOVec*);
 static char *libload_failure = "Unable to load xslt provider library.";
-char *entrypoint_failure = "Unable to locate entry point 'init_engine'.";
+char *entrypoint_failure = "Unable to locate entry point 'init_engine_v2' or 'init_engine'.";
+static char *invalid_engine = "Engine is missing required functions or uses an unsupported ABI.";
+static char *too_many_engines = "The maximum number of engines are already loaded.";
 
 /* MACROS */
 
@@ -203,9 +401,8 @@ set_dlerror(LoaderSpec *dest, char *message) {
     strcat(message, " ErrorCode: %i");
     sprintf(dest->error_message, message, (UInt32)error_code);
 #else
-    dest->error_message = dlerror();
-    if (dest->error_message == NULL) {
-        sprintf(dest->error_message, message, dest->name);
+    if ((dest->error_message = dlerror()) == NULL) {
+        dest->error_message = message;
     }
 #endif
 };
@@ -220,10 +417,32 @@ static void *_dlopen(const char *file) {
 };
 #endif
 
+#ifdef ERLXSL_STATIC_ENGINE
+/* Checks whether 'name' refers to the engine linked into the driver. */
+static int
+is_static_engine(const char *name) {
+    const char *file = strrchr(name, '/');
+    size_t length = strlen(ERLXSL_STATIC_ENGINE);
+
+    file = (file == NULL) ? name : file + 1;
+    return strncmp(file, ERLXSL_STATIC_ENGINE, length) == 0 &&
+           (file[length] == '\0' || file[length] == '.');
+};
+#endif
+
 static void
 load_library(LoaderSpec *dest) {
     if (dest == NULL) return;
 
+#ifdef ERLXSL_STATIC_ENGINE
+    if (is_static_engine(dest->name)) {
+        DBG("library %s is linked in\n", dest->name);
+        dest->library = &static_library;
+        dest->init_f = NULL;
+        dest->init_v2_f = init_engine_v2;
+        return;
+    }
+#endif
     if ((dest->library = _dlopen((const char*)dest->name)) == NULL) {
         set_dlerror(dest, libload_failure);
         DBG("dlopen failed with %s\n", dest->error_message);
@@ -232,14 +451,51 @@ load_library(LoaderSpec *dest) {
 
     DBG("library %s = %p\n", dest->name, dest->library);
 
-    if ((dest->init_f = dlsym(dest->library, init_entry_point)) == NULL) {
+    dest->init_f = NULL;
+    if ((dest->init_v2_f = dlsym(dest->library, init_v2_entry_point)) == NULL &&
+        (dest->init_f = dlsym(dest->library, init_entry_point)) == NULL) {
         set_dlerror(dest, entrypoint_failure);
     }
 };
 
+/* Initializes an ABI v1 engine, adapting it to the (v2) structure the driver uses. */
 static DriverState
-init_provider(DriverHandle *drv, char *buff) {
-    XslEngine *engine = ALLOC(sizeof(XslEngine));
+adapt_v1_engine(LoaderSpec *lib, XslEngineV2 *engine) {
+    XslEngine *legacy = ALLOC(sizeof(XslEngine));
+    if (legacy == NULL) return OutOfMemory;
+
+    memset(legacy, 0, sizeof(XslEngine));
+    (lib->init_f)(legacy);
+    lib->legacy = legacy;
+
+    engine->abi.version = 1;
+    engine->abi.size = sizeof(XslEngineV2);
+    engine->command = legacy->command;
+    engine->transform = legacy->transform;
+    engine->after_transform = legacy->after_transform;
+    engine->shutdown = legacy->shutdown;
+    engine->providerData = legacy->providerData;
+    // the driver has always called v1 engines from several threads at once
+    engine->capabilities = EngineReentrant;
+    return Success;
+};
+
+/* Unloads the library described by a LoaderSpec, and frees it. */
+static void
+release_loader(LoaderSpec *lib) {
+    if (lib == NULL) return;
+    if (lib->library != NULL && !linked_in(lib)) {
+        dlclose(lib->library);
+    }
+    DRV_FREE(lib->legacy);
+    DRV_FREE(lib->name);
+    DRV_FREE(lib);
+};
+
+/* Loads the engine provider library 'buff' and initializes its engine into 'slot'. */
+static DriverState
+load_provider(LoadedEngine *slot, char *buff, char **error_message) {
+    XslEngineV2 *engine = ALLOC(sizeof(XslEngineV2));
     LoaderSpec* lib = ALLOC(sizeof(LoaderSpec));
 
     if (engine == NULL || lib == NULL) {
@@ -248,38 +504,135 @@ init_provider(DriverHandle *drv, char *buff) {
         return OutOfMemory;
     }
 
-    drv->loader = lib;
-    lib->name = ALLOC(strlen(buff));
+    memset(lib, 0, sizeof(LoaderSpec));
+    if ((lib->name = ALLOC(strlen(buff) + 1)) == NULL) {
+        DRV_FREE(engine);
+        DRV_FREE(lib);
+        return OutOfMemory;
+    }
     strcpy(lib->name, buff);
     load_library(lib);
 
     if (lib->library == NULL) {
         // TODO: better reporting back to the port controller!?
         puts(lib->error_message);
+        *error_message = lib->error_message;
+        DRV_FREE(engine);
+        release_loader(lib);
         return LibraryNotFound;
     }
-    if (lib->init_f == NULL) {
+    if (lib->init_f == NULL && lib->init_v2_f == NULL) {
         // TODO: better reporting back to the port controller!?
         puts(lib->error_message);
+        *error_message = lib->error_message;
+        DRV_FREE(engine);
+        release_loader(lib);
         return EntryPointNotFound;
     }
 
-    (lib->init_f)(engine);
-    if (engine == NULL) {
+    memset(engine, 0, sizeof(XslEngineV2));
+    engine->abi.version = ERLXSL_ABI_VERSION;
+    engine->abi.size = sizeof(XslEngineV2);
+    if (lib->init_v2_f != NULL) {
+        (lib->init_v2_f)(engine);
+    } else if (adapt_v1_engine(lib, engine) != Success) {
+        DRV_FREE(engine);
+        release_loader(lib);
+        return OutOfMemory;
+    }
+
+    if ((lib->init_v2_f != NULL && engine->abi.version < 2) ||
+        engine->abi.size < offsetof(XslEngineV2, reserved) ||
+        engine->transform == NULL || engine->after_transform == NULL ||
+        engine->shutdown == NULL) {
+        *error_message = invalid_engine;
+        DRV_FREE(engine);
+        release_loader(lib);
         return InitFailed;
     }
 
-    drv->engine = engine;
+    memset(slot, 0, sizeof(LoadedEngine));
+    slot->engine = engine;
+    slot->loader = lib;
+    slot->capabilities = engine->capabilities & ENGINE_CAPABILITIES;
+    if (!abi_has_field(engine, transform_batch) || engine->transform_batch == NULL) {
+        slot->capabilities &= ~((UInt64)EngineBatch);
+    }
     return InitOk;
 };
 
-static void apply_transform(void *asd) {
-    AsyncState* data = (AsyncState*)asd;
-    DriverHandle* driver = data->driver;
-    XslEngine* engine = driver->engine;
-    Command* command = data->command;
-    data->state = engine->transform(command);
-    INFO("output buffer: %s\n", command->result->payload.buffer);
+/* Loads an engine provider into the first free slot, whose index is stored in 'index'. */
+static DriverState
+stage_provider(DriverHandle *drv, char *buff, UInt32 *index) {
+    DriverState state;
+    LoadedEngine *slot;
+    UInt32 i;
+
+    for (i = 0; i < MAX_ENGINES && drv->engines[i] != NULL; i++);
+    if (i == MAX_ENGINES) {
+        drv->error_message = too_many_engines;
+        return InitFailed;
+    }
+    if ((slot = ALLOC(sizeof(LoadedEngine))) == NULL) {
+        return OutOfMemory;
+    }
+    if ((state = load_provider(slot, buff, &drv->error_message)) != InitOk) {
+        DRV_FREE(slot);
+        return state;
+    }
+    // engines which must run serially get an async thread of their own; the key is
+    // derived from the library handle, which dlopen returns for every load of the
+    // same library, so that instances of it loaded into any slot, by any of the
+    // concurrently running ports, are serialized as well
+    slot->async_key = (unsigned int)(((uintptr_t)slot->loader->library) >> 4);
+    drv->engines[i] = slot;
+    if (i >= drv->engine_count) {
+        drv->engine_count = i + 1;
+    }
+    *index = i;
+    return state;
+};
+
+#ifdef _ERLXSL_PRT_H
+/* Loads another engine provider - the first engine loaded is the default. The
+   driver itself uses load_engine, which also sets up the engine's queues. */
+static DriverState
+init_provider(DriverHandle *drv, char *buff) {
+    UInt32 index;
+    return stage_provider(drv, buff, &index);
+};
+#endif
+
+/* Runs a batch of transforms with the engine's transform_batch, or one at a
+   time if it doesn't provide one. */
+static void
+run_transform_batch(XslEngineV2 *engine, Command **cmds, EngineState *states, size_t count) {
+    size_t i;
+    if (abi_has_field(engine, transform_batch) && engine->transform_batch != NULL) {
+        engine->transform_batch(cmds, states, count);
+        return;
+    }
+    for (i = 0; i < count; i++) {
+        states[i] = engine->transform(cmds[i]);
+    }
+};
+
+static UInt64
+hash_buffer(const char *buffer, size_t size) {
+    UInt64 hash = 14695981039346656037ULL;
+    size_t i;
+    for (i = 0; i < size; i++) {
+        hash ^= (UInt8)buffer[i];
+        hash *= 1099511628211ULL;
+    }
+    return hash;
+};
+
+static UInt64
+wall_clock_micros(void) {
+    struct timeval tv;
+    gettimeofday(&tv, NULL);
+    return ((UInt64)tv.tv_sec * 1000000) + (UInt64)tv.tv_usec;
 };
 
 static void
@@ -328,12 +681,17 @@ free_task(XslTask *task) {
 static void
 free_command(Command *cmd) {
     if (cmd != NULL) {
-        if (cmd->command_string != NULL && strcmp("transform", cmd->command_string) == 0) {
+        if (cmd->op == OpTransform) {
             free_task(cmd->command_data.xsl_task);
         } else {
             // FIXME: we should be checking the DriverIOVec was actually assigned!
             free_iov(cmd->command_data.iov);
         }
+        if (cmd->result != NULL && cmd->result->dirty == 1 && cmd->release != NULL) {
+            // results are allocated by the command's allocator, so are released by it too
+            cmd->release(cmd->result->payload.data);
+            cmd->result->dirty = 0;
+        }
         free_iov(cmd->result);
         DRV_FREE(cmd);
     }
@@ -344,6 +702,7 @@ free_async_state(AsyncState *state) {
     ASSERT(state != NULL);
     if (state != NULL) {
         free_command(state->command);
+        DRV_FREE(state->trace);
         DRV_FREE(state);
     }
 };
@@ -386,6 +745,8 @@ init_doc(InputType type,
 static void clear_task_fields(XslTask* t) {
     t->input_doc = t->xslt_doc = NULL;
     t->parameters = NULL;
+    t->input.data = t->stylesheet.data = NULL;
+    t->input.length = t->stylesheet.length = 0;
 };
 
 static DriverState
@@ -408,30 +769,44 @@ init_task(XslTask *task,
         return EmptyBufferError;
     }
 
-    ASSERT(hsize->input_size == strlen(xml));
-    ASSERT(hsize->xsl_size == strlen(xsl));
+    if (!hspec->borrowed) {
+        ASSERT(hsize->input_size == strlen(xml));
+        ASSERT(hsize->xsl_size == strlen(xsl));
+    }
 
     InputDocument *xmldoc;
     InputDocument *xsldoc;
 
     if ((xmldoc = init_doc((InputType)hspec->input_kind,
             hsize->input_size, xml)) == NULL) {
-        DRV_FREE(xml);
-        DRV_FREE(xsl);
+        if (!hspec->borrowed) {
+            DRV_FREE(xml);
+            DRV_FREE(xsl);
+        }
         return OutOfMemoryError;
     }
 
     if ((xsldoc = init_doc((InputType)hspec->xsl_kind,
             hsize->xsl_size, xsl)) == NULL) {
         free_document(xmldoc);
-        DRV_FREE(xml);
-        DRV_FREE(xsl);
+        if (!hspec->borrowed) {
+            DRV_FREE(xml);
+            DRV_FREE(xsl);
+        }
         return OutOfMemoryError;
     }
+    if (hspec->borrowed) {
+        // free_iov leaves clean buffers alone
+        xmldoc->iov->dirty = xsldoc->iov->dirty = 0;
+    }
 
     task->input_doc = xmldoc;
     task->xslt_doc = xsldoc;
     task->parameters = NULL;
+    task->input.data = xml;
+    task->input.length = (size_t)hsize->input_size;
+    task->stylesheet.data = xsl;
+    task->stylesheet.length = (size_t)hsize->xsl_size;
     return Success;
 };
 
@@ -447,7 +822,8 @@ internal_free(void *p) {
 
 static void*
 internal_realloc(void *ptr, size_t size) {
-    return REALLOC(ptr, size);
+    // driver_realloc makes no promises about null pointers
+    return (ptr == NULL) ? ALLOC(size) : REALLOC(ptr, size);
 };
 
 static Command*
@@ -464,11 +840,18 @@ init_command(const char *command, DriverContext *context,
         cmd->command_data.iov = iov;
     }
     cmd->command_string = command;
+    cmd->op = (xsl_task != NULL) ? OpTransform : OpCommand;
     cmd->context = context;
     cmd->alloc = internal_alloc;
     cmd->release = internal_free;
     cmd->resize = internal_realloc;
     cmd->async_state = NULL;
+    cmd->result_length = 0;
+    cmd->complete = NULL;
+    cmd->driver_private = NULL;
+    cmd->worker_context = NULL;
+    cmd->yield_check = NULL;
+    memset(cmd->reserved, 0, sizeof(cmd->reserved));
     return cmd;
 };
 
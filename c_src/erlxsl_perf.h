@@ -0,0 +1,369 @@
+/*
+ * erlxsl_perf.h
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * This header contains the (opt-in) hardware performance counter sampling used
+ * by the linked-in driver. Async worker threads lazily open a group of per-thread
+ * perf_event counters, which are read either side of a sampled transform. The
+ * deltas are aggregated per stylesheet hash and reported via the STATS_COMMAND.
+ *
+ * This header is specific to the linked-in driver and *must* be included after
+ * the erlxsl_driver and erlxsl_ei headers.
+ *
+ */
+
+#ifndef _ERLXSL_PERF_H
+#define _ERLXSL_PERF_H
+
+#ifdef __linux__
+#include <unistd.h>
+#include <sys/ioctl.h>
+#include <sys/syscall.h>
+#include <linux/perf_event.h>
+#define HAVE_PERF_EVENTS 1
+#endif
+
+/* INTERNAL DATA & DATA STRUCTURES */
+
+// cycles, instructions, cache misses and branch misses (in that order)
+#define PERF_NUM_COUNTERS 4
+// number of distinct stylesheets we aggregate before lumping samples together
+#define PERF_TABLE_SIZE 256
+// hash used for samples that arrive once the table is full
+#define PERF_OVERFLOW_HASH 0
+
+static const char *perf_counter_names[PERF_NUM_COUNTERS] = {
+    "cycles", "instructions", "cache_misses", "branch_misses"
+};
+
+/* A snapshot (or delta) of the hardware counters for the calling thread. */
+typedef struct {
+    UInt64 values[PERF_NUM_COUNTERS];
+} PerfSample;
+
+/* Aggregated counter deltas for a single stylesheet. */
+typedef struct {
+    /* hash of the stylesheet buffer (see hash_buffer) */
+    UInt64 stylesheet;
+    /* number of transforms sampled against this stylesheet */
+    UInt64 samples;
+    /* sum of the counter deltas over all samples */
+    UInt64 totals[PERF_NUM_COUNTERS];
+} PerfStatsEntry;
+
+/* Driver wide performance statistics - shared by all worker threads. */
+struct perf_stats {
+    ErlDrvMutex *lock;
+    /* a transform is sampled when a per-thread random number falls below this */
+    UInt32 sample_threshold;
+    /* number of transforms sampled successfully */
+    UInt64 sampled;
+    /* number of sampling attempts made on threads without working counters */
+    UInt64 unavailable;
+    PerfStatsEntry entries[PERF_TABLE_SIZE];
+};
+
+typedef struct perf_stats PerfStats;
+
+/* Per worker thread counter state, held in thread specific data. */
+typedef struct perf_thread_state {
+    /* fds[0] is the group leader, or -1 if the counters could not be opened */
+    int fds[PERF_NUM_COUNTERS];
+    /* state for the xorshift generator used to make sampling decisions */
+    UInt32 seed;
+    /* the next thread's state (see perf_finish) */
+    struct perf_thread_state *next;
+} PerfThreadState;
+
+static ErlDrvTSDKey perf_tsd_key;
+/* every thread's state, so that it can be released when the driver is unloaded */
+static ErlDrvMutex *perf_threads_lock = NULL;
+static PerfThreadState *perf_threads = NULL;
+
+/* INTERNAL FUNCTIONS */
+
+static void perf_close_thread_counters(PerfThreadState *ts);
+
+/* Initializes the thread specific data key - called once when the driver is loaded. */
+static int
+perf_init(void) {
+    if ((perf_threads_lock = erl_drv_mutex_create("erlxsl_perf_threads")) == NULL) {
+        return -1;
+    }
+    return erl_drv_tsd_key_create("erlxsl_perf", &perf_tsd_key);
+};
+
+/* Closes every thread's counters and frees its state. The key itself is not
+   destroyed, as the async threads still hold (now dangling) values under it
+   and cannot be made to clear them - a key that is never destroyed can never
+   be handed out again, so those values are never read. */
+static void
+perf_finish(void) {
+    PerfThreadState *ts;
+    while ((ts = perf_threads) != NULL) {
+        perf_threads = ts->next;
+        perf_close_thread_counters(ts);
+        DRV_FREE(ts);
+    }
+    if (perf_threads_lock != NULL) {
+        erl_drv_mutex_destroy(perf_threads_lock);
+        perf_threads_lock = NULL;
+    }
+};
+
+static PerfStats*
+perf_stats_create(void) {
+    PerfStats *stats = ALLOC(sizeof(PerfStats));
+    if (stats == NULL) return NULL;
+
+    memset(stats, 0, sizeof(PerfStats));
+    if ((stats->lock = erl_drv_mutex_create("erlxsl_perf_stats")) == NULL) {
+        DRV_FREE(stats);
+        return NULL;
+    }
+    return stats;
+};
+
+static void
+perf_stats_destroy(PerfStats *stats) {
+    if (stats != NULL) {
+        erl_drv_mutex_destroy(stats->lock);
+        DRV_FREE(stats);
+    }
+};
+
+/* Sets the fraction (0.0 - 1.0) of transforms to sample. Zero disables sampling. */
+static DriverState
+perf_set_sample_rate(PerfStats *stats, double rate) {
+    if (rate < 0.0 || rate > 1.0) {
+        return BadArgumentError;
+    }
+    stats->sample_threshold = (UInt32)(rate * (double)UINT32_MAX);
+    return Success;
+};
+
+#ifdef HAVE_PERF_EVENTS
+static int
+perf_open_counter(UInt32 type, UInt64 config, int group_fd) {
+    struct perf_event_attr attr;
+    memset(&attr, 0, sizeof(attr));
+    attr.size = sizeof(attr);
+    attr.type = type;
+    attr.config = config;
+    attr.exclude_kernel = 1;
+    attr.exclude_hv = 1;
+    attr.read_format = PERF_FORMAT_GROUP;
+    // count for the calling thread only, on whichever cpu it runs
+    return (int)syscall(__NR_perf_event_open, &attr, 0, -1, group_fd, 0);
+};
+
+static void
+perf_open_thread_counters(PerfThreadState *ts) {
+    static const UInt64 configs[PERF_NUM_COUNTERS] = {
+        PERF_COUNT_HW_CPU_CYCLES,
+        PERF_COUNT_HW_INSTRUCTIONS,
+        PERF_COUNT_HW_CACHE_MISSES,
+        PERF_COUNT_HW_BRANCH_MISSES
+    };
+    int i;
+
+    for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+        ts->fds[i] = perf_open_counter(PERF_TYPE_HARDWARE, configs[i],
+                                       (i == 0) ? -1 : ts->fds[0]);
+        if (ts->fds[i] < 0) {
+            // all or nothing: a partial group would skew the figures
+            while (--i >= 0) {
+                close(ts->fds[i]);
+            }
+            ts->fds[0] = -1;
+            return;
+        }
+    }
+};
+
+static void
+perf_close_thread_counters(PerfThreadState *ts) {
+    int i;
+    if (ts->fds[0] < 0) return;
+    for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+        close(ts->fds[i]);
+    }
+    ts->fds[0] = -1;
+};
+
+static int
+perf_read_counters(PerfThreadState *ts, PerfSample *sample) {
+    UInt64 data[PERF_NUM_COUNTERS + 1];
+    ssize_t expected = sizeof(data);
+    if (read(ts->fds[0], data, sizeof(data)) != expected) {
+        return 0;
+    }
+    memcpy(sample->values, &data[1], sizeof(sample->values));
+    return 1;
+};
+#else
+static void
+perf_open_thread_counters(PerfThreadState *ts) {
+    ts->fds[0] = -1;
+};
+
+static void
+perf_close_thread_counters(PerfThreadState *ts) {
+};
+
+static int
+perf_read_counters(PerfThreadState *ts, PerfSample *sample) {
+    return 0;
+};
+#endif
+
+static PerfThreadState*
+perf_thread_state(void) {
+    PerfThreadState *ts = (PerfThreadState*)erl_drv_tsd_get(perf_tsd_key);
+    if (ts == NULL) {
+        if ((ts = ALLOC(sizeof(PerfThreadState))) == NULL) return NULL;
+        // any non-zero seed will do, so long as threads don't share one
+        ts->seed = (UInt32)(((uintptr_t)ts) >> 4) | 1;
+        perf_open_thread_counters(ts);
+        erl_drv_mutex_lock(perf_threads_lock);
+        ts->next = perf_threads;
+        perf_threads = ts;
+        erl_drv_mutex_unlock(perf_threads_lock);
+        erl_drv_tsd_set(perf_tsd_key, ts);
+    }
+    return ts;
+};
+
+/* Decides whether or not to sample the current transform, returning 1 (and
+   taking an initial counter reading) if so. This is cheap when sampling is off. */
+static int
+perf_sample_begin(PerfStats *stats, PerfSample *start) {
+    PerfThreadState *ts;
+    UInt32 x;
+
+    if (stats == NULL || stats->sample_threshold == 0) return 0;
+    if ((ts = perf_thread_state()) == NULL) return 0;
+
+    x = ts->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    ts->seed = x;
+    if (x > stats->sample_threshold) return 0;
+
+    if (ts->fds[0] < 0 || !perf_read_counters(ts, start)) {
+        erl_drv_mutex_lock(stats->lock);
+        stats->unavailable++;
+        erl_drv_mutex_unlock(stats->lock);
+        return 0;
+    }
+    return 1;
+};
+
+/* Takes a second counter reading and adds the deltas to the stylesheet's entry. */
+static void
+perf_sample_end(PerfStats *stats, UInt64 stylesheet, const PerfSample *start) {
+    PerfThreadState *ts = (PerfThreadState*)erl_drv_tsd_get(perf_tsd_key);
+    PerfStatsEntry *entry = NULL;
+    PerfSample end;
+    UInt32 slot;
+    UInt32 probe;
+    int i;
+
+    if (ts == NULL || !perf_read_counters(ts, &end)) return;
+    if (stylesheet == PERF_OVERFLOW_HASH) stylesheet = 1;
+
+    erl_drv_mutex_lock(stats->lock);
+    // the last slot is reserved for aggregating samples once the table is full
+    slot = (UInt32)(stylesheet % (PERF_TABLE_SIZE - 1));
+    for (probe = 0; probe < (PERF_TABLE_SIZE - 1); probe++) {
+        entry = &stats->entries[(slot + probe) % (PERF_TABLE_SIZE - 1)];
+        if (entry->stylesheet == stylesheet || entry->samples == 0) break;
+        entry = NULL;
+    }
+    if (entry == NULL) {
+        entry = &stats->entries[PERF_TABLE_SIZE - 1];
+        stylesheet = PERF_OVERFLOW_HASH;
+    }
+    entry->stylesheet = stylesheet;
+    entry->samples++;
+    for (i = 0; i < PERF_NUM_COUNTERS; i++) {
+        entry->totals[i] += end.values[i] - start->values[i];
+    }
+    stats->sampled++;
+    erl_drv_mutex_unlock(stats->lock);
+};
+
+/* Encodes the statistics as a proplist of the form
+
+   [{sample_rate, Float}, {sampled, N}, {unavailable, N},
+    {stylesheets, [{Hash, Samples, [{cycles, N}, ...]}]}]
+
+   If buf is NULL, only the index is advanced (i.e., the size is computed).
+   The caller must hold the stats lock. */
+static void
+perf_stats_encode(PerfStats *stats, char *buf, int *index) {
+    int i;
+    int j;
+    int count = 0;
+
+    for (i = 0; i < PERF_TABLE_SIZE; i++) {
+        if (stats->entries[i].samples > 0) count++;
+    }
+
+    ei_encode_list_header(buf, index, 4);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "sample_rate");
+    ei_encode_double(buf, index, (double)stats->sample_threshold / (double)UINT32_MAX);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "sampled");
+    ei_encode_ulonglong(buf, index, stats->sampled);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "unavailable");
+    ei_encode_ulonglong(buf, index, stats->unavailable);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "stylesheets");
+    if (count > 0) {
+        ei_encode_list_header(buf, index, count);
+        for (i = 0; i < PERF_TABLE_SIZE; i++) {
+            PerfStatsEntry *entry = &stats->entries[i];
+            if (entry->samples == 0) continue;
+            ei_encode_tuple_header(buf, index, 3);
+            ei_encode_ulonglong(buf, index, entry->stylesheet);
+            ei_encode_ulonglong(buf, index, entry->samples);
+            ei_encode_list_header(buf, index, PERF_NUM_COUNTERS);
+            for (j = 0; j < PERF_NUM_COUNTERS; j++) {
+                ei_encode_tuple_header(buf, index, 2);
+                ei_encode_atom(buf, index, perf_counter_names[j]);
+                ei_encode_ulonglong(buf, index, entry->totals[j]);
+            }
+            ei_encode_empty_list(buf, index);
+        }
+    }
+    ei_encode_empty_list(buf, index);
+    ei_encode_empty_list(buf, index);
+};
+
+#endif /* _ERLXSL_PERF_H */
@@ -0,0 +1,190 @@
+/*
+ * erlxsl_shadow.h
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * This header contains the shadow engine statistics used by the linked-in
+ * driver. When a shadow engine is configured, a sampled fraction of the
+ * requests handled by the other engines is run a second time on it, once the
+ * caller has been sent the real result. The shadow result is discarded after
+ * its hash, state and latency have been compared with the original's, so a
+ * candidate engine can be evaluated against live traffic before it is
+ * switched in (see RELOAD_COMMAND).
+ *
+ * Sampling decisions and comparisons are made on the emulator thread (in
+ * outputv and ready_async) whilst holding the port lock, so no mutex is needed.
+ *
+ * This header is specific to the linked-in driver and *must* be included after
+ * the erlxsl_driver and erlxsl_ei headers.
+ *
+ */
+
+#ifndef _ERLXSL_SHADOW_H
+#define _ERLXSL_SHADOW_H
+
+/* INTERNAL DATA & DATA STRUCTURES */
+
+// no engine has been selected as the shadow
+#define SHADOW_NONE -1
+// shadow runs are skipped, rather than queued, once this many are outstanding
+#define SHADOW_DEFAULT_MAX_PENDING 4
+
+struct shadow_stats {
+    /* index of the shadow engine, or SHADOW_NONE */
+    long engine;
+    /* a request is shadowed when a random number falls below this */
+    UInt32 sample_threshold;
+    /* state for the xorshift generator used to make sampling decisions */
+    UInt32 seed;
+    /* shadow runs queued or running on the shadow engine */
+    UInt32 pending;
+    UInt32 max_pending;
+    /* requests selected for shadowing */
+    UInt64 sampled;
+    /* sampled requests dropped because the shadow engine was busy or gone */
+    UInt64 skipped;
+    /* shadow runs whose results have been compared */
+    UInt64 compared;
+    /* comparisons in which the state or the result differed */
+    UInt64 mismatches;
+    /* total engine time (microseconds) of the compared runs, on each engine */
+    UInt64 primary_us;
+    UInt64 shadow_us;
+    /* comparisons in which the shadow engine took longer */
+    UInt64 shadow_slower;
+    /* the largest amount (microseconds) by which the shadow engine was slower */
+    UInt64 max_regression_us;
+};
+
+typedef struct shadow_stats ShadowStats;
+
+/* INTERNAL FUNCTIONS */
+
+static ShadowStats*
+shadow_stats_create(void) {
+    ShadowStats *stats = ALLOC(sizeof(ShadowStats));
+    if (stats == NULL) return NULL;
+
+    memset(stats, 0, sizeof(ShadowStats));
+    stats->engine = SHADOW_NONE;
+    stats->max_pending = SHADOW_DEFAULT_MAX_PENDING;
+    // any non-zero seed will do, so long as ports don't share one
+    stats->seed = (UInt32)(((uintptr_t)stats) >> 4) | 1;
+    return stats;
+};
+
+static void
+shadow_stats_destroy(ShadowStats *stats) {
+    DRV_FREE(stats);
+};
+
+/* Sets the fraction (0.0 - 1.0) of requests to shadow. Zero disables shadowing. */
+static DriverState
+shadow_set_sample_rate(ShadowStats *stats, double rate) {
+    if (rate < 0.0 || rate > 1.0) {
+        return BadArgumentError;
+    }
+    stats->sample_threshold = (UInt32)(rate * (double)UINT32_MAX);
+    return Success;
+};
+
+/* Decides whether or not a request routed to the engine at 'index' should be
+   shadowed. This is cheap when shadowing is off. */
+static int
+shadow_sample(ShadowStats *stats, UInt32 index) {
+    UInt32 x;
+
+    if (stats->engine == SHADOW_NONE || stats->sample_threshold == 0 ||
+        stats->engine == (long)index) {
+        return 0;
+    }
+    x = stats->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    stats->seed = x;
+    if (x > stats->sample_threshold) return 0;
+
+    stats->sampled++;
+    return 1;
+};
+
+/* Compares a shadow run with the request's original run. */
+static void
+shadow_record(ShadowStats *stats,
+              EngineState primary_state, UInt64 primary_hash, UInt64 primary_us,
+              EngineState shadow_state, UInt64 shadow_hash, UInt64 shadow_us) {
+    stats->compared++;
+    if (primary_state != shadow_state || primary_hash != shadow_hash) {
+        stats->mismatches++;
+    }
+    stats->primary_us += primary_us;
+    stats->shadow_us += shadow_us;
+    if (shadow_us > primary_us) {
+        stats->shadow_slower++;
+        if (shadow_us - primary_us > stats->max_regression_us) {
+            stats->max_regression_us = shadow_us - primary_us;
+        }
+    }
+};
+
+/* Encodes the statistics as a proplist of the form
+
+   [{engine, Index | none}, {sample_rate, Float}, {max_pending, N},
+    {sampled, N}, {skipped, N}, {compared, N}, {mismatches, N},
+    {primary_us, N}, {shadow_us, N}, {shadow_slower, N}, {max_regression_us, N}]
+
+   If buf is NULL, only the index is advanced (i.e., the size is computed). */
+static void
+shadow_stats_encode(ShadowStats *stats, char *buf, int *index) {
+    const char *names[] = { "sampled", "skipped", "compared", "mismatches", "primary_us",
+                            "shadow_us", "shadow_slower", "max_regression_us" };
+    UInt64 values[] = { stats->sampled, stats->skipped, stats->compared, stats->mismatches,
+                        stats->primary_us, stats->shadow_us, stats->shadow_slower,
+                        stats->max_regression_us };
+    int i;
+
+    ei_encode_list_header(buf, index, 11);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "engine");
+    if (stats->engine == SHADOW_NONE) {
+        ei_encode_atom(buf, index, "none");
+    } else {
+        ei_encode_long(buf, index, stats->engine);
+    }
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "sample_rate");
+    ei_encode_double(buf, index, (double)stats->sample_threshold / (double)UINT32_MAX);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "max_pending");
+    ei_encode_ulong(buf, index, stats->max_pending);
+    for (i = 0; i < 8; i++) {
+        ei_encode_tuple_header(buf, index, 2);
+        ei_encode_atom(buf, index, names[i]);
+        ei_encode_ulonglong(buf, index, values[i]);
+    }
+    ei_encode_empty_list(buf, index);
+};
+
+#endif /* _ERLXSL_SHADOW_H */
@@ -0,0 +1,213 @@
+/*
+ * erlxsl_slowlog.h
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * This header contains the slow request log used by the linked-in driver. When
+ * a capture directory is configured, requests whose transform takes longer than
+ * the configured threshold are written to that directory (in the format defined
+ * by erlxsl_capture.h) so they can be replayed offline with erlxsl_replay.
+ * Captures are rate limited, and both the size of a single capture and the
+ * total number of bytes written are capped.
+ *
+ * Captures are written by the worker thread which ran the transform.
+ *
+ * This header is specific to the linked-in driver and *must* be included after
+ * the erlxsl_driver and erlxsl_ei headers.
+ *
+ */
+
+#ifndef _ERLXSL_SLOWLOG_H
+#define _ERLXSL_SLOWLOG_H
+
+#include "erlxsl_capture.h"
+
+/* INTERNAL DATA & DATA STRUCTURES */
+
+// defaults: at most 10 captures a minute, of up to 1Mb each, to a total of 64Mb
+#define SLOWLOG_DEFAULT_THRESHOLD 1000000
+#define SLOWLOG_DEFAULT_RATE 10
+#define SLOWLOG_DEFAULT_MAX_BYTES (1024 * 1024)
+#define SLOWLOG_DEFAULT_MAX_TOTAL (64 * 1024 * 1024)
+#define SLOWLOG_RATE_WINDOW 60000000
+
+struct slow_log {
+    ErlDrvMutex *lock;
+    /* capture directory, or NULL when the slow log is switched off */
+    char *dir;
+    /* transforms taking at least this long (in microseconds) are captured */
+    UInt64 threshold;
+    /* maximum number of captures per (one minute) window */
+    UInt32 rate_limit;
+    /* requests larger than this (input + stylesheet bytes) are not captured */
+    UInt64 max_bytes;
+    /* once this many bytes have been written, no further captures are made */
+    UInt64 max_total;
+    UInt64 window_start;
+    UInt32 window_count;
+    UInt64 written;
+    UInt64 sequence;
+    UInt64 captured;
+    UInt64 suppressed;
+    UInt64 failed;
+};
+
+typedef struct slow_log SlowLog;
+
+/* INTERNAL FUNCTIONS */
+
+/* Returns true if captures are switched on (i.e., a capture directory has been configured). */
+#define slow_log_enabled(log) ((log) != NULL && (log)->dir != NULL)
+
+static SlowLog*
+slow_log_create(void) {
+    SlowLog *log = ALLOC(sizeof(SlowLog));
+    if (log == NULL) return NULL;
+
+    memset(log, 0, sizeof(SlowLog));
+    log->threshold = SLOWLOG_DEFAULT_THRESHOLD;
+    log->rate_limit = SLOWLOG_DEFAULT_RATE;
+    log->max_bytes = SLOWLOG_DEFAULT_MAX_BYTES;
+    log->max_total = SLOWLOG_DEFAULT_MAX_TOTAL;
+    if ((log->lock = erl_drv_mutex_create("erlxsl_slow_log")) == NULL) {
+        DRV_FREE(log);
+        return NULL;
+    }
+    return log;
+};
+
+static void
+slow_log_destroy(SlowLog *log) {
+    if (log != NULL) {
+        erl_drv_mutex_destroy(log->lock);
+        DRV_FREE(log->dir);
+        DRV_FREE(log);
+    }
+};
+
+/* Sets the capture directory, taking ownership of the supplied (heap allocated) path. */
+static void
+slow_log_set_dir(SlowLog *log, char *dir) {
+    char *old;
+    erl_drv_mutex_lock(log->lock);
+    old = log->dir;
+    log->dir = dir;
+    erl_drv_mutex_unlock(log->lock);
+    DRV_FREE(old);
+};
+
+/* Decides whether a request is captured, enforcing the rate and size limits.
+   On success, the capture file name is written into path (of path_size bytes). */
+static int
+slow_log_reserve(SlowLog *log, UInt64 elapsed, UInt64 size,
+                 char *path, size_t path_size) {
+    UInt64 now;
+    int reserved = 0;
+
+    if (!slow_log_enabled(log) || elapsed < log->threshold) return 0;
+
+    now = wall_clock_micros();
+    erl_drv_mutex_lock(log->lock);
+    if (log->dir != NULL) {
+        if ((now - log->window_start) >= SLOWLOG_RATE_WINDOW) {
+            log->window_start = now;
+            log->window_count = 0;
+        }
+        if (size > log->max_bytes || log->window_count >= log->rate_limit ||
+            (log->written + size) > log->max_total) {
+            log->suppressed++;
+        } else {
+            log->window_count++;
+            log->written += size;
+            snprintf(path, path_size, "%s/%llu-%p-%llu" CAPTURE_EXTENSION, log->dir,
+                     (unsigned long long)now, (void*)log,
+                     (unsigned long long)log->sequence++);
+            reserved = 1;
+        }
+    }
+    erl_drv_mutex_unlock(log->lock);
+    return reserved;
+};
+
+/* Captures the supplied task if its transform was slow enough (and the limits allow). */
+static void
+slow_log_capture(SlowLog *log, XslTask *task, EngineState state,
+                 UInt64 queue_time, UInt64 transform_time) {
+    char path[FILENAME_MAX];
+    CaptureHeader header;
+    FILE *out;
+    Int64 written = -1;
+    UInt64 size = get_doc_size(task->input_doc) + get_doc_size(task->xslt_doc);
+
+    if (!slow_log_reserve(log, transform_time, size, path, sizeof(path))) return;
+
+    memset(&header, 0, sizeof(CaptureHeader));
+    header.captured_at = wall_clock_micros();
+    header.queue_time = queue_time;
+    header.transform_time = transform_time;
+    header.engine_state = (UInt32)state;
+    header.input_kind = (UInt8)task->input_doc->type;
+    header.xsl_kind = (UInt8)task->xslt_doc->type;
+    header.input_size = get_doc_size(task->input_doc);
+    header.xsl_size = get_doc_size(task->xslt_doc);
+
+    if ((out = fopen(path, "wb")) != NULL) {
+        written = capture_write(out, &header, get_doc_buffer(task->input_doc),
+                                get_doc_buffer(task->xslt_doc), task->parameters);
+        if (fclose(out) != 0) written = -1;
+    }
+
+    erl_drv_mutex_lock(log->lock);
+    if (written < 0) {
+        ERROR("Unable to write capture %s\n", path);
+        log->failed++;
+    } else {
+        log->captured++;
+    }
+    erl_drv_mutex_unlock(log->lock);
+};
+
+/* Encodes the slow log counters as a proplist. The caller must hold the log lock. */
+static void
+slow_log_encode(SlowLog *log, char *buf, int *index) {
+    ei_encode_list_header(buf, index, 5);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "enabled");
+    ei_encode_atom(buf, index, slow_log_enabled(log) ? "true" : "false");
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "captured");
+    ei_encode_ulonglong(buf, index, log->captured);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "suppressed");
+    ei_encode_ulonglong(buf, index, log->suppressed);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "failed");
+    ei_encode_ulonglong(buf, index, log->failed);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "bytes_written");
+    ei_encode_ulonglong(buf, index, log->written);
+    ei_encode_empty_list(buf, index);
+};
+
+#endif /* _ERLXSL_SLOWLOG_H */
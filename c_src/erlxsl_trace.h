@@ -0,0 +1,320 @@
+/*
+ * erlxsl_trace.h
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * This header contains the request tracing used by the linked-in driver. A
+ * request carrying a trace id (see erlxsl_marshall:pack/6) has its lifecycle
+ * timestamps recorded in a RequestTrace. Once the reply has been delivered, the
+ * spans are pushed into a ring buffer, which worker threads periodically flush
+ * to a file in Chrome trace-event (JSON array) format. A port timer flushes any
+ * spans left behind once the port goes quiet, so none wait on the next transform
+ * - handing the flush to a worker, so no file I/O happens on the emulator thread.
+ * Configuring an empty trace file switches tracing off.
+ *
+ * This header is specific to the linked-in driver and *must* be included after
+ * the erlxsl_driver and erlxsl_ei headers.
+ *
+ */
+
+#ifndef _ERLXSL_TRACE_H
+#define _ERLXSL_TRACE_H
+
+#ifdef __linux__
+#include <sys/syscall.h>
+#include <unistd.h>
+#else
+#include <pthread.h>
+#endif
+
+/* INTERNAL DATA & DATA STRUCTURES */
+
+// number of spans buffered between flushes - the oldest are dropped on overflow
+#define TRACE_RING_SIZE 4096
+// default interval between flushes (in microseconds)
+#define TRACE_FLUSH_INTERVAL 1000000
+
+/* A single complete ("ph":"X") trace event. */
+typedef struct {
+    UInt64 trace_id;
+    const char *name;
+    UInt64 start;
+    UInt64 duration;
+    UInt64 tid;
+} TraceEvent;
+
+/* Per port trace log. */
+struct trace_log {
+    /* protects the ring buffer and counters */
+    ErlDrvMutex *lock;
+    /* serialises writers, so that events reach the file in order */
+    ErlDrvMutex *file_lock;
+    FILE *file;
+    /* only requests taking at least this long (in microseconds) are recorded */
+    UInt64 threshold;
+    UInt64 flush_interval;
+    UInt64 last_flush;
+    UInt64 dropped;
+    UInt32 head;
+    UInt32 count;
+    /* set while the port's flush timer is running (emulator thread only) */
+    int timer_set;
+    /* the port's reference, and one for each flush handed to a worker */
+    volatile long refs;
+    TraceEvent events[TRACE_RING_SIZE];
+};
+
+typedef struct trace_log TraceLog;
+
+/* INTERNAL FUNCTIONS */
+
+static UInt64
+current_thread_id(void) {
+#ifdef __linux__
+    return (UInt64)syscall(SYS_gettid);
+#else
+    return (UInt64)(uintptr_t)pthread_self();
+#endif
+};
+
+static TraceLog*
+trace_log_create(void) {
+    TraceLog *log = ALLOC(sizeof(TraceLog));
+    if (log == NULL) return NULL;
+
+    memset(log, 0, sizeof(TraceLog));
+    log->flush_interval = TRACE_FLUSH_INTERVAL;
+    log->refs = 1;
+    log->lock = erl_drv_mutex_create("erlxsl_trace_log");
+    log->file_lock = erl_drv_mutex_create("erlxsl_trace_file");
+    if (log->lock == NULL || log->file_lock == NULL) {
+        if (log->lock != NULL) erl_drv_mutex_destroy(log->lock);
+        if (log->file_lock != NULL) erl_drv_mutex_destroy(log->file_lock);
+        DRV_FREE(log);
+        return NULL;
+    }
+    return log;
+};
+
+/* Returns true if tracing is switched on (i.e., a trace file has been configured). */
+#define trace_enabled(log) ((log) != NULL && (log)->file != NULL)
+
+/* Opens (or switches to) the supplied trace file. Events are appended, so the
+   JSON array is only opened when the file is empty. Trace viewers accept an
+   unterminated array, which lets us keep appending across flushes. An empty
+   path closes the file, switching tracing off. */
+static DriverState
+trace_log_open(TraceLog *log, const char *path) {
+    FILE *file = NULL;
+    if (*path != '\0') {
+        if ((file = fopen(path, "a")) == NULL) {
+            return BadArgumentError;
+        }
+        if (ftell(file) == 0) {
+            fputs("[\n", file);
+        }
+    }
+
+    erl_drv_mutex_lock(log->file_lock);
+    if (log->file != NULL) fclose(log->file);
+    log->file = file;
+    erl_drv_mutex_unlock(log->file_lock);
+    return Success;
+};
+
+static void
+trace_write_event(FILE *file, const TraceEvent *event) {
+    fprintf(file,
+        "{\"name\":\"%s\",\"cat\":\"erlxsl\",\"ph\":\"X\","
+        "\"ts\":%llu,\"dur\":%llu,\"pid\":%lu,\"tid\":%llu,"
+        "\"args\":{\"trace_id\":\"%016llx\"}},\n",
+        event->name,
+        (unsigned long long)event->start,
+        (unsigned long long)event->duration,
+        (unsigned long)getpid(),
+        (unsigned long long)event->tid,
+        (unsigned long long)event->trace_id);
+};
+
+/* Writes all buffered events to the trace file. If another thread is already
+   flushing, this returns immediately. */
+static void
+trace_log_flush(TraceLog *log) {
+    TraceEvent *pending;
+    UInt32 count;
+    UInt32 first;
+    UInt32 i;
+
+    if (!trace_enabled(log)) return;
+    if (erl_drv_mutex_trylock(log->file_lock) != 0) return;
+    if (log->file == NULL) {
+        // switched off since we checked
+        erl_drv_mutex_unlock(log->file_lock);
+        return;
+    }
+
+    erl_drv_mutex_lock(log->lock);
+    count = log->count;
+    first = (log->head + TRACE_RING_SIZE - count) % TRACE_RING_SIZE;
+    pending = (count > 0) ? ALLOC(sizeof(TraceEvent) * count) : NULL;
+    if (pending != NULL) {
+        for (i = 0; i < count; i++) {
+            pending[i] = log->events[(first + i) % TRACE_RING_SIZE];
+        }
+        log->count = 0;
+    }
+    log->last_flush = wall_clock_micros();
+    erl_drv_mutex_unlock(log->lock);
+
+    // the file I/O happens outside of the ring buffer lock
+    if (pending != NULL) {
+        for (i = 0; i < count; i++) {
+            trace_write_event(log->file, &pending[i]);
+        }
+        fflush(log->file);
+        DRV_FREE(pending);
+    }
+    erl_drv_mutex_unlock(log->file_lock);
+};
+
+/* Called from worker threads - flushes the log if the flush interval has passed. */
+static void
+trace_log_maybe_flush(TraceLog *log) {
+    if (trace_enabled(log) && log->count > 0 &&
+        (wall_clock_micros() - log->last_flush) >= log->flush_interval) {
+        trace_log_flush(log);
+    }
+};
+
+/* Called from the emulator thread once spans have been recorded - starts the
+   port's timer, so that they are flushed even if no further transforms run. */
+static void
+trace_log_set_timer(TraceLog *log, ErlDrvPort port) {
+    if (!log->timer_set && trace_enabled(log) && log->count > 0) {
+        driver_set_timer(port, (unsigned long)((log->flush_interval + 999) / 1000));
+        log->timer_set = 1;
+    }
+};
+
+static void
+trace_log_cancel_timer(TraceLog *log, ErlDrvPort port) {
+    if (log->timer_set) {
+        driver_cancel_timer(port);
+        log->timer_set = 0;
+    }
+};
+
+/* Drops a reference to the log, flushing and freeing it with the last. */
+static void
+trace_log_destroy(TraceLog *log) {
+    if (log != NULL && __sync_sub_and_fetch(&log->refs, 1) == 0) {
+        trace_log_flush(log);
+        if (log->file != NULL) fclose(log->file);
+        erl_drv_mutex_destroy(log->lock);
+        erl_drv_mutex_destroy(log->file_lock);
+        DRV_FREE(log);
+    }
+};
+
+/* Runs on a worker, flushing the log on behalf of the port's timer (see
+   trace_log_flush_async) - the port may have been closed in the meantime. */
+static void
+trace_log_flush_job(void *data) {
+    TraceLog *log = (TraceLog*)data;
+    trace_log_flush(log);
+    trace_log_destroy(log);
+};
+
+/* Called from the emulator thread when the port's timer fires - hands the flush
+   to a worker, holding a reference to the log until it has run. The driver's
+   ready_async must ignore the job, which is known by its data being the log. */
+static void
+trace_log_flush_async(TraceLog *log, ErlDrvPort port) {
+    log->timer_set = 0;
+    if (trace_enabled(log) && log->count > 0) {
+        __sync_add_and_fetch(&log->refs, 1);
+        driver_async(port, NULL, trace_log_flush_job, log, NULL);
+    }
+};
+
+static void
+trace_push(TraceLog *log, UInt64 trace_id, const char *name,
+           UInt64 start, UInt64 end, UInt64 tid) {
+    TraceEvent *event;
+    // missing timestamps (e.g., no submit time from erlang) mean no span
+    if (start == 0 || end < start) return;
+
+    event = &log->events[log->head];
+    event->trace_id = trace_id;
+    event->name = name;
+    event->start = start;
+    event->duration = end - start;
+    event->tid = tid;
+    log->head = (log->head + 1) % TRACE_RING_SIZE;
+    if (log->count < TRACE_RING_SIZE) {
+        log->count++;
+    } else {
+        log->dropped++;
+    }
+};
+
+/* Records the spans for a completed request, provided it was slow enough. */
+static void
+trace_record(TraceLog *log, const RequestTrace *trace, UInt64 replied) {
+    UInt64 begin = (trace->submitted > 0) ? trace->submitted : trace->received;
+    if (!trace_enabled(log) || (replied - begin) < log->threshold) return;
+
+    erl_drv_mutex_lock(log->lock);
+    trace_push(log, trace->trace_id, "submit", trace->submitted,
+               trace->received, 0);
+    trace_push(log, trace->trace_id, "receive", trace->received,
+               trace->queued, trace->scheduler_tid);
+    trace_push(log, trace->trace_id, "queue", trace->queued,
+               trace->started, trace->worker_tid);
+    trace_push(log, trace->trace_id, "transform", trace->started,
+               trace->finished, trace->worker_tid);
+    trace_push(log, trace->trace_id, "complete", trace->finished,
+               trace->delivering, trace->worker_tid);
+    trace_push(log, trace->trace_id, "reply", trace->delivering,
+               replied, trace->scheduler_tid);
+    erl_drv_mutex_unlock(log->lock);
+};
+
+/* Encodes the trace counters as a proplist. The caller must hold the log lock. */
+static void
+trace_log_encode(TraceLog *log, char *buf, int *index) {
+    ei_encode_list_header(buf, index, 3);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "enabled");
+    ei_encode_atom(buf, index, trace_enabled(log) ? "true" : "false");
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "buffered");
+    ei_encode_ulong(buf, index, log->count);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "dropped");
+    ei_encode_ulonglong(buf, index, log->dropped);
+    ei_encode_empty_list(buf, index);
+};
+
+#endif /* _ERLXSL_TRACE_H */
@@ -0,0 +1,294 @@
+/*
+ * erlxsl_traffic.h
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * This header contains the traffic log used by the linked-in driver. When a
+ * traffic file is configured, every transform is recorded to it (in the format
+ * defined by erlxsl_capture.h) with its arrival time, timings and the hashes
+ * and sizes of its documents and parameters. Each distinct document is written
+ * at most once, and only a configurable fraction of previously unseen
+ * documents are kept, so the log stays compact under realistic load. The log
+ * can be replayed with erlxsl_bench (in c_src/tools) or bin/erlxsl_bench.
+ *
+ * Records are written by the worker thread which ran the transform. Which
+ * bodies to write, and the space they take, are decided under the log lock,
+ * whilst the writing itself is serialized by a lock of its own - the stats
+ * call takes the former on the emulator thread, so must never wait on a write.
+ *
+ * This header is specific to the linked-in driver and *must* be included after
+ * the erlxsl_driver and erlxsl_ei headers.
+ *
+ */
+
+#ifndef _ERLXSL_TRAFFIC_H
+#define _ERLXSL_TRAFFIC_H
+
+#include "erlxsl_capture.h"
+
+/* INTERNAL DATA & DATA STRUCTURES */
+
+// must be a power of two - once full, no further bodies are written
+#define TRAFFIC_SEEN_SLOTS 8192
+#define TRAFFIC_DEFAULT_MAX_TOTAL (256 * 1024 * 1024)
+
+struct traffic_log {
+    /* guards the counters, the seen set and the choice of file */
+    ErlDrvMutex *lock;
+    /* held whilst writing a record, so records from different workers don't interleave */
+    ErlDrvMutex *write_lock;
+    /* the log file, or NULL when the traffic log is switched off - only changed
+       with both locks held */
+    FILE *file;
+    /* counts the files opened, so a writer can tell its file has been replaced */
+    UInt32 generation;
+    /* monotonic time at which the log was opened, from which offsets are taken */
+    UInt64 started;
+    /* a previously unseen body is written when a random number falls below this */
+    UInt32 body_threshold;
+    /* state for the xorshift generator used to make sampling decisions */
+    UInt32 seed;
+    /* once this many bytes have been written, further requests are dropped */
+    UInt64 max_total;
+    UInt64 written;
+    UInt64 recorded;
+    UInt64 bodies;
+    UInt64 dropped;
+    UInt64 failed;
+    /* open addressed set of the hashes for which bodies have been written */
+    UInt32 seen_count;
+    UInt64 seen[TRAFFIC_SEEN_SLOTS];
+};
+
+typedef struct traffic_log TrafficLog;
+
+/* INTERNAL FUNCTIONS */
+
+/* Returns true if the traffic log is switched on (i.e., a file has been configured). */
+#define traffic_log_enabled(log) ((log) != NULL && (log)->file != NULL)
+
+static TrafficLog*
+traffic_log_create(void) {
+    TrafficLog *log = ALLOC(sizeof(TrafficLog));
+    if (log == NULL) return NULL;
+
+    memset(log, 0, sizeof(TrafficLog));
+    log->body_threshold = UINT32_MAX;
+    log->seed = 2463534242U;
+    log->max_total = TRAFFIC_DEFAULT_MAX_TOTAL;
+    if ((log->lock = erl_drv_mutex_create("erlxsl_traffic_log")) == NULL) {
+        DRV_FREE(log);
+        return NULL;
+    }
+    if ((log->write_lock = erl_drv_mutex_create("erlxsl_traffic_log_write")) == NULL) {
+        erl_drv_mutex_destroy(log->lock);
+        DRV_FREE(log);
+        return NULL;
+    }
+    return log;
+};
+
+static void
+traffic_log_destroy(TrafficLog *log) {
+    if (log != NULL) {
+        erl_drv_mutex_destroy(log->write_lock);
+        erl_drv_mutex_destroy(log->lock);
+        if (log->file != NULL) fclose(log->file);
+        DRV_FREE(log);
+    }
+};
+
+/* Starts a new traffic log at path, replacing any open log. An empty path switches the log off. */
+static DriverState
+traffic_log_open(TrafficLog *log, const char *path) {
+    FILE *file = NULL;
+    FILE *old;
+
+    if (*path != '\0') {
+        if ((file = fopen(path, "wb")) == NULL) return BadArgumentError;
+        if (traffic_write_header(file, wall_clock_micros()) < 0) {
+            fclose(file);
+            return BadArgumentError;
+        }
+    }
+
+    // once we have the write lock, nobody is writing to the old file
+    erl_drv_mutex_lock(log->write_lock);
+    erl_drv_mutex_lock(log->lock);
+    old = log->file;
+    log->file = file;
+    log->generation++;
+    log->started = monotonic_micros();
+    log->written = sizeof(TrafficHeader);
+    log->seen_count = 0;
+    memset(log->seen, 0, sizeof(log->seen));
+    erl_drv_mutex_unlock(log->lock);
+    erl_drv_mutex_unlock(log->write_lock);
+
+    if (old != NULL) fclose(old);
+    return Success;
+};
+
+/* Sets the fraction (0.0 - 1.0) of previously unseen bodies to write. */
+static DriverState
+traffic_log_set_body_rate(TrafficLog *log, double rate) {
+    if (rate < 0.0 || rate > 1.0) {
+        return BadArgumentError;
+    }
+    log->body_threshold = (UInt32)(rate * (double)UINT32_MAX);
+    return Success;
+};
+
+/* Decides whether to write the body with the supplied hash. The caller must hold the log lock. */
+static int
+traffic_want_body(TrafficLog *log, UInt64 hash) {
+    UInt32 slot;
+    UInt32 x;
+
+    if (hash == 0) return 0;  // zero marks an empty slot
+    for (slot = (UInt32)hash & (TRAFFIC_SEEN_SLOTS - 1);
+         log->seen[slot] != 0;
+         slot = (slot + 1) & (TRAFFIC_SEEN_SLOTS - 1)) {
+        if (log->seen[slot] == hash) return 0;
+    }
+    // keep the table at most three quarters full, so probes stay short
+    if (log->seen_count >= (TRAFFIC_SEEN_SLOTS / 4) * 3) return 0;
+
+    x = log->seed;
+    x ^= x << 13;
+    x ^= x >> 17;
+    x ^= x << 5;
+    log->seed = x;
+    if (x > log->body_threshold) return 0;
+
+    log->seen[slot] = hash;
+    log->seen_count++;
+    return 1;
+};
+
+/* Decides whether to write a body, reserving the space it takes.
+   The caller must hold the log lock. */
+static int
+traffic_reserve_body(TrafficLog *log, UInt64 hash, UInt32 size) {
+    if (!traffic_want_body(log, hash)) return 0;
+    log->bodies++;
+    log->written += sizeof(TrafficBody) + size;
+    return 1;
+};
+
+/* Records a completed transform. enqueued, started and finished are monotonic timestamps. */
+static void
+traffic_log_record(TrafficLog *log, XslTask *task, EngineState state,
+                   UInt64 enqueued, UInt64 started, UInt64 finished) {
+    TrafficRequest request;
+    char *params;
+    const char *input = get_doc_buffer(task->input_doc);
+    const char *xsl = get_doc_buffer(task->xslt_doc);
+    FILE *file = NULL;
+    UInt32 generation = 0;
+    int input_body = 0, xsl_body = 0, params_body = 0;
+    int failed = 0;
+
+    if (!traffic_log_enabled(log)) return;
+
+    memset(&request, 0, sizeof(TrafficRequest));
+    params = traffic_describe_task(&request, task);
+    request.engine_state = (UInt32)state;
+    request.queue_time = (UInt32)(started - enqueued);
+    request.transform_time = (UInt32)(finished - started);
+
+    erl_drv_mutex_lock(log->lock);
+    if (log->file == NULL) {
+        // switched off since we checked
+    } else if (log->written >= log->max_total) {
+        log->dropped++;
+    } else {
+        file = log->file;
+        generation = log->generation;
+        request.offset = (enqueued > log->started) ? enqueued - log->started : 0;
+        input_body = traffic_reserve_body(log, request.input_hash, request.input_size);
+        xsl_body = traffic_reserve_body(log, request.xsl_hash, request.xsl_size);
+        params_body = params != NULL &&
+                      traffic_reserve_body(log, request.params_hash, request.params_size);
+        log->written += sizeof(TrafficRequest);
+    }
+    erl_drv_mutex_unlock(log->lock);
+
+    if (file == NULL) {
+        DRV_FREE(params);
+        return;
+    }
+    erl_drv_mutex_lock(log->write_lock);
+    // the log may have been switched to another file (or off) in the meantime
+    if (log->generation == generation) {
+        failed = (input_body && traffic_write_body(file, TrafficInput, request.input_hash,
+                                                   input, request.input_size) < 0) ||
+                 (xsl_body && traffic_write_body(file, TrafficStylesheet, request.xsl_hash,
+                                                 xsl, request.xsl_size) < 0) ||
+                 (params_body && traffic_write_body(file, TrafficParameters, request.params_hash,
+                                                    params, request.params_size) < 0) ||
+                 traffic_write_request(file, &request) < 0;
+    } else {
+        file = NULL;
+    }
+    erl_drv_mutex_unlock(log->write_lock);
+    DRV_FREE(params);
+
+    if (file != NULL) {
+        erl_drv_mutex_lock(log->lock);
+        if (failed) {
+            log->failed++;
+        } else {
+            log->recorded++;
+        }
+        erl_drv_mutex_unlock(log->lock);
+    }
+};
+
+/* Encodes the traffic log counters as a proplist. The caller must hold the log lock. */
+static void
+traffic_log_encode(TrafficLog *log, char *buf, int *index) {
+    ei_encode_list_header(buf, index, 6);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "enabled");
+    ei_encode_atom(buf, index, traffic_log_enabled(log) ? "true" : "false");
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "recorded");
+    ei_encode_ulonglong(buf, index, log->recorded);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "bodies");
+    ei_encode_ulonglong(buf, index, log->bodies);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "dropped");
+    ei_encode_ulonglong(buf, index, log->dropped);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "failed");
+    ei_encode_ulonglong(buf, index, log->failed);
+    ei_encode_tuple_header(buf, index, 2);
+    ei_encode_atom(buf, index, "bytes_written");
+    ei_encode_ulonglong(buf, index, log->written);
+    ei_encode_empty_list(buf, index);
+};
+
+#endif /* _ERLXSL_TRAFFIC_H */
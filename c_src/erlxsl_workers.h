@@ -0,0 +1,285 @@
+/*
+ * erlxsl_workers.h
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * This header contains the per-worker engine contexts used by the linked-in
+ * driver. Engines which provide a thread_init hook get a context of their own
+ * on every async thread which runs one of their transforms. The context is
+ * created lazily, the first time a thread runs a transform, and is found again
+ * via thread specific data - so the lookup on the transform path is lock free.
+ * All contexts are also kept on a list, so that thread_shutdown can be called
+ * for each of them when the engine is unloaded.
+ *
+ * A single key, created when the driver is loaded, holds each thread's map of
+ * the pools it has contexts for. Entries are matched on the pool's generation
+ * as well as its address, so a thread never mistakes the freed context of an
+ * unloaded engine for one belonging to a pool which later reuses the address.
+ * The key is never destroyed, as the async threads can't be made to clear
+ * their values first - the maps themselves are freed with the driver.
+ *
+ * This header is specific to the linked-in driver and *must* be included after
+ * the erlxsl_driver and erlxsl_ei headers.
+ *
+ */
+
+#ifndef _ERLXSL_WORKERS_H
+#define _ERLXSL_WORKERS_H
+
+/* INTERNAL DATA & DATA STRUCTURES */
+
+// the initial number of pools a thread's map has room for
+#define WORKER_MAP_SIZE 8
+
+typedef struct worker_context {
+    void *context;
+    struct worker_context *next;
+} WorkerContext;
+
+struct worker_pool {
+    /* distinguishes the pool from any earlier one at the same address */
+    UInt64 generation;
+    /* guards the list of contexts (but not their use) */
+    ErlDrvMutex *lock;
+    WorkerContext *contexts;
+    UInt32 count;
+    /* number of failed thread_init calls */
+    UInt64 failed;
+    /* the next pool not yet destroyed */
+    struct worker_pool *next_live;
+};
+
+typedef struct worker_pool WorkerPool;
+
+typedef struct {
+    WorkerPool *pool;
+    UInt64 generation;
+    WorkerContext *ctx;
+} WorkerMapEntry;
+
+/* A thread's contexts, one for each pool it has run transforms for. */
+typedef struct worker_map {
+    WorkerMapEntry *entries;
+    UInt32 size;
+    /* the next thread's map */
+    struct worker_map *next;
+} WorkerMap;
+
+static ErlDrvTSDKey worker_tsd_key;
+/* guards the pool and map lists below, and pool generations */
+static ErlDrvMutex *worker_lock = NULL;
+static WorkerPool *live_pools = NULL;
+static WorkerMap *worker_maps = NULL;
+static UInt64 last_generation = 0;
+
+/* INTERNAL FUNCTIONS */
+
+/* Creates the thread specific data key - called once when the driver is loaded. */
+static int
+worker_init(void) {
+    if ((worker_lock = erl_drv_mutex_create("erlxsl_workers")) == NULL) {
+        return -1;
+    }
+    return erl_drv_tsd_key_create("erlxsl_worker_contexts", &worker_tsd_key);
+};
+
+/* Frees every thread's map - called when the driver is unloaded, by which
+   time every pool has been destroyed. */
+static void
+worker_finish(void) {
+    WorkerMap *map;
+    while ((map = worker_maps) != NULL) {
+        worker_maps = map->next;
+        DRV_FREE(map->entries);
+        DRV_FREE(map);
+    }
+    if (worker_lock != NULL) {
+        erl_drv_mutex_destroy(worker_lock);
+        worker_lock = NULL;
+    }
+};
+
+static WorkerPool*
+worker_pool_create(void) {
+    WorkerPool *pool = ALLOC(sizeof(WorkerPool));
+    if (pool == NULL) return NULL;
+
+    memset(pool, 0, sizeof(WorkerPool));
+    if ((pool->lock = erl_drv_mutex_create("erlxsl_worker_pool")) == NULL) {
+        DRV_FREE(pool);
+        return NULL;
+    }
+    erl_drv_mutex_lock(worker_lock);
+    pool->generation = ++last_generation;
+    pool->next_live = live_pools;
+    live_pools = pool;
+    erl_drv_mutex_unlock(worker_lock);
+    return pool;
+};
+
+/* Calls thread_shutdown for every context the engine created, then frees the pool. */
+static void
+worker_pool_destroy(WorkerPool *pool, XslEngineV2 *engine) {
+    WorkerContext *ctx;
+    WorkerPool **link;
+    if (pool == NULL) return;
+
+    // threads' entries for the pool are dead from here on (see worker_map_add)
+    erl_drv_mutex_lock(worker_lock);
+    for (link = &live_pools; *link != NULL; link = &(*link)->next_live) {
+        if (*link == pool) {
+            *link = pool->next_live;
+            break;
+        }
+    }
+    erl_drv_mutex_unlock(worker_lock);
+
+    while ((ctx = pool->contexts) != NULL) {
+        pool->contexts = ctx->next;
+        if (engine->thread_shutdown != NULL) {
+            engine->thread_shutdown(engine->providerData, ctx->context);
+        }
+        DRV_FREE(ctx);
+    }
+    erl_drv_mutex_destroy(pool->lock);
+    DRV_FREE(pool);
+};
+
+/* Evaluates to true if a map entry belongs to a pool which has not been destroyed.
+   Called with worker_lock held. */
+static int
+worker_entry_live(WorkerMapEntry *entry) {
+    WorkerPool *pool;
+    if (entry->pool == NULL) return 0;
+    for (pool = live_pools; pool != NULL; pool = pool->next_live) {
+        if (pool == entry->pool && pool->generation == entry->generation) return 1;
+    }
+    return 0;
+};
+
+/* Records a new context in the calling thread's map, reusing the entry of a
+   destroyed pool if there is one. Returns zero if the map could not grow. */
+static int
+worker_map_add(WorkerPool *pool, WorkerContext *ctx) {
+    WorkerMap *map = (WorkerMap*)erl_drv_tsd_get(worker_tsd_key);
+    WorkerMapEntry *entries;
+    UInt32 i;
+    int added = 0;
+
+    erl_drv_mutex_lock(worker_lock);
+    if (map == NULL) {
+        if ((map = ALLOC(sizeof(WorkerMap))) == NULL ||
+            (map->entries = ALLOC(sizeof(WorkerMapEntry) * WORKER_MAP_SIZE)) == NULL) {
+            DRV_FREE(map);
+            erl_drv_mutex_unlock(worker_lock);
+            return 0;
+        }
+        memset(map->entries, 0, sizeof(WorkerMapEntry) * WORKER_MAP_SIZE);
+        map->size = WORKER_MAP_SIZE;
+        map->next = worker_maps;
+        worker_maps = map;
+        erl_drv_tsd_set(worker_tsd_key, map);
+    }
+    for (i = 0; i < map->size; i++) {
+        if (!worker_entry_live(&map->entries[i])) break;
+    }
+    if (i == map->size &&
+        (entries = REALLOC(map->entries, sizeof(WorkerMapEntry) * map->size * 2)) != NULL) {
+        memset(entries + map->size, 0, sizeof(WorkerMapEntry) * map->size);
+        map->entries = entries;
+        map->size *= 2;
+    }
+    if (i < map->size) {
+        map->entries[i].pool = pool;
+        map->entries[i].generation = pool->generation;
+        map->entries[i].ctx = ctx;
+        added = 1;
+    }
+    erl_drv_mutex_unlock(worker_lock);
+    return added;
+};
+
+/*
+ * Gets the calling thread's engine context, creating it on first use. Returns
+ * Ok and sets *context (to NULL if the engine keeps no per-worker state), or
+ * the state thread_init failed with.
+ */
+static EngineState
+worker_pool_context(WorkerPool *pool, XslEngineV2 *engine, void **context) {
+    WorkerMap *map;
+    WorkerContext *ctx;
+    EngineState state;
+    UInt32 i;
+
+    *context = NULL;
+    if (pool == NULL) return Ok;
+    if ((map = (WorkerMap*)erl_drv_tsd_get(worker_tsd_key)) != NULL) {
+        for (i = 0; i < map->size; i++) {
+            if (map->entries[i].pool == pool && map->entries[i].generation == pool->generation) {
+                *context = map->entries[i].ctx->context;
+                return Ok;
+            }
+        }
+    }
+
+    if ((ctx = ALLOC(sizeof(WorkerContext))) == NULL) return OutOfMemoryError;
+    ctx->context = NULL;
+    if ((state = engine->thread_init(engine->providerData, &ctx->context)) != Ok) {
+        DRV_FREE(ctx);
+        erl_drv_mutex_lock(pool->lock);
+        pool->failed++;
+        erl_drv_mutex_unlock(pool->lock);
+        return state;
+    }
+
+    erl_drv_mutex_lock(pool->lock);
+    ctx->next = pool->contexts;
+    pool->contexts = ctx;
+    pool->count++;
+    erl_drv_mutex_unlock(pool->lock);
+
+    // the context is still shut down with the pool, even if the thread can't find it again
+    if (!worker_map_add(pool, ctx)) {
+        return OutOfMemoryError;
+    }
+    DBG("created engine context %p for worker %llu\n", ctx->context,
+        (unsigned long long)current_thread_id());
+    *context = ctx->context;
+    return Ok;
+};
+
+/* Reads the number of worker contexts, and of failed thread_init calls. */
+static void
+worker_pool_snapshot(WorkerPool *pool, UInt32 *count, UInt64 *failed) {
+    *count = 0;
+    *failed = 0;
+    if (pool != NULL) {
+        erl_drv_mutex_lock(pool->lock);
+        *count = pool->count;
+        *failed = pool->failed;
+        erl_drv_mutex_unlock(pool->lock);
+    }
+};
+
+#endif /* _ERLXSL_WORKERS_H */
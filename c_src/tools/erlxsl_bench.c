@@ -0,0 +1,468 @@
+/*
+ * erlxsl_bench.c
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * Replays a traffic log written by the driver (see the traffic_file setting)
+ * against any engine provider library (ABI v1 or v2), and reports throughput and latency
+ * percentiles. Usage:
+ *
+ *   erlxsl_bench [-m original|scaled|max] [-s factor] [-n passes] [-b size]
+ *                engine.so traffic.xtrf
+ *
+ * In original mode, requests are issued at the times they originally arrived;
+ * scaled mode divides those inter-arrival times by the supplied factor, and max
+ * mode issues each request as soon as the previous one completes. For paced
+ * replays, latency is measured from the time a request was due rather than the
+ * time it was issued, so a slow engine cannot hide queueing delay.
+ *
+ * With -b, requests are handed to the engine in batches of up to 'size' (see
+ * XslEngineV2.transform_batch), or run one at a time in a loop for engines
+ * that can't batch. A batch is issued once its last request is due, and the
+ * latency of each request still counts from the time it was due.
+ *
+ * Requests whose documents were not kept in the log are skipped and reported
+ * as unresolved.
+ *
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "erlxsl_port.h"
+#include "erlxsl_capture.h"
+
+/* the engine's context for our (single) worker thread, see XslEngineV2.thread_init */
+static void *worker_context = NULL;
+
+typedef enum {
+    ReplayMax,
+    ReplayOriginal,
+    ReplayScaled
+} ReplayMode;
+
+typedef struct {
+    UInt64 hash;
+    UInt32 size;
+    char *buffer;
+} Body;
+
+/* Requests waiting to be run as a batch. */
+typedef struct {
+    Command **commands;
+    EngineState *states;
+    UInt64 *due;
+    UInt64 *captured;
+    size_t count;
+    size_t size;
+} Batch;
+
+typedef struct {
+    Body *bodies;
+    size_t body_count;
+    TrafficRequest *requests;
+    size_t request_count;
+} TrafficLog;
+
+static UInt64
+now_micros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((UInt64)ts.tv_sec * 1000000) + ((UInt64)ts.tv_nsec / 1000);
+};
+
+static void
+sleep_until(UInt64 when) {
+    struct timespec ts;
+    UInt64 now = now_micros();
+    if (when > now) {
+        ts.tv_sec = (time_t)((when - now) / 1000000);
+        ts.tv_nsec = (long)(((when - now) % 1000000) * 1000);
+        nanosleep(&ts, NULL);
+    }
+};
+
+static char*
+copy_buffer(const char *buffer, UInt64 size) {
+    char *copy = ALLOC(size + 1);
+    if (copy != NULL) {
+        memcpy(copy, buffer, size);
+        copy[size] = '\0';
+    }
+    return copy;
+};
+
+static int
+compare_times(const void *a, const void *b) {
+    UInt64 x = *(const UInt64*)a;
+    UInt64 y = *(const UInt64*)b;
+    return (x > y) - (x < y);
+};
+
+static int
+compare_bodies(const void *a, const void *b) {
+    UInt64 x = ((const Body*)a)->hash;
+    UInt64 y = ((const Body*)b)->hash;
+    return (x > y) - (x < y);
+};
+
+static int
+compare_arrivals(const void *a, const void *b) {
+    UInt64 x = ((const TrafficRequest*)a)->offset;
+    UInt64 y = ((const TrafficRequest*)b)->offset;
+    return (x > y) - (x < y);
+};
+
+static void*
+grow(void *items, size_t count, size_t *capacity, size_t item_size) {
+    void *resized;
+    if (count < *capacity) return items;
+    *capacity = (*capacity == 0) ? 256 : *capacity * 2;
+    if ((resized = realloc(items, *capacity * item_size)) == NULL) {
+        free(items);
+    }
+    return resized;
+};
+
+/* Reads an entire traffic log into memory, with the bodies sorted by hash and requests by arrival. */
+static int
+load_log(const char *path, TrafficLog *log) {
+    TrafficHeader header;
+    TrafficRecord record;
+    size_t body_capacity = 0;
+    size_t request_capacity = 0;
+    char *body;
+    FILE *in;
+    int result;
+
+    memset(log, 0, sizeof(TrafficLog));
+    if ((in = fopen(path, "rb")) == NULL) {
+        ERROR("%s: unable to open traffic log\n", path);
+        return 0;
+    }
+    if (traffic_read_header(in, &header) != Success) {
+        ERROR("%s: not a valid traffic log\n", path);
+        fclose(in);
+        return 0;
+    }
+
+    while ((result = traffic_read_record(in, &record, &body)) > 0) {
+        if (record.type == TrafficBodyRecord) {
+            if ((log->bodies = grow(log->bodies, log->body_count,
+                                    &body_capacity, sizeof(Body))) == NULL) break;
+            log->bodies[log->body_count].hash = record.body.hash;
+            log->bodies[log->body_count].size = record.body.size;
+            log->bodies[log->body_count].buffer = body;
+            log->body_count++;
+        } else {
+            if ((log->requests = grow(log->requests, log->request_count,
+                                      &request_capacity, sizeof(TrafficRequest))) == NULL) break;
+            log->requests[log->request_count++] = record.request;
+        }
+    }
+    fclose(in);
+
+    if (result < 0) {
+        // a log cut short (e.g., by a crash) is still worth replaying
+        ERROR("%s: truncated after %lu requests\n", path, (unsigned long)log->request_count);
+    }
+    if ((log->body_count > 0 && log->bodies == NULL) ||
+        (log->request_count > 0 && log->requests == NULL)) {
+        ERROR("%s: out of memory\n", path);
+        return 0;
+    }
+
+    qsort(log->bodies, log->body_count, sizeof(Body), compare_bodies);
+    qsort(log->requests, log->request_count, sizeof(TrafficRequest), compare_arrivals);
+    return 1;
+};
+
+static void
+free_log(TrafficLog *log) {
+    size_t i;
+    for (i = 0; i < log->body_count; i++) {
+        DRV_FREE(log->bodies[i].buffer);
+    }
+    free(log->bodies);
+    free(log->requests);
+};
+
+static Body*
+find_body(TrafficLog *log, UInt64 hash) {
+    Body key;
+    key.hash = hash;
+    return bsearch(&key, log->bodies, log->body_count, sizeof(Body), compare_bodies);
+};
+
+/* Builds the command for a single transform of the supplied request, or returns NULL. */
+static Command*
+make_command(TrafficRequest *request, Body *input, Body *stylesheet, Body *params) {
+    PayloadSize hsize;
+    InputSpec hspec;
+    XslTask *task;
+    Command *cmd;
+
+    hsize.input_size = input->size;
+    hsize.xsl_size = stylesheet->size;
+    hspec.input_kind = request->input_kind;
+    hspec.xsl_kind = request->xsl_kind;
+    hspec.param_grp_arity = request->param_count;
+    hspec.flags = 0;
+    hspec.borrowed = 0;
+
+    if ((task = ALLOC(sizeof(XslTask))) == NULL) return NULL;
+    if (init_task(task, &hsize, &hspec,
+            copy_buffer(input->buffer, input->size),
+            copy_buffer(stylesheet->buffer, stylesheet->size)) != Success) {
+        free_task(task);
+        DRV_FREE(task);
+        return NULL;
+    }
+    if (params != NULL) {
+        task->parameters = traffic_decode_params(params->buffer, params->size);
+    }
+    if ((cmd = init_command("transform", NULL, task, NULL)) == NULL) {
+        free_task(task);
+        DRV_FREE(task);
+        return NULL;
+    }
+    cmd->worker_context = worker_context;
+    return cmd;
+};
+
+static void
+release_command(XslEngineV2 *engine, Command *cmd) {
+    XslTask *task = cmd->command_data.xsl_task;
+    engine->after_transform(cmd);
+    free_command(cmd);
+    DRV_FREE(task);
+};
+
+static void
+report_latency(const char *name, UInt64 *times, size_t count) {
+    if (count == 0) return;
+    qsort(times, count, sizeof(UInt64), compare_times);
+    INFO("%s_us: p50=%llu p90=%llu p99=%llu p999=%llu max=%llu\n", name,
+         (unsigned long long)times[count / 2],
+         (unsigned long long)times[(count * 90) / 100],
+         (unsigned long long)times[(count * 99) / 100],
+         (unsigned long long)times[(count * 999) / 1000],
+         (unsigned long long)times[count - 1]);
+};
+
+/* Runs the batched requests, once the last of them is due, and records their latencies. */
+static void
+run_batch(XslEngineV2 *engine, Batch *batch, ReplayMode mode, UInt64 *latencies,
+          UInt64 *captured, size_t *completed, size_t *failed) {
+    size_t i;
+
+    if (batch->count == 0) return;
+    if (mode == ReplayMax) {
+        for (i = 0; i < batch->count; i++) {
+            batch->due[i] = now_micros();
+        }
+    } else {
+        sleep_until(batch->due[batch->count - 1]);
+    }
+    run_transform_batch(engine, batch->commands, batch->states, batch->count);
+
+    for (i = 0; i < batch->count; i++) {
+        if (batch->states[i] != Ok) {
+            (*failed)++;
+        } else {
+            latencies[*completed] = now_micros() - batch->due[i];
+            captured[*completed] = batch->captured[i];
+            (*completed)++;
+        }
+        release_command(engine, batch->commands[i]);
+    }
+    batch->count = 0;
+};
+
+static int
+replay_log(XslEngineV2 *engine, TrafficLog *log, ReplayMode mode,
+           double scale, int passes, size_t batch_size) {
+    UInt64 *latencies;
+    UInt64 *captured;
+    UInt64 started;
+    UInt64 base;
+    UInt64 elapsed;
+    size_t completed = 0;
+    size_t unresolved = 0;
+    size_t failed = 0;
+    size_t i;
+    int pass;
+    Batch batch;
+    TrafficRequest *request;
+    Body *input;
+    Body *stylesheet;
+    Body *params;
+    Command *cmd;
+
+    latencies = ALLOC(sizeof(UInt64) * (log->request_count * passes + 1));
+    captured = ALLOC(sizeof(UInt64) * (log->request_count * passes + 1));
+    batch.commands = ALLOC(sizeof(Command*) * batch_size);
+    batch.states = ALLOC(sizeof(EngineState) * batch_size);
+    batch.due = ALLOC(sizeof(UInt64) * batch_size);
+    batch.captured = ALLOC(sizeof(UInt64) * batch_size);
+    batch.count = 0;
+    batch.size = batch_size;
+    if (latencies == NULL || captured == NULL || batch.commands == NULL ||
+        batch.states == NULL || batch.due == NULL || batch.captured == NULL) {
+        ERROR("out of memory\n");
+        return 1;
+    }
+
+    started = now_micros();
+    for (pass = 0; pass < passes; pass++) {
+        base = now_micros();
+        for (i = 0; i < log->request_count; i++) {
+            request = &log->requests[i];
+            input = find_body(log, request->input_hash);
+            stylesheet = find_body(log, request->xsl_hash);
+            params = (request->params_hash == 0) ? NULL : find_body(log, request->params_hash);
+            if (input == NULL || stylesheet == NULL ||
+                (request->params_hash != 0 && params == NULL)) {
+                unresolved++;
+                continue;
+            }
+            if ((cmd = make_command(request, input, stylesheet, params)) == NULL) {
+                failed++;
+                continue;
+            }
+
+            batch.commands[batch.count] = cmd;
+            batch.due[batch.count] = base + (UInt64)((double)request->offset / scale);
+            batch.captured[batch.count] = request->transform_time;
+            if (++batch.count == batch.size) {
+                run_batch(engine, &batch, mode, latencies, captured, &completed, &failed);
+            }
+        }
+        run_batch(engine, &batch, mode, latencies, captured, &completed, &failed);
+    }
+    elapsed = now_micros() - started;
+
+    INFO("requests: %lu\n", (unsigned long)(log->request_count * passes));
+    INFO("completed: %lu\n", (unsigned long)completed);
+    INFO("unresolved: %lu\n", (unsigned long)unresolved);
+    INFO("failed: %lu\n", (unsigned long)failed);
+    INFO("batch_size: %lu\n", (unsigned long)batch_size);
+    INFO("elapsed_us: %llu\n", (unsigned long long)elapsed);
+    INFO("throughput_rps: %.1f\n",
+         (elapsed == 0) ? 0.0 : ((double)completed * 1000000.0) / (double)elapsed);
+    report_latency("latency", latencies, completed);
+    report_latency("captured_transform", captured, completed);
+
+    DRV_FREE(latencies);
+    DRV_FREE(captured);
+    DRV_FREE(batch.commands);
+    DRV_FREE(batch.states);
+    DRV_FREE(batch.due);
+    DRV_FREE(batch.captured);
+    return (failed == 0) ? 0 : 1;
+};
+
+static void
+usage(const char *name) {
+    ERROR("usage: %s [-m original|scaled|max] [-s factor] [-n passes] [-b size] "
+          "engine.so traffic.xtrf\n", name);
+};
+
+static void
+shutdown_engine(XslEngineV2 *engine) {
+    if (engine->thread_init != NULL && engine->thread_shutdown != NULL) {
+        engine->thread_shutdown(engine->providerData, worker_context);
+    }
+    engine->shutdown(shutdown_state(engine, NULL));
+};
+
+int
+main(int argc, char **argv) {
+    DriverHandle driver;
+    XslEngineV2 *engine;
+    TrafficLog log;
+    ReplayMode mode = ReplayMax;
+    double scale = 1.0;
+    int passes = 1;
+    int batch_size = 1;
+    int result;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "m:s:n:b:")) != -1) {
+        switch (opt) {
+        case 'm':
+            if (strcmp(optarg, "original") == 0) {
+                mode = ReplayOriginal;
+            } else if (strcmp(optarg, "scaled") == 0) {
+                mode = ReplayScaled;
+            } else if (strcmp(optarg, "max") == 0) {
+                mode = ReplayMax;
+            } else {
+                usage(argv[0]);
+                return 2;
+            }
+            break;
+        case 's':
+            scale = atof(optarg);
+            break;
+        case 'n':
+            passes = atoi(optarg);
+            break;
+        case 'b':
+            batch_size = atoi(optarg);
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (passes < 1 || batch_size < 1 || scale <= 0.0 || (argc - optind) != 2) {
+        usage(argv[0]);
+        return 2;
+    }
+    if (mode == ReplayOriginal) scale = 1.0;
+
+    memset(&driver, 0, sizeof(DriverHandle));
+    if (init_provider(&driver, argv[optind]) != InitOk) {
+        ERROR("unable to load engine %s\n", argv[optind]);
+        return 2;
+    }
+    engine = driver.engines[0]->engine;
+    if (engine->thread_init != NULL &&
+        engine->thread_init(engine->providerData, &worker_context) != Ok) {
+        ERROR("unable to initialize engine %s\n", argv[optind]);
+        engine->shutdown(shutdown_state(engine, NULL));
+        return 2;
+    }
+    if (!load_log(argv[optind + 1], &log)) {
+        shutdown_engine(engine);
+        return 2;
+    }
+
+    result = replay_log(engine, &log, mode, scale, passes, (size_t)batch_size);
+
+    free_log(&log);
+    shutdown_engine(engine);
+    return result;
+};
@@ -0,0 +1,917 @@
+/*
+ * erlxsl_conform.c
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * Checks that an engine provider library (ABI v1 or v2) behaves the way the
+ * driver relies on, then measures its throughput and latency across a matrix
+ * of document sizes and thread counts. Usage:
+ *
+ *   erlxsl_conform [-x stylesheet] [-r record] [-b bad_document] [-s sizes]
+ *                  [-t threads] [-d duration_ms] [-o report] engine.so
+ *
+ * Input documents are built by repeating 'record' (by default
+ * "<item>conformance</item>") inside a <doc> element until they reach each
+ * of the comma separated sizes in bytes (by default 1024,16384,262144). They
+ * are transformed with the stylesheet read from the file given by -x, which
+ * defaults to an identity transform. -b gives a document the engine ought to
+ * reject (by default "<doc><item>"). Every cell of the matrix runs for
+ * 'duration_ms' (default 500) on each of the comma separated thread counts
+ * (by default 1,2,4,8). Engines which are neither reentrant nor keep
+ * per-worker state are run one transform at a time, as the driver runs them.
+ *
+ * The report is written to stdout, or to the file given by -o (engines built
+ * with DEBUG write to stdout themselves), as Erlang terms which can be read
+ * with file:consult/1 (see test/engine_conformance_SUITE.erl):
+ *
+ *   {engine, Path, AbiVersion, [Capability]}.
+ *   {check, Name, pass | warn | fail | skip, Detail}.
+ *   {perf, [{size, Bytes}, {threads, N}, {serialized, Bool}, {requests, N},
+ *           {failed, N}, {throughput_rps, F}, {p50_us, N}, {p90_us, N},
+ *           {p99_us, N}, {max_us, N}]}.
+ *   {summary, [{passed, N}, {warnings, N}, {failed, N}, {skipped, N}]}.
+ *
+ * Warnings flag behaviour the driver copes with but callers may not expect,
+ * such as accepting a malformed document. The exit status is 0 unless a
+ * check failed (1), or the engine could not be loaded (2).
+ *
+ */
+
+#include <time.h>
+#include <unistd.h>
+#include <pthread.h>
+
+#include "erlxsl_port.h"
+
+#define DEFAULT_RECORD "<item>conformance</item>"
+#define DEFAULT_BAD_DOCUMENT "<doc><item>"
+#define DEFAULT_SIZES "1024,16384,262144"
+#define DEFAULT_THREADS "1,2,4,8"
+#define DEFAULT_DURATION_MS 500
+#define MAX_MATRIX 16
+#define CONCURRENT_THREADS 4
+#define CONCURRENT_TRANSFORMS 50
+#define BATCH_CHECK_SIZE 4
+
+static const char *identity_stylesheet =
+    "<xsl:stylesheet xmlns:xsl='http://www.w3.org/1999/XSL/Transform' version='1.0'>"
+    "<xsl:template match='@*|node()'><xsl:copy><xsl:apply-templates select='@*|node()'/>"
+    "</xsl:copy></xsl:template></xsl:stylesheet>";
+
+static const struct {
+    UInt64 flag;
+    const char *name;
+} capabilities[] = {
+    { EngineReentrant, "reentrant" },
+    { EngineZeroCopyInput, "zero_copy_input" },
+    { EngineBinaryOutput, "binary_output" },
+    { EngineStreaming, "streaming" },
+    { EngineStylesheetCache, "stylesheet_cache" },
+    { EngineBatch, "batch" },
+    { EngineAsyncCompletion, "async_completion" }
+};
+
+typedef enum {
+    CheckPass,
+    CheckWarn,
+    CheckFail,
+    CheckSkip
+} CheckResult;
+
+static const char *check_results[] = { "pass", "warn", "fail", "skip" };
+
+typedef struct {
+    char *data;
+    size_t length;
+} Document;
+
+/* What every transform of a given document is compared with. */
+typedef struct {
+    EngineState state;
+    UInt64 hash;
+    size_t length;
+} Outcome;
+
+/* Shared by the threads running one cell of the matrix, or the concurrency check. */
+typedef struct {
+    XslEngineV2 *engine;
+    LoadedEngine *slot;
+    Document *input;
+    Document *stylesheet;
+    /* serializes transforms for engines which need it, or NULL */
+    pthread_mutex_t *lock;
+    UInt64 until;
+    /* for the concurrency check, the number of transforms to run instead */
+    int transforms;
+    Outcome expected;
+} Workload;
+
+/* The results of a single thread. */
+typedef struct {
+    Workload *work;
+    pthread_t thread;
+    UInt64 *latencies;
+    size_t count;
+    size_t capacity;
+    size_t failed;
+    size_t mismatched;
+    int context_failed;
+} Worker;
+
+static int counts[4] = { 0, 0, 0, 0 };
+static FILE *report;
+
+/* the engine's context for the main thread, see XslEngineV2.thread_init */
+static void *main_context = NULL;
+
+/* Allocations made through the tracking allocator (see allocates_through_command). */
+static void *tracked[1024];
+static size_t tracked_count = 0;
+static int tracking_overflowed = 0;
+
+static UInt64
+now_micros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((UInt64)ts.tv_sec * 1000000) + ((UInt64)ts.tv_nsec / 1000);
+};
+
+static int
+compare_times(const void *a, const void *b) {
+    UInt64 x = *(const UInt64*)a;
+    UInt64 y = *(const UInt64*)b;
+    return (x > y) - (x < y);
+};
+
+/* Prints a string as an Erlang string literal. */
+static void
+print_string(const char *s) {
+    fputc('"', report);
+    for (; *s != '\0'; s++) {
+        if (*s == '"' || *s == '\\') {
+            fputc('\\', report);
+            fputc(*s, report);
+        } else if ((unsigned char)*s < 0x20) {
+            fputc(' ', report);
+        } else {
+            fputc(*s, report);
+        }
+    }
+    fputc('"', report);
+};
+
+static void
+report_check(const char *name, CheckResult result, const char *detail) {
+    counts[result]++;
+    fprintf(report, "{check, %s, %s, ", name, check_results[result]);
+    print_string(detail);
+    fprintf(report, "}.\n");
+};
+
+static const char*
+state_name(EngineState state) {
+    switch (state) {
+    case Ok: return "Ok";
+    case Error: return "Error";
+    case XmlParseError: return "XmlParseError";
+    case XslCompileError: return "XslCompileError";
+    case XslTransformError: return "XslTransformError";
+    case OutOfMemoryError: return "OutOfMemoryError";
+    case Pending: return "Pending";
+    case Yielded: return "Yielded";
+    default: return "unknown";
+    }
+};
+
+/* Evaluates to the size of a Text result, which v1 engines NUL terminate. */
+#define output_length(engine, cmd) \
+    (((engine)->abi.version >= 2) \
+        ? (cmd)->result_length \
+        : ((cmd)->result->payload.buffer == NULL) ? 0 \
+            : strnlen((cmd)->result->payload.buffer, (size_t)(cmd)->result->size))
+
+/* Builds a document of at least 'size' bytes by repeating 'record'. */
+static int
+build_document(Document *doc, const char *record, size_t size) {
+    size_t record_length = strlen(record);
+    size_t pos;
+
+    doc->length = 11;
+    while (doc->length < size) {
+        doc->length += record_length;
+    }
+    if ((doc->data = ALLOC(doc->length + 1)) == NULL) return 0;
+    memcpy(doc->data, "<doc>", 5);
+    for (pos = 5; pos + 6 < doc->length; pos += record_length) {
+        memcpy(doc->data + pos, record, record_length);
+    }
+    memcpy(doc->data + pos, "</doc>", 6);
+    doc->data[doc->length] = '\0';
+    return 1;
+};
+
+static int
+read_file(const char *path, Document *doc) {
+    FILE *in;
+    long size;
+
+    if ((in = fopen(path, "rb")) == NULL) return 0;
+    fseek(in, 0, SEEK_END);
+    size = ftell(in);
+    fseek(in, 0, SEEK_SET);
+    if (size <= 0 || (doc->data = ALLOC((size_t)size + 1)) == NULL) {
+        fclose(in);
+        return 0;
+    }
+    doc->length = fread(doc->data, 1, (size_t)size, in);
+    doc->data[doc->length] = '\0';
+    fclose(in);
+    return doc->length == (size_t)size;
+};
+
+/* Parses a comma separated list of numbers, returning how many there were. */
+static size_t
+parse_list(const char *list, size_t *values) {
+    size_t count = 0;
+    char *end;
+
+    while (*list != '\0' && count < MAX_MATRIX) {
+        values[count] = (size_t)strtoul(list, &end, 10);
+        if (end == list || values[count] == 0) return 0;
+        count++;
+        list = (*end == ',') ? end + 1 : end;
+    }
+    return count;
+};
+
+/*
+ * Builds a transform command for the supplied documents. Borrowed documents are
+ * passed as the driver passes them to EngineZeroCopyInput engines - neither copied
+ * nor NUL terminated - whereas others are copied.
+ */
+static Command*
+make_command(Document *input, Document *stylesheet, int borrowed, void *context) {
+    PayloadSize hsize;
+    InputSpec hspec;
+    XslTask *task;
+    Command *cmd;
+    char *xml = input->data;
+    char *xsl = stylesheet->data;
+
+    hsize.input_size = input->length;
+    hsize.xsl_size = stylesheet->length;
+    hspec.input_kind = Buffer;
+    hspec.xsl_kind = Buffer;
+    hspec.param_grp_arity = 0;
+    hspec.flags = 0;
+    hspec.borrowed = (UInt8)borrowed;
+
+    if (!borrowed) {
+        if ((xml = ALLOC(input->length + 1)) == NULL) return NULL;
+        if ((xsl = ALLOC(stylesheet->length + 1)) == NULL) {
+            DRV_FREE(xml);
+            return NULL;
+        }
+        memcpy(xml, input->data, input->length + 1);
+        memcpy(xsl, stylesheet->data, stylesheet->length + 1);
+    }
+    if ((task = ALLOC(sizeof(XslTask))) == NULL) return NULL;
+    if (init_task(task, &hsize, &hspec, xml, xsl) != Success) {
+        DRV_FREE(task);
+        return NULL;
+    }
+    if ((cmd = init_command("transform", NULL, task, NULL)) == NULL) {
+        free_task(task);
+        DRV_FREE(task);
+        return NULL;
+    }
+    cmd->worker_context = context;
+    return cmd;
+};
+
+/* Calls after_transform, then frees the command as the driver does. */
+static EngineState
+release_command(XslEngineV2 *engine, Command *cmd) {
+    XslTask *task = cmd->command_data.xsl_task;
+    EngineState state = engine->after_transform(cmd);
+    free_command(cmd);
+    DRV_FREE(task);
+    return state;
+};
+
+/* Runs a single transform, recording its outcome. Returns the after_transform state. */
+static EngineState
+run_once(XslEngineV2 *engine, Document *input, Document *stylesheet, int borrowed,
+         void *context, Outcome *outcome) {
+    Command *cmd = make_command(input, stylesheet, borrowed, context);
+    size_t length;
+
+    if (cmd == NULL) {
+        outcome->state = OutOfMemoryError;
+        outcome->hash = 0;
+        outcome->length = 0;
+        return Ok;
+    }
+    outcome->state = engine->transform(cmd);
+    length = output_length(engine, cmd);
+    outcome->length = length;
+    outcome->hash = (length == 0 || cmd->result->payload.buffer == NULL) ? 0
+                  : hash_buffer(cmd->result->payload.buffer, length);
+    return release_command(engine, cmd);
+};
+
+static void*
+tracking_alloc(size_t size) {
+    void *ptr = malloc(size);
+    if (ptr != NULL) {
+        if (tracked_count < sizeof(tracked) / sizeof(tracked[0])) {
+            tracked[tracked_count++] = ptr;
+        } else {
+            tracking_overflowed = 1;
+        }
+    }
+    return ptr;
+};
+
+static int
+untrack(void *ptr) {
+    size_t i;
+    for (i = 0; i < tracked_count; i++) {
+        if (tracked[i] == ptr) {
+            tracked[i] = tracked[--tracked_count];
+            return 1;
+        }
+    }
+    return 0;
+};
+
+static void*
+tracking_realloc(void *ptr, size_t size) {
+    void *resized;
+    if (ptr != NULL && !untrack(ptr)) {
+        // not one of ours - fail it, so the check notices
+        return NULL;
+    }
+    if ((resized = realloc(ptr, size)) == NULL) {
+        if (ptr != NULL) tracked[tracked_count++] = ptr;
+        return NULL;
+    }
+    if (tracked_count < sizeof(tracked) / sizeof(tracked[0])) {
+        tracked[tracked_count++] = resized;
+    } else {
+        tracking_overflowed = 1;
+    }
+    return resized;
+};
+
+static void
+tracking_release(void *ptr) {
+    if (ptr != NULL && untrack(ptr)) {
+        free(ptr);
+    }
+};
+
+/* CHECKS */
+
+static void
+check_transform(XslEngineV2 *engine, Document *input, Document *stylesheet, Outcome *baseline) {
+    char detail[128];
+    EngineState after;
+    Command *cmd;
+    size_t length;
+
+    if ((cmd = make_command(input, stylesheet, 0, main_context)) == NULL) {
+        report_check("transform_succeeds", CheckFail, "out of memory");
+        return;
+    }
+    baseline->state = engine->transform(cmd);
+    length = output_length(engine, cmd);
+    baseline->length = length;
+    baseline->hash = (length == 0 || cmd->result->payload.buffer == NULL) ? 0
+                   : hash_buffer(cmd->result->payload.buffer, length);
+
+    snprintf(detail, sizeof(detail), "returned %s with %lu bytes of output",
+             state_name(baseline->state), (unsigned long)length);
+    report_check("transform_succeeds",
+                 (baseline->state == Ok && length > 0) ? CheckPass : CheckFail, detail);
+
+    if (baseline->state == Pending || baseline->state == Yielded) {
+        report_check("completes_synchronously", CheckFail,
+                     "returned Pending or Yielded without a completion callback or yield check");
+    } else {
+        report_check("completes_synchronously", CheckPass, "");
+    }
+
+    if (cmd->result->type != Text) {
+        report_check("result_is_well_formed", CheckPass, "result is a binary");
+    } else if (length > 0 && cmd->result->payload.buffer == NULL) {
+        report_check("result_is_well_formed", CheckFail, "result has a length but no buffer");
+    } else if (engine->abi.version >= 2 && length > (size_t)cmd->result->size) {
+        snprintf(detail, sizeof(detail), "result_length %lu exceeds the buffer size %ld",
+                 (unsigned long)length, (long)cmd->result->size);
+        report_check("result_is_well_formed", CheckFail, detail);
+    } else if (engine->abi.version < 2 && length == (size_t)cmd->result->size) {
+        report_check("result_is_well_formed", CheckFail, "v1 result is not NUL terminated");
+    } else {
+        report_check("result_is_well_formed", CheckPass, "");
+    }
+
+    after = release_command(engine, cmd);
+    snprintf(detail, sizeof(detail), "returned %s", state_name(after));
+    report_check("after_transform_succeeds", (after == Ok) ? CheckPass : CheckFail, detail);
+};
+
+static void
+check_deterministic(XslEngineV2 *engine, Document *input, Document *stylesheet, Outcome *baseline) {
+    Outcome outcome;
+    run_once(engine, input, stylesheet, 0, main_context, &outcome);
+    report_check("result_is_deterministic",
+                 (outcome.state == baseline->state && outcome.hash == baseline->hash &&
+                  outcome.length == baseline->length) ? CheckPass : CheckFail,
+                 "a second transform of the same request");
+};
+
+static void
+check_errors(XslEngineV2 *engine, Document *bad, Document *stylesheet) {
+    char detail[128];
+    Outcome outcome;
+    EngineState after = run_once(engine, bad, stylesheet, 0, main_context, &outcome);
+
+    snprintf(detail, sizeof(detail), "malformed document returned %s", state_name(outcome.state));
+    if (outcome.state == Ok) {
+        report_check("rejects_malformed_input", CheckWarn, detail);
+    } else if (outcome.state == Error || outcome.state == XmlParseError ||
+               outcome.state == XslCompileError || outcome.state == XslTransformError) {
+        report_check("rejects_malformed_input", CheckPass, detail);
+    } else {
+        report_check("rejects_malformed_input", CheckFail, detail);
+    }
+    snprintf(detail, sizeof(detail), "returned %s after a failed transform", state_name(after));
+    report_check("after_transform_follows_errors", (after == Ok) ? CheckPass : CheckFail, detail);
+};
+
+static void
+check_allocation(XslEngineV2 *engine, LoadedEngine *slot, Document *input, Document *stylesheet) {
+    char detail[128];
+    XslTask *task;
+    Command *cmd;
+    EngineState state;
+    size_t live;
+    int owned;
+
+    if (!(slot->capabilities & EngineBinaryOutput)) {
+        report_check("allocates_through_command", CheckSkip, "engine does not claim binary_output");
+        return;
+    }
+    if ((cmd = make_command(input, stylesheet, 0, main_context)) == NULL) {
+        report_check("allocates_through_command", CheckFail, "out of memory");
+        return;
+    }
+    tracked_count = 0;
+    tracking_overflowed = 0;
+    cmd->alloc = tracking_alloc;
+    cmd->resize = tracking_realloc;
+    cmd->release = tracking_release;
+
+    state = engine->transform(cmd);
+    owned = (cmd->result->payload.buffer == NULL) || untrack(cmd->result->payload.buffer);
+    // the driver hands the result on, so it is no longer the command's to release
+    if (owned && cmd->result->payload.buffer != NULL) {
+        free(cmd->result->payload.buffer);
+    }
+    cmd->result->payload.buffer = NULL;
+    cmd->result->dirty = 0;
+    task = cmd->command_data.xsl_task;
+    engine->after_transform(cmd);
+    live = tracked_count;
+    free_command(cmd);
+    DRV_FREE(task);
+
+    if (state != Ok) {
+        snprintf(detail, sizeof(detail), "transform returned %s", state_name(state));
+        report_check("allocates_through_command", CheckFail, detail);
+    } else if (!owned) {
+        report_check("allocates_through_command", CheckFail,
+                     "result buffer was not allocated with Command.alloc/resize");
+    } else if (live > 0 && !tracking_overflowed) {
+        snprintf(detail, sizeof(detail), "%lu blocks from Command.alloc were never released",
+                 (unsigned long)live);
+        report_check("allocates_through_command", CheckFail, detail);
+    } else {
+        report_check("allocates_through_command", CheckPass, "");
+    }
+};
+
+static void
+check_zero_copy(XslEngineV2 *engine, LoadedEngine *slot, Document *input,
+                Document *stylesheet, Outcome *baseline) {
+    Document padded_input;
+    Document padded_stylesheet;
+    Outcome outcome;
+
+    if (!(slot->capabilities & EngineZeroCopyInput)) {
+        report_check("zero_copy_input_honours_lengths", CheckSkip,
+                     "engine does not claim zero_copy_input");
+        return;
+    }
+    // junk follows each document, where a NUL terminator would otherwise be
+    padded_input.length = input->length;
+    padded_stylesheet.length = stylesheet->length;
+    padded_input.data = ALLOC(input->length + 8);
+    padded_stylesheet.data = ALLOC(stylesheet->length + 8);
+    if (padded_input.data == NULL || padded_stylesheet.data == NULL) {
+        DRV_FREE(padded_input.data);
+        DRV_FREE(padded_stylesheet.data);
+        report_check("zero_copy_input_honours_lengths", CheckFail, "out of memory");
+        return;
+    }
+    memcpy(padded_input.data, input->data, input->length);
+    memcpy(padded_input.data + input->length, "<junk>\0", 8);
+    memcpy(padded_stylesheet.data, stylesheet->data, stylesheet->length);
+    memcpy(padded_stylesheet.data + stylesheet->length, "<junk>\0", 8);
+
+    run_once(engine, &padded_input, &padded_stylesheet, 1, main_context, &outcome);
+    report_check("zero_copy_input_honours_lengths",
+                 (outcome.state == baseline->state && outcome.hash == baseline->hash)
+                    ? CheckPass : CheckFail,
+                 "unterminated, borrowed documents give the same result");
+    DRV_FREE(padded_input.data);
+    DRV_FREE(padded_stylesheet.data);
+};
+
+static void
+check_batch(XslEngineV2 *engine, LoadedEngine *slot, Document *input,
+            Document *stylesheet, Outcome *baseline) {
+    Command *cmds[BATCH_CHECK_SIZE];
+    EngineState states[BATCH_CHECK_SIZE];
+    size_t i;
+    size_t created;
+    int agreed = 1;
+
+    if (!(slot->capabilities & EngineBatch)) {
+        report_check("batch_matches_transform", CheckSkip, "engine does not provide transform_batch");
+        return;
+    }
+    for (created = 0; created < BATCH_CHECK_SIZE; created++) {
+        if ((cmds[created] = make_command(input, stylesheet, 0, main_context)) == NULL) break;
+    }
+    if (created == BATCH_CHECK_SIZE) {
+        run_transform_batch(engine, cmds, states, created);
+    }
+    for (i = 0; i < created; i++) {
+        size_t length = output_length(engine, cmds[i]);
+        if (created < BATCH_CHECK_SIZE || states[i] != baseline->state ||
+            length != baseline->length ||
+            (length > 0 && hash_buffer(cmds[i]->result->payload.buffer, length) != baseline->hash)) {
+            agreed = 0;
+        }
+        release_command(engine, cmds[i]);
+    }
+    report_check("batch_matches_transform", agreed ? CheckPass : CheckFail,
+                 "a batch gives the same results as transforming one at a time");
+};
+
+/* MATRIX */
+
+static void
+record_latency(Worker *worker, UInt64 latency) {
+    UInt64 *resized;
+    if (worker->count == worker->capacity) {
+        worker->capacity = (worker->capacity == 0) ? 1024 : worker->capacity * 2;
+        if ((resized = realloc(worker->latencies, worker->capacity * sizeof(UInt64))) == NULL) {
+            worker->capacity = worker->count;
+            return;
+        }
+        worker->latencies = resized;
+    }
+    worker->latencies[worker->count++] = latency;
+};
+
+static void*
+run_worker(void *arg) {
+    Worker *worker = (Worker*)arg;
+    Workload *work = worker->work;
+    XslEngineV2 *engine = work->engine;
+    void *context = NULL;
+    int borrowed = (work->slot->capabilities & EngineZeroCopyInput) != 0;
+    int done = 0;
+    Outcome outcome;
+    UInt64 started;
+
+    if (engine->thread_init != NULL &&
+        engine->thread_init(engine->providerData, &context) != Ok) {
+        worker->context_failed = 1;
+        return NULL;
+    }
+    while ((work->transforms > 0) ? done < work->transforms : now_micros() < work->until) {
+        if (work->lock != NULL) pthread_mutex_lock(work->lock);
+        started = now_micros();
+        run_once(engine, work->input, work->stylesheet, borrowed, context, &outcome);
+        record_latency(worker, now_micros() - started);
+        if (work->lock != NULL) pthread_mutex_unlock(work->lock);
+
+        if (outcome.state != Ok) {
+            worker->failed++;
+        } else if (outcome.hash != work->expected.hash || outcome.length != work->expected.length) {
+            worker->mismatched++;
+        }
+        done++;
+    }
+    if (engine->thread_init != NULL && engine->thread_shutdown != NULL) {
+        engine->thread_shutdown(engine->providerData, context);
+    }
+    return NULL;
+};
+
+/* Runs the workload on 'count' threads, returning zero if any could not be started. */
+static int
+run_workers(Workload *work, Worker *workers, size_t count) {
+    size_t i;
+    size_t started;
+    int ok = 1;
+
+    memset(workers, 0, sizeof(Worker) * count);
+    for (started = 0; started < count; started++) {
+        workers[started].work = work;
+        if (pthread_create(&workers[started].thread, NULL, run_worker, &workers[started]) != 0) {
+            ok = 0;
+            break;
+        }
+    }
+    for (i = 0; i < started; i++) {
+        pthread_join(workers[i].thread, NULL);
+    }
+    return ok;
+};
+
+static void
+check_concurrency(XslEngineV2 *engine, LoadedEngine *slot, Document *input,
+                  Document *stylesheet, Outcome *baseline) {
+    Worker workers[CONCURRENT_THREADS];
+    Workload work;
+    char detail[128];
+    size_t failed = 0;
+    size_t mismatched = 0;
+    int context_failed = 0;
+    size_t i;
+
+    if (!(slot->capabilities & EngineReentrant) && engine->thread_init == NULL) {
+        report_check("concurrent_transforms_agree", CheckSkip,
+                     "engine is neither reentrant nor keeps per-worker state");
+        report_check("worker_contexts", CheckSkip, "engine keeps no per-worker state");
+        return;
+    }
+    memset(&work, 0, sizeof(Workload));
+    work.engine = engine;
+    work.slot = slot;
+    work.input = input;
+    work.stylesheet = stylesheet;
+    work.transforms = CONCURRENT_TRANSFORMS;
+    work.expected = *baseline;
+
+    if (!run_workers(&work, workers, CONCURRENT_THREADS)) {
+        report_check("concurrent_transforms_agree", CheckFail, "unable to start threads");
+    } else {
+        for (i = 0; i < CONCURRENT_THREADS; i++) {
+            failed += workers[i].failed;
+            mismatched += workers[i].mismatched;
+            context_failed |= workers[i].context_failed;
+            free(workers[i].latencies);
+        }
+        snprintf(detail, sizeof(detail), "%d threads: %lu failed, %lu differed%s",
+                 CONCURRENT_THREADS, (unsigned long)failed, (unsigned long)mismatched,
+                 context_failed ? ", thread_init failed" : "");
+        report_check("concurrent_transforms_agree",
+                     (failed == 0 && mismatched == 0 && !context_failed) ? CheckPass : CheckFail,
+                     detail);
+    }
+    if (engine->thread_init != NULL) {
+        report_check("worker_contexts", context_failed ? CheckFail : CheckPass,
+                     "thread_init and thread_shutdown on each thread");
+    } else {
+        report_check("worker_contexts", CheckSkip, "engine keeps no per-worker state");
+    }
+};
+
+static void
+run_cell(XslEngineV2 *engine, LoadedEngine *slot, Document *input, Document *stylesheet,
+         size_t threads, UInt64 duration) {
+    Worker workers[MAX_MATRIX];
+    Workload work;
+    pthread_mutex_t lock;
+    Outcome expected;
+    UInt64 *latencies;
+    UInt64 started;
+    UInt64 elapsed;
+    size_t total = 0;
+    size_t failed = 0;
+    size_t i;
+    int serialized = !(slot->capabilities & EngineReentrant) && engine->thread_init == NULL;
+
+    run_once(engine, input, stylesheet, 0, main_context, &expected);
+    memset(&work, 0, sizeof(Workload));
+    work.engine = engine;
+    work.slot = slot;
+    work.input = input;
+    work.stylesheet = stylesheet;
+    work.expected = expected;
+    if (serialized) {
+        pthread_mutex_init(&lock, NULL);
+        work.lock = &lock;
+    }
+
+    started = now_micros();
+    work.until = started + duration;
+    run_workers(&work, workers, threads);
+    elapsed = now_micros() - started;
+    if (serialized) {
+        pthread_mutex_destroy(&lock);
+    }
+
+    for (i = 0; i < threads; i++) {
+        total += workers[i].count;
+        failed += workers[i].failed;
+    }
+    latencies = ALLOC(sizeof(UInt64) * (total + 1));
+    total = 0;
+    for (i = 0; i < threads; i++) {
+        if (latencies != NULL) {
+            memcpy(latencies + total, workers[i].latencies, sizeof(UInt64) * workers[i].count);
+            total += workers[i].count;
+        }
+        free(workers[i].latencies);
+    }
+    if (latencies != NULL && total > 0) {
+        qsort(latencies, total, sizeof(UInt64), compare_times);
+    }
+
+    fprintf(report, "{perf, [{size, %lu}, {threads, %lu}, {serialized, %s}, {requests, %lu}, "
+           "{failed, %lu}, {throughput_rps, %.1f}, {p50_us, %llu}, {p90_us, %llu}, "
+           "{p99_us, %llu}, {max_us, %llu}]}.\n",
+           (unsigned long)input->length, (unsigned long)threads,
+           serialized ? "true" : "false", (unsigned long)total, (unsigned long)failed,
+           (elapsed == 0) ? 0.0 : ((double)(total - failed) * 1000000.0) / (double)elapsed,
+           (unsigned long long)((total == 0) ? 0 : latencies[total / 2]),
+           (unsigned long long)((total == 0) ? 0 : latencies[(total * 90) / 100]),
+           (unsigned long long)((total == 0) ? 0 : latencies[(total * 99) / 100]),
+           (unsigned long long)((total == 0) ? 0 : latencies[total - 1]));
+    fflush(report);
+    DRV_FREE(latencies);
+};
+
+static void
+usage(const char *name) {
+    ERROR("usage: %s [-x stylesheet] [-r record] [-b bad_document] [-s sizes] "
+          "[-t threads] [-d duration_ms] [-o report] engine.so\n", name);
+};
+
+int
+main(int argc, char **argv) {
+    DriverHandle driver;
+    LoadedEngine *slot;
+    XslEngineV2 *engine;
+    Document stylesheet;
+    Document input;
+    Document bad;
+    Outcome baseline;
+    const char *record = DEFAULT_RECORD;
+    const char *sizes_arg = DEFAULT_SIZES;
+    const char *threads_arg = DEFAULT_THREADS;
+    const char *stylesheet_path = NULL;
+    size_t sizes[MAX_MATRIX];
+    size_t threads[MAX_MATRIX];
+    size_t size_count;
+    size_t thread_count;
+    size_t i;
+    size_t j;
+    int first = 1;
+    UInt64 duration = DEFAULT_DURATION_MS;
+    int opt;
+
+    report = stdout;
+    bad.data = DEFAULT_BAD_DOCUMENT;
+    while ((opt = getopt(argc, argv, "x:r:b:s:t:d:o:")) != -1) {
+        switch (opt) {
+        case 'x': stylesheet_path = optarg; break;
+        case 'r': record = optarg; break;
+        case 'b': bad.data = optarg; break;
+        case 's': sizes_arg = optarg; break;
+        case 't': threads_arg = optarg; break;
+        case 'd': duration = strtoull(optarg, NULL, 10); break;
+        case 'o':
+            if ((report = fopen(optarg, "w")) == NULL) {
+                ERROR("%s: unable to open report\n", optarg);
+                return 2;
+            }
+            break;
+        default:
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    size_count = parse_list(sizes_arg, sizes);
+    thread_count = parse_list(threads_arg, threads);
+    if ((argc - optind) != 1 || size_count == 0 || thread_count == 0 ||
+        *record == '\0' || *bad.data == '\0') {
+        usage(argv[0]);
+        return 2;
+    }
+    bad.length = strlen(bad.data);
+    if (stylesheet_path == NULL) {
+        stylesheet.data = (char*)identity_stylesheet;
+        stylesheet.length = strlen(identity_stylesheet);
+    } else if (!read_file(stylesheet_path, &stylesheet)) {
+        ERROR("%s: unable to read stylesheet\n", stylesheet_path);
+        return 2;
+    }
+
+    memset(&driver, 0, sizeof(DriverHandle));
+    if (init_provider(&driver, argv[optind]) != InitOk) {
+        fprintf(report, "{check, loads, fail, ");
+        print_string((driver.error_message == NULL) ? "unable to load engine" : driver.error_message);
+        fprintf(report, "}.\n{summary, [{passed, 0}, {warnings, 0}, {failed, 1}, {skipped, 0}]}.\n");
+        return 2;
+    }
+    slot = driver.engines[0];
+    engine = slot->engine;
+
+    fprintf(report, "{engine, ");
+    print_string(argv[optind]);
+    fprintf(report, ", %u, [", engine->abi.version);
+    for (i = 0; i < sizeof(capabilities) / sizeof(capabilities[0]); i++) {
+        if (slot->capabilities & capabilities[i].flag) {
+            fprintf(report, "%s%s", first ? "" : ", ", capabilities[i].name);
+            first = 0;
+        }
+    }
+    fprintf(report, "]}.\n");
+    report_check("loads", CheckPass, "");
+
+    if (engine->thread_init != NULL &&
+        engine->thread_init(engine->providerData, &main_context) != Ok) {
+        report_check("worker_contexts", CheckFail, "thread_init failed");
+        engine->shutdown(shutdown_state(engine, NULL));
+        fprintf(report, "{summary, [{passed, %d}, {warnings, %d}, {failed, %d}, {skipped, %d}]}.\n",
+               counts[CheckPass], counts[CheckWarn], counts[CheckFail], counts[CheckSkip]);
+        return 1;
+    }
+    if (!build_document(&input, record, sizes[0])) {
+        ERROR("out of memory\n");
+        return 2;
+    }
+
+    check_transform(engine, &input, &stylesheet, &baseline);
+    check_deterministic(engine, &input, &stylesheet, &baseline);
+    check_errors(engine, &bad, &stylesheet);
+    check_allocation(engine, slot, &input, &stylesheet);
+    check_zero_copy(engine, slot, &input, &stylesheet, &baseline);
+    check_batch(engine, slot, &input, &stylesheet, &baseline);
+    check_concurrency(engine, slot, &input, &stylesheet, &baseline);
+    DRV_FREE(input.data);
+    fflush(report);
+
+    for (i = 0; i < size_count; i++) {
+        if (!build_document(&input, record, sizes[i])) {
+            ERROR("out of memory\n");
+            break;
+        }
+        for (j = 0; j < thread_count; j++) {
+            run_cell(engine, slot, &input, &stylesheet, threads[j], duration * 1000);
+        }
+        DRV_FREE(input.data);
+    }
+
+    if (engine->thread_init != NULL && engine->thread_shutdown != NULL) {
+        engine->thread_shutdown(engine->providerData, main_context);
+    }
+    engine->shutdown(shutdown_state(engine, NULL));
+    report_check("shuts_down", CheckPass, "");
+    fprintf(report, "{summary, [{passed, %d}, {warnings, %d}, {failed, %d}, {skipped, %d}]}.\n",
+           counts[CheckPass], counts[CheckWarn], counts[CheckFail], counts[CheckSkip]);
+    if (stylesheet_path != NULL) {
+        DRV_FREE(stylesheet.data);
+    }
+    fclose(report);
+    return (counts[CheckFail] == 0) ? 0 : 1;
+};
@@ -0,0 +1,215 @@
+/*
+ * erlxsl_replay.c
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes:
+ *
+ * Replays requests captured by the driver's slow request log (see the
+ * capture_dir setting) against any engine provider library, reporting the
+ * captured and replayed transform times. Usage:
+ *
+ *   erlxsl_replay [-n iterations] engine.so capture.xcap [capture.xcap ...]
+ *
+ */
+
+#include <time.h>
+#include <unistd.h>
+
+#include "erlxsl_port.h"
+#include "erlxsl_capture.h"
+
+/* the engine's context for our (single) worker thread, see XslEngineV2.thread_init */
+static void *worker_context = NULL;
+
+static UInt64
+now_micros(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return ((UInt64)ts.tv_sec * 1000000) + ((UInt64)ts.tv_nsec / 1000);
+};
+
+static char*
+copy_buffer(const char *buffer, UInt64 size) {
+    char *copy = ALLOC(size + 1);
+    if (copy != NULL) {
+        memcpy(copy, buffer, size);
+        copy[size] = '\0';
+    }
+    return copy;
+};
+
+static int
+compare_times(const void *a, const void *b) {
+    UInt64 x = *(const UInt64*)a;
+    UInt64 y = *(const UInt64*)b;
+    return (x > y) - (x < y);
+};
+
+/* Runs a single transform of the captured request, returning the engine state. */
+static EngineState
+replay_once(XslEngineV2 *engine, CaptureRecord *record, UInt64 *elapsed) {
+    PayloadSize hsize;
+    InputSpec hspec;
+    XslTask *task;
+    Command *cmd;
+    EngineState state;
+    UInt64 start;
+
+    hsize.input_size = record->header.input_size;
+    hsize.xsl_size = record->header.xsl_size;
+    hspec.input_kind = record->header.input_kind;
+    hspec.xsl_kind = record->header.xsl_kind;
+    hspec.param_grp_arity = (UInt8)record->header.param_count;
+    hspec.flags = 0;
+    hspec.borrowed = 0;
+
+    if ((task = ALLOC(sizeof(XslTask))) == NULL) return OutOfMemoryError;
+    if (init_task(task, &hsize, &hspec,
+            copy_buffer(record->input, hsize.input_size),
+            copy_buffer(record->stylesheet, hsize.xsl_size)) != Success) {
+        free_task(task);
+        DRV_FREE(task);
+        return OutOfMemoryError;
+    }
+    if (record->parameters != NULL) {
+        // the task owns (and frees) its parameters, so each run gets a copy
+        UInt32 size;
+        char *params = traffic_encode_params(record->parameters, &size);
+        task->parameters = traffic_decode_params(params, size);
+        DRV_FREE(params);
+    }
+    if ((cmd = init_command("transform", NULL, task, NULL)) == NULL) {
+        free_task(task);
+        DRV_FREE(task);
+        return OutOfMemoryError;
+    }
+    cmd->worker_context = worker_context;
+
+    start = now_micros();
+    state = engine->transform(cmd);
+    *elapsed = now_micros() - start;
+
+    engine->after_transform(cmd);
+    free_command(cmd);
+    DRV_FREE(task);
+    return state;
+};
+
+static int
+replay_file(XslEngineV2 *engine, const char *path, int iterations) {
+    CaptureRecord record;
+    UInt64 *times;
+    EngineState state = Ok;
+    FILE *in;
+    int i;
+
+    if ((in = fopen(path, "rb")) == NULL) {
+        ERROR("%s: unable to open capture\n", path);
+        return 1;
+    }
+    if (capture_read(in, &record) != Success) {
+        fclose(in);
+        ERROR("%s: not a valid capture\n", path);
+        return 1;
+    }
+    fclose(in);
+
+    if ((times = ALLOC(sizeof(UInt64) * iterations)) == NULL) {
+        capture_free(&record);
+        return 1;
+    }
+    for (i = 0; i < iterations; i++) {
+        if ((state = replay_once(engine, &record, &times[i])) != Ok) break;
+    }
+
+    if (state != Ok) {
+        INFO("%s: engine state %i (captured with %u)\n", path, state,
+             record.header.engine_state);
+    } else {
+        qsort(times, iterations, sizeof(UInt64), compare_times);
+        INFO("%s: input=%llu xsl=%llu captured=%lluus replay min=%lluus median=%lluus max=%lluus\n",
+             path,
+             (unsigned long long)record.header.input_size,
+             (unsigned long long)record.header.xsl_size,
+             (unsigned long long)record.header.transform_time,
+             (unsigned long long)times[0],
+             (unsigned long long)times[iterations / 2],
+             (unsigned long long)times[iterations - 1]);
+    }
+
+    DRV_FREE(times);
+    capture_free(&record);
+    return (state == Ok) ? 0 : 1;
+};
+
+static void
+shutdown_engine(XslEngineV2 *engine) {
+    if (engine->thread_init != NULL && engine->thread_shutdown != NULL) {
+        engine->thread_shutdown(engine->providerData, worker_context);
+    }
+    engine->shutdown(shutdown_state(engine, NULL));
+};
+
+int
+main(int argc, char **argv) {
+    DriverHandle driver;
+    XslEngineV2 *engine;
+    int iterations = 1;
+    int failures = 0;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "n:")) != -1) {
+        switch (opt) {
+        case 'n':
+            iterations = atoi(optarg);
+            break;
+        default:
+            ERROR("usage: %s [-n iterations] engine.so capture.xcap ...\n", argv[0]);
+            return 2;
+        }
+    }
+    if (iterations < 1 || (argc - optind) < 2) {
+        ERROR("usage: %s [-n iterations] engine.so capture.xcap ...\n", argv[0]);
+        return 2;
+    }
+
+    memset(&driver, 0, sizeof(DriverHandle));
+    if (init_provider(&driver, argv[optind]) != InitOk) {
+        ERROR("unable to load engine %s\n", argv[optind]);
+        return 2;
+    }
+    engine = driver.engines[0]->engine;
+    if (engine->thread_init != NULL &&
+        engine->thread_init(engine->providerData, &worker_context) != Ok) {
+        ERROR("unable to initialize engine %s\n", argv[optind]);
+        engine->shutdown(shutdown_state(engine, NULL));
+        return 2;
+    }
+
+    for (opt = optind + 1; opt < argc; opt++) {
+        failures += replay_file(engine, argv[opt], iterations);
+    }
+
+    shutdown_engine(engine);
+    return (failures == 0) ? 0 : 1;
+};
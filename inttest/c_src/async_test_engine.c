@@ -0,0 +1,120 @@
+/*
+ * async_test_engine.c
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes: This *test* engine exercises the asynchronous completion API (see
+ * EngineAsyncCompletion). Each transform is handed to a thread of its own,
+ * which waits briefly (standing in for fetching a remote resource) and then
+ * completes the command with the input followed by the stylesheet, as the
+ * test_engine does.
+ */
+
+#include <pthread.h>
+#include <unistd.h>
+#include "erlxsl.h"
+
+#ifdef    __cplusplus
+extern "C" {
+#endif
+
+// how long each transform 'waits on I/O' for
+#define SIMULATED_IO_MICROS 2000
+
+/* INTERNAL DRIVER FUNCTIONS */
+ERLXSL_EXPORT void init_engine_v2(XslEngineV2*);
+static EngineState async_transform(Command*);
+static EngineState async_after_transform(Command*);
+static void async_shutdown(void*);
+
+/* STORAGE */
+
+// commands handed to a thread, but not yet completed
+static volatile long outstanding = 0;
+
+void init_engine_v2(XslEngineV2 *spec) {
+    if (spec->abi.version < 2 || spec->abi.size < sizeof(XslEngineV2)) {
+        return;
+    }
+    spec->abi.version = ERLXSL_ABI_VERSION;
+    spec->abi.size = sizeof(XslEngineV2);
+    spec->capabilities = EngineReentrant | EngineAsyncCompletion;
+    spec->transform = async_transform;
+    spec->after_transform = async_after_transform;
+    spec->shutdown = async_shutdown;
+};
+
+static EngineState
+write_result(Command *command) {
+    XslTask *task = get_task(command);
+    if (append_result_buffer(task->input.data, task->input.length, command) == NULL ||
+        append_result_buffer(task->stylesheet.data, task->stylesheet.length, command) == NULL) {
+        return OutOfMemoryError;
+    }
+    return Ok;
+};
+
+static void*
+complete_later(void *arg) {
+    Command *command = (Command*)arg;
+    usleep(SIMULATED_IO_MICROS);
+    command->complete(command, write_result(command));
+    __sync_sub_and_fetch(&outstanding, 1);
+    return NULL;
+};
+
+static EngineState
+async_transform(Command *command) {
+    pthread_t thread;
+    INFO("async_transform\n");
+
+    if (command->complete == NULL) {
+        // the caller can't wait for us, so do the work right away
+        return write_result(command);
+    }
+    __sync_add_and_fetch(&outstanding, 1);
+    if (pthread_create(&thread, NULL, complete_later, command) != 0) {
+        __sync_sub_and_fetch(&outstanding, 1);
+        return write_result(command);
+    }
+    pthread_detach(thread);
+    return Pending;
+};
+
+static EngineState
+async_after_transform(Command *command) {
+    INFO("async_after_transform\n");
+    return Ok;
+};
+
+static void
+async_shutdown(void *state) {
+    INFO("async_shutdown\n");
+    // every pending command must be completed before we return
+    while (__sync_fetch_and_add(&outstanding, 0) > 0) {
+        usleep(SIMULATED_IO_MICROS);
+    }
+};
+
+#ifdef __cplusplus
+}
+#endif
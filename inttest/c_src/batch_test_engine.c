@@ -0,0 +1,96 @@
+/*
+ * batch_test_engine.c
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes: This *test* engine exercises batching (see XslEngineV2.transform_batch).
+ * It produces the input followed by the stylesheet, as the test_engine does.
+ * Each call to transform_batch stalls for a moment before running its batch,
+ * so that requests arriving meanwhile queue up and are batched together.
+ */
+
+#include <time.h>
+#include "erlxsl.h"
+
+#ifdef    __cplusplus
+extern "C" {
+#endif
+
+// how long each call to transform_batch stalls for
+#define BATCH_STALL_NANOS 5000000
+
+/* INTERNAL DRIVER FUNCTIONS */
+ERLXSL_EXPORT void init_engine_v2(XslEngineV2*);
+static EngineState batch_transform(Command*);
+static void batch_transform_batch(Command**, EngineState*, size_t);
+static EngineState batch_after_transform(Command*);
+static void batch_shutdown(void*);
+
+void init_engine_v2(XslEngineV2 *spec) {
+    if (spec->abi.version < 2 || spec->abi.size < sizeof(XslEngineV2)) {
+        return;
+    }
+    spec->abi.version = ERLXSL_ABI_VERSION;
+    spec->abi.size = sizeof(XslEngineV2);
+    spec->capabilities = EngineReentrant | EngineBatch;
+    spec->transform = batch_transform;
+    spec->transform_batch = batch_transform_batch;
+    spec->after_transform = batch_after_transform;
+    spec->shutdown = batch_shutdown;
+};
+
+static EngineState
+batch_transform(Command *command) {
+    XslTask *task = get_task(command);
+    if (append_result_buffer(task->input.data, task->input.length, command) == NULL ||
+        append_result_buffer(task->stylesheet.data, task->stylesheet.length, command) == NULL) {
+        return OutOfMemoryError;
+    }
+    return Ok;
+};
+
+static void
+batch_transform_batch(Command **commands, EngineState *states, size_t count) {
+    struct timespec stall = { 0, BATCH_STALL_NANOS };
+    size_t i;
+
+    INFO("batch_transform_batch of %lu\n", (unsigned long)count);
+    nanosleep(&stall, NULL);
+    for (i = 0; i < count; i++) {
+        states[i] = batch_transform(commands[i]);
+    }
+};
+
+static EngineState
+batch_after_transform(Command *command) {
+    INFO("batch_after_transform\n");
+    return Ok;
+};
+
+static void
+batch_shutdown(void *state) {
+    INFO("batch_shutdown\n");
+};
+
+#ifdef __cplusplus
+}
+#endif
@@ -0,0 +1,94 @@
+/*
+ * sliced_test_engine.c
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes: This *test* engine exercises cooperative yielding (see
+ * Command.yield_check). It produces the input followed by the stylesheet (as
+ * the test_engine does), one byte at a time, checking whether its time slice
+ * is used up after each byte - if so, it parks the command by recording how
+ * far it got in Command.async_state, and picks up from there when resumed.
+ */
+
+#include <stdint.h>
+#include "erlxsl.h"
+
+#ifdef    __cplusplus
+extern "C" {
+#endif
+
+/* INTERNAL DRIVER FUNCTIONS */
+ERLXSL_EXPORT void init_engine_v2(XslEngineV2*);
+static EngineState sliced_transform(Command*);
+static EngineState sliced_after_transform(Command*);
+static void sliced_shutdown(void*);
+
+void init_engine_v2(XslEngineV2 *spec) {
+    if (spec->abi.version < 2 || spec->abi.size < sizeof(XslEngineV2)) {
+        return;
+    }
+    spec->abi.version = ERLXSL_ABI_VERSION;
+    spec->abi.size = sizeof(XslEngineV2);
+    spec->capabilities = EngineReentrant;
+    spec->transform = sliced_transform;
+    spec->after_transform = sliced_after_transform;
+    spec->shutdown = sliced_shutdown;
+};
+
+static EngineState
+sliced_transform(Command *command) {
+    XslTask *task = get_task(command);
+    size_t total = task->input.length + task->stylesheet.length;
+    // the number of bytes written before the command was last parked
+    size_t offset = (size_t)(uintptr_t)command->async_state;
+    INFO("sliced_transform resuming at %lu\n", (unsigned long)offset);
+
+    for (; offset < total; offset++) {
+        const char *next = (offset < task->input.length)
+            ? &task->input.data[offset]
+            : &task->stylesheet.data[offset - task->input.length];
+        if (append_result_buffer(next, 1, command) == NULL) {
+            return OutOfMemoryError;
+        }
+        if (offset + 1 < total && command->yield_check != NULL && command->yield_check(command)) {
+            command->async_state = (void*)(uintptr_t)(offset + 1);
+            return Yielded;
+        }
+    }
+    return Ok;
+};
+
+static EngineState
+sliced_after_transform(Command *command) {
+    INFO("sliced_after_transform\n");
+    command->async_state = NULL;
+    return Ok;
+};
+
+static void
+sliced_shutdown(void *state) {
+    INFO("sliced_shutdown\n");
+};
+
+#ifdef __cplusplus
+}
+#endif
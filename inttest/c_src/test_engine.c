@@ -33,7 +33,7 @@ extern "C" {
 #endif
 
 /* INTERNAL DRIVER FUNCTIONS */
-void init_engine(XslEngine*);
+ERLXSL_EXPORT void init_engine(XslEngine*);
 static EngineState default_handleTransform(Command*);
 static EngineState default_postHandle(Command*);
 static void default_shutdown(void*);
@@ -85,7 +85,12 @@ static void setup_stub(int cmd, char *data) {
 };
 
 static void process_cmd(CmdData *cd) {
-    setup_stub(TRANSFORM_CMD, cd->payload.buffer);
+    // command data belongs to the driver, so the stub keeps a copy
+    char *data = malloc(cd->size + 1);
+    if (data != NULL) {
+        memcpy(data, cd->payload.buffer, cd->size + 1);
+    }
+    setup_stub(TRANSFORM_CMD, data);
 };
 
 static EngineState
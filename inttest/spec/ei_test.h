@@ -35,6 +35,7 @@
 #define ERL_SMALL_INTEGER_EXT   'a'
 #define ERL_INTEGER_EXT         'b'
 #define ERL_FLOAT_EXT           'c'
+#define NEW_FLOAT_EXT           'F'
 #define ERL_ATOM_EXT            'd'
 #define ERL_REFERENCE_EXT       'e'
 #define ERL_NEW_REFERENCE_EXT   'r'
@@ -93,6 +94,8 @@ static int ei_get_type(const char *buf, const int *index, int *type, int *size);
 static int ei_decode_string(const char *buf, int *index, char *p);
 static int ei_decode_atom(const char *buf, int *index, char *p);
 static int ei_decode_tuple_header(const char *buf, int *index, int *arity);
+static int ei_decode_long(const char *buf, int *index, long *p);
+static int ei_decode_double(const char *buf, int *index, double *p);
 
 static char *test_buff = NULL;
 static int test_type;
@@ -129,4 +132,20 @@ static int ei_decode_string(const char *buf, int *index, char *p) {
     return 0;
 };
 
+static int ei_decode_long(const char *buf, int *index, long *p) {
+    // buf is ignored...
+    if (test_fail) return 1;
+    *p = strtol(test_buff, NULL, 10);
+    (*index)++;
+    return 0;
+};
+
+static int ei_decode_double(const char *buf, int *index, double *p) {
+    // buf is ignored...
+    if (test_fail) return 1;
+    *p = strtod(test_buff, NULL);
+    (*index)++;
+    return 0;
+};
+
 #endif /* _SPEC_EI_H */
@@ -53,7 +53,9 @@ static char *internal_command_string = "command123";
 #define setup_spec_headers(Spec, In, Xsl, Pg) \
     Spec.input_kind = (Int8)In; \
     Spec.xsl_kind = (Int8)Xsl;    \
-    Spec.param_grp_arity = (Int16)Pg
+    Spec.param_grp_arity = (Int16)Pg; \
+    Spec.flags = 0; \
+    Spec.borrowed = 0
 
 describe "Initializing DriverIOVec Structures"
 
@@ -266,7 +268,7 @@ describe "Initializing XslTask Structures"
     it "should (fail) assertion for non-matching [input] buffer vs. header size"
         DriverState state;
         PayloadSize hsize;
-        InputSpec hspec;
+        InputSpec hspec = { .borrowed = 0 };
         XslTask *task = ALLOC(sizeof(XslTask));
         create_test_data(test_xml, input_doc);
         create_test_data(test_xsl, xsl_doc);
@@ -290,7 +292,7 @@ describe "Initializing XslTask Structures"
     it "should (fail) assertion for non-matching [xsl] buffer vs. header size"
         DriverState state;
         PayloadSize hsize;
-        InputSpec hspec;
+        InputSpec hspec = { .borrowed = 0 };
         XslTask *task = ALLOC(sizeof(XslTask));
         create_test_data(test_xml, input_doc);
         create_test_data(test_xsl, xsl_doc);
@@ -310,6 +312,34 @@ describe "Initializing XslTask Structures"
         free_task(task);
     end
 
+    it "should neither free nor require NUL termination of borrowed buffers"
+        DriverState state;
+        PayloadSize hsize;
+        InputSpec hspec;
+        XslTask *task = ALLOC(sizeof(XslTask));
+        char buffer[] = { '<', 'a', '/', '>', '<', 'b', '/', '>' };
+
+        hsize.input_size = 4;
+        hsize.xsl_size = 4;
+        setup_spec_headers(hspec, Buffer, Buffer, 0);
+        hspec.borrowed = 1;
+
+        state = init_task(task,
+                        (const PayloadSize* const)&hsize,
+                        (const InputSpec* const)&hspec,
+                        buffer, buffer + 4);
+
+        state should be Success;
+        task->input.data should point_to buffer;
+        task->input.length should equal 4;
+        task->stylesheet.data should point_to (buffer + 4);
+        task->stylesheet.length should equal 4;
+        task->input_doc->iov->dirty should equal 0;
+
+        // would fail (freeing the stack) were the buffers not borrowed
+        free_task(task);
+    end
+
     it "should fail when no memory is available to allocate InputDocument(s)"
         PayloadSize hsize;
         InputSpec hspec;
@@ -69,6 +69,19 @@ describe "Extracting an XslTask from a Command using get_task"
         free_command(cmd);
     end
 
+    it "should dispatch on the op rather than the command string"
+        XslTask *task = ALLOC(sizeof(XslTask));
+        clear_task_fields(task);
+        Command *cmd = init_command(NULL, NULL, task, NULL);
+        cmd->op should equal OpTransform;
+        get_task(cmd) should point_to task;
+
+        cmd->op = OpCommand;
+        get_task(cmd) should be NULL;
+        cmd->op = OpTransform;
+        free_command(cmd);
+    end
+
 end
 
 describe "Obtaining a char buffer from a DriverIOVec using the get_buffer macro"
@@ -256,6 +269,46 @@ describe "Assigning a result buffer to a Command using the supplied macro"
 
 end
 
+describe "Appending length delimited data to a Command's result buffer"
+
+    it "should evaluate to NULL when the Command argument is NULL"
+        Command *cmd = NULL;
+        append_result_buffer(assigned_data, 4, cmd) should be NULL;
+    end
+
+    it "should allocate the buffer and track the result length"
+        Command *cmd = init_command(command_foo, NULL, NULL, NULL);
+
+        append_result_buffer(assigned_data, 4, cmd) should not be NULL;
+        cmd->result_length should equal 4;
+        cmd->result->size should equal 4;
+        cmd->result->dirty should equal 1;
+        free_command(cmd);
+    end
+
+    it "should append without relying on NUL termination"
+        Command *cmd = init_command(command_foo, NULL, NULL, NULL);
+
+        // only the first two bytes of each buffer are appended
+        append_result_buffer(assigned_data, 2, cmd);
+        append_result_buffer(combined_data, 2, cmd);
+        cmd->result_length should equal 4;
+        strncmp(cmd->result->payload.buffer, "dada", 4) should equal 0;
+        free_command(cmd);
+    end
+
+    it "should grow the buffer geometrically"
+        Command *cmd = init_command(command_foo, NULL, NULL, NULL);
+
+        append_result_buffer(combined_data, 8, cmd);
+        append_result_buffer(assigned_data, 1, cmd);
+        cmd->result_length should equal 9;
+        cmd->result->size should equal 16;
+        free_command(cmd);
+    end
+
+end
+
 describe "Assigning command_data Objects using the supplied macros"
 
     it "should allocate an initial slot and set the length/size property accordingly"
@@ -0,0 +1,136 @@
+/*
+ * traffic.spec
+ *
+ * -----------------------------------------------------------------------------
+ * Copyright (c) 2008-2010 Tim Watson (watson.timothy@gmail.com)
+ *
+ * Permission is hereby granted, free of charge, to any person obtaining a copy
+ * of this software and associated documentation files (the "Software"), to deal
+ * in the Software without restriction, including without limitation the rights
+ * to use, copy, modify, merge, publish, distribute, sublicense, and/or sell
+ * copies of the Software, and to permit persons to whom the Software is
+ * furnished to do so, subject to the following conditions:
+ *
+ * The above copyright notice and this permission notice shall be included in
+ * all copies or substantial portions of the Software.
+ *
+ * THE SOFTWARE IS PROVIDED "AS IS", WITHOUT WARRANTY OF ANY KIND, EXPRESS OR
+ * IMPLIED, INCLUDING BUT NOT LIMITED TO THE WARRANTIES OF MERCHANTABILITY,
+ * FITNESS FOR A PARTICULAR PURPOSE AND NONINFRINGEMENT. IN NO EVENT SHALL THE
+ * AUTHORS OR COPYRIGHT HOLDERS BE LIABLE FOR ANY CLAIM, DAMAGES OR OTHER
+ * LIABILITY, WHETHER IN AN ACTION OF CONTRACT, TORT OR OTHERWISE, ARISING FROM,
+ * OUT OF OR IN CONNECTION WITH THE SOFTWARE OR THE USE OR OTHER DEALINGS IN
+ * THE SOFTWARE.
+ * -----------------------------------------------------------------------------
+ * Notes: If you're looking at a version of this file with the extension .c then
+ * you're looking at generated code. For the original test specifications, please
+ * look at the file with the .spec extension instead.
+ */
+
+#include "cspec.h"
+#include "spec_includes.h"
+#include "erlxsl_capture.h"
+
+static char *traffic_input = "<input />";
+static char *traffic_xsl = "<xsl:stylesheet />";
+
+static ParameterListNode*
+traffic_param(const char *key, const char *value, ParameterListNode *next) {
+    ParameterListNode *param = ALLOC(sizeof(ParameterListNode));
+    param->key = ALLOC(strlen(key) + 1);
+    param->value = ALLOC(strlen(value) + 1);
+    strcpy(param->key, key);
+    strcpy(param->value, value);
+    param->next = next;
+    return param;
+};
+
+static void
+traffic_task(XslTask *task, ParameterListNode *params) {
+    PayloadSize hsize = { strlen(traffic_input), strlen(traffic_xsl) };
+    InputSpec hspec = { .param_grp_arity = 0, .input_kind = Text, .xsl_kind = Text, .borrowed = 1 };
+    init_task(task, &hsize, &hspec, traffic_input, traffic_xsl);
+    task->parameters = params;
+};
+
+describe "Recording requests in a traffic log"
+
+    it "should count the parameters of the request"
+        XslTask task;
+        TrafficRequest request;
+        char *params;
+
+        traffic_task(&task, traffic_param("a", "1", traffic_param("b", "2", NULL)));
+        memset(&request, 0, sizeof(TrafficRequest));
+        params = traffic_describe_task(&request, &task);
+
+        params should not be NULL;
+        request.param_count should equal 2;
+        request.params_hash should not equal 0;
+
+        DRV_FREE(params);
+        free_task(&task);
+    end
+
+    it "should leave the parameter fields clear for requests without any"
+        XslTask task;
+        TrafficRequest request;
+
+        traffic_task(&task, NULL);
+        memset(&request, 0, sizeof(TrafficRequest));
+
+        traffic_describe_task(&request, &task) should be NULL;
+        request.param_count should equal 0;
+        request.params_hash should equal 0;
+
+        free_task(&task);
+    end
+
+end
+
+describe "Replaying requests from a traffic log"
+
+    it "should rebuild the parameters of the recorded request"
+        XslTask task;
+        TrafficRequest request;
+        TrafficHeader header;
+        TrafficRecord record;
+        ParameterListNode *replayed = NULL;
+        UInt32 replayed_count = 0;
+        ParameterListNode *param;
+        char *params;
+        char *body;
+        FILE *log = tmpfile();
+
+        traffic_task(&task, traffic_param("a", "1", traffic_param("b", "2", NULL)));
+        memset(&request, 0, sizeof(TrafficRequest));
+        params = traffic_describe_task(&request, &task);
+        traffic_write_header(log, 0);
+        traffic_write_body(log, TrafficParameters, request.params_hash, params, request.params_size);
+        traffic_write_request(log, &request);
+        DRV_FREE(params);
+        free_task(&task);
+
+        rewind(log);
+        traffic_read_header(log, &header) should be Success;
+        while (traffic_read_record(log, &record, &body) > 0) {
+            if (record.type == TrafficBodyRecord) {
+                replayed = traffic_decode_params(body, record.body.size);
+                DRV_FREE(body);
+            }
+        }
+        fclose(log);
+
+        record.type should equal TrafficRequestRecord;
+        record.request.param_count should equal 2;
+        for (param = replayed; param != NULL; param = (ParameterListNode*)param->next) {
+            replayed_count++;
+        }
+        replayed_count should equal record.request.param_count;
+        replayed->key should be_equal_to "a";
+        replayed->value should be_equal_to "1";
+
+        free_parameters(replayed);
+    end
+
+end
@@ -32,7 +32,12 @@
 -include("erlxsl.hrl").
 
 %% Public API Exports
--export([pack/4, pack/5]).
+-export([pack/4, pack/5, pack/6, pack_command/1]).
+
+%% flags for the optional (64bit) header fields
+-define(TRACE_FLAG, 16#01).
+-define(ENGINE_FLAG, 16#02).
+-define(BATCH_REPLY_FLAG, 16#04).
 
 %% FIXME: tighten up spec for /headers to specify the allowed range of atoms
 
@@ -50,19 +55,83 @@ when is_binary(Input) andalso is_binary(Xsl) ->
 -spec(pack(InputType::atom(), XslType::atom(),
            Input::binary(), Xsl::binary(), [{binary(), binary()}]) -> iolist()).
 pack(InputType, XslType, Input, Xsl, Params) ->
+    pack(InputType, XslType, Input, Xsl, Params, []).
+
+%% @doc Packs the request as pack/5 does, additionally encoding any of the
+%% following request options into the header:
+%% <ul>
+%%   <li>{trace, TraceId} - a non-zero integer identifying the request in the
+%%       driver's trace log</li>
+%%   <li>{submitted, Micros} - the (wall clock) time at which the client
+%%       submitted a traced request</li>
+%%   <li>{engine_index, Index} - the engine to run the request on, given as
+%%       its index in the order the driver loaded its engines</li>
+%%   <li>{reply_id, Id} - asks for the reply to be batched with others to the
+%%       same caller, in a {results, Port, Replies} message in which it is
+%%       identified by Id (an integer)</li>
+%% </ul>
+-spec(pack(InputType::atom(), XslType::atom(),
+           Input::binary(), Xsl::binary(), [{binary(), binary()}],
+           proplist()) -> iolist()).
+pack(InputType, XslType, Input, Xsl, Params, Options)
+when is_binary(Input) andalso is_binary(Xsl) ->
     PSize = length(Params),
     T1 = pack(InputType),
     T2 = pack(XslType),
     B1 = byte_size(Input),
     B2 = byte_size(Xsl),
+    {Flags, Extra} = pack_options(Options),
     %% FIXME: whilst more than max uint8_t parameters is unlikely, it would
     %% be good to deal with this limitation more explicitly (or remove it)
     [<<PSize:8/native,
        T1:8/native,
        T2:8/native,
+       Flags:8/native,
        B1:64/native,
-       B2:64/native>>,
+       B2:64/native,
+       Extra/binary>>,
        Input, Xsl].
 
+%% @doc Packs an engine command - a {Tag, Value} pair, or a list of (at most
+%% 255) of them - into the compact form the driver decodes engine commands
+%% from. Each item is written as its tag and value lengths, followed by the
+%% (NUL terminated) tag and value, which lets the driver hand the engine
+%% pointers into the request rather than copies of it.
+-spec(pack_command({atom(), iodata()} | [{atom(), iodata()}]) -> binary()).
+pack_command({Tag, _}=Item) when is_atom(Tag) ->
+    pack_command([Item]);
+pack_command(Items) when is_list(Items) andalso length(Items) < 256 ->
+    iolist_to_binary([length(Items)|[ pack_item(Item) || Item <- Items ]]).
+
+pack_item({Tag, Value}) when is_atom(Tag) ->
+    T = atom_to_binary(Tag, latin1),
+    V = iolist_to_binary(Value),
+    <<(byte_size(T)):8/native, (byte_size(V)):32/native,
+      T/binary, 0:8, V/binary, 0:8>>.
+
+%% the optional headers are written in flag order
+pack_options(Options) ->
+    {Flags, Trace} =
+    case proplists:get_value(trace, Options) of
+        TraceId when is_integer(TraceId) andalso TraceId > 0 ->
+            Submitted = proplists:get_value(submitted, Options, 0),
+            {?TRACE_FLAG, <<TraceId:64/native, Submitted:64/native>>};
+        _ ->
+            {0, <<>>}
+    end,
+    {Flags2, Engine} =
+    case proplists:get_value(engine_index, Options) of
+        Index when is_integer(Index) andalso Index >= 0 ->
+            {Flags bor ?ENGINE_FLAG, <<Trace/binary, Index:64/native>>};
+        _ ->
+            {Flags, Trace}
+    end,
+    case proplists:get_value(reply_id, Options) of
+        Id when is_integer(Id) andalso Id >= 0 ->
+            {Flags2 bor ?BATCH_REPLY_FLAG, <<Engine/binary, Id:64/native>>};
+        _ ->
+            {Flags2, Engine}
+    end.
+
 pack(?BUFFER_INPUT) -> 0;
 pack(?FILE_INPUT) -> 1.
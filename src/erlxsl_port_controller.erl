@@ -42,10 +42,28 @@
 
 %% Public API Exports
 -export([start/0, start_link/0, start/1,
-                 start_link/1, stop/0, transform/2]).
+                 start_link/1, stop/0, transform/2, transform/3,
+                 transform_all/1, transform_all/2,
+                 configure/2, stats/0, set_stylesheet_engine/2,
+                 reload_engine/2, engine_command/1]).
 
 -define(SERVER, ?MODULE).
+-define(PORT_ENGINE, 7).      %% magic number for passing a command to the default engine
 -define(PORT_INIT, 9).        %% magic number indicating that the port should initialize itself
+-define(PORT_CONFIGURE, 11).  %% magic number for adjusting a driver setting
+-define(PORT_STATS, 13).      %% magic number for fetching driver statistics
+-define(PORT_RELOAD, 15).     %% magic number for staging/switching a replacement engine
+-define(WARMUP_INPUT, <<"<warmup/>">>).
+-define(WARMUP_TIMEOUT, 5000).
+-define(DRIVER_SETTINGS, [perf_sample_rate, trace_file,
+                          trace_threshold_us, trace_flush_interval_ms,
+                          capture_dir, capture_threshold_ms,
+                          capture_rate_per_min, capture_max_bytes,
+                          capture_max_total_bytes, traffic_file,
+                          traffic_body_rate, traffic_max_total_bytes,
+                          shadow_engine, shadow_sample_rate, shadow_max_pending,
+                          transform_slice_us, transform_batch_max,
+                          inline_max_us, inline_max_input]).
 -define(DIVIDER, list_to_binary(lists:seq(1, 65))).
 
 -record(state, {
@@ -55,6 +73,17 @@
     driver        :: string(),
     load_path     :: string(),
     bin_heap_div  :: binary(),
+    settings = [] :: [{atom(), number() | string()}],
+    extra_engines = [] :: [{atom(), string()}],
+    %% engine names, mapped to their index in the driver's load order
+    engines = [] :: [{atom(), non_neg_integer()}],
+    %% stylesheets with a default engine, keyed by size, as a list of
+    %% {Digest, EngineIndex, Xsl} for each size
+    stylesheet_engines = dict:new() :: dict(),
+    %% engines with a replacement currently being warmed up
+    reloading = [] :: [atom()],
+    %% engine commands running on the driver's workers, by request id
+    commands = [] :: [{integer(), term()}],
     clients = []  :: [{pid(), pid()}]     %% TODO: consider ets instead of in-proc state...
 }).
 
@@ -82,10 +111,51 @@ stop() ->
 
 %% @doc Transforms 'Input' using the supplied 'Xsl' stylesheet.
 transform(Input, Xsl) ->
-    processing = gen_server:call(?SERVER, {transform, Input, Xsl}),
+    transform(Input, Xsl, []).
+
+%% @doc Transforms 'Input' using the supplied 'Xsl' stylesheet. Passing
+%% {trace, TraceId} in the options records the request's spans in the
+%% driver's trace log (see the trace_file setting), and returns the result
+%% as {Result, [{trace, TraceId}, {queue_us, Micros}, {engine_us, Micros}]},
+%% with the time the request spent queued and in the engine. Passing {engine, Name}
+%% runs the transform on the named engine (see the engines driver option),
+%% rather than the stylesheet's default (see set_stylesheet_engine/2).
+transform(Input, Xsl, Options) ->
+    case gen_server:call(?SERVER, {transform, Input, Xsl, request_options(Options)}) of
+        processing -> await_result();
+        {error, _}=Error -> Error
+    end.
+
+%% @doc Transforms each {Input, Xsl} pair in 'Requests', returning their
+%% results in the same order. See transform_all/2.
+transform_all(Requests) ->
+    transform_all(Requests, []).
+
+%% @doc Transforms each {Input, Xsl} pair in 'Requests' as transform/3 does,
+%% applying 'Options' to each, and returns their results in the same order
+%% (as {error, Reason} for those which failed). The driver sends the replies
+%% of requests completing together in a single message, which keeps the cost
+%% of each down when many are submitted at once.
+transform_all(Requests, Options) ->
+    case gen_server:call(?SERVER, {transform_all, Requests, request_options(Options)}) of
+        processing -> await_results();
+        {error, _}=Error -> Error
+    end.
+
+await_results() ->
+    receive
+        {_Ref, {results, Results}} ->
+            Results;
+        {_Ref, {error, _}=Err} ->
+            Err
+    end.
+
+await_result() ->
     receive
         {_Ref, {result, _, Result}} ->
             Result;
+        {_Ref, {result, _, Result, {TraceId, Queued, Engine}}} ->
+            {Result, [{trace, TraceId}, {queue_us, Queued}, {engine_us, Engine}]};
         {_Ref, {error, _}=Err} ->
             Err;
         {data, Data} ->
@@ -93,6 +163,111 @@ transform(Input, Xsl) ->
         Other -> Other
     end.
 
+%% @doc Adjusts a driver setting at runtime. The supported settings are
+%% <ul>
+%%   <li>perf_sample_rate - fraction (0.0 - 1.0) of transforms for which
+%%       hardware performance counters are sampled (0 disables sampling)</li>
+%%   <li>trace_file - path of the (Chrome trace-event format) file traced
+%%       requests are written to; tracing is off until this is set, and an
+%%       empty string switches it off again</li>
+%%   <li>trace_threshold_us - only traced requests taking at least this
+%%       many microseconds end to end are recorded</li>
+%%   <li>trace_flush_interval_ms - how often the trace log is written out</li>
+%%   <li>capture_dir - directory into which slow requests are captured, for
+%%       replay with erlxsl_replay; an empty string switches capturing off</li>
+%%   <li>capture_threshold_ms - transforms taking at least this long are
+%%       captured (default 1000)</li>
+%%   <li>capture_rate_per_min - maximum captures per minute (default 10)</li>
+%%   <li>capture_max_bytes - requests larger than this are never captured
+%%       (default 1Mb)</li>
+%%   <li>capture_max_total_bytes - capturing stops once this many bytes have
+%%       been written (default 64Mb)</li>
+%%   <li>traffic_file - path of the traffic log every request is recorded to,
+%%       for replay with erlxsl_bench; an empty string closes the log</li>
+%%   <li>traffic_body_rate - fraction (0.0 - 1.0) of previously unseen
+%%       documents written to the traffic log (default 1.0)</li>
+%%   <li>traffic_max_total_bytes - requests are no longer recorded once this
+%%       many bytes have been written (default 256Mb)</li>
+%%   <li>shadow_engine - name of an engine (see the engines driver option)
+%%       on which sampled requests are run a second time, to compare its
+%%       results and latency with those of the engine which served them;
+%%       none switches shadowing off</li>
+%%   <li>shadow_sample_rate - fraction (0.0 - 1.0) of requests to shadow</li>
+%%   <li>shadow_max_pending - sampled requests are skipped whilst this many
+%%       shadow runs are outstanding (default 4)</li>
+%%   <li>transform_slice_us - engines able to yield (see erlxsl.h) give up
+%%       their worker thread after this many microseconds, letting queued
+%%       requests run before they resume (default 10000); 0 never yields</li>
+%%   <li>transform_batch_max - the most queued requests handed to an engine
+%%       in one call, for engines able to batch them (default 16, at most
+%%       64); 1 runs every request on its own</li>
+%%   <li>inline_max_us - small requests whose stylesheet the engine has
+%%       already compiled are run straight away on the scheduler, rather than
+%%       being queued, if the engine's (learned) average time for the
+%%       stylesheet is less than both this and the (learned) cost of queueing
+%%       them (default 100); 0 always queues requests, as does turning on
+%%       the slow or traffic logs</li>
+%%   <li>inline_max_input - only documents up to this many bytes are
+%%       considered for running inline (default 1024)</li>
+%% </ul>
+-spec(configure(Key::atom(), Value::number() | string() | atom()) ->
+      ok | {error, term()}).
+configure(Key, Value) ->
+    gen_server:call(?SERVER, {configure, Key, Value}).
+
+%% @doc Sets the engine 'Xsl' is transformed with, unless a request names
+%% another. Engines are named in the engines driver option, and the engine
+%% given by the engine option is named default.
+-spec(set_stylesheet_engine(Xsl::binary(), Engine::atom()) ->
+      ok | {error, {unknown_engine, atom()}}).
+set_stylesheet_engine(Xsl, Engine) when is_binary(Xsl) andalso is_atom(Engine) ->
+    gen_server:call(?SERVER, {set_stylesheet_engine, Xsl, Engine}).
+
+%% @doc Replaces the named engine with the library at 'Path', without
+%% dropping any requests. The replacement is loaded alongside the running
+%% engine and warmed up by transforming a small document with each stylesheet
+%% registered to the engine (see set_stylesheet_engine/2), after which new
+%% requests are switched over to it. The replaced engine is unloaded once the
+%% requests it is still processing have completed. If any warm up transform
+%% fails or times out, the replacement is discarded instead, and the result is
+%% {error, {warmup_failed, Reason}}.
+-spec(reload_engine(Engine::atom(), Path::string()) -> ok | {error, term()}).
+reload_engine(Engine, Path) when is_atom(Engine) andalso is_list(Path) ->
+    gen_server:call(?SERVER, {reload_engine, Engine, Path}, infinity).
+
+%% @doc Passes a {Tag, Value} command (or a list of them) to the default
+%% engine, packed by erlxsl_marshall:pack_command/1. Commands are run
+%% on the driver's workers, so long running ones never hold up a scheduler,
+%% unless the engine declares them trivial (see erlxsl.h), in which case they
+%% run straight away. Either way the caller gets the engine's result.
+-spec(engine_command({Tag::atom(), Value::iodata()} | [{atom(), iodata()}]) ->
+      {ok, binary()} | {error, term()}).
+engine_command(Cmd) ->
+    gen_server:call(?SERVER, {engine_command, erlxsl_marshall:pack_command(Cmd)}, infinity).
+
+%% @doc Returns the statistics gathered by the driver, as a proplist of
+%% sections. The perf section holds the sampled hardware counters, aggregated
+%% per stylesheet hash. The engines section holds a proplist for each loaded
+%% engine (the default first), giving its library, the ABI version it
+%% implements, the capabilities negotiated with it, the number of requests
+%% routed to it, the number of those still in flight, the number of per-worker
+%% contexts it has created, and for engines able to batch requests, the number
+%% of batches run, the requests run in them and the largest batch. The
+%% draining_engines section counts the replaced engines (see reload_engine/2)
+%% still waiting to be unloaded. The shadow section counts the requests run
+%% again on the shadow engine (see configure/2), how many of its results
+%% differed from the originals, and the total engine time taken by each. The
+%% slicing section gives the current transform_slice_us, the number of times
+%% transforms have yielded, how many transforms yielded at least once and the
+%% most any one of them yielded. The inline section gives the inline settings,
+%% the current threshold, the average time queued requests spend outside the
+%% engine, the number of requests run inline and the time they took, and the
+%% number of small requests queued because they were predicted to take too
+%% long.
+-spec(stats() -> proplist()).
+stats() ->
+    gen_server:call(?SERVER, stats).
+
 %% gen_server api
 
 init(Config) ->
@@ -109,20 +284,103 @@ init(Config) ->
             init_driver(State)
     end.
 
-handle_call({transform, Input, Stylesheet}, From,
+handle_call({transform, Input, Stylesheet, Options}, From,
                         #state{ clients=CL }=State) ->
-    WorkerPid = handle_transform(?BUFFER_INPUT, ?BUFFER_INPUT, Input,
-                                                             Stylesheet, From, State),
-    NewState = State#state{ clients=[{WorkerPid, From}|CL] },
-    {reply, processing, NewState};
+    case engine_options(Stylesheet, Options, State) of
+        {ok, EngineOptions} ->
+            WorkerPid = handle_transform(?BUFFER_INPUT, ?BUFFER_INPUT, Input,
+                                         Stylesheet, EngineOptions, From, State),
+            NewState = State#state{ clients=[{WorkerPid, From}|CL] },
+            {reply, processing, NewState};
+        {error, _}=Error ->
+            {reply, Error, State}
+    end;
+handle_call({transform_all, Requests, Options}, From,
+                        #state{ clients=CL }=State) ->
+    Resolved = [ {Input, Xsl, engine_options(Xsl, Options, State)} || {Input, Xsl} <- Requests ],
+    case [ Error || {_, _, {error, _}=Error} <- Resolved ] of
+        [] ->
+            WorkerPid = handle_transform_all([ {Input, Xsl, EngineOptions} ||
+                                               {Input, Xsl, {ok, EngineOptions}} <- Resolved ],
+                                             From, State),
+            NewState = State#state{ clients=[{WorkerPid, From}|CL] },
+            {reply, processing, NewState};
+        [Error|_] ->
+            {reply, Error, State}
+    end;
+handle_call({set_stylesheet_engine, Xsl, Engine}, _From,
+            #state{ engines=Engines, stylesheet_engines=Defaults }=State) ->
+    case proplists:get_value(Engine, Engines) of
+        undefined ->
+            {reply, {error, {unknown_engine, Engine}}, State};
+        Index ->
+            Digest = erlang:md5(Xsl),
+            Entries = case dict:find(byte_size(Xsl), Defaults) of
+                {ok, Found} -> Found;
+                error -> []
+            end,
+            Updated = lists:keystore(Digest, 1, Entries, {Digest, Index, Xsl}),
+            {reply, ok, State#state{ stylesheet_engines=dict:store(byte_size(Xsl), Updated, Defaults) }}
+    end;
+handle_call({configure, Key, Value}, _From, #state{ port=Port }=State) ->
+    {reply, configure_port(Port, driver_setting({Key, Value}, State)), State};
+handle_call(stats, _From, #state{ port=Port }=State) ->
+    {reply, erlang:port_call(Port, ?PORT_STATS, []), State};
+handle_call({reload_engine, Engine, Path}, From,
+            #state{ port=Port, engines=Engines, reloading=Reloading }=State) ->
+    case {proplists:get_value(Engine, Engines), lists:member(Engine, Reloading)} of
+        {undefined, _} ->
+            {reply, {error, {unknown_engine, Engine}}, State};
+        {_, true} ->
+            {reply, {error, {reload_in_progress, Engine}}, State};
+        {Index, false} ->
+            case erlang:port_call(Port, ?PORT_RELOAD, {stage, Path}) of
+                {ok, Staged} ->
+                    warm_up(Engine, Index, Staged, From, State),
+                    {noreply, State#state{ reloading=[Engine|Reloading] }};
+                {error, _}=Error ->
+                    {reply, Error, State}
+            end
+    end;
+handle_call({engine_command, Cmd}, From,
+            #state{ port=Port, commands=Commands }=State) ->
+    case erlang:port_call(Port, ?PORT_ENGINE, Cmd) of
+        {pending, Id} ->
+            %% the driver sends the result once a worker has run the command
+            {noreply, State#state{ commands=[{Id, From}|Commands] }};
+        Reply ->
+            {reply, Reply, State}
+    end;
 handle_call(_Msg, _From, State) ->
     {noreply, State}.
 
 handle_cast(stop, State) ->
     {stop, shutdown, State};
+handle_cast({switch_engine, Engine, Index, Staged, Client},
+            #state{ port=Port, reloading=Reloading }=State) ->
+    gen_server:reply(Client, erlang:port_call(Port, ?PORT_RELOAD, {switch, Index, Staged})),
+    {noreply, State#state{ reloading=lists:delete(Engine, Reloading) }};
+handle_cast({discard_engine, Engine, Staged, Client, Reason},
+            #state{ port=Port, reloading=Reloading }=State) ->
+    %% the running engine is left in place
+    erlang:port_call(Port, ?PORT_RELOAD, {discard, Staged}),
+    gen_server:reply(Client, {error, {warmup_failed, Reason}}),
+    {noreply, State#state{ reloading=lists:delete(Engine, Reloading) }};
 handle_cast(_, State) ->
     {noreply, State}.
 
+handle_info({command, _Port, Id, Tag, Result},
+            #state{ commands=Commands }=State) ->
+    case lists:keytake(Id, 1, Commands) of
+        {value, {Id, Client}, Rest} ->
+            gen_server:reply(Client, case Tag of
+                                         result -> {ok, Result};
+                                         error -> {error, Result}
+                                     end),
+            {noreply, State#state{ commands=Rest }};
+        false ->
+            {noreply, State}
+    end;
 handle_info({'EXIT', _, normal}, State) ->
     %% worker has completed successfully
     {noreply, State};
@@ -143,7 +401,7 @@ code_change(_OldVsn, State, _Extra) ->
 
 %% private api
 
-handle_transform(InType, XslType, Input, Stylesheet, Client,
+handle_transform(InType, XslType, Input, Stylesheet, Options, Client,
                                  #state{ port=Port, logger=Log, bin_heap_div=_Dv }) ->
     %% TODO: don't let this potentially hang for ever:
     %%             (a) we might never receive a response, so use a (configurable?) timeout
@@ -151,19 +409,132 @@ handle_transform(InType, XslType, Input, Stylesheet, Client,
         fun() ->
             %% TODO: find a neater way of doing this 'pause until ready' thing
             port_command(Port,
-              erlxsl_marshall:pack(InType, XslType, Input, Stylesheet)),
+              pack_request(InType, XslType, Input, Stylesheet, Options)),
             receive
                 Data -> gen_server:reply(Client, Data)
             end
         end
     ).
 
+%% submits each request under a reply id (its position in the list), and
+%% collects the batched replies the driver sends back for them
+handle_transform_all(Requests, Client, #state{ port=Port }) ->
+    spawn_link(
+        fun() ->
+            Count = lists:foldl(
+                fun({Input, Stylesheet, Options}, Id) ->
+                    port_command(Port,
+                      pack_request(?BUFFER_INPUT, ?BUFFER_INPUT, Input,
+                                   Stylesheet, [{reply_id, Id}|Options])),
+                    Id + 1
+                end, 0, Requests),
+            gen_server:reply(Client, {results, collect_replies(Count, [])})
+        end
+    ).
+
+collect_replies(0, Replies) ->
+    [ Result || {_, Result} <- lists:keysort(1, Replies) ];
+collect_replies(Count, Replies) ->
+    receive
+        {results, _Port, Batch} ->
+            collect_replies(Count - length(Batch),
+                            [ batched_reply(Reply) || Reply <- Batch ] ++ Replies)
+    end.
+
+batched_reply({result, Id, Result}) ->
+    {Id, Result};
+batched_reply({result, Id, Result, {TraceId, Queued, Engine}}) ->
+    {Id, {Result, [{trace, TraceId}, {queue_us, Queued}, {engine_us, Engine}]}};
+batched_reply({error, Id, Reason}) ->
+    {Id, {error, Reason}};
+batched_reply({error, Id, Reason, _}) ->
+    {Id, {error, Reason}}.
+
+%% runs each stylesheet registered to the engine at 'Index' through the staged
+%% replacement, so its caches are populated before it starts taking requests
+warm_up(Engine, Index, Staged, Client,
+        #state{ port=Port, stylesheet_engines=Defaults }) ->
+    Stylesheets = [ Xsl || {_, Entries} <- dict:to_list(Defaults),
+                           {_, I, Xsl} <- Entries, I =:= Index ],
+    spawn_link(
+        fun() ->
+            case warm_up_each(Port, Staged, Stylesheets) of
+                ok ->
+                    gen_server:cast(?SERVER, {switch_engine, Engine, Index, Staged, Client});
+                {error, Reason} ->
+                    gen_server:cast(?SERVER, {discard_engine, Engine, Staged, Client, Reason})
+            end
+        end
+    ).
+
+%% transforms the warm up document with each stylesheet in turn, giving up at
+%% the first which fails or times out - a late reply would otherwise be taken
+%% for the next stylesheet's
+warm_up_each(_Port, _Staged, []) ->
+    ok;
+warm_up_each(Port, Staged, [Xsl|Rest]) ->
+    port_command(Port, pack_request(?BUFFER_INPUT, ?BUFFER_INPUT, ?WARMUP_INPUT,
+                                    Xsl, [{engine_index, Staged}])),
+    receive
+        {result, Port, _} -> warm_up_each(Port, Staged, Rest);
+        {error, Port, Reason} -> {error, Reason}
+    after ?WARMUP_TIMEOUT ->
+        {error, timeout}
+    end.
+
+pack_request(InType, XslType, Input, Stylesheet, []) ->
+    erlxsl_marshall:pack(InType, XslType, Input, Stylesheet);
+pack_request(InType, XslType, Input, Stylesheet, Options) ->
+    erlxsl_marshall:pack(InType, XslType, Input, Stylesheet, [], Options).
+
+%% resolves the engine a request runs on - the engine named in its options,
+%% or else the stylesheet's default - to the index the driver knows it by
+engine_options(Xsl, Options, #state{ engines=Engines, stylesheet_engines=Defaults }) ->
+    case proplists:get_value(engine, Options) of
+        undefined ->
+            case default_engine(Xsl, Defaults) of
+                {ok, Index} -> {ok, [{engine_index, Index}|Options]};
+                error -> {ok, Options}
+            end;
+        Engine ->
+            case proplists:get_value(Engine, Engines) of
+                undefined -> {error, {unknown_engine, Engine}};
+                Index -> {ok, [{engine_index, Index}|proplists:delete(engine, Options)]}
+            end
+    end.
+
+%% finds the stylesheet's default engine without hashing the whole stylesheet
+%% on every request - only stylesheets the size of one with a default are
+%% digested, and there is nothing to look up at all until a default is set
+default_engine(Xsl, Defaults) ->
+    case dict:size(Defaults) =:= 0 orelse dict:find(byte_size(Xsl), Defaults) of
+        {ok, Entries} ->
+            case lists:keyfind(erlang:md5(Xsl), 1, Entries) of
+                {_, Index, _} -> {ok, Index};
+                false -> error
+            end;
+        _ ->
+            error
+    end.
+
+%% traced requests are stamped with their submission time by the client
+request_options(Options) ->
+    case proplists:is_defined(trace, Options) of
+        true ->
+            {Mega, Secs, Micros} = os:timestamp(),
+            [{submitted, (Mega * 1000000 + Secs) * 1000000 + Micros}|Options];
+        false ->
+            Options
+    end.
+
 init_config(Config) ->
     #state{
         logger=proplists:get_value(logger, Config, erlxsl_fast_log),
         engine=proplists:get_value(engine, Config, "default_provider"),
         driver=proplists:get_value(driver, Config, "erlxsl_drv"),
         bin_heap_div= ?DIVIDER,
+        settings=[ S || {K, _}=S <- Config, lists:member(K, ?DRIVER_SETTINGS) ],
+        extra_engines=proplists:get_value(engines, Config, []),
         load_path=proplists:get_value(load_path, Config, init_path())
     }.
 
@@ -189,10 +560,47 @@ init_lib(ok, #state{ driver=Driver }=State) ->
 init_port(#state{ port=Port, engine=Engine }=State) when is_list(Engine) ->
     erlxsl_fast_log:debug("configuring driver with ~p~n", [Engine]),
     try (erlang:port_call(Port, ?PORT_INIT, Engine)) of
-        configured -> {ok, State};
+        configured -> init_engines(State#state{ engines=[{default, 0}] });
         Other -> {stop, {unexpected_driver_state, Other}}
     catch
         _:Badness ->
             terminate(Badness, State),
             {stop, Badness}
     end.
+
+%% each further engine is loaded by another init call, taking the next index
+init_engines(#state{ extra_engines=[] }=State) ->
+    init_settings(State);
+init_engines(#state{ port=Port, extra_engines=[{Name, Path}|Rest],
+                     engines=Engines }=State) ->
+    erlxsl_fast_log:debug("loading engine ~p from ~p~n", [Name, Path]),
+    case erlang:port_call(Port, ?PORT_INIT, Path) of
+        configured ->
+            init_engines(State#state{ extra_engines=Rest,
+                                      engines=Engines ++ [{Name, length(Engines)}] });
+        Other ->
+            {stop, {engine_load_failed, Name, Other}}
+    end.
+
+init_settings(#state{ port=Port, settings=Settings }=State) ->
+    case [ {K, E} || {K, _}=S <- Settings,
+                     {error, _}=E <- [configure_port(Port, driver_setting(S, State))] ] of
+        [] -> {ok, State};
+        Errors -> {stop, {invalid_settings, Errors}}
+    end.
+
+configure_port(Port, {ok, Setting}) ->
+    erlang:port_call(Port, ?PORT_CONFIGURE, Setting);
+configure_port(_, {error, _}=Error) ->
+    Error.
+
+%% the driver knows engines by their index, rather than their name
+driver_setting({shadow_engine, none}, _) ->
+    {ok, {shadow_engine, -1}};
+driver_setting({shadow_engine, Engine}, #state{ engines=Engines }) ->
+    case proplists:get_value(Engine, Engines) of
+        undefined -> {error, {unknown_engine, Engine}};
+        Index -> {ok, {shadow_engine, Index}}
+    end;
+driver_setting(Setting, _) ->
+    {ok, Setting}.
@@ -0,0 +1,118 @@
+%
+% Copyright (c) Tim Watson, 2008 - 2010
+% All rights reserved.
+%
+% Redistribution and use in source and binary forms, with or without modification,
+% are permitted provided that the following conditions are met:
+%
+%     * Redistributions of source code must retain the above copyright notice,
+%       this list of conditions and the following disclaimer.
+%
+%     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+%        and the following disclaimer in the documentation and/or other materials provided with the distribution.
+%
+%     * Neither the name of the author nor the names of any contributors may be used to endorse or
+%        promote products derived from this software without specific prior written permission.
+%
+% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+% EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+% OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+% IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+% INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+% PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+% INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+% LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+% OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+%
+% @author Tim Watson [http://hyperthunk.wordpress.com]
+% @copyright (c) Tim Watson, 2008
+% @since: 29 Feb 2008
+% @version 0.3.0
+% @hidden
+% @doc  runs priv/bin/erlxsl_conform against each of the engine providers we build
+%
+
+-module(engine_conformance_SUITE).
+-author('Tim Watson <watson.timothy@gmail.com>').
+-compile(export_all).
+
+-include_lib("common_test/include/ct.hrl").
+-include_lib("eunit/include/eunit.hrl").
+-include_lib("hamcrest/include/hamcrest.hrl").
+-include("../include/test.hrl").
+
+%% a deliberately small matrix - the defaults are meant for benchmarking
+-define(MATRIX, "-s 1024,16384 -t 1,2 -d 50").
+-define(SYNTHETIC_PROFILE, "spin_us=20 allocs=10 output_ratio=2 chunk_bytes=512").
+
+% automatically registers all exported functions as test cases
+all() ->
+    ?EXPORT_TESTS(?MODULE).
+
+init_per_suite(C) ->
+    BaseDir = filename:rootname(filename:dirname(filename:absname(code:which(?MODULE))), "test"),
+    Runner = filename:join([BaseDir, "priv", "bin", "erlxsl_conform"]),
+    case filelib:is_regular(Runner) of
+        false ->
+            {skip, "erlxsl_conform has not been built - run 'make tools'"};
+        true ->
+            [{runner, Runner},
+             {engine_dir, filename:join([BaseDir, "priv", "bin"])},
+             {test_engine_dir, filename:join([BaseDir, "priv", "test", "bin"])}|C]
+    end.
+
+end_per_suite(_) ->
+    ok.
+
+test_engine_conforms(C) ->
+    conforms(test_engine_path(C, "test_engine.so"), "", C).
+
+async_test_engine_conforms(C) ->
+    conforms(test_engine_path(C, "async_test_engine.so"), "", C).
+
+sliced_test_engine_conforms(C) ->
+    conforms(test_engine_path(C, "sliced_test_engine.so"), "", C).
+
+batch_test_engine_conforms(C) ->
+    conforms(test_engine_path(C, "batch_test_engine.so"), "", C).
+
+libxslt_engine_conforms(C) ->
+    conforms(engine_path(C, "libxslt_engine.so"), "", C).
+
+synthetic_engine_conforms(C) ->
+    Profile = filename:join(?config(priv_dir, C), "synthetic.profile"),
+    ok = file:write_file(Profile, ?SYNTHETIC_PROFILE),
+    conforms(engine_path(C, "synthetic_engine.so"), "-x " ++ Profile, C).
+
+libxslt_engine_rejects_malformed_documents(C) ->
+    Report = run(engine_path(C, "libxslt_engine.so"), "-s 1024 -t 1 -d 10", C),
+    ?assertThat(check(rejects_malformed_input, Report), equal_to(pass)).
+
+batch_capable_engines_are_checked_in_batches(C) ->
+    Report = run(test_engine_path(C, "batch_test_engine.so"), "-s 1024 -t 1 -d 10", C),
+    ?assertThat(check(batch_matches_transform, Report), equal_to(pass)).
+
+conforms(Engine, Args, C) ->
+    Report = run(Engine, Args ++ " " ++ ?MATRIX, C),
+    Failures = [Check || {check, _, fail, _}=Check <- Report],
+    ?assertThat(Failures, equal_to([])),
+    [ct:pal("~p: ~p~n", [filename:basename(Engine), Perf]) || {perf, Perf} <- Report],
+    ?assertThat(lists:keyfind(summary, 1, Report), is_not(equal_to(false))).
+
+run(Engine, Args, C) ->
+    Output = filename:join(?config(priv_dir, C), filename:basename(Engine) ++ ".report"),
+    Cmd = string:join([?config(runner, C), Args, "-o", Output, Engine], " "),
+    ct:pal("running ~s~n", [Cmd]),
+    ct:pal("~s~n", [os:cmd(Cmd)]),
+    {ok, Report} = file:consult(Output),
+    Report.
+
+check(Name, Report) ->
+    {check, Name, Result, _} = lists:keyfind(Name, 2, Report),
+    Result.
+
+engine_path(C, Name) ->
+    filename:join(?config(engine_dir, C), Name).
+
+test_engine_path(C, Name) ->
+    filename:join(?config(test_engine_dir, C), Name).
@@ -0,0 +1,172 @@
+%
+% Copyright (c) Tim Watson, 2008 - 2010
+% All rights reserved.
+%
+% Redistribution and use in source and binary forms, with or without modification,
+% are permitted provided that the following conditions are met:
+%
+%     * Redistributions of source code must retain the above copyright notice,
+%       this list of conditions and the following disclaimer.
+%
+%     * Redistributions in binary form must reproduce the above copyright notice, this list of conditions
+%        and the following disclaimer in the documentation and/or other materials provided with the distribution.
+%
+%     * Neither the name of the author nor the names of any contributors may be used to endorse or
+%        promote products derived from this software without specific prior written permission.
+%
+% THIS SOFTWARE IS PROVIDED BY THE COPYRIGHT HOLDERS AND CONTRIBUTORS "AS IS" AND ANY
+% EXPRESS OR IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+% OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+% IN NO EVENT SHALL THE COPYRIGHT OWNER OR CONTRIBUTORS BE LIABLE FOR ANY DIRECT, INDIRECT,
+% INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT NOT LIMITED TO,
+% PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE, DATA, OR PROFITS; OR BUSINESS
+% INTERRUPTION) HOWEVER CAUSED AND ON ANY THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT
+% LIABILITY, OR TORT (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE
+% OF THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+%
+% @author Tim Watson [http://hyperthunk.wordpress.com]
+% @copyright (c) Tim Watson, 2008
+% @since: 29 Feb 2008
+% @version 0.3.0
+% @hidden
+% @doc  libxslt engine provider tests
+%
+
+-module(libxslt_engine_SUITE).
+-author('Tim Watson <watson.timothy@gmail.com>').
+-compile(export_all).
+
+-include_lib("common_test/include/ct.hrl").
+-include_lib("eunit/include/eunit.hrl").
+-include_lib("hamcrest/include/hamcrest.hrl").
+-include("../include/erlxsl.hrl").
+-include("../include/test.hrl").
+
+-define(STYLESHEET,
+    <<"<xsl:stylesheet xmlns:xsl='http://www.w3.org/1999/XSL/Transform' version='1.0'>"
+      "<xsl:output method='xml' omit-xml-declaration='yes'/>"
+      "<xsl:template match='/'><count><xsl:value-of select='count(//item)'/></count>"
+      "</xsl:template></xsl:stylesheet>">>).
+
+-define(PORT_INIT, 9).
+%% small enough that a few padded stylesheets fill the shared cache
+-define(CACHE_BYTES, 65536).
+
+% automatically registers all exported functions as test cases
+all() ->
+    ?EXPORT_TESTS(?MODULE).
+
+init_per_suite(C) ->
+    BaseDir  = filename:rootname(filename:dirname(filename:absname(code:which(?MODULE))), "test"),
+    PrivDir = filename:join(filename:join(BaseDir, "priv"), "bin"),
+    AppSpec = ct:get_config(test_app_config),
+    {application, erlxsl, Conf} = AppSpec,
+    {env, Env} = lists:keyfind(env, 1, Conf),
+    {driver_options, Opts} = lists:keyfind(driver_options, 1, Env),
+    UpdatedOpts = lists:keyreplace(load_path, 1, Opts, {load_path, PrivDir}),
+    UpdatedOpts2 = lists:keyreplace(engine, 1, UpdatedOpts,
+      {engine, filename:join(PrivDir, "libxslt_engine.so")}),
+    UpdatedEnv = lists:keyreplace(driver_options, 1, Env, {driver_options, UpdatedOpts2}),
+    UpdatedConf = lists:keyreplace(env, 1, Conf, {env, UpdatedEnv}),
+    %% read when the first port creates the shared stylesheet cache
+    os:putenv("ERLXSL_STYLESHEET_CACHE_BYTES", integer_to_list(?CACHE_BYTES)),
+    application:load({application, erlxsl, UpdatedConf}),
+    erlxsl_app:start(),
+    [{engine, filename:join(PrivDir, "libxslt_engine.so")}|C].
+
+end_per_suite(_) ->
+    erlxsl_app:stop(),
+    application:unload(erlxsl).
+
+applies_the_stylesheet(_) ->
+    ct:pal("applies_the_stylesheet", []),
+    X = erlxsl_port_controller:transform(<<"<root><item/><item/></root>">>, ?STYLESHEET),
+    ?assertThat(X, equal_to(<<"<count>2</count>\n">>)).
+
+compiled_stylesheets_are_reused(_) ->
+    ct:pal("compiled_stylesheets_are_reused", []),
+    Results = [ erlxsl_port_controller:transform(<<"<root><item/></root>">>, ?STYLESHEET)
+                || _ <- lists:seq(1, 20) ],
+    ?assertThat(lists:usort(Results), equal_to([<<"<count>1</count>\n">>])).
+
+malformed_documents_are_reported(_) ->
+    ct:pal("malformed_documents_are_reported", []),
+    ?assertMatch({_, {error, _, _}},
+                 erlxsl_port_controller:transform(<<"<root>">>, ?STYLESHEET)).
+
+engine_negotiates_its_fast_paths(_) ->
+    ct:pal("engine_negotiates_its_fast_paths", []),
+    [Engine] = proplists:get_value(engines, erlxsl_port_controller:stats()),
+    ?assertThat(proplists:get_value(abi, Engine), equal_to(2)),
+    ?assertThat(lists:sort(proplists:get_value(capabilities, Engine)),
+                equal_to([batch, binary_output, reentrant, stylesheet_cache,
+                          zero_copy_input])).
+
+cache_stats_report_the_hits_for_each_stylesheet(_) ->
+    ct:pal("cache_stats_report_the_hits_for_each_stylesheet", []),
+    [ erlxsl_port_controller:transform(<<"<root><item/></root>">>, ?STYLESHEET)
+      || _ <- lists:seq(1, 5) ],
+    {ok, Stats} = erlxsl_port_controller:engine_command({cache_stats, <<>>}),
+    [Summary|Entries] = binary:split(Stats, <<"\n">>, [global, trim]),
+    ?assertMatch({match, _}, re:run(Summary, "^entries=[1-9]")),
+    Hits = [ list_to_integer(binary_to_list(H))
+             || Entry <- Entries,
+                {match, [H]} <- [re:run(Entry, "hits=([0-9]+)", [{capture, all_but_first, binary}])] ],
+    ?assert(lists:max(Hits) >= 4).
+
+eviction_keeps_the_shared_cache_within_its_budget(Config) ->
+    ct:pal("eviction_keeps_the_shared_cache_within_its_budget", []),
+    Ports = open_engine_ports(?config(engine, Config), 4),
+    Sheets = lists:seq(1, 24),
+    Results = [ {N, transform_on_each_port(Ports, buffer, padded_stylesheet(N, 1024))}
+                || _ <- lists:seq(1, 2), N <- Sheets ],
+    [ port_close(Port) || Port <- Ports ],
+    [ ?assertThat(Replies, equal_to(lists:duplicate(length(Ports),
+        list_to_binary(["<count>", integer_to_list(N), "-1</count>\n"]))))
+      || {N, Replies} <- Results ],
+    {ok, Stats} = erlxsl_port_controller:engine_command({cache_stats, <<>>}),
+    [Summary|_] = binary:split(Stats, <<"\n">>),
+    {match, Totals} = re:run(Summary,
+        "^entries=([0-9]+) bytes=([0-9]+) retired_bytes=([0-9]+) max_bytes=([0-9]+)",
+        [{capture, all_but_first, list}]),
+    [Entries, Bytes, Retired, Max] = [ list_to_integer(T) || T <- Totals ],
+    ?assertThat(Max, equal_to(?CACHE_BYTES)),
+    ?assert(Bytes + Retired =< Max),
+    ?assert(Entries < length(Sheets)).
+
+stylesheets_are_matched_on_their_source_and_type(Config) ->
+    ct:pal("stylesheets_are_matched_on_their_source_and_type", []),
+    Path = list_to_binary(filename:join(?config(priv_dir, Config), "count.xsl")),
+    ok = file:write_file(Path, ?STYLESHEET),
+    Ports = open_engine_ports(?config(engine, Config), 1),
+    [FromFile] = transform_on_each_port(Ports, file, Path),
+    %% the uri is no stylesheet at all, so must not be given the file's cached entry
+    [FromBuffer] = transform_on_each_port(Ports, buffer, Path),
+    [ port_close(Port) || Port <- Ports ],
+    ?assertThat(FromFile, equal_to(<<"<count>1</count>\n">>)),
+    ?assertMatch({error, _}, FromBuffer).
+
+open_engine_ports(Engine, Count) ->
+    [ begin
+          Port = open_port({spawn, "erlxsl"}, [binary]),
+          configured = erlang:port_call(Port, ?PORT_INIT, Engine),
+          Port
+      end || _ <- lists:seq(1, Count) ].
+
+transform_on_each_port(Ports, XslType, Xsl) ->
+    Request = erlxsl_marshall:pack(buffer, XslType, <<"<root><item/></root>">>, Xsl),
+    [ port_command(Port, Request) || Port <- Ports ],
+    [ receive
+          {result, Port, Result} -> Result;
+          {error, Port, Reason} -> {error, Reason}
+      after 10000 -> timeout
+      end || Port <- Ports ].
+
+%% a distinct stylesheet, padded out with a comment so it costs more of the budget
+padded_stylesheet(N, Padding) ->
+    list_to_binary(
+      ["<xsl:stylesheet xmlns:xsl='http://www.w3.org/1999/XSL/Transform' version='1.0'>"
+       "<!--", lists:duplicate(Padding, $\s), "-->"
+       "<xsl:output method='xml' omit-xml-declaration='yes'/>"
+       "<xsl:template match='/'><count>", integer_to_list(N),
+       "-<xsl:value-of select='count(//item)'/></count></xsl:template></xsl:stylesheet>"]).
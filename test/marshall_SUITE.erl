@@ -62,11 +62,67 @@ standard_request_creates_nested_iolist(_) ->
     Headers = <<0:8/native,
                 1:8/native,
                 1:8/native,
+                0:8/native,
                 (byte_size(Xml)):64/native,
                 (byte_size(Xsl)):64/native>>,
     ExpectedStructure = [Headers, Xml, Xsl],
     ?assertThat(Packed, is(equal_to(ExpectedStructure))).
 
+traced_request_carries_trace_headers(_) ->
+    Xml = <<"<fragment><empty /></fragment>">>,
+    Xsl = <<"<?xml version='1.0'?>">>,
+    Packed = erlxsl_marshall:pack(?BUFFER_INPUT, ?BUFFER_INPUT, Xml, Xsl, [],
+                                  [{trace, 42}, {submitted, 1234567}]),
+    Headers = <<0:8/native,
+                0:8/native,
+                0:8/native,
+                1:8/native,
+                (byte_size(Xml)):64/native,
+                (byte_size(Xsl)):64/native,
+                42:64/native,
+                1234567:64/native>>,
+    ?assertThat(Packed, is(equal_to([Headers, Xml, Xsl]))).
+
+batched_replies_carry_their_reply_id_last(_) ->
+    Xml = <<"<fragment><empty /></fragment>">>,
+    Xsl = <<"<?xml version='1.0'?>">>,
+    Packed = erlxsl_marshall:pack(?BUFFER_INPUT, ?BUFFER_INPUT, Xml, Xsl, [],
+                                  [{reply_id, 9}, {engine_index, 2}]),
+    Headers = <<0:8/native,
+                0:8/native,
+                0:8/native,
+                6:8/native,
+                (byte_size(Xml)):64/native,
+                (byte_size(Xsl)):64/native,
+                2:64/native,
+                9:64/native>>,
+    ?assertThat(Packed, is(equal_to([Headers, Xml, Xsl]))).
+
+engine_selection_follows_the_trace_headers(_) ->
+    Xml = <<"<fragment><empty /></fragment>">>,
+    Xsl = <<"<?xml version='1.0'?>">>,
+    Packed = erlxsl_marshall:pack(?BUFFER_INPUT, ?BUFFER_INPUT, Xml, Xsl, [],
+                                  [{engine_index, 2}, {trace, 42}, {submitted, 7}]),
+    Headers = <<0:8/native,
+                0:8/native,
+                0:8/native,
+                3:8/native,
+                (byte_size(Xml)):64/native,
+                (byte_size(Xsl)):64/native,
+                42:64/native,
+                7:64/native,
+                2:64/native>>,
+    ?assertThat(Packed, is(equal_to([Headers, Xml, Xsl]))).
+
+engine_commands_are_length_prefixed(_) ->
+    Packed = erlxsl_marshall:pack_command([{transform, "<a/>"}, {cache, <<>>}]),
+    Expected = <<2:8/native,
+                 9:8/native, 4:32/native, "transform", 0:8, "<a/>", 0:8,
+                 5:8/native, 0:32/native, "cache", 0:8, 0:8>>,
+    ?assertThat(Packed, is(equal_to(Expected))),
+    ?assertThat(erlxsl_marshall:pack_command({cache, "x"}),
+                is(equal_to(<<1:8/native, 5:8/native, 1:32/native, "cache", 0:8, "x", 0:8>>))).
+
 parameterised_request_becomes_nested_iolist(_, _, _) ->
     Xml = <<"<fragment><empty /></fragment>">>,
     Xsl = <<"<?xml version='1.0'?>">>,
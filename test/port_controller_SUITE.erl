@@ -44,6 +44,9 @@
 
 % public api exports
 
+%% the engines init_per_suite loads, in the order the driver indexes them
+-define(ENGINES, [default, second, async, sliced, batch, zero_copy]).
+
 % automatically registers all exported functions as test cases
 all() ->
     ?EXPORT_TESTS(?MODULE).
@@ -65,14 +68,23 @@ init_per_suite(C) ->
     end,
     Lib = proplists:get_value(engine, UpdatedOpts),
     ct:pal("startup with lib ~p~n", [Lib]),
-    UpdatedOpts2 = lists:keyreplace(engine, 1, UpdatedOpts,
-      {engine, filename:join(filename:join(BaseDir, "priv/test/bin"), Lib)}),
+    EnginePath = filename:join(filename:join(BaseDir, "priv/test/bin"), Lib),
+    %% the same library is loaded a second time, so requests can be routed to it
+    AsyncPath = filename:join(filename:dirname(EnginePath), "async_test_engine.so"),
+    SlicedPath = filename:join(filename:dirname(EnginePath), "sliced_test_engine.so"),
+    BatchPath = filename:join(filename:dirname(EnginePath), "batch_test_engine.so"),
+    %% a v2 engine which reads the request binaries in place
+    ZeroCopyPath = filename:join(PrivDir, "synthetic_engine.so"),
+    UpdatedOpts2 = [{engines, [{second, EnginePath}, {async, AsyncPath},
+                               {sliced, SlicedPath}, {batch, BatchPath},
+                               {zero_copy, ZeroCopyPath}]}|
+                    lists:keyreplace(engine, 1, UpdatedOpts, {engine, EnginePath})],
     UpdatedEnv = lists:keyreplace(driver_options, 1, Env, {driver_options, UpdatedOpts2}),
     UpdatedConf = lists:keyreplace(env, 1, Conf, {env, UpdatedEnv}),
     TestAppSpec = {application, erlxsl, UpdatedConf},
     application:load(TestAppSpec),
     erlxsl_app:start(),
-    C.
+    [{engine_path, EnginePath}|C].
 
 end_per_suite(_) ->
     erlxsl_app:stop().
@@ -115,3 +127,253 @@ transform_small_binaries(Config) ->
     X = erlxsl_port_controller:transform(Xml, Xsl),
     ExpectedResult = binary_to_list(Xml) ++ binary_to_list(Xsl),
     ?assertThat(binary_to_list(X), equal_to(ExpectedResult)).
+
+perf_sampling_is_reported_per_stylesheet(Config) ->
+    ct:pal("perf_sampling_is_reported_per_stylesheet", []),
+    ?assertThat(erlxsl_port_controller:configure(perf_sample_rate, 1.0), equal_to(ok)),
+    {ok, Xsl} = file:read_file(?fixture(Config, "minimal.xsl")),
+    erlxsl_port_controller:transform(<<"<input />">>, Xsl),
+    ok = erlxsl_port_controller:configure(perf_sample_rate, 0),
+    Perf = proplists:get_value(perf, erlxsl_port_controller:stats()),
+    %% counters may legitimately be unavailable (e.g., perf_event_paranoid)
+    Attempts = proplists:get_value(sampled, Perf) +
+               proplists:get_value(unavailable, Perf),
+    ?assertThat(Attempts >= 1, is(true)).
+
+unknown_settings_are_rejected(_) ->
+    ct:pal("unknown_settings_are_rejected", []),
+    ?assertMatch({error, _}, erlxsl_port_controller:configure(no_such_setting, 1)),
+    ?assertMatch({error, _}, erlxsl_port_controller:configure(perf_sample_rate, 2.5)).
+
+traced_requests_are_written_to_the_trace_file(Config) ->
+    ct:pal("traced_requests_are_written_to_the_trace_file", []),
+    TraceFile = filename:join(?config(priv_dir, Config), "erlxsl.trace.json"),
+    ok = erlxsl_port_controller:configure(trace_file, TraceFile),
+    ok = erlxsl_port_controller:configure(trace_threshold_us, 0),
+    {ok, Xsl} = file:read_file(?fixture(Config, "minimal.xsl")),
+    %% spans are recorded on reply, and flushed by the next worker to run
+    erlxsl_port_controller:transform(<<"<input />">>, Xsl, [{trace, 1}]),
+    erlxsl_port_controller:transform(<<"<input />">>, Xsl, [{trace, 2}]),
+    {ok, Trace} = file:read_file(TraceFile),
+    ?assertMatch({_, _}, binary:match(Trace, <<"\"name\":\"transform\"">>)),
+    ?assertMatch({_, _}, binary:match(Trace, <<"0000000000000001">>)),
+    %% an empty path switches tracing off again
+    ok = erlxsl_port_controller:configure(trace_file, ""),
+    Tracing = proplists:get_value(trace, erlxsl_port_controller:stats()),
+    ?assertThat(proplists:get_value(enabled, Tracing), equal_to(false)).
+
+traced_requests_are_returned_with_their_timings(Config) ->
+    ct:pal("traced_requests_are_returned_with_their_timings", []),
+    {ok, Xsl} = file:read_file(?fixture(Config, "minimal.xsl")),
+    {Result, Timings} = erlxsl_port_controller:transform(<<"<input />">>, Xsl, [{trace, 3}]),
+    ?assertThat(is_binary(Result), is(true)),
+    ?assertThat(proplists:get_value(trace, Timings), equal_to(3)),
+    ?assertThat(is_integer(proplists:get_value(queue_us, Timings)), is(true)),
+    ?assertThat(is_integer(proplists:get_value(engine_us, Timings)), is(true)).
+
+slow_requests_are_captured_for_replay(Config) ->
+    ct:pal("slow_requests_are_captured_for_replay", []),
+    CaptureDir = filename:join(?config(priv_dir, Config), "captures"),
+    ok = file:make_dir(CaptureDir),
+    ok = erlxsl_port_controller:configure(capture_dir, CaptureDir),
+    ok = erlxsl_port_controller:configure(capture_threshold_ms, 0),
+    {ok, Xsl} = file:read_file(?fixture(Config, "minimal.xsl")),
+    erlxsl_port_controller:transform(<<"<input />">>, Xsl),
+    ok = erlxsl_port_controller:configure(capture_dir, ""),
+    ?assertMatch([_|_], filelib:wildcard(filename:join(CaptureDir, "*.xcap"))),
+    Capture = proplists:get_value(capture, erlxsl_port_controller:stats()),
+    ?assertThat(proplists:get_value(captured, Capture) >= 1, is(true)).
+
+traffic_is_recorded_for_replay(Config) ->
+    ct:pal("traffic_is_recorded_for_replay", []),
+    TrafficFile = filename:join(?config(priv_dir, Config), "traffic.xtrf"),
+    ok = erlxsl_port_controller:configure(traffic_file, TrafficFile),
+    {ok, Xsl} = file:read_file(?fixture(Config, "minimal.xsl")),
+    erlxsl_port_controller:transform(<<"<input />">>, Xsl),
+    erlxsl_port_controller:transform(<<"<input />">>, Xsl),
+    %% closing the log flushes it
+    ok = erlxsl_port_controller:configure(traffic_file, ""),
+    {ok, <<"XTRF", _/binary>>} = file:read_file(TrafficFile),
+    Traffic = proplists:get_value(traffic, erlxsl_port_controller:stats()),
+    ?assertThat(proplists:get_value(recorded, Traffic), equal_to(2)),
+    %% identical documents are only written once
+    ?assertThat(proplists:get_value(bodies, Traffic), equal_to(2)).
+
+legacy_engines_report_their_negotiated_capabilities(_) ->
+    ct:pal("legacy_engines_report_their_negotiated_capabilities", []),
+    Stats = erlxsl_port_controller:stats(),
+    ?assertThat(engine_stat(abi, default, Stats), equal_to(1)),
+    ?assertThat(engine_stat(capabilities, default, Stats), equal_to([reentrant])),
+    %% v1 engines have no thread_init hook, so keep no per-worker state
+    ?assertThat(engine_stat(workers, default, Stats), equal_to(0)).
+
+requests_are_routed_to_the_selected_engine(Config) ->
+    ct:pal("requests_are_routed_to_the_selected_engine", []),
+    {ok, Xsl} = file:read_file(?fixture(Config, "minimal.xsl")),
+    Before = erlxsl_port_controller:stats(),
+    erlxsl_port_controller:transform(<<"<input />">>, Xsl, [{engine, second}]),
+    ok = erlxsl_port_controller:set_stylesheet_engine(Xsl, second),
+    erlxsl_port_controller:transform(<<"<input />">>, Xsl),
+    ok = erlxsl_port_controller:set_stylesheet_engine(Xsl, default),
+    erlxsl_port_controller:transform(<<"<input />">>, Xsl),
+    After = erlxsl_port_controller:stats(),
+    ?assertThat([ engine_stat(requests, E, After) - engine_stat(requests, E, Before) ||
+                  E <- [default, second] ], equal_to([1, 2])),
+    ?assertMatch({error, {unknown_engine, missing}},
+                 erlxsl_port_controller:transform(<<"<input />">>, Xsl, [{engine, missing}])).
+
+engines_are_reloaded_without_dropping_requests(Config) ->
+    ct:pal("engines_are_reloaded_without_dropping_requests", []),
+    {ok, Xsl} = file:read_file(?fixture(Config, "minimal.xsl")),
+    ok = erlxsl_port_controller:set_stylesheet_engine(Xsl, second),
+    ok = erlxsl_port_controller:reload_engine(second, ?config(engine_path, Config)),
+    %% the replacement takes over the slot (and its counters), having been warmed
+    %% up with the stylesheet, so count from there
+    Before = erlxsl_port_controller:stats(),
+    erlxsl_port_controller:transform(<<"<input />">>, Xsl),
+    ok = erlxsl_port_controller:set_stylesheet_engine(Xsl, default),
+    Stats = erlxsl_port_controller:stats(),
+    ?assertThat(engine_stat(requests, second, Stats) -
+                engine_stat(requests, second, Before), equal_to(1)),
+    ?assertThat(proplists:get_value(draining_engines, Stats), equal_to(0)),
+    ?assertMatch({error, {unknown_engine, missing}},
+                 erlxsl_port_controller:reload_engine(missing, ?config(engine_path, Config))),
+    ?assertMatch({error, _}, erlxsl_port_controller:reload_engine(second, "no_such_engine.so")).
+
+shadowed_requests_are_compared_but_never_returned(Config) ->
+    ct:pal("shadowed_requests_are_compared_but_never_returned", []),
+    {ok, Xsl} = file:read_file(?fixture(Config, "minimal.xsl")),
+    Before = shadow_stat(compared, erlxsl_port_controller:stats()),
+    ok = erlxsl_port_controller:configure(shadow_engine, second),
+    ok = erlxsl_port_controller:configure(shadow_sample_rate, 1.0),
+    Result = erlxsl_port_controller:transform(<<"<input />">>, Xsl),
+    ?assert(is_binary(Result)),
+    %% the shadow run completes after the caller has its result
+    Shadow = wait_for_shadow_comparisons(Before + 1, 50),
+    ok = erlxsl_port_controller:configure(shadow_engine, none),
+    ok = erlxsl_port_controller:configure(shadow_sample_rate, 0),
+    %% both engines are the same library, so their results should agree
+    ?assertThat(proplists:get_value(mismatches, Shadow), equal_to(0)),
+    ?assertMatch({error, {unknown_engine, missing}},
+                 erlxsl_port_controller:configure(shadow_engine, missing)).
+
+zero_copy_requests_are_copied_for_legacy_shadow_engines(_) ->
+    ct:pal("zero_copy_requests_are_copied_for_legacy_shadow_engines", []),
+    Stats = erlxsl_port_controller:stats(),
+    ?assert(lists:member(zero_copy_input, engine_stat(capabilities, zero_copy, Stats))),
+    Before = shadow_stat(compared, Stats),
+    Skipped = shadow_stat(skipped, Stats),
+    %% the v1 test engine needs NUL terminated documents, which the request binaries aren't
+    ok = erlxsl_port_controller:configure(shadow_engine, default),
+    ok = erlxsl_port_controller:configure(shadow_sample_rate, 1.0),
+    %% (stylesheets under 64 bytes are copied by the emulator, so spell the profile out)
+    Profile = <<"spin_us=0 allocs=0 alloc_bytes=0 output_ratio=1.000000000000 chunk_bytes=0">>,
+    Result = erlxsl_port_controller:transform(<<"<input />">>, Profile, [{engine, zero_copy}]),
+    Shadow = wait_for_shadow_comparisons(Before + 1, 50),
+    ok = erlxsl_port_controller:configure(shadow_engine, none),
+    ok = erlxsl_port_controller:configure(shadow_sample_rate, 0),
+    ?assertThat(Result, equal_to(<<"<input />">>)),
+    %% the shadow run was given copies, rather than being skipped
+    ?assertThat(proplists:get_value(skipped, Shadow), equal_to(Skipped)).
+
+shadow_stat(Key, Stats) ->
+    proplists:get_value(Key, proplists:get_value(shadow, Stats)).
+
+%% (not arity 1, or ?EXPORT_TESTS would run it as a test case)
+wait_for_shadow_comparisons(Expected, Retries) ->
+    Shadow = proplists:get_value(shadow, erlxsl_port_controller:stats()),
+    case proplists:get_value(compared, Shadow) of
+        Compared when Compared < Expected andalso Retries > 0 ->
+            timer:sleep(10),
+            wait_for_shadow_comparisons(Expected, Retries - 1);
+        Compared ->
+            ?assertThat(Compared, equal_to(Expected)),
+            Shadow
+    end.
+
+engines_can_complete_transforms_asynchronously(Config) ->
+    ct:pal("engines_can_complete_transforms_asynchronously", []),
+    {ok, Xsl} = file:read_file(?fixture(Config, "minimal.xsl")),
+    Capabilities = engine_stat(capabilities, async, erlxsl_port_controller:stats()),
+    ?assert(lists:member(async_completion, Capabilities)),
+    %% the async test engine completes each transform from a thread of its own
+    Self = self(),
+    Inputs = [ list_to_binary(io_lib:format("<input n='~p' />", [N])) || N <- lists:seq(1, 20) ],
+    [ spawn_link(fun() ->
+          Self ! {done, Input,
+                  erlxsl_port_controller:transform(Input, Xsl, [{engine, async}])}
+      end) || Input <- Inputs ],
+    Results = [ receive {done, Input, Result} -> Result end || Input <- Inputs ],
+    ?assertThat(Results, equal_to([ <<Input/binary, Xsl/binary>> || Input <- Inputs ])).
+
+long_transforms_yield_between_time_slices(Config) ->
+    ct:pal("long_transforms_yield_between_time_slices", []),
+    {ok, Xsl} = file:read_file(?fixture(Config, "minimal.xsl")),
+    %% the sliced test engine checks whether to yield after every byte it writes
+    ok = erlxsl_port_controller:configure(transform_slice_us, 1),
+    Result = erlxsl_port_controller:transform(<<"<input />">>, Xsl, [{engine, sliced}]),
+    ok = erlxsl_port_controller:configure(transform_slice_us, 10000),
+    ?assertThat(Result, equal_to(<<"<input />", Xsl/binary>>)),
+    Slicing = proplists:get_value(slicing, erlxsl_port_controller:stats()),
+    ?assertThat(proplists:get_value(slice_us, Slicing), equal_to(10000)),
+    ?assert(proplists:get_value(yields, Slicing) > 0),
+    ?assert(proplists:get_value(yielded_jobs, Slicing) > 0),
+    ?assertMatch({error, _}, erlxsl_port_controller:configure(transform_slice_us, -1)).
+
+queued_requests_are_batched(Config) ->
+    ct:pal("queued_requests_are_batched", []),
+    {ok, Xsl} = file:read_file(?fixture(Config, "minimal.xsl")),
+    Capabilities = engine_stat(capabilities, batch, erlxsl_port_controller:stats()),
+    ?assert(lists:member(batch, Capabilities)),
+    Self = self(),
+    Inputs = [ list_to_binary(io_lib:format("<input n='~p' />", [N])) || N <- lists:seq(1, 20) ],
+    [ spawn_link(fun() ->
+          Self ! {done, Input,
+                  erlxsl_port_controller:transform(Input, Xsl, [{engine, batch}])}
+      end) || Input <- Inputs ],
+    Results = [ receive {done, Input, Result} -> Result end || Input <- Inputs ],
+    ?assertThat(Results, equal_to([ <<Input/binary, Xsl/binary>> || Input <- Inputs ])),
+    %% how the requests were grouped depends on timing, but every one went through a batch
+    Stats = erlxsl_port_controller:stats(),
+    ?assertThat(engine_stat(batched_requests, batch, Stats), equal_to(20)),
+    ?assert(engine_stat(batches, batch, Stats) =< 20),
+    ?assertMatch({error, _}, erlxsl_port_controller:configure(transform_batch_max, 0)).
+
+batched_replies_are_returned_in_request_order(Config) ->
+    ct:pal("batched_replies_are_returned_in_request_order", []),
+    {ok, Xsl} = file:read_file(?fixture(Config, "minimal.xsl")),
+    Inputs = [ list_to_binary(io_lib:format("<input n='~p' />", [N])) || N <- lists:seq(1, 20) ],
+    Results = erlxsl_port_controller:transform_all([ {Input, Xsl} || Input <- Inputs ]),
+    ?assertThat(Results, equal_to([ <<Input/binary, Xsl/binary>> || Input <- Inputs ])).
+
+engine_commands_are_run_on_workers(_) ->
+    ct:pal("engine_commands_are_run_on_workers", []),
+    %% the test engine declares no trivial commands, so every one goes to a worker
+    Self = self(),
+    [ spawn_link(fun() ->
+          Self ! {done, N, erlxsl_port_controller:engine_command({transform, "<output />"})}
+      end) || N <- lists:seq(1, 5) ],
+    Results = [ receive {done, N, Result} -> Result end || N <- lists:seq(1, 5) ],
+    ?assertThat([ is_binary(Bin) || {ok, Bin} <- Results ], equal_to([true, true, true, true, true])).
+
+small_transforms_are_timed_for_running_inline(Config) ->
+    ct:pal("small_transforms_are_timed_for_running_inline", []),
+    {ok, Xsl} = file:read_file(?fixture(Config, "minimal.xsl")),
+    Before = proplists:get_value(inline, erlxsl_port_controller:stats()),
+    erlxsl_port_controller:transform(<<"<input />">>, Xsl),
+    erlxsl_port_controller:transform(<<"<input />">>, Xsl),
+    After = proplists:get_value(inline, erlxsl_port_controller:stats()),
+    ?assertThat(proplists:get_value(round_trips, After) -
+                proplists:get_value(round_trips, Before), equal_to(2)),
+    %% the test engine doesn't cache stylesheets, so its requests are always queued
+    ?assertThat(proplists:get_value(inlined, After), equal_to(0)),
+    ?assertMatch({error, _}, erlxsl_port_controller:configure(inline_max_us, -1)).
+
+%% looks up one of an engine's stats by the engine's index, rather than its
+%% position in the list (not arity 1, or ?EXPORT_TESTS would run it as a test case)
+engine_stat(Key, Engine, Stats) ->
+    {Engine, Index} = lists:keyfind(Engine, 1,
+                                    lists:zip(?ENGINES, lists:seq(0, length(?ENGINES) - 1))),
+    Engines = [ {proplists:get_value(index, E), E} || E <- proplists:get_value(engines, Stats) ],
+    {Index, Found} = lists:keyfind(Index, 1, Engines),
+    proplists:get_value(Key, Found).